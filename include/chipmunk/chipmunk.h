@@ -93,6 +93,8 @@ typedef struct cpShape cpShape;
 typedef struct cpCircleShape cpCircleShape;
 typedef struct cpSegmentShape cpSegmentShape;
 typedef struct cpPolyShape cpPolyShape;
+typedef struct cpBoxShape cpBoxShape;
+typedef struct cpTilemapShape cpTilemapShape;
 
 typedef struct cpConstraint cpConstraint;
 typedef struct cpPinJoint cpPinJoint;
@@ -122,6 +124,7 @@ typedef struct cpSpace cpSpace;
 #include "cpBody.h"
 #include "cpShape.h"
 #include "cpPolyShape.h"
+#include "cpTilemapShape.h"
 
 #include "cpConstraint.h"
 
@@ -25,9 +25,29 @@
 #include "chipmunk/chipmunk.h"
 #include "chipmunk/chipmunk_structs.h"
 
+// SSE2 is always available on x86-64. MSVC never defines __SSE2__, so check its target macros too.
+#ifndef CP_USE_SSE2
+	#if (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) && !CP_USE_DOUBLES
+		#define CP_USE_SSE2 1
+	#else
+		#define CP_USE_SSE2 0
+	#endif
+#endif
+
 #define CP_HASH_COEF (3344921057ul)
 #define CP_HASH_PAIR(A, B) ((cpHashValue)(A)*CP_HASH_COEF ^ (cpHashValue)(B)*CP_HASH_COEF)
 
+// Integer versions of cpfmin() and cpfmax() for sizes and cell coordinates.
+static inline int cpimin(int a, int b)
+{
+	return (a < b) ? a : b;
+}
+
+static inline int cpimax(int a, int b)
+{
+	return (a > b) ? a : b;
+}
+
 // TODO: Eww. Magic numbers.
 #define MAGIC_EPSILON 1e-5
 
@@ -82,12 +102,29 @@ void cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint);
 //MARK: Spatial Index Functions
 
 cpSpatialIndex *cpSpatialIndexInit(cpSpatialIndex *index, cpSpatialIndexClass *klass, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+void cpSpatialIndexRunWorkers(cpSpatialIndex *index, cpSpatialIndexWorkerFunc func, void *data);
+cpBool cpSpatialIndexIsBBTree(cpSpatialIndex *index);
+// Rebuild a spatial hash's grid if objects changed since it was last built. Does nothing for other index types.
+void cpSpaceHashFlush(cpSpatialIndex *index);
 
 
 //MARK: Arbiters
 
 cpArbiter* cpArbiterInit(cpArbiter *arb, cpShape *a, cpShape *b);
 
+// Arbiters are cached by their pair of shapes and part.
+struct cpArbiterKey
+{
+	const cpShape *a, *b;
+	cpHashValue part;
+};
+
+static inline cpHashValue
+cpArbiterKeyHash(const struct cpArbiterKey *key)
+{
+	return CP_HASH_PAIR((cpHashValue)key->a, (cpHashValue)key->b) ^ key->part;
+}
+
 static inline struct cpArbiterThread *
 cpArbiterThreadForBody(cpArbiter *arb, cpBody *body)
 {
@@ -116,6 +153,121 @@ cpShapeActive(cpShape *shape)
 
 // Note: This function returns contact points with r1/r2 in absolute coordinates, not body relative.
 struct cpCollisionInfo cpCollide(const cpShape *a, const cpShape *b, cpCollisionID id, struct cpContact *contacts);
+// Boolean overlap test, skips EPA and contact generation.
+cpBool cpOverlap(const cpShape *a, const cpShape *b);
+// Collide 'count' pairs of a circle and a shape of 'type', either a circle or a segment, giving the same results as cpCollide().
+// 'pairs' holds the two shapes of each pair with the circle first. Each pair gets at most one contact in 'contacts' at the pair's index.
+void cpCollideCircles(cpShapeType type, int count, const cpShape **pairs, struct cpCollisionInfo *infos, struct cpContact *contacts);
+
+// Corner 'i' of a box with center 'c' and half axes 'x' and 'y'.
+// Corners are numbered counter-clockwise from the bottom right, like cpBoxShapeInit2() orders a poly's vertexes.
+static inline cpVect
+cpBoxCorner(cpVect c, cpVect x, cpVect y, int i)
+{
+	cpFloat sx = (i < 2 ? 1.0f : -1.0f), sy = (i == 1 || i == 2 ? 1.0f : -1.0f);
+	return cpvadd(c, cpvadd(cpvmult(x, sx), cpvmult(y, sy)));
+}
+
+// World splitting planes of a box, laid out like a transformed poly's.
+static inline void
+cpBoxShapePlanes(const cpBoxShape *box, struct cpSplittingPlane *planes)
+{
+	cpVect tx = box->tx, ty = cpvperp(tx);
+	cpVect x = cpvmult(tx, box->th.x), y = cpvmult(ty, box->th.y);
+
+	planes[0].n = cpvneg(ty);
+	planes[1].n = tx;
+	planes[2].n = ty;
+	planes[3].n = cpvneg(tx);
+	for (int i = 0; i < 4; i++) planes[i].v0 = cpBoxCorner(box->tc, x, y, i);
+}
+
+// Temporary copy of a shape, used to move it without writing to the original.
+typedef union cpShapeScratch
+{
+	cpShape shape;
+	cpCircleShape circle;
+	cpSegmentShape segment;
+	cpPolyShape poly;
+	cpBoxShape box;
+	cpTilemapShape tilemap;
+} cpShapeScratch;
+
+// Bytes of plane storage cpShapeScratchInit() needs, only polys too large for the inline planes need any.
+size_t cpShapeScratchPlanesSize(const cpShape *shape);
+// Copy 'shape' into 'scratch' and move the copy to 'transform'. The copy is only valid as long as 'planes' is.
+cpShape *cpShapeScratchInit(cpShapeScratch *scratch, const cpShape *shape, cpTransform transform, struct cpSplittingPlane *planes);
+
+typedef void (*cpTilemapFaceFunc)(cpShape *face, void *data);
+// Call 'func' with a temporary segment for each merged face of solid cells that touches 'bb'.
+// The segments' normals point out of the solid cells and their hash ids are unique within the tilemap.
+// Extended faces reach one cell into the apron if the face continues there so shapes don't catch on the seam.
+void cpTilemapShapeEachFace(const cpTilemapShape *tilemap, cpBB bb, cpBool extend, cpTilemapFaceFunc func, void *data);
+// Collide a shape with one face of a tilemap. The collision is ordered from the shape to the tilemap.
+struct cpCollisionInfo cpCollideTilemapFace(const cpShape *tilemap, const cpShape *face, const cpShape *shape, struct cpContact *contacts);
+// Material of the cell under a contact at 'p', with 'n' pointing out of the tilemap.
+uint8_t cpTilemapShapeMaterialAt(const cpShape *shape, cpVect p, cpVect n);
+
+typedef struct cpCompoundShape cpCompoundShape;
+
+// Proxy that stands in for all of a compound body's shapes in the broadphase.
+cpCompoundShape *cpCompoundShapeNew(cpBody *body);
+// Add a shape whose world data is current. The tree is rebuilt the next time the proxy is updated.
+void cpCompoundShapeAdd(cpCompoundShape *compound, cpShape *shape);
+void cpCompoundShapeRemove(cpCompoundShape *compound, cpShape *shape);
+// Rebuild the tree and filter bits on the next update after a child's geometry or filter changed.
+void cpCompoundShapeChanged(cpCompoundShape *compound);
+// Only refresh the proxy's filter bits after a child's filter changed.
+void cpCompoundShapeFilterChanged(cpCompoundShape *compound);
+// Move the children the narrowphase didn't need during the step.
+void cpCompoundShapeFlush(cpCompoundShape *compound);
+void cpCompoundShapeEach(const cpCompoundShape *compound, cpSpatialIndexIteratorFunc func, void *data);
+
+// Counterparts of the spatial index queries over a compound's children. Children are passed as the second object.
+// Queries fall back to scanning the children while the tree is out of date.
+void cpCompoundShapeQuery(const cpCompoundShape *compound, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data);
+// Returns false if 'func' stopped the query.
+cpBool cpCompoundShapeBBQuery(const cpCompoundShape *compound, void *obj, cpBB bb, cpSpatialIndexBBQueryFunc func, void *data);
+// Returns the new exit time.
+cpFloat cpCompoundShapeSegmentQuery(const cpCompoundShape *compound, void *obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data);
+// Returns the new search radius.
+cpFloat cpCompoundShapeNearestQuery(const cpCompoundShape *compound, void *obj, cpVect point, cpFloat maxDistance, cpBBTreeNearestFunc func, void *data);
+// Call 'func' for each pair of children with overlapping bounding boxes. Either shape may be a compound.
+void cpCompoundShapeEachPair(cpShape *a, cpShape *b, cpSpatialIndexQueryFunc func, void *data);
+
+static inline cpBool
+cpShapeIsCompound(const cpShape *shape)
+{
+	return (shape->klass->type == CP_COMPOUND_SHAPE);
+}
+
+// The body's compound proxy if it is in a space.
+static inline cpShape *
+cpBodyCompoundProxy(const cpBody *body)
+{
+	return (body->compound && body->compound->shape.space ? (cpShape *)body->compound : NULL);
+}
+
+// Sweep of a shape between two body transforms.
+struct cpShapeCast
+{
+	const cpShape *shape;
+	// Body relative core geometry and radius.
+	int count;
+	const cpVect *verts;
+	cpFloat r, rmax;
+
+	cpVect p0, delta;
+	cpFloat a0, da;
+	// Bounds of the whole sweep.
+	cpBB bb;
+};
+
+int cpShapeCastVertexCount(const cpShape *shape);
+// 'verts' must have room for cpShapeCastVertexCount() vertexes and outlive the cast.
+void cpShapeCastInit(struct cpShapeCast *cast, const cpShape *shape, cpTransform start, cpTransform end, cpVect *verts);
+// Find the first time of impact before 'maxAlpha' against a shape at its current position.
+cpBool cpShapeCastShape(const struct cpShapeCast *cast, const cpShape *target, cpFloat maxAlpha, cpSegmentQueryInfo *info);
 
 static inline void
 CircleSegmentQuery(cpShape *shape, cpVect center, cpFloat r1, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo *info)
@@ -303,21 +455,42 @@ void cpSpaceUnlock(cpSpace *space, cpBool runPostStep);
 static inline void
 cpSpaceUncacheArbiter(cpSpace *space, cpArbiter *arb)
 {
-	const cpShape *a = arb->a, *b = arb->b;
-	const cpShape *shape_pair[] = {a, b};
-	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
-	cpHashSetRemove(space->cachedArbiters, arbHashID, shape_pair);
+	struct cpArbiterKey key = {arb->a, arb->b, arb->part};
+	cpHashSetRemove(space->cachedArbiters, cpArbiterKeyHash(&key), &key);
 	cpArrayDeleteObj(space->arbiters, arb);
 }
 
+// Bring spatial hashes up to date so queries running on several threads only read them.
+static inline void
+cpSpaceFlushIndexes(cpSpace *space)
+{
+	cpSpaceHashFlush(space->staticShapes);
+	cpSpaceHashFlush(space->dynamicShapes);
+}
+
 static inline cpArray *
 cpSpaceArrayForBodyType(cpSpace *space, cpBodyType type)
 {
 	return (type == CP_BODY_TYPE_STATIC ? space->staticBodies : space->dynamicBodies);
 }
 
+void cpSpaceSensorOverlap(cpSpace *space, cpShape *a, cpShape *b);
+void cpSpaceSensorsBeginStep(cpSpace *space);
+void cpSpaceSensorsEndStep(cpSpace *space);
+void cpSpaceSensorsRemoveShape(cpSpace *space, cpShape *shape);
+
+void cpSpaceSnapshotsPublish(cpSpace *space);
+void cpSpaceQueryQueueFree(cpSpace *space);
+
+void cpSpaceIndexTunerBegin(cpSpace *space);
+void cpSpaceIndexTunerEnd(cpSpace *space);
+
 void cpShapeUpdateFunc(cpShape *shape, void *unused);
+// Move a body's shapes between the static and dynamic indexes.
+void cpSpaceMoveBodyShapes(cpSpace *space, cpBody *body, cpSpatialIndex *fromIndex, cpSpatialIndex *toIndex);
 cpCollisionID cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space);
+// Collide the circle pairs cpSpaceCollideShapes() set aside.
+void cpSpaceCollideCircles(cpSpace *space);
 
 
 //MARK: Foreach loops
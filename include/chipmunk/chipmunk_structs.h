@@ -74,6 +74,8 @@ struct cpBody
 	cpSpace* space;
 
 	cpShape* shapeList;
+	// Proxy that holds the body's shapes in the broadphase when it is a compound body.
+	struct cpCompoundShape* compound;
 	cpArbiter* arbiterList;
 	cpConstraint* constraintList;
 
@@ -178,6 +180,13 @@ struct cpArbiter
 	struct cpContact* contacts;
 	cpVect n;
 
+	// Transform from body b to body a when the narrowphase last generated the contacts.
+	cpTransform pose;
+	// Rotations of the bodies when the contacts were last updated.
+	cpVect rot_a, rot_b;
+	// Tells apart the arbiters of a pair with more than one, like the faces of a tilemap. Zero otherwise.
+	cpHashValue part;
+
 	// Regular, wildcard A and wildcard B collision handlers.
 	cpCollisionHandler* handler, * handlerA, * handlerB;
 	cpFloat r;
@@ -201,8 +210,11 @@ typedef enum cpShapeType
 	CP_CIRCLE_SHAPE,
 	CP_SEGMENT_SHAPE,
 	CP_POLY_SHAPE,
-	//CP_BOX_SHAPE,
-	CP_NUM_SHAPES
+	CP_BOX_SHAPE,
+	CP_TILEMAP_SHAPE,
+	CP_NUM_SHAPES,
+	// Broadphase proxy for a compound body, never reaches the narrowphase.
+	CP_COMPOUND_SHAPE = CP_NUM_SHAPES,
 } cpShapeType;
 
 typedef cpBB(*cpShapeCacheDataImpl)(cpShape* shape, cpTransform transform);
@@ -279,7 +291,11 @@ struct cpSegmentShape
 struct cpBoxShape
 {
 	cpShape shape;
-	cpVect a, b;
+
+	// Center and half extents relative to the body.
+	cpVect c, h;
+	// World center, half extents and unit x axis. The y axis is its perpendicular.
+	cpVect tc, th, tx;
 };
 
 struct cpSplittingPlane
@@ -287,6 +303,64 @@ struct cpSplittingPlane
 	cpVect v0, n;
 };
 
+struct cpTilemapCell
+{
+	uint8_t block_id;
+	uint8_t material_type;
+};
+
+struct cpTilemapShape
+{
+	cpShape shape;
+
+	int width, height;
+	cpFloat cellSize;
+	// Body relative position of the lower left corner of cell (0, 0).
+	cpVect offset;
+
+	// Row major cells, including a ring of apron cells around the grid that mirror the neighboring tilemaps.
+	struct cpTilemapCell* cells;
+	// Number of solid cells, not counting the apron.
+	int solidCount;
+
+	cpTransform transform;
+};
+
+struct cpCompoundNode
+{
+	// Bounds in the body's unscaled frame.
+	cpBB bb;
+	// Index of the shape for leaves, or of the first of two consecutive children.
+	int index;
+	cpBool leaf;
+};
+
+struct cpCompoundShape
+{
+	cpShape shape;
+
+	int count, capacity;
+	cpShape** shapes;
+
+	// Tree over the shapes, rebuilt lazily after shapes are added or removed or the body is rescaled.
+	struct cpCompoundNode* nodes;
+	cpBool dirty;
+	cpVect scale;
+	// Scratch space for rebuilding the tree, sized like 'shapes'.
+	cpBB* bbs;
+	int* order;
+
+	// Body transform the tree was last updated with and its inverse.
+	cpTransform transform, inverse;
+
+	// During a step the children are only moved when they are needed.
+	// A child's world data is current when its stamp matches the compound's.
+	cpTransform childTransform;
+	cpTimestamp stamp;
+	cpTimestamp* stamps;
+	cpBool stale;
+};
+
 #define CP_POLY_SHAPE_INLINE_ALLOC 6
 
 struct cpPolyShape
@@ -482,6 +556,10 @@ struct cpSimpleMotor
 };
 
 typedef struct cpContactBufferHeader cpContactBufferHeader;
+typedef struct cpSpaceIndexTuner cpSpaceIndexTuner;
+typedef struct cpSensorSet cpSensorSet;
+typedef struct cpSnapshotSet cpSnapshotSet;
+typedef struct cpQueryQueue cpQueryQueue;
 typedef void (*cpSpaceArbiterApplyImpulseFunc)(cpArbiter* arb);
 
 struct cpSpace
@@ -498,6 +576,7 @@ struct cpSpace
 	cpFloat collisionSlop;
 	cpFloat collisionBias;
 	cpTimestamp collisionPersistence;
+	cpFloat contactReuseTolerance;
 
 	cpDataPointer userData;
 
@@ -508,16 +587,24 @@ struct cpSpace
 	cpArray* staticBodies;
 	cpArray* rousedBodies;
 	cpArray* sleepingComponents;
+	// Compound proxies whose children weren't all moved yet this step.
+	cpArray* staleCompounds;
 
 	cpHashValue shapeIDCounter;
 	cpSpatialIndex* staticShapes;
 	cpSpatialIndex* dynamicShapes;
+	cpSpaceIndexTuner* indexTuner;
 
 	cpArray* constraints;
 
 	cpArray* arbiters;
 	cpContactBufferHeader* contactBuffersHead;
 	cpHashSet* cachedArbiters;
+	// Shapes of the circle/circle and circle/segment pairs waiting to be collided in batches.
+	cpArray* circlePairs[2];
+	cpSensorSet* sensorSet;
+	cpSnapshotSet* snapshotSet;
+	cpQueryQueue* queryQueue;
 	cpArray* pooledArbiters;
 
 	cpArray* allocatedBuffers;
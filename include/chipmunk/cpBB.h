@@ -118,7 +118,7 @@ static inline cpFloat cpBBSegmentQuery(cpBB bb, cpVect a, cpVect b, cpFloat r)
 	cpFloat tmin = -INFINITY, tmax = INFINITY;
 	
 	if(delta.x == 0.0f){
-		if(a.x < bb.l || bb.r < a.x) return INFINITY;
+		if(a.x < bb.l - r || bb.r + r < a.x) return INFINITY;
 	} else {
 		cpFloat t1 = (bb.l - r - a.x)/delta.x;
 		cpFloat t2 = (bb.r + r - a.x)/delta.x;
@@ -127,7 +127,7 @@ static inline cpFloat cpBBSegmentQuery(cpBB bb, cpVect a, cpVect b, cpFloat r)
 	}
 	
 	if(delta.y == 0.0f){
-		if(a.y < bb.b || bb.t < a.y) return INFINITY;
+		if(a.y < bb.b - r || bb.t + r < a.y) return INFINITY;
 	} else {
 		cpFloat t1 = (bb.b - r - a.y)/delta.y;
 		cpFloat t2 = (bb.t + r - a.y)/delta.y;
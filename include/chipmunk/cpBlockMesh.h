@@ -0,0 +1,55 @@
+// Copyright 2013 Howling Moon Software. All rights reserved.
+// See http://chipmunk2d.net/legal.php for more information.
+
+// A block mesh merges a body's grid aligned blocks into as few boxes as it can.
+// The blocks themselves are owned by the caller and are never added to a space, only the merged boxes are.
+// Blocks are only merged with neighbors of the same density that would collide the same way (friction, elasticity, filter, material, etc).
+// The grid is split into 16x16 chunks so adding or removing a block only rebuilds the boxes of its own chunk.
+// Merged boxes never cross a chunk boundary, so a long wall is split into several boxes there.
+// Shapes sliding along a wall can catch on those seams just like on the seams between unmerged blocks.
+typedef struct cpBlockMesh cpBlockMesh;
+
+/// Block mesh iterator callback type.
+typedef void (*cpBlockMeshShapeIteratorFunc)(cpShape *shape, void *data);
+
+/// Allocate a block mesh.
+CP_EXPORT cpBlockMesh *cpBlockMeshAlloc(void);
+/// Initialize a block mesh for the blocks of @c body.
+/// Cell (0, 0) spans from @c offset to @c offset + (cellSize, cellSize) in body coordinates.
+CP_EXPORT cpBlockMesh *cpBlockMeshInit(cpBlockMesh *mesh, cpBody *body, cpFloat cellSize, cpVect offset);
+/// Allocate and initialize a block mesh.
+CP_EXPORT cpBlockMesh *cpBlockMeshNew(cpBody *body, cpFloat cellSize, cpVect offset);
+/// Destroy a block mesh. The merged boxes are removed from their space and freed, the blocks are not.
+CP_EXPORT void cpBlockMeshDestroy(cpBlockMesh *mesh);
+/// Destroy and free a block mesh.
+CP_EXPORT void cpBlockMeshFree(cpBlockMesh *mesh);
+
+/// Get the body of a block mesh.
+CP_EXPORT cpBody *cpBlockMeshGetBody(const cpBlockMesh *mesh);
+
+/// Add a block to the mesh. The block's cell is the one containing its center of gravity and must be empty.
+CP_EXPORT void cpBlockMeshAddBlock(cpBlockMesh *mesh, cpShape *block);
+/// Remove a block from the mesh.
+CP_EXPORT void cpBlockMeshRemoveBlock(cpBlockMesh *mesh, cpShape *block);
+/// Get the block in a cell or NULL if the cell is empty.
+CP_EXPORT cpShape *cpBlockMeshGetBlock(const cpBlockMesh *mesh, int x, int y);
+
+/**
+	Rebuild the merged boxes of the chunks that changed since the last update.
+	The old boxes are removed from their space and freed, so don't keep references to them across an update.
+	If @c space is not NULL the new boxes are added to it.
+	Can't be called while @c space is locked, use a post-step callback instead.
+*/
+CP_EXPORT void cpBlockMeshUpdate(cpBlockMesh *mesh, cpSpace *space);
+
+/// Call @c func for each of the merged boxes of a mesh.
+CP_EXPORT void cpBlockMeshEachShape(cpBlockMesh *mesh, cpBlockMeshShapeIteratorFunc func, void *data);
+/// Call @c func for each of the blocks covered by a merged box.
+/// Merged boxes have a block id of 0, use this or cpBlockMeshBlockAt() to find the blocks behind them.
+/// Between changing the blocks and the next cpBlockMeshUpdate(), blocks removed since the box was built are skipped
+/// and blocks added since are not covered by it.
+CP_EXPORT void cpBlockMeshEachBlock(cpBlockMesh *mesh, cpShape *merged, cpBlockMeshShapeIteratorFunc func, void *data);
+/// Get the block of a merged box that contains the world space point @c p.
+/// @c n is the normal pointing out of the box at @c p (such as from a query or contact) and may be cpvzero.
+/// Returns NULL if that block was removed or replaced since the last cpBlockMeshUpdate().
+CP_EXPORT cpShape *cpBlockMeshBlockAt(const cpBlockMesh *mesh, cpShape *merged, cpVect p, cpVect n);
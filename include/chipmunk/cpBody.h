@@ -81,6 +81,13 @@ CP_EXPORT cpBodyType cpBodyGetType(cpBody *body);
 /// Set the type of the body.
 CP_EXPORT void cpBodySetType(cpBody *body, cpBodyType type);
 
+/// Get whether the body is a compound body.
+CP_EXPORT cpBool cpBodyGetCompound(const cpBody *body);
+/// Make the body a compound body. Its shapes are kept in a tree of their own
+/// and the space's broadphase only holds a single proxy for all of them.
+/// Use this for bodies made of many shapes. Must be set before the body is added to a space.
+CP_EXPORT void cpBodySetCompound(cpBody *body, cpBool compound);
+
 /// Get the space this body is added to.
 CP_EXPORT cpSpace* cpBodyGetSpace(const cpBody *body);
 
@@ -45,12 +45,18 @@ CP_EXPORT cpPolyShape* cpBoxShapeInit2(cpPolyShape *poly, cpBody *body, cpBB box
 CP_EXPORT cpShape* cpBoxShapeNew(cpBody *body, cpFloat width, cpFloat height, cpFloat radius);
 /// Allocate and initialize an offset box shaped polygon shape.
 CP_EXPORT cpShape* cpBoxShapeNew2(cpBody *body, cpBB box, cpFloat radius);
+/// Allocate and initialize a box shape with faster collisions than a box shaped polygon.
+/// Its type is @c CP_BOX_SHAPE instead of @c CP_POLY_SHAPE. The polygon getters below work on it,
+/// but it can't have rounded corners or be changed with the unsafe API.
+CP_EXPORT cpShape* cpBoxShapeNewFast(cpBody *body, cpFloat width, cpFloat height);
+/// Allocate and initialize an offset box shape. See cpBoxShapeNewFast().
+CP_EXPORT cpShape* cpBoxShapeNewFast2(cpBody *body, cpBB box);
 
-/// Get the number of verts in a polygon shape.
+/// Get the number of verts in a polygon or box shape.
 CP_EXPORT int cpPolyShapeGetCount(const cpShape *shape);
-/// Get the @c ith vertex of a polygon shape.
+/// Get the @c ith vertex of a polygon or box shape.
 CP_EXPORT cpVect cpPolyShapeGetVert(const cpShape *shape, int index);
-/// Get the radius of a polygon shape.
+/// Get the radius of a polygon or box shape.
 CP_EXPORT cpFloat cpPolyShapeGetRadius(const cpShape *shape);
 
 /// @}
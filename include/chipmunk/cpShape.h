@@ -112,6 +112,16 @@ CP_EXPORT cpBool cpShapeSegmentQuery(const cpShape* shape, cpVect a, cpVect b, c
 
 /// Return contact information about two shapes.
 CP_EXPORT cpContactPointSet cpShapesCollide(const cpShape* a, const cpShape* b);
+/// Check if two shapes overlap without generating any contact information.
+/// Much cheaper than cpShapesCollide() when only a hit/no-hit answer is needed.
+CP_EXPORT cpBool cpShapesOverlap(const cpShape* a, const cpShape* b);
+/// Sweep @c shape from the body transform @c start to @c end and find where it first touches @c target at its current position.
+/// The rotation between the transforms is interpolated the short way around.
+/// On a hit, @c info->alpha is the fraction of the sweep and the point and normal are on the surface of @c target.
+/// Hits are only reported once the shapes are within a tiny fraction of the sweep of each other.
+/// Long or quickly spinning shapes that approach @c target slowly fall back to root finding along the closest points' axis.
+/// A sweep that still can't get within the tolerance after that is reported as a miss.
+CP_EXPORT cpBool cpShapeCast(const cpShape* shape, cpTransform start, cpTransform end, const cpShape* target, cpSegmentQueryInfo* info);
 
 /// The cpSpace this body is added to.
 CP_EXPORT cpSpace* cpShapeGetSpace(const cpShape* shape);
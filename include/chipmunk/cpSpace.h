@@ -38,6 +38,18 @@ typedef void (*cpCollisionSeparateFunc)(cpArbiter* arb, cpSpace* space, cpDataPo
 
 typedef void (*cpImpactFunc)(cpBody* body, cpSpace* space, cpDataPointer userData);
 
+/// A sensor shape that started or stopped overlapping another shape. (see cpSpaceSetSensorEvents())
+typedef struct cpSensorEvent
+{
+	/// The sensor shape. If both shapes are sensors, either one.
+	cpShape* sensor;
+	/// The shape overlapping the sensor.
+	cpShape* visitor;
+} cpSensorEvent;
+
+/// Immutable copy of the shapes in a space that can be queried while the space steps. (see cpSpaceSetSnapshots())
+typedef struct cpSpaceSnapshot cpSpaceSnapshot;
+
 /// Struct that holds function callback pointers to configure custom collision handling.
 /// Collision handlers have a pair of types; when a collision occurs between two shapes that have these types, the collision handler functions are triggered.
 struct cpCollisionHandler
@@ -126,6 +138,14 @@ CP_EXPORT void cpSpaceSetCollisionBias(cpSpace* space, cpFloat collisionBias);
 CP_EXPORT cpTimestamp cpSpaceGetCollisionPersistence(const cpSpace* space);
 CP_EXPORT void cpSpaceSetCollisionPersistence(cpSpace* space, cpTimestamp collisionPersistence);
 
+/// Distance two bodies may move relative to each other before their contacts are regenerated.
+/// While a colliding pair stays within it, the last step's contacts are moved with the bodies instead of running the narrowphase.
+/// This skips most of the collision work for resting stacks that are still awake.
+/// Defaults to 0, which regenerates the contacts every step.
+/// Should be much smaller than the collision slop. Collision persistence must be at least 1 for contacts to be reused.
+CP_EXPORT cpFloat cpSpaceGetContactReuseTolerance(const cpSpace* space);
+CP_EXPORT void cpSpaceSetContactReuseTolerance(cpSpace* space, cpFloat contactReuseTolerance);
+
 /// User definable data pointer.
 /// Generally this points to your game's controller or game state
 /// class so you can access it when given a cpSpace reference in a callback.
@@ -160,6 +180,8 @@ CP_EXPORT cpCollisionHandler* cpSpaceAddWildcardHandler(cpSpace* space, cpCollis
 /// Add a collision shape to the simulation.
 /// If the shape is attached to a static body, it will be added as a static shape.
 CP_EXPORT cpShape* cpSpaceAddShape(cpSpace* space, cpShape* shape);
+/// Add many shapes attached to static bodies at once, see cpBBTreeInsertBulk().
+CP_EXPORT void cpSpaceAddStaticShapes(cpSpace* space, cpShape** shapes, int count, cpBool restructure);
 /// Add a rigid body to the simulation.
 CP_EXPORT cpBody* cpSpaceAddBody(cpSpace* space, cpBody* body);
 /// Add a constraint to the simulation.
@@ -181,6 +203,22 @@ CP_EXPORT cpBool cpSpaceContainsBody(cpSpace* space, cpBody* body);
 /// Test if a constraint has been added to the space.
 CP_EXPORT cpBool cpSpaceContainsConstraint(cpSpace* space, cpConstraint* constraint);
 
+//MARK: Sensor Events
+
+/// Track sensor overlaps with the sensor event system instead of arbiters.
+/// Sensors are tested for overlap without creating arbiters or contacts, and their collision handlers are not called.
+/// Instead, overlaps that begin or end during a step are reported in batches. (see cpSpaceGetSensorBeginEvents())
+/// Overlaps with a shape that is removed from the space end without an event.
+CP_EXPORT void cpSpaceSetSensorEvents(cpSpace* space, cpBool enabled);
+/// Returns true if sensor overlaps are tracked with the sensor event system.
+CP_EXPORT cpBool cpSpaceGetSensorEvents(const cpSpace* space);
+/// Get the sensor overlaps that began during the last step.
+/// The array is valid until the next call to cpSpaceStep().
+CP_EXPORT const cpSensorEvent* cpSpaceGetSensorBeginEvents(const cpSpace* space, int* count);
+/// Get the sensor overlaps that ended during the last step.
+/// The array is valid until the next call to cpSpaceStep().
+CP_EXPORT const cpSensorEvent* cpSpaceGetSensorEndEvents(const cpSpace* space, int* count);
+
 //MARK: Post-Step Callbacks
 
 /// Post Step callback function type.
@@ -197,6 +235,12 @@ CP_EXPORT cpBool cpSpaceAddPostStepCallback(cpSpace* space, cpPostStepFunc func,
 // TODO: Queries and iterators should take a cpSpace parametery.
 // TODO: They should also be abortable.
 
+/// The query functions below don't lock the space or write to the space, its spatial indexes or its shapes.
+/// Between steps, any number of threads can run point, segment, BB, shape and shape cast queries at the same time
+/// as long as nothing adds, removes, moves or reindexes objects meanwhile and the callbacks don't either.
+/// The exception is cpSpaceSegmentQueryBatch() which runs on the space's worker threads.
+/// Shapes added to or reindexed in a spatial hash outside of a step are checked one by one until the space is stepped again.
+
 enum cpQueryFlags
 {
 	QUERY_FLAG_NONE = 0b0000,
@@ -218,6 +262,19 @@ CP_EXPORT void cpSpaceSegmentQuery(cpSpace* space, cpVect start, cpVect end, cpF
 /// Perform a directed line segment query (like a raycast) against the space and return the first shape hit. Returns NULL if no shapes were hit.
 CP_EXPORT cpShape* cpSpaceSegmentQueryFirst(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* out);
 
+/// A single segment for cpSpaceSegmentQueryBatch().
+typedef struct cpSegmentQueryRay
+{
+	cpVect start, end;
+	cpFloat radius;
+	cpShapeFilter filter;
+} cpSegmentQueryRay;
+/// Perform cpSpaceSegmentQueryFirst() for each of the @c count segments in @c rays, writing the hits to @c out.
+/// Segments are sorted into coherent packets that share a traversal of the spatial indexes.
+/// Large batches are split across the space's worker threads if it has any. (see cpHastySpace)
+/// Returns the number of segments that hit something.
+CP_EXPORT int cpSpaceSegmentQueryBatch(cpSpace* space, const cpSegmentQueryRay* rays, int count, cpSegmentQueryInfo* out);
+
 /// Rectangle Query callback function type.
 typedef void (*cpSpaceBBQueryFunc)(cpShape* shape, void* data);
 /// Perform a fast rectangle query on the space calling @c func for each shape found.
@@ -228,13 +285,77 @@ CP_EXPORT void cpSpaceBBQuery(cpSpace* space, cpBB bb, cpShapeFilter filter, cpS
 typedef void (*cpSpaceShapeQueryFunc)(cpShape* shape, cpContactPointSet* points, void* data);
 /// Query a space for any shapes overlapping the given shape and call @c func for each shape found.
 CP_EXPORT cpBool cpSpaceShapeQuery(cpSpace* space, cpShape* shape, cpSpaceShapeQueryFunc func, void* data);
+/// Sweep @c shape from the body transform @c start to @c end and return the first shape it hits, or NULL.
+/// The shape doesn't need to be added to the space. If it is, it and the other shapes on its body are ignored, as are sensors.
+/// See cpShapeCast() for the contents of @c out.
+CP_EXPORT cpShape* cpSpaceShapeCast(cpSpace* space, cpShape* shape, cpTransform start, cpTransform end, cpShapeFilter filter, cpSegmentQueryInfo* out);
 
 CP_EXPORT size_t cpSpaceSegmentQuery2(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Find the @c k nearest shapes along a segment, sorted by alpha. Sensor shapes are ignored like in cpSpaceSegmentQueryFirst().
+/// Subtrees further away than the current kth hit are skipped. Returns the number of hits written to @c results.
+CP_EXPORT size_t cpSpaceSegmentQueryNearestK(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int k);
 CP_EXPORT size_t cpSpacePointQuery2(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Find the @c k nearest shapes within @c maxDistance of @c point, sorted by distance. Sensor shapes are ignored like in cpSpacePointQueryNearest().
+/// Pass a large @c k to get every shape within the radius sorted by distance. Returns the number of shapes written to @c results.
+CP_EXPORT size_t cpSpacePointQueryKNearest(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int k);
 CP_EXPORT size_t cpSpaceBBQuery2(cpSpace* space, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* results, enum cpQueryFlags flags, int max_count);
 CP_EXPORT size_t cpSpaceShapeQuery2(cpSpace* space, cpShape* shape, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Like cpSpaceShapeQuery2(), but with the shape placed at @c transform instead of at its body's transform.
+/// Neither the shape nor its body are modified, so several threads can query with the same shape.
+CP_EXPORT size_t cpSpaceShapeQueryTransformed(cpSpace* space, cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count);
 //CP_EXPORT size_t cpSpaceBBQuery2(cpSpace* space, cpBB bb, cpShapeFilter filter, cpPointQueryInfo* results, cpQueryFlags flags, int max_count);
 
+
+//MARK: Query Snapshots
+
+/// Publish a snapshot of the space's shapes at the end of each step.
+/// Other threads can query the latest snapshot while the next step runs. Snapshots are reused once no reader holds them.
+/// The shapes reported by snapshot queries identify the live shapes, which must not be read while the space steps.
+CP_EXPORT void cpSpaceSetSnapshots(cpSpace* space, cpBool enabled);
+/// Returns true if the space publishes snapshots.
+CP_EXPORT cpBool cpSpaceGetSnapshots(const cpSpace* space);
+/// Get the latest snapshot, or NULL if the space hasn't stepped since snapshots were enabled. Safe to call from any thread.
+/// The snapshot stays valid and unchanged until it's released with cpSpaceReleaseSnapshot().
+CP_EXPORT const cpSpaceSnapshot* cpSpaceAcquireSnapshot(cpSpace* space);
+/// Release a snapshot acquired with cpSpaceAcquireSnapshot().
+CP_EXPORT void cpSpaceReleaseSnapshot(cpSpace* space, const cpSpaceSnapshot* snapshot);
+/// The space's timestamp at the end of the step the snapshot was taken after.
+CP_EXPORT cpTimestamp cpSpaceSnapshotGetStamp(const cpSpaceSnapshot* snapshot);
+
+/// Snapshot version of cpSpacePointQuery2().
+CP_EXPORT size_t cpSpaceSnapshotPointQuery(const cpSpaceSnapshot* snapshot, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Snapshot version of cpSpaceSegmentQuery2().
+CP_EXPORT size_t cpSpaceSnapshotSegmentQuery(const cpSpaceSnapshot* snapshot, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Snapshot version of cpSpaceSegmentQueryFirst().
+CP_EXPORT cpShape* cpSpaceSnapshotSegmentQueryFirst(const cpSpaceSnapshot* snapshot, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* out);
+/// Snapshot version of cpSpaceBBQuery2().
+CP_EXPORT size_t cpSpaceSnapshotBBQuery(const cpSpaceSnapshot* snapshot, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* results, enum cpQueryFlags flags, int max_count);
+/// Snapshot version of cpSpaceShapeQueryTransformed(). The shape only needs to stay unchanged during the call.
+CP_EXPORT size_t cpSpaceSnapshotShapeQuery(const cpSpaceSnapshot* snapshot, const cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count);
+
+//MARK: Deferred Queries
+
+/// Queue a cpSpacePointQuery2() to run at the next cpSpaceFlushQueries(). @c results must stay valid until then.
+CP_EXPORT void cpSpaceQueuePointQuery(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag);
+/// Queue a cpSpaceSegmentQuery2() to run at the next cpSpaceFlushQueries().
+CP_EXPORT void cpSpaceQueueSegmentQuery(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag);
+/// Queue a cpSpaceSegmentQueryFirst() to run at the next cpSpaceFlushQueries(). Its result count is 1 if something was hit.
+CP_EXPORT void cpSpaceQueueSegmentQueryFirst(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* out, cpDataPointer tag);
+/// Queue a cpSpaceBBQuery2() to run at the next cpSpaceFlushQueries().
+CP_EXPORT void cpSpaceQueueBBQuery(cpSpace* space, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag);
+/// Queue a cpSpaceShapeQueryTransformed() to run at the next cpSpaceFlushQueries(). The shape must stay unchanged until then.
+CP_EXPORT void cpSpaceQueueShapeQuery(cpSpace* space, cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag);
+/// Number of queries waiting for the next cpSpaceFlushQueries().
+CP_EXPORT int cpSpaceGetQueuedQueryCount(const cpSpace* space);
+
+/// Deferred query result callback function type. @c results is the array passed when the query was queued.
+typedef void (*cpSpaceQueryResultFunc)(cpDataPointer tag, void* results, size_t count, void* data);
+/// Run all of the queued queries and empty the queue. Call it between steps, such as right after cpSpaceStep().
+/// The queries are sorted spatially and split across the space's worker threads if it has any. (see cpHastySpace)
+/// Once they all finish, @c func is called for each query in the order they were queued. It may queue more queries for the next flush.
+/// Queuing and flushing must happen on the thread that steps the space. Returns the number of queries run.
+CP_EXPORT int cpSpaceFlushQueries(cpSpace* space, cpSpaceQueryResultFunc func, void* data);
+
 //MARK: Iteration
 
 /// Space/body iterator callback function type.
@@ -264,6 +385,15 @@ CP_EXPORT void cpSpaceReindexShapesForBody(cpSpace* space, cpBody* body);
 
 /// Switch the space to use a spatial has as it's spatial index.
 CP_EXPORT void cpSpaceUseSpatialHash(cpSpace* space, cpFloat dim, int count);
+/// Let the space choose the spatial index for its dynamic shapes at runtime.
+/// A cpBBTree, a cpSpaceHash sized from the average shape and a cpSweep1D are timed for a few steps each,
+/// and the fastest one is kept until the number, size, speed or overlap of the shapes changes significantly.
+/// The choice depends on how long the trial steps take, so two runs of the same simulation may not pick the same index
+/// and aren't guaranteed to produce identical results.
+/// Calling cpSpaceUseSpatialHash() turns this off again.
+CP_EXPORT void cpSpaceSetAutoSpatialIndex(cpSpace* space, cpBool enabled);
+/// Returns true if the space is choosing its spatial index automatically.
+CP_EXPORT cpBool cpSpaceGetAutoSpatialIndex(const cpSpace* space);
 
 
 //MARK: Time Stepping
@@ -50,6 +50,12 @@ typedef cpCollisionID (*cpSpatialIndexQueryFunc)(void *obj1, void *obj2, cpColli
 /// Spatial segment query callback function type.
 typedef cpFloat (*cpSpatialIndexSegmentQueryFunc)(void *obj1, void *obj2, void *data);
 typedef cpBool(*cpSpatialIndexBBQueryFunc)(void* obj1, void* obj2, void* data);
+/// Spatial index worker function type.
+/// Called once on each worker thread with the index of the worker and the total worker count.
+typedef void (*cpSpatialIndexWorkerFunc)(void *data, unsigned long worker, unsigned long worker_count);
+/// Spatial index worker dispatch function type.
+/// Must call @c func on every available worker thread and return once all of them have finished.
+typedef void (*cpSpatialIndexRunWorkersFunc)(cpSpatialIndexWorkerFunc func, void *data, void *runnerData);
 
 typedef struct cpSpatialIndexClass cpSpatialIndexClass;
 typedef struct cpSpatialIndex cpSpatialIndex;
@@ -61,8 +67,15 @@ struct cpSpatialIndex {
 	cpSpatialIndexBBFunc bbfunc;
 	
 	cpSpatialIndex *staticIndex, *dynamicIndex;
+	
+	cpSpatialIndexRunWorkersFunc runWorkers;
+	void *runWorkersData;
 };
 
+/// Set the function used to spread expensive internal work (tree rebuilds, etc.) across worker threads.
+/// Passing NULL runs everything on the calling thread, which is the default.
+CP_EXPORT void cpSpatialIndexSetWorkers(cpSpatialIndex *index, cpSpatialIndexRunWorkersFunc func, void *data);
+
 
 //MARK: Spatial Hash
 
@@ -88,19 +101,66 @@ typedef struct cpBBTree cpBBTree;
 /// Allocate a bounding box tree.
 CP_EXPORT cpBBTree* cpBBTreeAlloc(void);
 /// Initialize a bounding box tree.
+/// If @c staticIndex is a tree that already has objects, they are relinked to the new tree so pairs between the two are found.
+/// A static tree can't be detached from its dynamic tree afterwards, free both together.
 CP_EXPORT cpSpatialIndex* cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 /// Allocate and initialize a bounding box tree.
 CP_EXPORT cpSpatialIndex* cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 
 /// Perform a static top down optimization of the tree.
+/// Rebuilds the tree using a binned surface area heuristic, splitting the work across worker threads if they are set.
 CP_EXPORT void cpBBTreeOptimize(cpSpatialIndex *index);
 
+/// Insert many objects at once.
+/// The new objects get their own subtree, built in linear time from their Morton codes and then attached to the existing tree.
+/// Much faster than inserting them one by one when streaming in large batches of static geometry.
+/// Pass @c restructure to run a pass of tree rotations over the new subtree, trading some build time for query speed.
+CP_EXPORT void cpBBTreeInsertBulk(cpSpatialIndex *index, void **objs, const cpHashValue *hashids, int count, cpBool restructure);
+
 /// Bounding box tree velocity callback function.
 /// This function should return an estimate for the object's velocity.
 typedef cpVect (*cpBBTreeVelocityFunc)(void *obj);
 /// Set the velocity function for the bounding box tree to enable temporal coherence.
 CP_EXPORT void cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func);
 
+/// Bounding box tree filter callback function.
+/// This function should return the layer and mask bits of the object. (see cpShapeFilter)
+typedef void (*cpBBTreeFilterFunc)(void *obj, cpBitmask *layer, cpBitmask *mask);
+/// Set the filter function for the bounding box tree.
+/// The tree keeps the union of the bits for each subtree so filtered queries and pair finding can skip whole subtrees.
+/// The bits are refreshed when an object is reindexed.
+CP_EXPORT void cpBBTreeSetFilterFunc(cpSpatialIndex *index, cpBBTreeFilterFunc func);
+
+/// Perform a query, skipping subtrees that can't pass the layer/mask test against @c layer and @c mask.
+/// Falls back to cpSpatialIndexQuery() for other index types.
+CP_EXPORT void cpBBTreeQueryFiltered(cpSpatialIndex *index, void *obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexQueryFunc func, void *data);
+/// Perform a bounding box query, skipping subtrees that can't pass the layer/mask test.
+/// Falls back to cpSpatialIndexBBQuery() for other index types.
+CP_EXPORT void cpBBTreeBBQueryFiltered(cpSpatialIndex *index, void *obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexBBQueryFunc func, void *data);
+/// Perform a segment query, skipping subtrees that can't pass the layer/mask test.
+/// Falls back to cpSpatialIndexSegmentQuery() for other index types.
+CP_EXPORT void cpBBTreeSegmentQueryFiltered(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpBitmask layer, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void *data);
+
+/// Maximum number of segments traced together by cpBBTreeSegmentQueryPacket().
+#define CP_BBTREE_PACKET_SIZE 16
+
+/// Segment packet query callback function type.
+/// @c ray is the index of the segment within the packet. Return the new exit time for that segment.
+typedef cpFloat (*cpBBTreeSegmentPacketFunc)(void *obj1, void *obj2, int ray, void *data);
+/// Perform up to CP_BBTREE_PACKET_SIZE filtered segment queries with a single traversal of the tree.
+/// Each node is tested against all of the packet's segments at once, so coherent segments share most of the work.
+/// @c t_exit is updated in place with the exit times returned by @c func.
+/// Falls back to one cpSpatialIndexSegmentQuery() per segment for other index types.
+CP_EXPORT void cpBBTreeSegmentQueryPacket(cpSpatialIndex *index, void *obj, int count, const cpVect *a, const cpVect *b, const cpFloat *r, cpFloat *t_exit, const cpBitmask *layers, const cpBitmask *masks, cpBBTreeSegmentPacketFunc func, void *data);
+
+/// Nearest query callback function type.
+/// Return the current search radius, subtrees further away than it are skipped.
+typedef cpFloat (*cpBBTreeNearestFunc)(void *obj1, void *obj2, void *data);
+/// Visit the objects within @c maxDistance of @c point in order of increasing bounding box distance.
+/// Uses a best first traversal so large search radii only visit the subtrees that can still beat the current result.
+/// Other index types visit everything in range in no particular order.
+CP_EXPORT void cpBBTreeNearestQuery(cpSpatialIndex *index, void *obj, cpVect point, cpFloat maxDistance, cpBitmask layer, cpBitmask mask, cpBBTreeNearestFunc func, void *data);
+
 //MARK: Single Axis Sweep
 
 typedef struct cpSweep1D cpSweep1D;
@@ -0,0 +1,59 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/// @defgroup cpTilemapShape cpTilemapShape
+/// A grid of square cells that each hold a block id and a material.
+/// The whole grid is a single shape in the spatial index, so large block worlds should use a tilemap per chunk instead of a shape per block.
+/// Shapes collide with the merged faces between solid and empty cells and don't catch on the seams between blocks.
+/// Each face a shape touches gets its own arbiter, so a pair of shapes can have several arbiters.
+/// Tilemaps have no mass and are meant for static or kinematic bodies. They don't collide with each other and can't be cast.
+/// @{
+
+/// Allocate a tilemap shape.
+CP_EXPORT cpTilemapShape* cpTilemapShapeAlloc(void);
+/// Initialize a tilemap shape with @c width by @c height empty cells of size @c cellSize.
+/// @c offset is the body relative position of the lower left corner of cell (0, 0).
+CP_EXPORT cpTilemapShape* cpTilemapShapeInit(cpTilemapShape *tilemap, cpBody *body, int width, int height, cpFloat cellSize, cpVect offset);
+/// Allocate and initialize a tilemap shape.
+CP_EXPORT cpShape* cpTilemapShapeNew(cpBody *body, int width, int height, cpFloat cellSize, cpVect offset);
+
+/// Get the number of columns of a tilemap shape.
+CP_EXPORT int cpTilemapShapeGetWidth(const cpShape *shape);
+/// Get the number of rows of a tilemap shape.
+CP_EXPORT int cpTilemapShapeGetHeight(const cpShape *shape);
+/// Get the size of the cells of a tilemap shape.
+CP_EXPORT cpFloat cpTilemapShapeGetCellSize(const cpShape *shape);
+/// Get the offset of a tilemap shape.
+CP_EXPORT cpVect cpTilemapShapeGetOffset(const cpShape *shape);
+
+/// Set the block id and material of a cell. A block id of 0 makes the cell empty.
+/// The cells one step outside of the grid (-1 and @c width or @c height) are an apron that should mirror the neighboring tilemap's edge.
+/// They never collide themselves, but keep faces from being generated along the seam between the two tilemaps.
+/// Bodies sleeping against a removed cell are not woken up, see cpBodyActivateStatic().
+CP_EXPORT void cpTilemapShapeSetCell(cpShape *shape, int x, int y, uint8_t block_id, uint8_t material_type);
+/// Get the block id of a cell.
+CP_EXPORT uint8_t cpTilemapShapeGetCellBlock(const cpShape *shape, int x, int y);
+/// Get the material of a cell.
+CP_EXPORT uint8_t cpTilemapShapeGetCellMaterial(const cpShape *shape, int x, int y);
+/// Get the cell containing a point in world coordinates. Returns false if the point is outside of the grid.
+CP_EXPORT cpBool cpTilemapShapeGetCellAtPoint(const cpShape *shape, cpVect p, int *x, int *y);
+
+/// @}
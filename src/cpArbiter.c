@@ -344,6 +344,7 @@ cpArbiterInit(cpArbiter* arb, cpShape* a, cpShape* b)
 
 	arb->a = a; arb->body_a = a->body;
 	arb->b = b; arb->body_b = b->body;
+	arb->part = 0;
 
 	arb->thread_a.next = NULL;
 	arb->thread_b.next = NULL;
@@ -21,27 +21,64 @@
 
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
 
 #include "chipmunk/chipmunk_private.h"
 
+#if CP_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 static inline cpSpatialIndexClass* Klass(void);
 
 typedef struct Node Node;
 typedef struct Pair Pair;
+typedef struct PairSlot PairSlot;
+
+// Minimum dynamic leaf count before finding new pairs is split across worker threads.
+#define CP_BBTREE_PARALLEL_MARK_THRESHOLD 1024
+// Depth of the subtrees that are handed to the workers. (up to 2^depth tasks)
+#define CP_BBTREE_PARALLEL_MARK_DEPTH 4
+
+// New pairs found by one marking task, stored as consecutive (a, b) leaves.
+typedef struct MarkBuffer
+{
+	Node** leaves;
+	int count, capacity;
+} MarkBuffer;
 
 struct cpBBTree
 {
 	cpSpatialIndex spatialIndex;
 	cpBBTreeVelocityFunc velocityFunc;
+	cpBBTreeFilterFunc filterFunc;
 
 	cpHashSet* leaves;
 	Node* root;
 
 	Node* pooledNodes;
-	Pair* pooledPairs;
 	cpArray* allocatedBuffers;
 
 	cpTimestamp stamp;
+
+	// The remaining fields are only used by the master tree. (see GetMasterTree())
+	// Every leaf of both the static and dynamic trees is assigned an index into 'leafNodes'.
+	Node** leafNodes;
+	int leafCount, leafCapacity;
+
+	// Indexes of removed leaves can't be reused until the pairs referencing them are compacted.
+	int* freeIndexes, * pendingIndexes;
+	int freeCount, pendingCount, freeCapacity, pendingCapacity;
+
+	// Dense array of the overlapping pairs, and an open addressed table to find them by leaf indexes.
+	Pair* pairs;
+	int pairCount, pairCapacity;
+
+	PairSlot* pairSlots;
+	int pairSlotMask;
+
+	// Per task output of the parallel marking pass.
+	MarkBuffer markBuffers[1 << CP_BBTREE_PARALLEL_MARK_DEPTH];
 };
 
 struct Node
@@ -50,6 +87,9 @@ struct Node
 	cpBB bb;
 	Node* parent;
 
+	// Union of the layer and mask bits of the leaves in the subtree.
+	cpBitmask layer, mask;
+
 	union
 	{
 		// Internal nodes
@@ -62,7 +102,7 @@ struct Node
 		struct
 		{
 			cpTimestamp stamp;
-			Pair* pairs;
+			int index;
 		} leaf;
 	} node;
 };
@@ -71,21 +111,22 @@ struct Node
 #define A node.children.a
 #define B node.children.b
 #define STAMP node.leaf.stamp
-#define PAIRS node.leaf.pairs
-
-typedef struct Thread
-{
-	Pair* prev;
-	Node* leaf;
-	Pair* next;
-} Thread;
+#define INDEX node.leaf.index
 
 struct Pair
 {
-	Thread a, b;
+	int a, b;
 	cpCollisionID id;
 };
 
+#define EMPTY_PAIR_KEY (~(uint64_t)0)
+
+struct PairSlot
+{
+	uint64_t key;
+	int pair;
+};
+
 //MARK: Misc Functions
 
 static inline cpBB
@@ -109,6 +150,39 @@ GetBB(cpBBTree* tree, void* obj)
 	}
 }
 
+static inline void
+GetFilter(cpBBTree* tree, void* obj, cpBitmask* layer, cpBitmask* mask)
+{
+	cpBBTreeFilterFunc filterFunc = tree->filterFunc;
+	if (filterFunc)
+	{
+		filterFunc(obj, layer, mask);
+	}
+	else
+	{
+		*layer = *mask = CP_ALL_CATEGORIES;
+	}
+}
+
+// Filter bits of a query, NULL for unfiltered queries.
+typedef struct QueryFilter
+{
+	cpBitmask layer, mask;
+} QueryFilter;
+
+// False if no leaf in the subtree can pass the layer/mask test. (see cpShapeFilterAccept())
+static inline cpBool
+NodeAccepts(Node* node, cpBitmask layer, cpBitmask mask)
+{
+	return ((node->layer & mask) | (layer & node->mask)) != 0;
+}
+
+static inline cpBool
+NodeAcceptsQuery(Node* node, const QueryFilter* filter)
+{
+	return (!filter || NodeAccepts(node, filter->layer, filter->mask));
+}
+
 static inline cpBBTree*
 GetTree(cpSpatialIndex* index)
 {
@@ -142,116 +216,224 @@ IncrementStamp(cpBBTree* tree)
 	}
 }
 
-//MARK: Pair/Thread Functions
+//MARK: Leaf Index Functions
 
 static void
-PairRecycle(cpBBTree* tree, Pair* pair)
+IndexPush(int** arr, int* count, int* capacity, int index)
+{
+	if (*count == *capacity)
+	{
+		*capacity = (*capacity ? 2 * (*capacity) : 64);
+		*arr = (int*)cprealloc(*arr, (*capacity) * sizeof(int));
+	}
+
+	(*arr)[(*count)++] = index;
+}
+
+static int
+LeafIndexNew(cpBBTree* tree, Node* leaf)
 {
-	// Share the pool of the master tree.
-	// TODO: would be lovely to move the pairs stuff into an external data structure.
 	tree = GetMasterTree(tree);
 
-	pair->a.next = tree->pooledPairs;
-	tree->pooledPairs = pair;
+	int index;
+	if (tree->freeCount)
+	{
+		index = tree->freeIndexes[--tree->freeCount];
+	}
+	else
+	{
+		if (tree->leafCount == tree->leafCapacity)
+		{
+			tree->leafCapacity = (tree->leafCapacity ? 2 * tree->leafCapacity : 64);
+			tree->leafNodes = (Node**)cprealloc(tree->leafNodes, tree->leafCapacity * sizeof(Node*));
+		}
+
+		index = tree->leafCount++;
+	}
+
+	tree->leafNodes[index] = leaf;
+	return index;
 }
 
-static Pair*
-PairFromPool(cpBBTree* tree)
+static void
+LeafIndexRecycle(cpBBTree* tree, int index)
 {
-	// Share the pool of the master tree.
-	// TODO: would be lovely to move the pairs stuff into an external data structure.
 	tree = GetMasterTree(tree);
 
-	Pair* pair = tree->pooledPairs;
+	tree->leafNodes[index] = NULL;
+	IndexPush(&tree->pendingIndexes, &tree->pendingCount, &tree->pendingCapacity, index);
+}
 
-	if (pair)
+// Once no pairs reference the removed leaves, their indexes can be reused.
+static void
+LeafIndexesFree(cpBBTree* tree)
+{
+	for (int i = 0; i < tree->pendingCount; i++)
 	{
-		tree->pooledPairs = pair->a.next;
-		return pair;
+		IndexPush(&tree->freeIndexes, &tree->freeCount, &tree->freeCapacity, tree->pendingIndexes[i]);
 	}
-	else
+
+	tree->pendingCount = 0;
+}
+
+//MARK: Pair Functions
+
+static inline uint64_t
+PairKey(int a, int b)
+{
+	return (a < b ? ((uint64_t)a << 32) | (uint32_t)b : ((uint64_t)b << 32) | (uint32_t)a);
+}
+
+static inline int
+PairSlotFor(cpBBTree* tree, uint64_t key)
+{
+	uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+	return (int)(hash >> 32) & tree->pairSlotMask;
+}
+
+// Returns the slot holding 'key', or the empty slot where it would go.
+static inline int
+PairSlotFind(cpBBTree* tree, uint64_t key)
+{
+	PairSlot* slots = tree->pairSlots;
+	int mask = tree->pairSlotMask;
+
+	int i = PairSlotFor(tree, key);
+	while (slots[i].key != key && slots[i].key != EMPTY_PAIR_KEY) i = (i + 1) & mask;
+	return i;
+}
+
+static void
+PairSlotsResize(cpBBTree* tree, int capacity)
+{
+	PairSlot* old = tree->pairSlots;
+	int oldCapacity = (old ? tree->pairSlotMask + 1 : 0);
+
+	tree->pairSlots = (PairSlot*)cpcalloc(capacity, sizeof(PairSlot));
+	tree->pairSlotMask = capacity - 1;
+	for (int i = 0; i < capacity; i++) tree->pairSlots[i].key = EMPTY_PAIR_KEY;
+
+	for (int i = 0; i < oldCapacity; i++)
 	{
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES / sizeof(Pair);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		if (old[i].key != EMPTY_PAIR_KEY) tree->pairSlots[PairSlotFind(tree, old[i].key)] = old[i];
+	}
 
-		Pair* buffer = (Pair*)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(tree->allocatedBuffers, buffer);
+	cpfree(old);
+}
 
-		// push all but the first one, return the first instead
-		for (int i = 1; i < count; i++) PairRecycle(tree, buffer + i);
-		return buffer;
+// Linear probing removal, shifts the following entries back instead of leaving tombstones.
+static void
+PairSlotRemove(cpBBTree* tree, int i)
+{
+	PairSlot* slots = tree->pairSlots;
+	int mask = tree->pairSlotMask;
+
+	for (int j = (i + 1) & mask; slots[j].key != EMPTY_PAIR_KEY; j = (j + 1) & mask)
+	{
+		int home = PairSlotFor(tree, slots[j].key);
+
+		// Move the entry back if 'i' lies cyclically between its home slot and 'j'.
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			slots[i] = slots[j];
+			i = j;
+		}
 	}
+
+	slots[i].key = EMPTY_PAIR_KEY;
 }
 
-static inline void
-ThreadUnlink(Thread thread)
+static void
+PairInsert(Node* a, Node* b, cpBBTree* tree)
 {
-	Pair* next = thread.next;
-	Pair* prev = thread.prev;
+	tree = GetMasterTree(tree);
 
-	if (next)
+	// Keep the load factor under 1/2.
+	if (2 * (tree->pairCount + 1) > tree->pairSlotMask + 1)
 	{
-		if (next->a.leaf == thread.leaf) next->a.prev = prev; else next->b.prev = prev;
+		PairSlotsResize(tree, tree->pairSlots ? 2 * (tree->pairSlotMask + 1) : 256);
 	}
 
-	if (prev)
+	uint64_t key = PairKey(a->INDEX, b->INDEX);
+	int slot = PairSlotFind(tree, key);
+	if (tree->pairSlots[slot].key == key) return;
+
+	if (tree->pairCount == tree->pairCapacity)
 	{
-		if (prev->a.leaf == thread.leaf) prev->a.next = next; else prev->b.next = next;
+		tree->pairCapacity = (tree->pairCapacity ? 2 * tree->pairCapacity : 128);
+		tree->pairs = (Pair*)cprealloc(tree->pairs, tree->pairCapacity * sizeof(Pair));
 	}
-	else
+
+	Pair pair = { a->INDEX, b->INDEX, 0 };
+	tree->pairs[tree->pairCount] = pair;
+
+	tree->pairSlots[slot].key = key;
+	tree->pairSlots[slot].pair = tree->pairCount++;
+}
+
+// Swap removes the pair, the last pair takes its place.
+static void
+PairRemove(cpBBTree* tree, int i)
+{
+	Pair* pairs = tree->pairs;
+	PairSlotRemove(tree, PairSlotFind(tree, PairKey(pairs[i].a, pairs[i].b)));
+
+	int last = --tree->pairCount;
+	if (i != last)
 	{
-		thread.leaf->PAIRS = next;
+		pairs[i] = pairs[last];
+		tree->pairSlots[PairSlotFind(tree, PairKey(pairs[i].a, pairs[i].b))].pair = i;
 	}
 }
 
+// Drops pairs whose leaves were removed or no longer overlap and passes the rest to 'func'.
 static void
-PairsClear(Node* leaf, cpBBTree* tree)
+PairsCompact(cpBBTree* tree, cpSpatialIndexQueryFunc func, void* data)
 {
-	Pair* pair = leaf->PAIRS;
-	leaf->PAIRS = NULL;
+	Node** leafNodes = tree->leafNodes;
 
-	while (pair)
+	for (int i = 0; i < tree->pairCount;)
 	{
-		if (pair->a.leaf == leaf)
+		Pair* pair = tree->pairs + i;
+		Node* a = leafNodes[pair->a];
+		Node* b = leafNodes[pair->b];
+
+		if (a && b && cpBBIntersects(a->bb, b->bb))
 		{
-			Pair* next = pair->a.next;
-			ThreadUnlink(pair->b);
-			PairRecycle(tree, pair);
-			pair = next;
+			pair->id = func(a->obj, b->obj, pair->id, data);
+			i++;
 		}
 		else
 		{
-			Pair* next = pair->b.next;
-			ThreadUnlink(pair->a);
-			PairRecycle(tree, pair);
-			pair = next;
+			PairRemove(tree, i);
 		}
 	}
+
+	LeafIndexesFree(tree);
 }
 
+// Drops only the pairs of removed leaves, without reporting the rest.
 static void
-PairInsert(Node* a, Node* b, cpBBTree* tree)
+PairsDropRemoved(cpBBTree* tree)
 {
-	Pair* nextA = a->PAIRS, * nextB = b->PAIRS;
-	Pair* pair = PairFromPool(tree);
-	Pair temp = { {NULL, a, nextA},{NULL, b, nextB}, 0 };
+	Node** leafNodes = tree->leafNodes;
 
-	a->PAIRS = b->PAIRS = pair;
-	*pair = temp;
-
-	if (nextA)
+	for (int i = 0; i < tree->pairCount;)
 	{
-		if (nextA->a.leaf == a) nextA->a.prev = pair; else nextA->b.prev = pair;
+		Pair* pair = tree->pairs + i;
+		if (leafNodes[pair->a] && leafNodes[pair->b])
+		{
+			i++;
+		}
+		else
+		{
+			PairRemove(tree, i);
+		}
 	}
 
-	if (nextB)
-	{
-		if (nextB->a.leaf == b) nextB->a.prev = pair; else nextB->b.prev = pair;
-	}
+	LeafIndexesFree(tree);
 }
 
-
 //MARK: Node Functions
 
 static void
@@ -300,17 +482,26 @@ NodeSetB(Node* node, Node* value)
 	value->parent = node;
 }
 
+// Recalculate the bounds and filter bits of an internal node from its children.
+static inline void
+NodeRefit(Node* node)
+{
+	node->bb = cpBBMerge(node->A->bb, node->B->bb);
+	node->layer = node->A->layer | node->B->layer;
+	node->mask = node->A->mask | node->B->mask;
+}
+
 static Node*
 NodeNew(cpBBTree* tree, Node* a, Node* b)
 {
 	Node* node = NodeFromPool(tree);
 
 	node->obj = NULL;
-	node->bb = cpBBMerge(a->bb, b->bb);
 	node->parent = NULL;
 
 	NodeSetA(node, a);
 	NodeSetB(node, b);
+	NodeRefit(node);
 
 	return node;
 }
@@ -344,10 +535,7 @@ NodeReplaceChild(Node* parent, Node* child, Node* value, cpBBTree* tree)
 		NodeSetB(parent, value);
 	}
 
-	for (Node* node = parent; node; node = node->parent)
-	{
-		node->bb = cpBBMerge(node->A->bb, node->B->bb);
-	}
+	for (Node* node = parent; node; node = node->parent) NodeRefit(node);
 }
 
 //MARK: Subtree Functions
@@ -390,14 +578,16 @@ SubtreeInsert(Node* subtree, Node* leaf, cpBBTree* tree)
 		}
 
 		subtree->bb = cpBBMerge(subtree->bb, leaf->bb);
+		subtree->layer |= leaf->layer;
+		subtree->mask |= leaf->mask;
 		return subtree;
 	}
 }
 
 static void
-SubtreeQuery(Node* subtree, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, void* data)
+SubtreeQuery(Node* subtree, void* obj, cpBB bb, const QueryFilter* filter, cpSpatialIndexQueryFunc func, void* data)
 {
-	if (cpBBIntersects(subtree->bb, bb))
+	if (cpBBIntersects(subtree->bb, bb) && NodeAcceptsQuery(subtree, filter))
 	{
 		if (NodeIsLeaf(subtree))
 		{
@@ -405,16 +595,16 @@ SubtreeQuery(Node* subtree, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, vo
 		}
 		else
 		{
-			SubtreeQuery(subtree->A, obj, bb, func, data);
-			SubtreeQuery(subtree->B, obj, bb, func, data);
+			SubtreeQuery(subtree->A, obj, bb, filter, func, data);
+			SubtreeQuery(subtree->B, obj, bb, filter, func, data);
 		}
 	}
 }
 
 static cpBool
-SubtreeBBQuery(Node* subtree, void* obj, cpBB bb, cpSpatialIndexBBQueryFunc func, void* data)
+SubtreeBBQuery(Node* subtree, void* obj, cpBB bb, const QueryFilter* filter, cpSpatialIndexBBQueryFunc func, void* data)
 {
-	if (cpBBIntersects(subtree->bb, bb))
+	if (cpBBIntersects(subtree->bb, bb) && NodeAcceptsQuery(subtree, filter))
 	{
 		if (NodeIsLeaf(subtree))
 		{
@@ -423,8 +613,8 @@ SubtreeBBQuery(Node* subtree, void* obj, cpBB bb, cpSpatialIndexBBQueryFunc func
 		else
 		{
 			cpBool ok = cpTrue;
-			ok &= SubtreeBBQuery(subtree->A, obj, bb, func, data);
-			ok &= SubtreeBBQuery(subtree->B, obj, bb, func, data);
+			ok &= SubtreeBBQuery(subtree->A, obj, bb, filter, func, data);
+			ok &= SubtreeBBQuery(subtree->B, obj, bb, filter, func, data);
 			return ok;
 		}
 	}
@@ -435,7 +625,7 @@ SubtreeBBQuery(Node* subtree, void* obj, cpBB bb, cpSpatialIndexBBQueryFunc func
 }
 
 static cpFloat
-SubtreeSegmentQuery(Node* subtree, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void* data)
+SubtreeSegmentQuery(Node* subtree, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, const QueryFilter* filter, cpSpatialIndexSegmentQueryFunc func, void* data)
 {
 	if (NodeIsLeaf(subtree))
 	{
@@ -443,18 +633,20 @@ SubtreeSegmentQuery(Node* subtree, void* obj, cpVect a, cpVect b, cpFloat r, cpF
 	}
 	else
 	{
-		cpFloat t_a = cpBBSegmentQuery(subtree->A->bb, a, b, r);
-		cpFloat t_b = cpBBSegmentQuery(subtree->B->bb, a, b, r);
+		Node* node_a = subtree->A;
+		Node* node_b = subtree->B;
+		cpFloat t_a = (NodeAcceptsQuery(node_a, filter) ? cpBBSegmentQuery(node_a->bb, a, b, r) : INFINITY);
+		cpFloat t_b = (NodeAcceptsQuery(node_b, filter) ? cpBBSegmentQuery(node_b->bb, a, b, r) : INFINITY);
 
 		if (t_a < t_b)
 		{
-			if (t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, r, t_exit, func, data));
-			if (t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, r, t_exit, func, data));
+			if (t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(node_a, obj, a, b, r, t_exit, filter, func, data));
+			if (t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(node_b, obj, a, b, r, t_exit, filter, func, data));
 		}
 		else
 		{
-			if (t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, r, t_exit, func, data));
-			if (t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, r, t_exit, func, data));
+			if (t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(node_b, obj, a, b, r, t_exit, filter, func, data));
+			if (t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(node_a, obj, a, b, r, t_exit, filter, func, data));
 		}
 
 		return t_exit;
@@ -503,25 +695,46 @@ typedef struct MarkContext
 {
 	cpBBTree* tree;
 	Node* staticRoot;
-	cpSpatialIndexQueryFunc func;
-	void* data;
+
+	// When set, new pairs are collected here instead of being added to the pair table.
+	MarkBuffer* buffer;
 } MarkContext;
 
+static void
+MarkPair(Node* a, Node* b, MarkContext* context)
+{
+	MarkBuffer* buffer = context->buffer;
+	if (buffer)
+	{
+		if (buffer->count + 2 > buffer->capacity)
+		{
+			buffer->capacity = (buffer->capacity ? 2 * buffer->capacity : 256);
+			buffer->leaves = (Node**)cprealloc(buffer->leaves, buffer->capacity * sizeof(Node*));
+		}
+
+		buffer->leaves[buffer->count++] = a;
+		buffer->leaves[buffer->count++] = b;
+	}
+	else
+	{
+		PairInsert(a, b, context->tree);
+	}
+}
+
 static void
 MarkLeafQuery(Node* subtree, Node* leaf, cpBool left, MarkContext* context)
 {
-	if (cpBBIntersects(leaf->bb, subtree->bb))
+	if (cpBBIntersects(leaf->bb, subtree->bb) && NodeAccepts(subtree, leaf->layer, leaf->mask))
 	{
 		if (NodeIsLeaf(subtree))
 		{
 			if (left)
 			{
-				PairInsert(leaf, subtree, context->tree);
+				MarkPair(leaf, subtree, context);
 			}
-			else
+			else if (subtree->STAMP < leaf->STAMP)
 			{
-				if (subtree->STAMP < leaf->STAMP) PairInsert(subtree, leaf, context->tree);
-				context->func(leaf->obj, subtree->obj, 0, context->data);
+				MarkPair(subtree, leaf, context);
 			}
 		}
 		else
@@ -535,6 +748,7 @@ MarkLeafQuery(Node* subtree, Node* leaf, cpBool left, MarkContext* context)
 static void
 MarkLeaf(Node* leaf, MarkContext* context)
 {
+	// Pairs of leaves that didn't move are still in the pair table.
 	cpBBTree* tree = context->tree;
 	if (leaf->STAMP == GetMasterTree(tree)->stamp)
 	{
@@ -553,22 +767,6 @@ MarkLeaf(Node* leaf, MarkContext* context)
 			}
 		}
 	}
-	else
-	{
-		Pair* pair = leaf->PAIRS;
-		while (pair)
-		{
-			if (leaf == pair->b.leaf)
-			{
-				pair->id = context->func(pair->a.leaf->obj, leaf->obj, pair->id, context->data);
-				pair = pair->b.next;
-			}
-			else
-			{
-				pair = pair->a.next;
-			}
-		}
-	}
 }
 
 static void
@@ -585,6 +783,63 @@ MarkSubtree(Node* subtree, MarkContext* context)
 	}
 }
 
+typedef struct MarkTasks
+{
+	cpBBTree* tree;
+	Node* staticRoot;
+
+	Node* subtrees[1 << CP_BBTREE_PARALLEL_MARK_DEPTH];
+	int count;
+} MarkTasks;
+
+// Collects the subtrees at 'depth' from left to right.
+static void
+MarkTasksCollect(Node* subtree, int depth, MarkTasks* tasks)
+{
+	if (depth == 0 || NodeIsLeaf(subtree))
+	{
+		tasks->subtrees[tasks->count++] = subtree;
+	}
+	else
+	{
+		MarkTasksCollect(subtree->A, depth - 1, tasks);
+		MarkTasksCollect(subtree->B, depth - 1, tasks);
+	}
+}
+
+static void
+MarkWorker(MarkTasks* tasks, unsigned long worker, unsigned long worker_count)
+{
+	for (int i = (int)worker; i < tasks->count; i += (int)worker_count)
+	{
+		MarkBuffer* buffer = tasks->tree->markBuffers + i;
+		buffer->count = 0;
+
+		MarkContext context = { tasks->tree, tasks->staticRoot, buffer };
+		MarkSubtree(tasks->subtrees[i], &context);
+	}
+}
+
+// Finds the pairs of the moved leaves on the worker threads.
+// The tree is only read while the workers run, the pairs are added afterwards in the same order a serial pass would.
+static void
+MarkSubtreeParallel(cpBBTree* tree, Node* staticRoot)
+{
+	MarkTasks tasks;
+	tasks.tree = tree;
+	tasks.staticRoot = staticRoot;
+	tasks.count = 0;
+
+	MarkTasksCollect(tree->root, CP_BBTREE_PARALLEL_MARK_DEPTH, &tasks);
+	cpSpatialIndexRunWorkers((cpSpatialIndex*)tree, (cpSpatialIndexWorkerFunc)MarkWorker, &tasks);
+
+	for (int i = 0; i < tasks.count; i++)
+	{
+		MarkBuffer* buffer = tree->markBuffers + i;
+		for (int j = 0; j < buffer->count; j += 2) PairInsert(buffer->leaves[j], buffer->leaves[j + 1], tree);
+	}
+}
+
 //MARK: Leaf Functions
 
 static Node*
@@ -596,16 +851,33 @@ LeafNew(cpBBTree* tree, void* obj, cpBB bb)
 
 	node->parent = NULL;
 	node->STAMP = 0;
-	node->PAIRS = NULL;
+	node->INDEX = LeafIndexNew(tree, node);
+	GetFilter(tree, obj, &node->layer, &node->mask);
 
 	return node;
 }
 
+// Returns true if the filter bits of the leaf changed.
+static cpBool
+LeafUpdateFilter(Node* leaf, cpBBTree* tree)
+{
+	cpBitmask layer, mask;
+	GetFilter(tree, leaf->obj, &layer, &mask);
+	if (layer == leaf->layer && mask == leaf->mask) return cpFalse;
+
+	leaf->layer = layer;
+	leaf->mask = mask;
+	for (Node* node = leaf->parent; node; node = node->parent) NodeRefit(node);
+
+	return cpTrue;
+}
+
 static cpBool
 LeafUpdate(Node* leaf, cpBBTree* tree)
 {
 	Node* root = tree->root;
 	cpBB bb = tree->spatialIndex.bbfunc(leaf->obj);
+	cpBool filterChanged = LeafUpdateFilter(leaf, tree);
 
 	if (!cpBBContainsBB(leaf->bb, bb))
 	{
@@ -614,7 +886,14 @@ LeafUpdate(Node* leaf, cpBBTree* tree)
 		root = SubtreeRemove(root, leaf, tree);
 		tree->root = SubtreeInsert(root, leaf, tree);
 
-		PairsClear(leaf, tree);
+		// Stale pairs are dropped once the leaves stop overlapping. (see PairsCompact())
+		leaf->STAMP = GetMasterTree(tree)->stamp;
+
+		return cpTrue;
+	}
+	else if (filterChanged)
+	{
+		// Pairs that the old bits pruned have to be searched for again.
 		leaf->STAMP = GetMasterTree(tree)->stamp;
 
 		return cpTrue;
@@ -640,14 +919,14 @@ LeafAddPairs(Node* leaf, cpBBTree* tree)
 		if (dynamicRoot)
 		{
 			cpBBTree* dynamicTree = GetTree(dynamicIndex);
-			MarkContext context = { dynamicTree, NULL, NULL, NULL };
+			MarkContext context = { dynamicTree, NULL, NULL };
 			MarkLeafQuery(dynamicRoot, leaf, cpTrue, &context);
 		}
 	}
 	else
 	{
 		Node* staticRoot = GetRootIfTree(tree->spatialIndex.staticIndex);
-		MarkContext context = { tree, staticRoot, VoidQueryFunc, NULL };
+		MarkContext context = { tree, staticRoot, NULL };
 		MarkLeaf(leaf, &context);
 	}
 }
@@ -660,10 +939,10 @@ cpBBTreeAlloc(void)
 	return (cpBBTree*)cpcalloc(1, sizeof(cpBBTree));
 }
 
-static int
-leafSetEql(void* obj, Node* node)
+static cpBool
+leafSetEql(const void* obj, const void* elt)
 {
-	return (obj == node->obj);
+	return (obj == ((const Node*)elt)->obj);
 }
 
 static void*
@@ -672,14 +951,45 @@ leafSetTrans(void* obj, cpBBTree* tree)
 	return LeafNew(tree, obj, tree->spatialIndex.bbfunc(obj));
 }
 
+static void
+RelinkStaticLeaf(Node* leaf, cpBBTree* staticTree)
+{
+	leaf->INDEX = LeafIndexNew(staticTree, leaf);
+	leaf->STAMP = GetMasterTree(staticTree)->stamp;
+}
+
+// Leaf indexes are handed out by the dynamic tree once they are linked.
+// Give the leaves already in the static tree new indexes, and drop its own index and pair tables.
+static void
+RelinkStaticTree(cpBBTree* staticTree)
+{
+	cpfree(staticTree->leafNodes);
+	cpfree(staticTree->freeIndexes);
+	cpfree(staticTree->pendingIndexes);
+	cpfree(staticTree->pairs);
+	cpfree(staticTree->pairSlots);
+
+	staticTree->leafNodes = NULL;
+	staticTree->leafCount = staticTree->leafCapacity = 0;
+	staticTree->freeIndexes = staticTree->pendingIndexes = NULL;
+	staticTree->freeCount = staticTree->pendingCount = staticTree->freeCapacity = staticTree->pendingCapacity = 0;
+	staticTree->pairs = NULL;
+	staticTree->pairCount = staticTree->pairCapacity = 0;
+	staticTree->pairSlots = NULL;
+	staticTree->pairSlotMask = 0;
+
+	cpHashSetEach(staticTree->leaves, (cpHashSetIteratorFunc)RelinkStaticLeaf, staticTree);
+}
+
 cpSpatialIndex*
 cpBBTreeInit(cpBBTree* tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex* staticIndex)
 {
 	cpSpatialIndexInit((cpSpatialIndex*)tree, Klass(), bbfunc, staticIndex);
 
 	tree->velocityFunc = NULL;
+	tree->filterFunc = NULL;
 
-	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
+	tree->leaves = cpHashSetNew(0, leafSetEql);
 	tree->root = NULL;
 
 	tree->pooledNodes = NULL;
@@ -687,6 +997,23 @@ cpBBTreeInit(cpBBTree* tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex* static
 
 	tree->stamp = 0;
 
+	tree->leafNodes = NULL;
+	tree->leafCount = tree->leafCapacity = 0;
+
+	tree->freeIndexes = tree->pendingIndexes = NULL;
+	tree->freeCount = tree->pendingCount = tree->freeCapacity = tree->pendingCapacity = 0;
+
+	tree->pairs = NULL;
+	tree->pairCount = tree->pairCapacity = 0;
+
+	tree->pairSlots = NULL;
+	tree->pairSlotMask = 0;
+
+	memset(tree->markBuffers, 0, sizeof(tree->markBuffers));
+
+	cpBBTree* staticTree = GetTree(staticIndex);
+	if (staticTree) RelinkStaticTree(staticTree);
+
 	return (cpSpatialIndex*)tree;
 }
 
@@ -702,6 +1029,18 @@ cpBBTreeSetVelocityFunc(cpSpatialIndex* index, cpBBTreeVelocityFunc func)
 	((cpBBTree*)index)->velocityFunc = func;
 }
 
+void
+cpBBTreeSetFilterFunc(cpSpatialIndex* index, cpBBTreeFilterFunc func)
+{
+	if (index->klass != Klass())
+	{
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetFilterFunc() call to non-tree spatial index.");
+		return;
+	}
+
+	((cpBBTree*)index)->filterFunc = func;
+}
+
 cpSpatialIndex*
 cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex* staticIndex)
 {
@@ -715,6 +1054,14 @@ cpBBTreeDestroy(cpBBTree* tree)
 
 	if (tree->allocatedBuffers) cpArrayFreeEach(tree->allocatedBuffers, cpfree);
 	cpArrayFree(tree->allocatedBuffers);
+
+	cpfree(tree->leafNodes);
+	cpfree(tree->freeIndexes);
+	cpfree(tree->pendingIndexes);
+	cpfree(tree->pairs);
+	cpfree(tree->pairSlots);
+
+	for (int i = 0; i < (1 << CP_BBTREE_PARALLEL_MARK_DEPTH); i++) cpfree(tree->markBuffers[i].leaves);
 }
 
 //MARK: Insert/Remove
@@ -738,8 +1085,21 @@ cpBBTreeRemove(cpBBTree* tree, void* obj, cpHashValue hashid)
 	Node* leaf = (Node*)cpHashSetRemove(tree->leaves, hashid, obj);
 
 	tree->root = SubtreeRemove(tree->root, leaf, tree);
-	PairsClear(leaf, tree);
+	LeafIndexRecycle(tree, leaf->INDEX);
 	NodeRecycle(tree, leaf);
+
+	// Removed indexes are normally freed when cpBBTreeReindexQuery() compacts the master tree's pairs.
+	// Trees that never get there (ex: a static tree next to a spatial hash, or a tree that is only queried)
+	// free them right away if they have no pairs, or drop the stale pairs once they are half of the indexes.
+	cpBBTree* master = GetMasterTree(tree);
+	if (master->pairCount == 0)
+	{
+		LeafIndexesFree(master);
+	}
+	else if (master->pendingCount > master->leafCount / 2)
+	{
+		PairsDropRemoved(master);
+	}
 }
 
 static cpBool
@@ -755,19 +1115,42 @@ static void LeafUpdateWrap(Node* leaf, cpBBTree* tree)
 	LeafUpdate(leaf, tree);
 }
 
+static void
+StaticLeafUpdateWrap(Node* leaf, cpBBTree* tree)
+{
+	if (LeafUpdate(leaf, tree)) LeafAddPairs(leaf, tree);
+}
+
 static void
 cpBBTreeReindexQuery(cpBBTree* tree, cpSpatialIndexQueryFunc func, void* data)
 {
 	if (!tree->root) return;
 
+	// A static tree keeps no pairs of its own, moved leaves are only checked against the dynamic tree.
+	if (tree->spatialIndex.dynamicIndex)
+	{
+		cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)StaticLeafUpdateWrap, tree);
+		IncrementStamp(tree);
+		return;
+	}
+
 	// LeafUpdate() may modify tree->root. Don't cache it.
 	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
 
 	cpSpatialIndex* staticIndex = tree->spatialIndex.staticIndex;
 	Node* staticRoot = (staticIndex && staticIndex->klass == Klass() ? ((cpBBTree*)staticIndex)->root : NULL);
 
-	MarkContext context = { tree, staticRoot, func, data };
-	MarkSubtree(tree->root, &context);
+	if (tree->spatialIndex.runWorkers && cpHashSetCount(tree->leaves) >= CP_BBTREE_PARALLEL_MARK_THRESHOLD)
+	{
+		MarkSubtreeParallel(tree, staticRoot);
+	}
+	else
+	{
+		MarkContext context = { tree, staticRoot, NULL };
+		MarkSubtree(tree->root, &context);
+	}
+
+	PairsCompact(tree, func, data);
 	if (staticIndex && !staticRoot) cpSpatialIndexCollideStatic((cpSpatialIndex*)tree, staticIndex, func, data);
 
 	IncrementStamp(tree);
@@ -796,48 +1179,536 @@ static void
 cpBBTreeSegmentQuery(cpBBTree* tree, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void* data)
 {
 	Node* root = tree->root;
-	if (root) SubtreeSegmentQuery(root, obj, a, b, r, t_exit, func, data);
+	if (root) SubtreeSegmentQuery(root, obj, a, b, r, t_exit, NULL, func, data);
 }
 
 static void
 cpBBTreeQuery(cpBBTree* tree, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, void* data)
 {
-	if (tree->root) SubtreeQuery(tree->root, obj, bb, func, data);
+	if (tree->root) SubtreeQuery(tree->root, obj, bb, NULL, func, data);
 }
 
 static void
 cpBBTreeBBQuery(cpBBTree* tree, void* obj, cpBB bb, cpSpatialIndexBBQueryFunc func, void* data)
 {
 	Node* root = tree->root;
-	if (root) SubtreeBBQuery(root, obj, bb, func, data);
+	if (root) SubtreeBBQuery(root, obj, bb, NULL, func, data);
 }
 
-//MARK: Misc
-
-static int
-cpBBTreeCount(cpBBTree* tree)
+void
+cpBBTreeQueryFiltered(cpSpatialIndex* index, void* obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexQueryFunc func, void* data)
 {
-	return cpHashSetCount(tree->leaves);
+	cpBBTree* tree = GetTree(index);
+	if (tree)
+	{
+		QueryFilter filter = { layer, mask };
+		if (tree->root) SubtreeQuery(tree->root, obj, bb, &filter, func, data);
+	}
+	else
+	{
+		cpSpatialIndexQuery(index, obj, bb, func, data);
+	}
 }
 
-typedef struct eachContext
+typedef struct BBQueryFallbackContext
 {
-	cpSpatialIndexIteratorFunc func;
+	cpSpatialIndexBBQueryFunc func;
 	void* data;
-} eachContext;
+} BBQueryFallbackContext;
 
-static void each_helper(Node* node, eachContext* context)
+static cpCollisionID
+BBQueryFallbackQuery(void* obj1, void* obj2, cpCollisionID id, BBQueryFallbackContext* context)
 {
-	context->func(node->obj, context->data);
+	context->func(obj1, obj2, context->data);
+	return id;
 }
 
-static void
-cpBBTreeEach(cpBBTree* tree, cpSpatialIndexIteratorFunc func, void* data)
+void
+cpBBTreeBBQueryFiltered(cpSpatialIndex* index, void* obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexBBQueryFunc func, void* data)
 {
-	eachContext context = { func, data };
-	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)each_helper, &context);
-}
-
+	cpBBTree* tree = GetTree(index);
+	if (tree)
+	{
+		QueryFilter filter = { layer, mask };
+		if (tree->root) SubtreeBBQuery(tree->root, obj, bb, &filter, func, data);
+	}
+	else if (index->klass->bbQuery)
+	{
+		cpSpatialIndexBBQuery(index, obj, bb, func, data);
+	}
+	else
+	{
+		// The spatial hash and sweep don't implement BB queries, use a regular query instead.
+		BBQueryFallbackContext context = { func, data };
+		cpSpatialIndexQuery(index, obj, bb, (cpSpatialIndexQueryFunc)BBQueryFallbackQuery, &context);
+	}
+}
+
+void
+cpBBTreeSegmentQueryFiltered(cpSpatialIndex* index, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpBitmask layer, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void* data)
+{
+	cpBBTree* tree = GetTree(index);
+	if (tree)
+	{
+		QueryFilter filter = { layer, mask };
+		Node* root = tree->root;
+		if (root && NodeAccepts(root, layer, mask)) SubtreeSegmentQuery(root, obj, a, b, r, t_exit, &filter, func, data);
+	}
+	else
+	{
+		cpSpatialIndexSegmentQuery(index, obj, a, b, r, t_exit, func, data);
+	}
+}
+
+//MARK: Segment Packets
+
+// Packets with this many segments or fewer left in them split into regular traversals.
+#define CP_BBTREE_PACKET_SPLIT 2
+
+typedef struct SegmentPacket
+{
+	// Segments are stored as structures of arrays to keep each lane's data together for the node tests.
+	cpFloat ax[CP_BBTREE_PACKET_SIZE], ay[CP_BBTREE_PACKET_SIZE];
+	cpFloat idx[CP_BBTREE_PACKET_SIZE], idy[CP_BBTREE_PACKET_SIZE];
+	cpFloat r[CP_BBTREE_PACKET_SIZE];
+	cpFloat* t_exit;
+	const cpVect* a, * b;
+	cpBitmask layers[CP_BBTREE_PACKET_SIZE], masks[CP_BBTREE_PACKET_SIZE];
+
+	void* obj;
+	cpBBTreeSegmentPacketFunc func;
+	void* data;
+} SegmentPacket;
+
+static inline int
+BitCount(unsigned int bits)
+{
+	int count = 0;
+	for (; bits; bits &= bits - 1) count++;
+	return count;
+}
+
+static inline int
+LowestBit(unsigned int bits)
+{
+	int i = 0;
+	while (!(bits & 1u))
+	{
+		bits >>= 1;
+		i++;
+	}
+
+	return i;
+}
+
+#if CP_USE_SSE2
+// Slab test the node against the packet's active segments four at a time.
+// Returns the ones that enter the node before their exit times, and the nearest entry time.
+static unsigned int
+PacketTest(const SegmentPacket* packet, const Node* node, unsigned int active, cpFloat* t, cpFloat* t_near)
+{
+	cpBB bb = node->bb;
+	__m128 l = _mm_set1_ps(bb.l), b = _mm_set1_ps(bb.b), r = _mm_set1_ps(bb.r), top = _mm_set1_ps(bb.t);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), inf = _mm_set1_ps(INFINITY);
+
+	unsigned int hits = 0;
+	for (int i = 0; i < CP_BBTREE_PACKET_SIZE; i += 4)
+	{
+		if (!((active >> i) & 0xF)) continue;
+
+		__m128 radius = _mm_loadu_ps(packet->r + i);
+		__m128 ax = _mm_loadu_ps(packet->ax + i), ay = _mm_loadu_ps(packet->ay + i);
+		__m128 idx = _mm_loadu_ps(packet->idx + i), idy = _mm_loadu_ps(packet->idy + i);
+
+		__m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(l, radius), ax), idx);
+		__m128 x2 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(r, radius), ax), idx);
+		__m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(b, radius), ay), idy);
+		__m128 y2 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(top, radius), ay), idy);
+
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x1, x2), _mm_min_ps(y1, y2)), zero);
+		__m128 tmax = _mm_min_ps(_mm_max_ps(x1, x2), _mm_max_ps(y1, y2));
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(tmin, tmax), _mm_cmple_ps(tmin, one));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(tmin, _mm_loadu_ps(packet->t_exit + i)));
+
+		_mm_storeu_ps(t + i, _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, inf)));
+		hits |= (unsigned int)_mm_movemask_ps(hit) << i;
+	}
+
+	// The layer bits are too wide for SSE2, check them per segment.
+	hits &= active;
+	cpFloat nearest = INFINITY;
+	for (unsigned int bits = hits; bits; bits &= bits - 1)
+	{
+		int i = LowestBit(bits);
+		if ((node->layer & packet->masks[i]) | (packet->layers[i] & node->mask))
+		{
+			nearest = cpfmin(nearest, t[i]);
+		}
+		else
+		{
+			hits &= ~(1u << i);
+		}
+	}
+
+	(*t_near) = nearest;
+	return hits;
+}
+#else
+// Slab test the node against the packet's active segments.
+// Returns the ones that enter the node before their exit times, and the nearest entry time.
+static unsigned int
+PacketTest(const SegmentPacket* packet, const Node* node, unsigned int active, cpFloat* t, cpFloat* t_near)
+{
+	cpBB bb = node->bb;
+	const cpFloat* t_exit = packet->t_exit;
+
+	unsigned int hits = 0;
+	cpFloat nearest = INFINITY;
+	for (unsigned int bits = active; bits; bits &= bits - 1)
+	{
+		int i = LowestBit(bits);
+		cpFloat r = packet->r[i];
+		cpFloat x1 = (bb.l - r - packet->ax[i]) * packet->idx[i];
+		cpFloat x2 = (bb.r + r - packet->ax[i]) * packet->idx[i];
+		cpFloat y1 = (bb.b - r - packet->ay[i]) * packet->idy[i];
+		cpFloat y2 = (bb.t + r - packet->ay[i]) * packet->idy[i];
+
+		cpFloat tmin = cpfmax(cpfmax(cpfmin(x1, x2), cpfmin(y1, y2)), 0.0f);
+		cpFloat tmax = cpfmin(cpfmax(x1, x2), cpfmax(y1, y2));
+		t[i] = (tmin <= tmax && tmin <= 1.0f ? tmin : INFINITY);
+
+		if (t[i] < t_exit[i] && ((node->layer & packet->masks[i]) | (packet->layers[i] & node->mask)))
+		{
+			hits |= 1u << i;
+			nearest = cpfmin(nearest, t[i]);
+		}
+	}
+
+	(*t_near) = nearest;
+	return hits;
+}
+#endif
+
+// Drop the segments whose exit times moved in front of their entry times 't'.
+static inline unsigned int
+PacketCull(const SegmentPacket* packet, unsigned int active, const cpFloat* t)
+{
+	for (unsigned int bits = active; bits; bits &= bits - 1)
+	{
+		int i = LowestBit(bits);
+		if (t[i] >= packet->t_exit[i]) active &= ~(1u << i);
+	}
+
+	return active;
+}
+
+typedef struct PacketFallbackContext
+{
+	cpBBTreeSegmentPacketFunc func;
+	void* data;
+	int ray;
+	cpFloat t_exit;
+} PacketFallbackContext;
+
+static cpFloat
+PacketFallbackQuery(void* obj1, void* obj2, PacketFallbackContext* context)
+{
+	cpFloat t = context->func(obj1, obj2, context->ray, context->data);
+	context->t_exit = cpfmin(context->t_exit, t);
+	return t;
+}
+
+static void
+SubtreeSegmentQueryPacket(Node* subtree, SegmentPacket* packet, unsigned int active)
+{
+	if (NodeIsLeaf(subtree))
+	{
+		for (unsigned int bits = active; bits; bits &= bits - 1)
+		{
+			int i = LowestBit(bits);
+			packet->t_exit[i] = cpfmin(packet->t_exit[i], packet->func(packet->obj, subtree->obj, i, packet->data));
+		}
+	}
+	else if (BitCount(active) <= CP_BBTREE_PACKET_SPLIT)
+	{
+		// The packet has diverged, finish the remaining segments with regular traversals.
+		for (unsigned int bits = active; bits; bits &= bits - 1)
+		{
+			int i = LowestBit(bits);
+			PacketFallbackContext context = { packet->func, packet->data, i, packet->t_exit[i] };
+			QueryFilter filter = { packet->layers[i], packet->masks[i] };
+			SubtreeSegmentQuery(subtree, packet->obj, packet->a[i], packet->b[i], packet->r[i], packet->t_exit[i], &filter, (cpSpatialIndexSegmentQueryFunc)PacketFallbackQuery, &context);
+			packet->t_exit[i] = context.t_exit;
+		}
+	}
+	else
+	{
+		cpFloat t_a[CP_BBTREE_PACKET_SIZE], t_b[CP_BBTREE_PACKET_SIZE];
+		cpFloat near_a, near_b;
+		unsigned int active_a = PacketTest(packet, subtree->A, active, t_a, &near_a);
+		unsigned int active_b = PacketTest(packet, subtree->B, active, t_b, &near_b);
+
+		// Visit the child the packet reaches first so the exit times shrink sooner.
+		if (near_a < near_b)
+		{
+			if (active_a) SubtreeSegmentQueryPacket(subtree->A, packet, active_a);
+			if (active_b && (active_b = PacketCull(packet, active_b, t_b))) SubtreeSegmentQueryPacket(subtree->B, packet, active_b);
+		}
+		else
+		{
+			if (active_b) SubtreeSegmentQueryPacket(subtree->B, packet, active_b);
+			if (active_a && (active_a = PacketCull(packet, active_a, t_a))) SubtreeSegmentQueryPacket(subtree->A, packet, active_a);
+		}
+	}
+}
+
+void
+cpBBTreeSegmentQueryPacket(cpSpatialIndex* index, void* obj, int count, const cpVect* a, const cpVect* b, const cpFloat* r, cpFloat* t_exit, const cpBitmask* layers, const cpBitmask* masks, cpBBTreeSegmentPacketFunc func, void* data)
+{
+	cpAssertHard(count <= CP_BBTREE_PACKET_SIZE, "Too many segments for a single packet.");
+
+	cpBBTree* tree = GetTree(index);
+	if (!tree)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			PacketFallbackContext context = { func, data, i, t_exit[i] };
+			cpSpatialIndexSegmentQuery(index, obj, a[i], b[i], r[i], t_exit[i], (cpSpatialIndexSegmentQueryFunc)PacketFallbackQuery, &context);
+			t_exit[i] = context.t_exit;
+		}
+
+		return;
+	}
+
+	Node* root = tree->root;
+	if (!root || count <= 0) return;
+
+	// Unused lanes are zeroed so the vectorized tests don't read garbage.
+	SegmentPacket packet;
+	cpFloat t_packet[CP_BBTREE_PACKET_SIZE];
+	memset(&packet, 0, sizeof(packet));
+	memset(t_packet, 0, sizeof(t_packet));
+
+	packet.t_exit = t_packet;
+	packet.a = a;
+	packet.b = b;
+	packet.obj = obj;
+	packet.func = func;
+	packet.data = data;
+
+	for (int i = 0; i < count; i++)
+	{
+		cpVect delta = cpvsub(b[i], a[i]);
+
+		packet.ax[i] = a[i].x;
+		packet.ay[i] = a[i].y;
+		// Axis aligned segments get huge (but not infinite) inverse deltas to avoid 0*inf.
+		packet.idx[i] = 1.0f / (delta.x ? delta.x : CPFLOAT_MIN);
+		packet.idy[i] = 1.0f / (delta.y ? delta.y : CPFLOAT_MIN);
+		packet.r[i] = r[i];
+		packet.layers[i] = layers[i];
+		packet.masks[i] = masks[i];
+		t_packet[i] = t_exit[i];
+	}
+
+	cpFloat t_root[CP_BBTREE_PACKET_SIZE], near;
+	unsigned int active = PacketTest(&packet, root, (1u << count) - 1u, t_root, &near);
+	if (active) SubtreeSegmentQueryPacket(root, &packet, active);
+
+	for (int i = 0; i < count; i++) t_exit[i] = t_packet[i];
+}
+
+//MARK: Nearest Queries
+
+typedef struct NearestEntry
+{
+	cpFloat distsq;
+	Node* node;
+} NearestEntry;
+
+typedef struct NearestHeap
+{
+	NearestEntry* entries;
+	int count, capacity;
+	NearestEntry buffer[64];
+} NearestHeap;
+
+static inline cpFloat
+NodeDistSq(const Node* node, cpVect p)
+{
+	cpBB bb = node->bb;
+	cpFloat dx = cpfmax(cpfmax(bb.l - p.x, p.x - bb.r), 0.0f);
+	cpFloat dy = cpfmax(cpfmax(bb.b - p.y, p.y - bb.t), 0.0f);
+	return dx * dx + dy * dy;
+}
+
+static void
+NearestHeapPush(NearestHeap* heap, Node* node, cpFloat distsq)
+{
+	if (heap->count == heap->capacity)
+	{
+		heap->capacity *= 2;
+		if (heap->entries == heap->buffer)
+		{
+			heap->entries = (NearestEntry*)cpcalloc(heap->capacity, sizeof(NearestEntry));
+			memcpy(heap->entries, heap->buffer, heap->count * sizeof(NearestEntry));
+		}
+		else
+		{
+			heap->entries = (NearestEntry*)cprealloc(heap->entries, heap->capacity * sizeof(NearestEntry));
+		}
+	}
+
+	NearestEntry* entries = heap->entries;
+	int i = heap->count++;
+	for (int parent = (i - 1) / 2; i > 0 && distsq < entries[parent].distsq; i = parent, parent = (i - 1) / 2)
+	{
+		entries[i] = entries[parent];
+	}
+
+	NearestEntry entry = { distsq, node };
+	entries[i] = entry;
+}
+
+static NearestEntry
+NearestHeapPop(NearestHeap* heap)
+{
+	NearestEntry* entries = heap->entries;
+	NearestEntry top = entries[0];
+	NearestEntry last = entries[--heap->count];
+	int count = heap->count;
+
+	int i = 0;
+	for (int child = 1; child < count; i = child, child = 2 * i + 1)
+	{
+		if (child + 1 < count && entries[child + 1].distsq < entries[child].distsq) child++;
+		if (last.distsq <= entries[child].distsq) break;
+		entries[i] = entries[child];
+	}
+
+	if (count > 0) entries[i] = last;
+	return top;
+}
+
+typedef struct NearestFallbackContext
+{
+	cpBBTreeNearestFunc func;
+	void* data;
+} NearestFallbackContext;
+
+static cpCollisionID
+NearestFallbackQuery(void* obj1, void* obj2, cpCollisionID id, NearestFallbackContext* context)
+{
+	context->func(obj1, obj2, context->data);
+	return id;
+}
+
+typedef struct NearestFallbackEachContext
+{
+	void* obj;
+	cpBBTreeNearestFunc func;
+	void* data;
+} NearestFallbackEachContext;
+
+static void
+NearestFallbackEach(void* obj, NearestFallbackEachContext* context)
+{
+	context->func(context->obj, obj, context->data);
+}
+
+void
+cpBBTreeNearestQuery(cpSpatialIndex* index, void* obj, cpVect point, cpFloat maxDistance, cpBitmask layer, cpBitmask mask, cpBBTreeNearestFunc func, void* data)
+{
+	cpBBTree* tree = GetTree(index);
+	if (!tree)
+	{
+		// Other indexes can't order their results, visit everything in range instead.
+		if (maxDistance < INFINITY)
+		{
+			NearestFallbackContext context = { func, data };
+			cpSpatialIndexQuery(index, obj, cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f)), (cpSpatialIndexQueryFunc)NearestFallbackQuery, &context);
+		}
+		else
+		{
+			NearestFallbackEachContext context = { obj, func, data };
+			cpSpatialIndexEach(index, (cpSpatialIndexIteratorFunc)NearestFallbackEach, &context);
+		}
+
+		return;
+	}
+
+	Node* root = tree->root;
+	if (!root || !NodeAccepts(root, layer, mask)) return;
+
+	// Objects may report negative distances when the point is inside of them.
+	// Only nodes containing the point can hold those, so the bound never drops below zero.
+	cpFloat maxsq = (maxDistance > 0.0f ? maxDistance * maxDistance : 0.0f);
+
+	NearestHeap heap;
+	heap.entries = heap.buffer;
+	heap.count = 0;
+	heap.capacity = sizeof(heap.buffer) / sizeof(NearestEntry);
+
+	cpFloat rootsq = NodeDistSq(root, point);
+	if (rootsq <= maxsq) NearestHeapPush(&heap, root, rootsq);
+
+	while (heap.count > 0)
+	{
+		NearestEntry entry = NearestHeapPop(&heap);
+		// Everything left in the heap is further away.
+		if (entry.distsq > maxsq) break;
+
+		Node* node = entry.node;
+		if (NodeIsLeaf(node))
+		{
+			cpFloat bound = func(obj, node->obj, data);
+			if (bound < maxDistance)
+			{
+				maxDistance = bound;
+				maxsq = (bound > 0.0f ? bound * bound : 0.0f);
+			}
+		}
+		else
+		{
+			Node* children[2] = { node->A, node->B };
+			for (int i = 0; i < 2; i++)
+			{
+				Node* child = children[i];
+				cpFloat distsq = NodeDistSq(child, point);
+				if (distsq <= maxsq && NodeAccepts(child, layer, mask)) NearestHeapPush(&heap, child, distsq);
+			}
+		}
+	}
+
+	if (heap.entries != heap.buffer) cpfree(heap.entries);
+}
+
+//MARK: Misc
+
+static int
+cpBBTreeCount(cpBBTree* tree)
+{
+	return cpHashSetCount(tree->leaves);
+}
+
+typedef struct eachContext
+{
+	cpSpatialIndexIteratorFunc func;
+	void* data;
+} eachContext;
+
+static void each_helper(Node* node, eachContext* context)
+{
+	context->func(node->obj, context->data);
+}
+
+static void
+cpBBTreeEach(cpBBTree* tree, cpSpatialIndexIteratorFunc func, void* data)
+{
+	eachContext context = { func, data };
+	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)each_helper, &context);
+}
+
 static cpSpatialIndexClass klass = {
 	(cpSpatialIndexDestroyImpl)cpBBTreeDestroy,
 
@@ -865,11 +1736,12 @@ static inline cpSpatialIndexClass* Klass()
 
 //MARK: Tree Optimization
 
-static int
-cpfcompare(const cpFloat* a, const cpFloat* b)
-{
-	return (*a < *b ? -1 : (*b < *a ? 1 : 0));
-}
+#define CP_BBTREE_SAH_BINS 16
+
+// Minimum leaf count before a rebuild is split across worker threads.
+#define CP_BBTREE_PARALLEL_BUILD_THRESHOLD 4096
+// Levels built serially before handing the subtrees to the workers. (up to 2^depth tasks)
+#define CP_BBTREE_PARALLEL_BUILD_DEPTH 3
 
 static void
 fillNodeArray(Node* node, Node*** cursor)
@@ -878,63 +1750,111 @@ fillNodeArray(Node* node, Node*** cursor)
 	(*cursor)++;
 }
 
-static Node*
-partitionNodes(cpBBTree* tree, Node** nodes, int count)
+static inline cpFloat
+BBPerimeter(cpBB bb)
 {
-	if (count == 1)
-	{
-		return nodes[0];
-	}
-	else if (count == 2)
+	return (bb.r - bb.l) + (bb.t - bb.b);
+}
+
+static inline int
+BinIndex(Node* node, cpBool splitWidth, cpFloat min, cpFloat scale)
+{
+	cpFloat c = (splitWidth ? node->bb.l + node->bb.r : node->bb.b + node->bb.t);
+	int bin = (int)((c - min) * scale);
+	return (bin < CP_BBTREE_SAH_BINS - 1 ? bin : CP_BBTREE_SAH_BINS - 1);
+}
+
+// Partitions the leaves in place using a binned SAH split and returns the size of the left half.
+static int
+BinnedSplit(Node** leaves, int count)
+{
+	// Find the bounds of the (doubled) centroids.
+	cpFloat l = INFINITY, r = -INFINITY, b = INFINITY, t = -INFINITY;
+	for (int i = 0; i < count; i++)
 	{
-		return NodeNew(tree, nodes[0], nodes[1]);
+		cpBB bb = leaves[i]->bb;
+		cpFloat cx = bb.l + bb.r, cy = bb.b + bb.t;
+		l = cpfmin(l, cx); r = cpfmax(r, cx);
+		b = cpfmin(b, cy); t = cpfmax(t, cy);
 	}
 
-	// Find the AABB for these nodes
-	cpBB bb = nodes[0]->bb;
-	for (int i = 1; i < count; i++) bb = cpBBMerge(bb, nodes[i]->bb);
+	// Split on the longest axis of the centroid bounds.
+	cpBool splitWidth = (r - l > t - b);
+	cpFloat min = (splitWidth ? l : b);
+	cpFloat extent = (splitWidth ? r - l : t - b);
+
+	// All centroids coincide, no split is better than any other.
+	if (!(extent > 0.0f)) return count / 2;
 
-	// Split it on it's longest axis
-	cpBool splitWidth = (bb.r - bb.l > bb.t - bb.b);
+	cpFloat scale = CP_BBTREE_SAH_BINS / extent;
 
-	// Sort the bounds and use the median as the splitting point
-	cpFloat* bounds = (cpFloat*)cpcalloc(count * 2, sizeof(cpFloat));
-	if (splitWidth)
+	int binCounts[CP_BBTREE_SAH_BINS] = { 0 };
+	cpBB binBBs[CP_BBTREE_SAH_BINS];
+
+	for (int i = 0; i < count; i++)
 	{
-		for (int i = 0; i < count; i++)
+		Node* node = leaves[i];
+		int bin = BinIndex(node, splitWidth, min, scale);
+		binBBs[bin] = (binCounts[bin] ? cpBBMerge(binBBs[bin], node->bb) : node->bb);
+		binCounts[bin]++;
+	}
+
+	// Sweep from the right to find the cost of everything right of each split plane.
+	cpFloat rightCosts[CP_BBTREE_SAH_BINS];
+	int rightCounts[CP_BBTREE_SAH_BINS];
+	{
+		cpBB bb = cpBBNew(0.0f, 0.0f, 0.0f, 0.0f);
+		int n = 0;
+		for (int i = CP_BBTREE_SAH_BINS - 1; i > 0; i--)
 		{
-			bounds[2 * i + 0] = nodes[i]->bb.l;
-			bounds[2 * i + 1] = nodes[i]->bb.r;
+			if (binCounts[i])
+			{
+				bb = (n ? cpBBMerge(bb, binBBs[i]) : binBBs[i]);
+				n += binCounts[i];
+			}
+
+			rightCosts[i] = BBPerimeter(bb) * n;
+			rightCounts[i] = n;
 		}
 	}
-	else
+
+	// Then sweep from the left and pick the cheapest plane.
+	int split = -1;
+	cpFloat bestCost = INFINITY;
 	{
-		for (int i = 0; i < count; i++)
+		cpBB bb = cpBBNew(0.0f, 0.0f, 0.0f, 0.0f);
+		int n = 0;
+		for (int i = 0; i < CP_BBTREE_SAH_BINS - 1; i++)
 		{
-			bounds[2 * i + 0] = nodes[i]->bb.b;
-			bounds[2 * i + 1] = nodes[i]->bb.t;
+			if (binCounts[i])
+			{
+				bb = (n ? cpBBMerge(bb, binBBs[i]) : binBBs[i]);
+				n += binCounts[i];
+			}
+
+			if (n == 0 || rightCounts[i + 1] == 0) continue;
+
+			cpFloat cost = BBPerimeter(bb) * n + rightCosts[i + 1];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				split = i;
+			}
 		}
 	}
 
-	qsort(bounds, count * 2, sizeof(cpFloat), (int (*)(const void*, const void*))cpfcompare);
-	cpFloat split = (bounds[count - 1] + bounds[count]) * 0.5f; // use the medain as the split
-	cpfree(bounds);
+	if (split < 0) return count / 2;
 
-	// Generate the child BBs
-	cpBB a = bb, b = bb;
-	if (splitWidth) a.r = b.l = split; else a.t = b.b = split;
-
-	// Partition the nodes
+	// Partition the leaves.
 	int right = count;
 	for (int left = 0; left < right;)
 	{
-		Node* node = nodes[left];
-		if (cpBBMergedArea(node->bb, b) < cpBBMergedArea(node->bb, a))
+		Node* node = leaves[left];
+		if (BinIndex(node, splitWidth, min, scale) > split)
 		{
-			//		if(cpBBProximity(node->bb, b) < cpBBProximity(node->bb, a)){
 			right--;
-			nodes[left] = nodes[right];
-			nodes[right] = node;
+			leaves[left] = leaves[right];
+			leaves[right] = node;
 		}
 		else
 		{
@@ -942,18 +1862,328 @@ partitionNodes(cpBBTree* tree, Node** nodes, int count)
 		}
 	}
 
-	if (right == count)
+	return right;
+}
+
+// Splits the Morton sorted leaves at the highest bit where the first and last codes differ.
+static int
+MortonSplit(uint32_t* codes, int count)
+{
+	uint32_t diff = codes[0] ^ codes[count - 1];
+	if (diff == 0) return count / 2;
+
+	// Isolate the highest differing bit.
+	diff |= diff >> 1; diff |= diff >> 2; diff |= diff >> 4; diff |= diff >> 8; diff |= diff >> 16;
+	uint32_t bit = diff ^ (diff >> 1);
+
+	// The codes share everything above 'bit', so the ones with it cleared come first.
+	int lo = 1, hi = count - 1;
+	while (lo < hi)
 	{
-		Node* node = NULL;
-		for (int i = 0; i < count; i++) node = SubtreeInsert(node, nodes[i], tree);
-		return node;
+		int mid = (lo + hi) / 2;
+		if (codes[mid] & bit) hi = mid; else lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// Builds a subtree over 'count' leaves using the 'count - 1' preallocated internal nodes.
+// Each split owns a fixed slot so subtrees can be built independently of each other.
+// Splits by SAH, or by Morton code if the leaves were sorted by 'codes'.
+static Node*
+BuildSubtree(Node** leaves, uint32_t* codes, Node** nodes, int count)
+{
+	if (count == 1) return leaves[0];
+
+	int split = (codes ? MortonSplit(codes, count) : BinnedSplit(leaves, count));
+
+	Node* node = nodes[split - 1];
+	node->obj = NULL;
+	node->parent = NULL;
+
+	NodeSetA(node, BuildSubtree(leaves, codes, nodes, split));
+	NodeSetB(node, BuildSubtree(leaves + split, (codes ? codes + split : NULL), nodes + split, count - split));
+	NodeRefit(node);
+
+	return node;
+}
+
+typedef struct BuildTask
+{
+	Node** leaves;
+	uint32_t* codes;
+	Node** nodes;
+	int count;
+	Node** out;
+} BuildTask;
+
+typedef struct BuildContext
+{
+	BuildTask tasks[1 << CP_BBTREE_PARALLEL_BUILD_DEPTH];
+	int count;
+} BuildContext;
+
+static void
+BuildTopLevel(Node** leaves, uint32_t* codes, Node** nodes, int count, int depth, Node** out, BuildContext* context)
+{
+	if (depth == 0 || count < 2)
+	{
+		BuildTask task = { leaves, codes, nodes, count, out };
+		context->tasks[context->count++] = task;
+		return;
 	}
 
-	// Recurse and build the node!
-	return NodeNew(tree,
-		partitionNodes(tree, nodes, right),
-		partitionNodes(tree, nodes + right, count - right)
-	);
+	int split = (codes ? MortonSplit(codes, count) : BinnedSplit(leaves, count));
+
+	Node* node = nodes[split - 1];
+	node->obj = NULL;
+	node->parent = NULL;
+	*out = node;
+
+	BuildTopLevel(leaves, codes, nodes, split, depth - 1, &node->A, context);
+	BuildTopLevel(leaves + split, (codes ? codes + split : NULL), nodes + split, count - split, depth - 1, &node->B, context);
+}
+
+static void
+BuildWorker(BuildContext* context, unsigned long worker, unsigned long worker_count)
+{
+	for (int i = (int)worker; i < context->count; i += (int)worker_count)
+	{
+		BuildTask* task = context->tasks + i;
+		*task->out = BuildSubtree(task->leaves, task->codes, task->nodes, task->count);
+	}
+}
+
+// Fix the parent links and bounds of the serially built top levels.
+static void
+BuildRefitTop(Node* node, int depth)
+{
+	if (NodeIsLeaf(node)) return;
+
+	if (depth > 0)
+	{
+		BuildRefitTop(node->A, depth - 1);
+		BuildRefitTop(node->B, depth - 1);
+	}
+
+	NodeSetA(node, node->A);
+	NodeSetB(node, node->B);
+	NodeRefit(node);
+}
+
+// Builds a tree over the leaves, splitting it across the worker threads if it's large enough.
+// 'leaves' and 'codes' are reordered and a fresh internal node is taken from the pool for each split.
+static Node*
+BuildTree(cpBBTree* tree, Node** leaves, uint32_t* codes, int count)
+{
+	Node** nodes = (Node**)cpcalloc(count, sizeof(Node*));
+	for (int i = 0; i < count - 1; i++) nodes[i] = NodeFromPool(tree);
+
+	Node* root = NULL;
+	if (count >= CP_BBTREE_PARALLEL_BUILD_THRESHOLD && tree->spatialIndex.runWorkers)
+	{
+		BuildContext context;
+		context.count = 0;
+
+		BuildTopLevel(leaves, codes, nodes, count, CP_BBTREE_PARALLEL_BUILD_DEPTH, &root, &context);
+		cpSpatialIndexRunWorkers((cpSpatialIndex*)tree, (cpSpatialIndexWorkerFunc)BuildWorker, &context);
+		BuildRefitTop(root, CP_BBTREE_PARALLEL_BUILD_DEPTH);
+	}
+	else
+	{
+		root = BuildSubtree(leaves, codes, nodes, count);
+	}
+
+	cpfree(nodes);
+
+	root->parent = NULL;
+	return root;
+}
+
+//MARK: Linear Bulk Build
+
+typedef struct MortonContext
+{
+	Node** leaves;
+	uint32_t* codes;
+	int count;
+
+	cpVect origin;
+	cpVect scale;
+} MortonContext;
+
+static inline uint32_t
+MortonSpread(uint32_t x)
+{
+	x &= 0x0000FFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+static void
+MortonWorker(MortonContext* context, unsigned long worker, unsigned long worker_count)
+{
+	int count = context->count;
+	int begin = (int)((count * worker) / worker_count);
+	int end = (int)((count * (worker + 1)) / worker_count);
+
+	cpVect origin = context->origin, scale = context->scale;
+	for (int i = begin; i < end; i++)
+	{
+		cpBB bb = context->leaves[i]->bb;
+		cpFloat x = (bb.l + bb.r - origin.x) * scale.x;
+		cpFloat y = (bb.b + bb.t - origin.y) * scale.y;
+
+		context->codes[i] = MortonSpread((uint32_t)cpfclamp(x, 0.0f, 65535.0f)) | (MortonSpread((uint32_t)cpfclamp(y, 0.0f, 65535.0f)) << 1);
+	}
+}
+
+// LSD radix sort of the leaves by their Morton codes.
+static void
+MortonSort(Node** leaves, uint32_t* codes, int count)
+{
+	Node** leavesTmp = (Node**)cpcalloc(count, sizeof(Node*));
+	uint32_t* codesTmp = (uint32_t*)cpcalloc(count, sizeof(uint32_t));
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		int offsets[256] = { 0 };
+		for (int i = 0; i < count; i++) offsets[(codes[i] >> shift) & 0xFF]++;
+
+		// Skip passes where every code has the same digit.
+		if (offsets[(codes[0] >> shift) & 0xFF] == count) continue;
+
+		for (int i = 0, sum = 0; i < 256; i++)
+		{
+			int n = offsets[i];
+			offsets[i] = sum;
+			sum += n;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			int j = offsets[(codes[i] >> shift) & 0xFF]++;
+			codesTmp[j] = codes[i];
+			leavesTmp[j] = leaves[i];
+		}
+
+		memcpy(codes, codesTmp, count * sizeof(uint32_t));
+		memcpy(leaves, leavesTmp, count * sizeof(Node*));
+	}
+
+	cpfree(leavesTmp);
+	cpfree(codesTmp);
+}
+
+static inline cpFloat
+RotationCost(Node* a, Node* b)
+{
+	return BBPerimeter(cpBBMerge(a->bb, b->bb));
+}
+
+// Tree rotations (treelets of a node, its children and grandchildren).
+// Swaps a child with a grandchild on the other side whenever that shrinks the bounds in between.
+static void
+SubtreeRestructure(Node* node)
+{
+	if (NodeIsLeaf(node)) return;
+
+	SubtreeRestructure(node->A);
+	SubtreeRestructure(node->B);
+
+	cpFloat best = 0.0f;
+	int rotation = -1;
+
+	for (int i = 0; i < 4; i++)
+	{
+		Node* child = (i < 2 ? node->A : node->B);
+		Node* other = (i < 2 ? node->B : node->A);
+		if (NodeIsLeaf(child)) continue;
+
+		// Swap 'other' with one of the grandchildren.
+		Node* stay = (i & 1 ? child->A : child->B);
+		cpFloat delta = RotationCost(other, stay) - BBPerimeter(child->bb);
+		if (delta < best)
+		{
+			best = delta;
+			rotation = i;
+		}
+	}
+
+	if (rotation < 0) return;
+
+	Node* child = (rotation < 2 ? node->A : node->B);
+	Node* other = (rotation < 2 ? node->B : node->A);
+	Node* swap = (rotation & 1 ? child->B : child->A);
+
+	if (rotation & 1) NodeSetB(child, other); else NodeSetA(child, other);
+	if (rotation < 2) NodeSetB(node, swap); else NodeSetA(node, swap);
+	NodeRefit(child);
+}
+
+void
+cpBBTreeInsertBulk(cpSpatialIndex* index, void** objs, const cpHashValue* hashids, int count, cpBool restructure)
+{
+	if (index->klass != &klass)
+	{
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeInsertBulk() call to non-tree spatial index.");
+		return;
+	}
+
+	if (count <= 0) return;
+
+	cpBBTree* tree = (cpBBTree*)index;
+	Node** leaves = (Node**)cpcalloc(count, sizeof(Node*));
+	uint32_t* codes = (uint32_t*)cpcalloc(count, sizeof(uint32_t));
+
+	cpBB bounds = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+	for (int i = 0; i < count; i++)
+	{
+		Node* leaf = leaves[i] = (Node*)cpHashSetInsert(tree->leaves, hashids[i], objs[i], (cpHashSetTransFunc)leafSetTrans, tree);
+		cpAssertHard(leaf->parent == NULL && leaf != tree->root, "Internal Error: Object was already in the tree.");
+
+		// Bounds of the (doubled) centroids.
+		cpBB bb = leaf->bb;
+		cpVect c = cpv(bb.l + bb.r, bb.b + bb.t);
+		bounds = cpBBNew(cpfmin(bounds.l, c.x), cpfmin(bounds.b, c.y), cpfmax(bounds.r, c.x), cpfmax(bounds.t, c.y));
+	}
+
+	cpFloat w = bounds.r - bounds.l, h = bounds.t - bounds.b;
+	MortonContext context = {
+		leaves, codes, count,
+		cpv(bounds.l, bounds.b),
+		cpv(w > 0.0f ? 65535.0f / w : 0.0f, h > 0.0f ? 65535.0f / h : 0.0f),
+	};
+
+	if (count >= CP_BBTREE_PARALLEL_BUILD_THRESHOLD)
+	{
+		cpSpatialIndexRunWorkers(index, (cpSpatialIndexWorkerFunc)MortonWorker, &context);
+	}
+	else
+	{
+		MortonWorker(&context, 0, 1);
+	}
+
+	MortonSort(leaves, codes, count);
+
+	Node* subtree = BuildTree(tree, leaves, codes, count);
+	if (restructure) SubtreeRestructure(subtree);
+
+	tree->root = SubtreeInsert(tree->root, subtree, tree);
+	tree->root->parent = NULL;
+
+	// Stamp all the new leaves first so pairs between them are only added once.
+	cpTimestamp stamp = GetMasterTree(tree)->stamp;
+	for (int i = 0; i < count; i++) leaves[i]->STAMP = stamp;
+	for (int i = 0; i < count; i++) LeafAddPairs(leaves[i], tree);
+
+	IncrementStamp(tree);
+
+	cpfree(leaves);
+	cpfree(codes);
 }
 
 //static void
@@ -989,14 +2219,20 @@ cpBBTreeOptimize(cpSpatialIndex* index)
 	if (!root) return;
 
 	int count = cpBBTreeCount(tree);
-	Node** nodes = (Node**)cpcalloc(count, sizeof(Node*));
-	Node** cursor = nodes;
+	Node** leaves = (Node**)cpcalloc(count, sizeof(Node*));
+	Node** cursor = leaves;
 
 	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)fillNodeArray, &cursor);
 
 	SubtreeRecycle(tree, root);
-	tree->root = partitionNodes(tree, nodes, count);
-	cpfree(nodes);
+	tree->root = BuildTree(tree, leaves, NULL, count);
+	cpfree(leaves);
+}
+
+cpBool
+cpSpatialIndexIsBBTree(cpSpatialIndex* index)
+{
+	return (index && index->klass == Klass());
 }
 
 //MARK: Debug Draw
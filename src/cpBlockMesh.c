@@ -0,0 +1,438 @@
+// Copyright 2013 Howling Moon Software. All rights reserved.
+// See http://chipmunk2d.net/legal.php for more information.
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "chipmunk/chipmunk_private.h"
+#include "chipmunk/cpBlockMesh.h"
+
+#define CHUNK_SIZE 16
+
+struct cpBlockMesh {
+	cpBody* body;
+	cpFloat cellSize;
+	cpVect offset;
+
+	cpHashSet* chunks;
+	cpArray* dirtyChunks;
+};
+
+typedef struct ChunkKey {
+	int x, y;
+} ChunkKey;
+
+typedef struct Chunk {
+	int x, y;
+
+	int count;
+	cpShape* cells[CHUNK_SIZE * CHUNK_SIZE];
+
+	cpBool dirty;
+	// Merged boxes built from the cells, and the cells they were built from while the chunk is dirty.
+	cpArray* shapes;
+	cpShape* built[CHUNK_SIZE * CHUNK_SIZE];
+} Chunk;
+
+static inline int
+FloorDiv(int a, int b)
+{
+	return (a >= 0 ? a / b : -((b - 1 - a) / b));
+}
+
+static inline cpHashValue
+ChunkHash(int x, int y)
+{
+	return CP_HASH_PAIR((cpHashValue)x, (cpHashValue)y);
+}
+
+static cpBool
+ChunkSetEql(ChunkKey* key, Chunk* chunk)
+{
+	return (key->x == chunk->x && key->y == chunk->y);
+}
+
+static void*
+ChunkSetTrans(ChunkKey* key, void* unused)
+{
+	(void)unused;
+	Chunk* chunk = (Chunk*)cpcalloc(1, sizeof(Chunk));
+	chunk->x = key->x;
+	chunk->y = key->y;
+	chunk->shapes = cpArrayNew(0);
+
+	return chunk;
+}
+
+static Chunk*
+FindChunk(const cpBlockMesh* mesh, int x, int y)
+{
+	ChunkKey key = {FloorDiv(x, CHUNK_SIZE), FloorDiv(y, CHUNK_SIZE)};
+	return (Chunk*)cpHashSetFind(mesh->chunks, ChunkHash(key.x, key.y), &key);
+}
+
+static inline cpShape**
+ChunkCell(Chunk* chunk, int x, int y)
+{
+	return &chunk->cells[(y - chunk->y * CHUNK_SIZE) * CHUNK_SIZE + (x - chunk->x * CHUNK_SIZE)];
+}
+
+// Must be called before changing the cells so the merged boxes can still be mapped back to their blocks.
+static void
+MarkDirty(cpBlockMesh* mesh, Chunk* chunk)
+{
+	if (!chunk->dirty)
+	{
+		memcpy(chunk->built, chunk->cells, sizeof(chunk->cells));
+		chunk->dirty = cpTrue;
+		cpArrayPush(mesh->dirtyChunks, chunk);
+	}
+}
+
+static void
+FreeShapes(Chunk* chunk)
+{
+	for (int i = 0; i < chunk->shapes->num; i++)
+	{
+		cpShape* shape = (cpShape*)chunk->shapes->arr[i];
+		if (shape->space) cpSpaceRemoveShape(shape->space, shape);
+		cpShapeFree(shape);
+	}
+
+	chunk->shapes->num = 0;
+}
+
+static void
+FreeChunk(Chunk* chunk, void* unused)
+{
+	(void)unused;
+	FreeShapes(chunk);
+	cpArrayFree(chunk->shapes);
+	cpfree(chunk);
+}
+
+//MARK: Memory Management Functions
+
+cpBlockMesh*
+cpBlockMeshAlloc(void)
+{
+	return (cpBlockMesh*)cpcalloc(1, sizeof(cpBlockMesh));
+}
+
+cpBlockMesh*
+cpBlockMeshInit(cpBlockMesh* mesh, cpBody* body, cpFloat cellSize, cpVect offset)
+{
+	cpAssertHard(cellSize > 0.0f, "Cell size must be positive.");
+
+	mesh->body = body;
+	mesh->cellSize = cellSize;
+	mesh->offset = offset;
+
+	mesh->chunks = cpHashSetNew(0, (cpHashSetEqlFunc)ChunkSetEql);
+	mesh->dirtyChunks = cpArrayNew(0);
+
+	return mesh;
+}
+
+cpBlockMesh*
+cpBlockMeshNew(cpBody* body, cpFloat cellSize, cpVect offset)
+{
+	return cpBlockMeshInit(cpBlockMeshAlloc(), body, cellSize, offset);
+}
+
+void
+cpBlockMeshDestroy(cpBlockMesh* mesh)
+{
+	cpHashSetEach(mesh->chunks, (cpHashSetIteratorFunc)FreeChunk, NULL);
+	cpHashSetFree(mesh->chunks);
+	cpArrayFree(mesh->dirtyChunks);
+}
+
+void
+cpBlockMeshFree(cpBlockMesh* mesh)
+{
+	if (mesh)
+	{
+		cpBlockMeshDestroy(mesh);
+		cpfree(mesh);
+	}
+}
+
+cpBody*
+cpBlockMeshGetBody(const cpBlockMesh* mesh)
+{
+	return mesh->body;
+}
+
+//MARK: Blocks
+
+static void
+CellForPoint(const cpBlockMesh* mesh, cpVect p, int* x, int* y)
+{
+	cpVect v = cpvmult(cpvsub(p, mesh->offset), 1.0f / mesh->cellSize);
+	(*x) = (int)cpffloor(v.x);
+	(*y) = (int)cpffloor(v.y);
+}
+
+void
+cpBlockMeshAddBlock(cpBlockMesh* mesh, cpShape* block)
+{
+	int x, y;
+	CellForPoint(mesh, block->massInfo.cog, &x, &y);
+
+	ChunkKey key = {FloorDiv(x, CHUNK_SIZE), FloorDiv(y, CHUNK_SIZE)};
+	Chunk* chunk = (Chunk*)cpHashSetInsert(mesh->chunks, ChunkHash(key.x, key.y), &key, (cpHashSetTransFunc)ChunkSetTrans, NULL);
+
+	cpShape** cell = ChunkCell(chunk, x, y);
+	cpAssertHard(*cell == NULL, "The cell of this block is already taken.");
+
+	MarkDirty(mesh, chunk);
+	(*cell) = block;
+	chunk->count++;
+}
+
+void
+cpBlockMeshRemoveBlock(cpBlockMesh* mesh, cpShape* block)
+{
+	int x, y;
+	CellForPoint(mesh, block->massInfo.cog, &x, &y);
+
+	Chunk* chunk = FindChunk(mesh, x, y);
+	cpShape** cell = (chunk ? ChunkCell(chunk, x, y) : NULL);
+	cpAssertHard(cell && *cell == block, "Cannot remove a block that was not added to the mesh.");
+
+	MarkDirty(mesh, chunk);
+	(*cell) = NULL;
+	chunk->count--;
+}
+
+cpShape*
+cpBlockMeshGetBlock(const cpBlockMesh* mesh, int x, int y)
+{
+	Chunk* chunk = FindChunk(mesh, x, y);
+	return (chunk ? *ChunkCell(chunk, x, y) : NULL);
+}
+
+//MARK: Merging
+
+// The mass of a merged box is spread evenly over it, so only blocks of the same density can share one.
+static inline cpBool
+DensitiesMatch(const cpShape* a, const cpShape* b)
+{
+	cpFloat ma = a->massInfo.m * b->massInfo.area;
+	cpFloat mb = b->massInfo.m * a->massInfo.area;
+	return cpfabs(ma - mb) <= 1e-5f * cpfmax(cpfabs(ma), cpfabs(mb));
+}
+
+// Blocks are only merged if swapping one for the other wouldn't change how it collides or moves.
+static cpBool
+BlocksMatch(const cpShape* a, const cpShape* b)
+{
+	return (
+		DensitiesMatch(a, b) &&
+		a->sensor == b->sensor &&
+		a->e == b->e && a->u == b->u &&
+		a->rg_d == b->rg_d && a->rg_s == b->rg_s &&
+		cpveql(a->surfaceV, b->surfaceV) &&
+		a->userData == b->userData &&
+		a->material_type == b->material_type &&
+		a->attached_component_id == b->attached_component_id &&
+		a->type == b->type &&
+		a->filter.group == b->filter.group &&
+		a->filter.layer == b->filter.layer &&
+		a->filter.mask == b->filter.mask &&
+		a->filter.required == b->filter.required &&
+		a->filter.optional == b->filter.optional &&
+		a->filter.excluded == b->filter.excluded
+	);
+}
+
+static cpShape*
+MakeBox(cpBlockMesh* mesh, cpShape* block, int x, int y, int w, int h, cpFloat mass)
+{
+	cpFloat size = mesh->cellSize;
+	cpVect p = cpvadd(mesh->offset, cpv(x * size, y * size));
+	cpShape* shape = cpBoxShapeNewFast2(mesh->body, cpBBNew(p.x, p.y, p.x + w * size, p.y + h * size));
+
+	shape->sensor = block->sensor;
+	shape->e = block->e;
+	shape->u = block->u;
+	shape->rg_d = block->rg_d;
+	shape->rg_s = block->rg_s;
+	shape->surfaceV = block->surfaceV;
+	shape->userData = block->userData;
+	shape->material_type = block->material_type;
+	shape->attached_component_id = block->attached_component_id;
+	shape->type = block->type;
+	shape->filter = block->filter;
+	cpShapeSetMass(shape, mass);
+
+	return shape;
+}
+
+// Greedily grow a rectangle right and then up from each free cell in row order.
+static void
+MergeChunk(cpBlockMesh* mesh, Chunk* chunk, cpSpace* space)
+{
+	cpBool used[CHUNK_SIZE * CHUNK_SIZE] = {0};
+	cpShape** cells = chunk->cells;
+
+	for (int y = 0; y < CHUNK_SIZE; y++)
+	{
+		for (int x = 0; x < CHUNK_SIZE; x++)
+		{
+			int i = y * CHUNK_SIZE + x;
+			cpShape* block = cells[i];
+			if (block == NULL || used[i]) continue;
+
+			int w = 1;
+			while (x + w < CHUNK_SIZE)
+			{
+				int j = i + w;
+				if (cells[j] == NULL || used[j] || !BlocksMatch(block, cells[j])) break;
+				w++;
+			}
+
+			int h = 1;
+			while (y + h < CHUNK_SIZE)
+			{
+				int row = i + h * CHUNK_SIZE, k = 0;
+				for (; k < w; k++)
+				{
+					int j = row + k;
+					if (cells[j] == NULL || used[j] || !BlocksMatch(block, cells[j])) break;
+				}
+
+				if (k < w) break;
+				h++;
+			}
+
+			cpFloat mass = 0.0f;
+			for (int v = 0; v < h; v++)
+			{
+				for (int u = 0; u < w; u++)
+				{
+					int j = i + v * CHUNK_SIZE + u;
+					used[j] = cpTrue;
+					mass += cells[j]->massInfo.m;
+				}
+			}
+
+			cpShape* shape = MakeBox(mesh, block, chunk->x * CHUNK_SIZE + x, chunk->y * CHUNK_SIZE + y, w, h, mass);
+			cpArrayPush(chunk->shapes, shape);
+			if (space) cpSpaceAddShape(space, shape);
+		}
+	}
+}
+
+void
+cpBlockMeshUpdate(cpBlockMesh* mesh, cpSpace* space)
+{
+	cpArray* dirty = mesh->dirtyChunks;
+
+	for (int i = 0; i < dirty->num; i++)
+	{
+		Chunk* chunk = (Chunk*)dirty->arr[i];
+		chunk->dirty = cpFalse;
+		FreeShapes(chunk);
+
+		if (chunk->count)
+		{
+			MergeChunk(mesh, chunk, space);
+		}
+		else
+		{
+			ChunkKey key = {chunk->x, chunk->y};
+			cpHashSetRemove(mesh->chunks, ChunkHash(key.x, key.y), &key);
+			FreeChunk(chunk, NULL);
+		}
+	}
+
+	dirty->num = 0;
+}
+
+//MARK: Merged Boxes
+
+struct EachShapeContext {
+	cpBlockMeshShapeIteratorFunc func;
+	void* data;
+};
+
+static void
+EachChunkShape(Chunk* chunk, struct EachShapeContext* context)
+{
+	for (int i = 0; i < chunk->shapes->num; i++) context->func((cpShape*)chunk->shapes->arr[i], context->data);
+}
+
+void
+cpBlockMeshEachShape(cpBlockMesh* mesh, cpBlockMeshShapeIteratorFunc func, void* data)
+{
+	struct EachShapeContext context = {func, data};
+	cpHashSetEach(mesh->chunks, (cpHashSetIteratorFunc)EachChunkShape, &context);
+}
+
+// Get the block a merged box was built from at cell (x, y), or NULL if it was removed since.
+static cpShape*
+MergedBlock(Chunk* chunk, int x, int y)
+{
+	cpShape* block = *ChunkCell(chunk, x, y);
+	if (!chunk->dirty) return block;
+
+	// The cells changed since the boxes were built, skip blocks that are no longer in the mesh or that the box doesn't cover.
+	int i = (int)(ChunkCell(chunk, x, y) - chunk->cells);
+	return (chunk->built[i] == block ? block : NULL);
+}
+
+// Get the range of cells covered by a merged box.
+static void
+MergedCells(const cpBlockMesh* mesh, cpShape* merged, int* x, int* y, int* w, int* h)
+{
+	cpAssertHard(merged->klass->type == CP_BOX_SHAPE && merged->body == mesh->body, "Shape is not a merged box of this block mesh.");
+	cpBoxShape* box = (cpBoxShape*)merged;
+
+	cpVect min = cpvmult(cpvsub(cpvsub(box->c, box->h), mesh->offset), 1.0f / mesh->cellSize);
+	cpVect size = cpvmult(box->h, 2.0f / mesh->cellSize);
+	(*x) = (int)cpffloor(min.x + 0.5f);
+	(*y) = (int)cpffloor(min.y + 0.5f);
+	(*w) = (int)cpffloor(size.x + 0.5f);
+	(*h) = (int)cpffloor(size.y + 0.5f);
+}
+
+void
+cpBlockMeshEachBlock(cpBlockMesh* mesh, cpShape* merged, cpBlockMeshShapeIteratorFunc func, void* data)
+{
+	int x, y, w, h;
+	MergedCells(mesh, merged, &x, &y, &w, &h);
+
+	// A merged box never crosses a chunk boundary.
+	Chunk* chunk = FindChunk(mesh, x, y);
+	if (chunk == NULL) return;
+
+	for (int v = y; v < y + h; v++)
+	{
+		for (int u = x; u < x + w; u++)
+		{
+			cpShape* block = MergedBlock(chunk, u, v);
+			if (block) func(block, data);
+		}
+	}
+}
+
+cpShape*
+cpBlockMeshBlockAt(const cpBlockMesh* mesh, cpShape* merged, cpVect p, cpVect n)
+{
+	int x, y, w, h;
+	MergedCells(mesh, merged, &x, &y, &w, &h);
+
+	// Nudge points on the surface inside of the box before looking up the cell.
+	cpVect local = cpBodyWorldToLocal(mesh->body, cpvsub(p, cpvmult(n, 0.25f * mesh->cellSize)));
+
+	int cx, cy;
+	CellForPoint(mesh, local, &cx, &cy);
+	cx = (cx < x ? x : (cx < x + w ? cx : x + w - 1));
+	cy = (cy < y ? y : (cy < y + h ? cy : y + h - 1));
+
+	Chunk* chunk = FindChunk(mesh, cx, cy);
+	return (chunk ? MergedBlock(chunk, cx, cy) : NULL);
+}
@@ -35,6 +35,7 @@ cpBodyInit(cpBody* body, cpFloat mass, cpFloat moment)
 {
 	body->space = NULL;
 	body->shapeList = NULL;
+	body->compound = NULL;
 	body->arbiterList = NULL;
 	body->constraintList = NULL;
 
@@ -98,6 +99,7 @@ cpBodyNewStatic()
 
 void cpBodyDestroy(cpBody* body)
 {
+	cpShapeFree((cpShape*)body->compound);
 }
 
 void
@@ -227,14 +229,31 @@ cpBodySetType(cpBody* body, cpBodyType type)
 		// Move the body's shapes to the correct spatial index.
 		cpSpatialIndex* fromIndex = (oldType == CP_BODY_TYPE_STATIC ? space->staticShapes : space->dynamicShapes);
 		cpSpatialIndex* toIndex = (type == CP_BODY_TYPE_STATIC ? space->staticShapes : space->dynamicShapes);
-		if (fromIndex != toIndex)
-		{
-			CP_BODY_FOREACH_SHAPE(body, shape)
-			{
-				cpSpatialIndexRemove(fromIndex, shape, shape->hashid);
-				cpSpatialIndexInsert(toIndex, shape, shape->hashid);
-			}
-		}
+		if (fromIndex != toIndex) cpSpaceMoveBodyShapes(space, body, fromIndex, toIndex);
+	}
+}
+
+cpBool
+cpBodyGetCompound(const cpBody* body)
+{
+	return (body->compound != NULL);
+}
+
+void
+cpBodySetCompound(cpBody* body, cpBool compound)
+{
+	if (compound == (body->compound != NULL)) return;
+
+	if (compound)
+	{
+		cpAssertHard(body->space == NULL, "A body must be made a compound body before it is added to a space.");
+		body->compound = cpCompoundShapeNew(body);
+	}
+	else
+	{
+		cpAssertHard(body->compound->count == 0, "The body's shapes must be removed from the space before it stops being a compound body.");
+		cpShapeFree((cpShape*)body->compound);
+		body->compound = NULL;
 	}
 }
 
@@ -25,6 +25,10 @@
 #include "chipmunk/chipmunk_private.h"
 #include "chipmunk/cpRobust.h"
 
+#if CP_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #if DEBUG && 0
 #include "ChipmunkDemo.h"
 #define DRAW_ALL 0
@@ -41,6 +45,9 @@
 #define WARN_GJK_ITERATIONS 20
 #define WARN_EPA_ITERATIONS 20
 
+// Polys with more vertexes than this search for support points with SIMD or by walking from a nearby vertex.
+#define POLY_SCAN_MAX_VERTS 8
+
 static inline void
 cpCollisionInfoPushContact(struct cpCollisionInfo* info, cpVect p1, cpVect p2, cpHashValue hash)
 {
@@ -64,8 +71,47 @@ PolySupportPointIndex(const int count, const struct cpSplittingPlane* planes, co
 {
 	cpFloat max = -INFINITY;
 	int index = 0;
+	int i = 0;
 
-	for (int i = 0; i < count; i++)
+#if CP_USE_SSE2
+	if (count > POLY_SCAN_MAX_VERTS)
+	{
+		__m128 nx = _mm_set1_ps(n.x), ny = _mm_set1_ps(n.y), maxes = _mm_set1_ps(-INFINITY);
+		__m128i indexes = _mm_setzero_si128(), lanes = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+
+		for (; i + 4 <= count; i += 4)
+		{
+			// Gather the x and y coordinates of four vertexes out of the planes.
+			__m128 v01 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)&planes[i + 0].v0), (const __m64*)&planes[i + 1].v0);
+			__m128 v23 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)&planes[i + 2].v0), (const __m64*)&planes[i + 3].v0);
+			__m128 x = _mm_shuffle_ps(v01, v23, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 y = _mm_shuffle_ps(v01, v23, _MM_SHUFFLE(3, 1, 3, 1));
+
+			__m128 d = _mm_add_ps(_mm_mul_ps(x, nx), _mm_mul_ps(y, ny));
+			__m128i greater = _mm_castps_si128(_mm_cmpgt_ps(d, maxes));
+			maxes = _mm_max_ps(d, maxes);
+			indexes = _mm_or_si128(_mm_and_si128(greater, lanes), _mm_andnot_si128(greater, indexes));
+			lanes = _mm_add_epi32(lanes, four);
+		}
+
+		float laneMax[4];
+		int laneIndex[4];
+		_mm_storeu_ps(laneMax, maxes);
+		_mm_storeu_si128((__m128i*)laneIndex, indexes);
+
+		// Break ties towards the lowest index like the scalar loop.
+		for (int j = 0; j < 4; j++)
+		{
+			if (laneMax[j] > max || (laneMax[j] == max && laneIndex[j] < index))
+			{
+				max = laneMax[j];
+				index = laneIndex[j];
+			}
+		}
+	}
+#endif
+
+	for (; i < count; i++)
 	{
 		cpVect v = planes[i].v0;
 		cpFloat d = cpvdot(v, n);
@@ -79,6 +125,54 @@ PolySupportPointIndex(const int count, const struct cpSplittingPlane* planes, co
 	return index;
 }
 
+// Walk from vertex 'i' towards the support point along 'n'.
+// The distance along 'n' rises and falls only once around a convex polygon, so this finds the same vertex as a full search.
+static inline int
+PolySupportPointIndexFrom(const int count, const struct cpSplittingPlane* planes, const cpVect n, int i)
+{
+	int prev = (i == 0 ? count - 1 : i - 1);
+	int next = (i == count - 1 ? 0 : i + 1);
+	cpFloat d = cpvdot(planes[i].v0, n), dprev = cpvdot(planes[prev].v0, n), dnext = cpvdot(planes[next].v0, n);
+
+	int step;
+	if (dnext > d)
+	{
+		step = 1;
+		i = next;
+		d = dnext;
+	}
+	else if (dprev > d)
+	{
+		step = -1;
+		i = prev;
+		d = dprev;
+	}
+	else if (dprev == d && dnext == d)
+	{
+		// Flat spot in the middle of collinear vertexes, could be the minimum.
+		return PolySupportPointIndex(count, planes, n);
+	}
+	else
+	{
+		return i;
+	}
+
+	for (int steps = 0; steps < count; steps++)
+	{
+		int j = i + step;
+		if (j == count) j = 0;
+		else if (j < 0) j = count - 1;
+
+		cpFloat dj = cpvdot(planes[j].v0, n);
+		if (dj <= d) break;
+
+		i = j;
+		d = dj;
+	}
+
+	return i;
+}
+
 struct SupportPoint
 {
 	cpVect p;
@@ -93,17 +187,20 @@ SupportPointNew(cpVect p, cpCollisionID index)
 	return point;
 }
 
-typedef struct SupportPoint(*SupportPointFunc)(const cpShape* shape, const cpVect n);
+// 'hint' is the index of a vertex near the support point, or -1 if there is none.
+typedef struct SupportPoint(*SupportPointFunc)(const cpShape* shape, const cpVect n, const int hint);
 
 static inline struct SupportPoint
-CircleSupportPoint(const cpCircleShape* circle, const cpVect n)
+CircleSupportPoint(const cpCircleShape* circle, const cpVect n, const int hint)
 {
+	(void)hint;
 	return SupportPointNew(circle->tc, 0);
 }
 
 static inline struct SupportPoint
-SegmentSupportPoint(const cpSegmentShape* seg, const cpVect n)
+SegmentSupportPoint(const cpSegmentShape* seg, const cpVect n, const int hint)
 {
+	(void)hint;
 	if (cpvdot(seg->ta, n) > cpvdot(seg->tb, n))
 	{
 		return SupportPointNew(seg->ta, 0);
@@ -115,13 +212,37 @@ SegmentSupportPoint(const cpSegmentShape* seg, const cpVect n)
 }
 
 static inline struct SupportPoint
-PolySupportPoint(const cpPolyShape* poly, const cpVect n)
+PolySupportPoint(const cpPolyShape* poly, const cpVect n, const int hint)
 {
 	const struct cpSplittingPlane* planes = poly->planes;
-	int i = PolySupportPointIndex(poly->count, planes, n);
+	int count = poly->count;
+
+	// Poly shapes may change vertex count.
+	int i = (count > POLY_SCAN_MAX_VERTS && 0 <= hint && hint < count ? PolySupportPointIndexFrom(count, planes, n, hint) : PolySupportPointIndex(count, planes, n));
 	return SupportPointNew(planes[i].v0, i);
 }
 
+// Index of the box corner with the given signs along the box's axes.
+static inline int
+BoxCornerIndex(const cpFloat x, const cpFloat y)
+{
+	return (x > 0.0f ? (y > 0.0f ? 1 : 0) : (y > 0.0f ? 2 : 3));
+}
+
+static inline cpVect
+BoxVert(const cpBoxShape* box, const int i)
+{
+	return cpBoxCorner(box->tc, cpvmult(box->tx, box->th.x), cpvmult(cpvperp(box->tx), box->th.y), i);
+}
+
+static inline struct SupportPoint
+BoxSupportPoint(const cpBoxShape* box, const cpVect n, const int hint)
+{
+	(void)hint;
+	int i = BoxCornerIndex(cpvdot(n, box->tx), cpvcross(box->tx, n));
+	return SupportPointNew(BoxVert(box, i), i);
+}
+
 // A point on the surface of two shape's minkowski difference.
 struct MinkowskiPoint
 {
@@ -150,8 +271,17 @@ struct SupportContext
 static inline struct MinkowskiPoint
 Support(const struct SupportContext* ctx, const cpVect n)
 {
-	struct SupportPoint a = ctx->func1(ctx->shape1, cpvneg(n));
-	struct SupportPoint b = ctx->func2(ctx->shape2, n);
+	struct SupportPoint a = ctx->func1(ctx->shape1, cpvneg(n), -1);
+	struct SupportPoint b = ctx->func2(ctx->shape2, n, -1);
+	return MinkowskiPointNew(a, b);
+}
+
+// Same as Support(), but start searching from the support points of 'near' since it's likely close by.
+static inline struct MinkowskiPoint
+SupportNear(const struct SupportContext* ctx, const cpVect n, const struct MinkowskiPoint near)
+{
+	struct SupportPoint a = ctx->func1(ctx->shape1, cpvneg(n), (near.id >> 8) & 0xFF);
+	struct SupportPoint b = ctx->func2(ctx->shape2, n, near.id & 0xFF);
 	return MinkowskiPointNew(a, b);
 }
 
@@ -170,30 +300,33 @@ struct Edge
 	cpVect n;
 };
 
+// Support edge around the support point 'i1' along 'n' of a convex polygon given by its world planes.
 static struct Edge
-SupportEdgeForPoly(const cpPolyShape* poly, const cpVect n)
+SupportEdgeForPlanes(const int count, const struct cpSplittingPlane* planes, const cpFloat r, const cpHashValue hashid, const int i1, const cpVect n)
 {
-	int count = poly->count;
-	int i1 = PolySupportPointIndex(poly->count, poly->planes, n);
-
 	// TODO: get rid of mod eventually, very expensive on ARM
 	int i0 = (i1 - 1 + count) % count;
 	int i2 = (i1 + 1) % count;
 
-	const struct cpSplittingPlane* planes = poly->planes;
-	cpHashValue hashid = poly->shape.hashid;
 	if (cpvdot(n, planes[i1].n) > cpvdot(n, planes[i2].n))
 	{
-		struct Edge edge = { {planes[i0].v0, CP_HASH_PAIR(hashid, i0)}, {planes[i1].v0, CP_HASH_PAIR(hashid, i1)}, poly->r, planes[i1].n };
+		struct Edge edge = { {planes[i0].v0, CP_HASH_PAIR(hashid, i0)}, {planes[i1].v0, CP_HASH_PAIR(hashid, i1)}, r, planes[i1].n };
 		return edge;
 	}
 	else
 	{
-		struct Edge edge = { {planes[i1].v0, CP_HASH_PAIR(hashid, i1)}, {planes[i2].v0, CP_HASH_PAIR(hashid, i2)}, poly->r, planes[i2].n };
+		struct Edge edge = { {planes[i1].v0, CP_HASH_PAIR(hashid, i1)}, {planes[i2].v0, CP_HASH_PAIR(hashid, i2)}, r, planes[i2].n };
 		return edge;
 	}
 }
 
+static struct Edge
+SupportEdgeForPoly(const cpPolyShape* poly, const cpVect n)
+{
+	int i1 = PolySupportPointIndex(poly->count, poly->planes, n);
+	return SupportEdgeForPlanes(poly->count, poly->planes, poly->r, poly->shape.hashid, i1, n);
+}
+
 static struct Edge
 SupportEdgeForSegment(const cpSegmentShape* seg, const cpVect n)
 {
@@ -310,7 +443,7 @@ EPARecurse(const struct SupportContext* ctx, const int count, const struct Minko
 	cpAssertSoft(!cpveql(v0.ab, v1.ab), "Internal Error: EPA vertexes are the same (%d and %d)", mini, (mini + 1) % count);
 
 	// Check if there is a point on the minkowski difference beyond this edge.
-	struct MinkowskiPoint p = Support(ctx, cpvperp(cpvsub(v1.ab, v0.ab)));
+	struct MinkowskiPoint p = SupportNear(ctx, cpvperp(cpvsub(v1.ab, v0.ab)), v0);
 
 #if DRAW_EPA
 	cpVect verts[count];
@@ -390,7 +523,7 @@ GJKRecurse(const struct SupportContext* ctx, const struct MinkowskiPoint v0, con
 	{
 		cpFloat t = ClosestT(v0.ab, v1.ab);
 		cpVect n = (-1.0f < t && t < 1.0f ? cpvperp(cpvsub(v1.ab, v0.ab)) : cpvneg(LerpT(v0.ab, v1.ab, t)));
-		struct MinkowskiPoint p = Support(ctx, n);
+		struct MinkowskiPoint p = SupportNear(ctx, n, v0);
 
 #if DRAW_GJK
 		ChipmunkDebugDrawSegment(v0.ab, v1.ab, RGBAColor(1, 1, 1, 1));
@@ -450,6 +583,9 @@ ShapePoint(const cpShape* shape, const int i)
 		// Poly shapes may change vertex count.
 		int index = (i < poly->count ? i : 0);
 		return SupportPointNew(poly->planes[index].v0, index);
+	} case CP_BOX_SHAPE:
+	{
+		return SupportPointNew(BoxVert((cpBoxShape*)shape, i & 3), i & 3);
 	} default:
 	{
 		return SupportPointNew(cpvzero, 0);
@@ -469,6 +605,7 @@ GJK(const struct SupportContext* ctx, cpCollisionID* id)
 	{
 	case CP_SEGMENT_SHAPE: count1 = 2; break;
 	case CP_POLY_SHAPE: count1 = ((cpPolyShape*)ctx->shape1)->count; break;
+	case CP_BOX_SHAPE: count1 = 4; break;
 	default: break;
 	}
 
@@ -476,6 +613,7 @@ GJK(const struct SupportContext* ctx, cpCollisionID* id)
 	{
 	case CP_SEGMENT_SHAPE: count1 = 2; break;
 	case CP_POLY_SHAPE: count2 = ((cpPolyShape*)ctx->shape2)->count; break;
+	case CP_BOX_SHAPE: count2 = 4; break;
 	default: break;
 	}
 
@@ -573,6 +711,224 @@ ContactPoints(const struct Edge e1, const struct Edge e2, const struct ClosestPo
 	}
 }
 
+//MARK: Separating Axis Tests
+
+// Polys with more vertices than this use GJK since the face search is O(n*m).
+#define SAT_MAX_VERTS 8
+// Flags a cached SAT face in a cpCollisionID. GJK's vertex indexes never reach it for polys this small.
+#define SAT_ID_FLAG 0x80000000
+// The second shape's face must be this much deeper to be used as the reference face so it doesn't flip between frames.
+#define SAT_RELATIVE_TOLERANCE 0.98f
+#define SAT_ABSOLUTE_TOLERANCE 1e-3f
+
+struct SATAxis
+{
+	// Separation of the shapes' cores along the face's normal, negative if they overlap.
+	cpFloat d;
+	// The face, and the vertex of the other shape furthest behind it.
+	int face, support;
+};
+
+static inline struct SATAxis
+SATFaceAxis(const struct cpSplittingPlane* planes, const int face, const int count, const struct cpSplittingPlane* verts)
+{
+	cpVect n = planes[face].n;
+	int support = PolySupportPointIndex(count, verts, cpvneg(n));
+	struct SATAxis axis = { cpvdot(n, cpvsub(verts[support].v0, planes[face].v0)), face, support };
+	return axis;
+}
+
+static struct SATAxis
+SATMaxAxis(const int count1, const struct cpSplittingPlane* planes1, const int count2, const struct cpSplittingPlane* planes2)
+{
+	struct SATAxis max = SATFaceAxis(planes1, 0, count2, planes2);
+	for (int i = 1; i < count1; i++)
+	{
+		struct SATAxis axis = SATFaceAxis(planes1, i, count2, planes2);
+		if (axis.d > max.d) max = axis;
+	}
+
+	return max;
+}
+
+// Pick the reference face from the deepest faces of both shapes and cache it.
+static inline int
+SATReferenceFace(const struct SATAxis axis1, const struct SATAxis axis2, cpCollisionID* id, struct SATAxis* out)
+{
+	int owner = (axis2.d > SAT_RELATIVE_TOLERANCE * axis1.d + SAT_ABSOLUTE_TOLERANCE);
+	*out = (owner ? axis2 : axis1);
+	*id = SAT_ID_FLAG | (owner << 8) | out->face;
+	return owner;
+}
+
+// Find the face of either shape with the largest separation.
+// Returns which shape the face belongs to, or -1 if it separates the shapes by more than their radii 'r'.
+static int
+SAT(const int count1, const struct cpSplittingPlane* planes1, const int count2, const struct cpSplittingPlane* planes2, const cpFloat r, cpCollisionID* id, struct SATAxis* out)
+{
+	// Most separated pairs stay separated by the same face as the last frame.
+	if (*id & SAT_ID_FLAG)
+	{
+		int owner = (*id >> 8) & 1, face = (*id & 0xFF);
+		if (owner == 0 && face < count1 && SATFaceAxis(planes1, face, count2, planes2).d > r) return -1;
+		if (owner == 1 && face < count2 && SATFaceAxis(planes2, face, count1, planes1).d > r) return -1;
+	}
+
+	struct SATAxis axis1 = SATMaxAxis(count1, planes1, count2, planes2);
+	if (axis1.d > r)
+	{
+		*id = SAT_ID_FLAG | axis1.face;
+		return -1;
+	}
+
+	struct SATAxis axis2 = SATMaxAxis(count2, planes2, count1, planes1);
+	if (axis2.d > r)
+	{
+		*id = SAT_ID_FLAG | (1 << 8) | axis2.face;
+		return -1;
+	}
+
+	return SATReferenceFace(axis1, axis2, id, out);
+}
+
+// Convex polygon given by its world planes, a poly or a box.
+struct SATShape
+{
+	int count;
+	const struct cpSplittingPlane* planes;
+	cpFloat r;
+	cpHashValue hashid;
+};
+
+static inline struct SATShape
+SATShapeForPoly(const cpPolyShape* poly)
+{
+	struct SATShape shape = { poly->count, poly->planes, poly->r, poly->shape.hashid };
+	return shape;
+}
+
+// 'planes' must have room for the box's 4 planes.
+static inline struct SATShape
+SATShapeForBox(const cpBoxShape* box, struct cpSplittingPlane* planes)
+{
+	cpBoxShapePlanes(box, planes);
+	struct SATShape shape = { 4, planes, 0.0f, box->shape.hashid };
+	return shape;
+}
+
+static inline struct Edge
+SupportEdgeForSATShape(const struct SATShape* shape, const int i1, const cpVect n)
+{
+	return SupportEdgeForPlanes(shape->count, shape->planes, shape->r, shape->hashid, i1, n);
+}
+
+// Clip the reference face against the incident edge around the other shape's support point.
+static void
+SATContacts(const struct SATShape* shape1, const struct SATShape* shape2, const int owner, const struct SATAxis axis, struct cpCollisionInfo* info)
+{
+	struct ClosestPoints points = { cpvzero, cpvzero, cpvzero, axis.d, 0 };
+	if (owner == 0)
+	{
+		points.n = shape1->planes[axis.face].n;
+		ContactPoints(SupportEdgeForSATShape(shape1, axis.face, points.n), SupportEdgeForSATShape(shape2, axis.support, cpvneg(points.n)), points, info);
+	}
+	else
+	{
+		points.n = cpvneg(shape2->planes[axis.face].n);
+		ContactPoints(SupportEdgeForSATShape(shape1, axis.support, points.n), SupportEdgeForSATShape(shape2, axis.face, cpvneg(points.n)), points, info);
+	}
+}
+
+// Collide two convex shapes using their face normals as the separating axes.
+// Returns false if the cores are apart, but closer than the radii. Vertexes may be the closest features then so GJK is needed.
+static cpBool
+ShapeToShapeSAT(const struct SATShape* shape1, const struct SATShape* shape2, struct cpCollisionInfo* info)
+{
+	struct SATAxis axis;
+	int owner = SAT(shape1->count, shape1->planes, shape2->count, shape2->planes, shape1->r + shape2->r, &info->id, &axis);
+	if (owner < 0) return cpTrue;
+
+	// Clear the cached face so GJK doesn't mistake it for vertex indexes.
+	if (axis.d > 0.0f)
+	{
+		info->id = 0;
+		return cpFalse;
+	}
+
+	SATContacts(shape1, shape2, owner, axis, info);
+	return cpTrue;
+}
+
+// Same as above, with the segment treated as a polygon with two opposite faces.
+static cpBool
+SegmentToShapeSAT(const cpSegmentShape* seg, const struct SATShape* shape, struct cpCollisionInfo* info)
+{
+	struct cpSplittingPlane planes[2] = { {seg->ta, seg->tn}, {seg->tb, cpvneg(seg->tn)} };
+
+	struct SATAxis axis;
+	int owner = SAT(2, planes, shape->count, shape->planes, seg->r + shape->r, &info->id, &axis);
+	if (owner < 0) return cpTrue;
+
+	if (axis.d > 0.0f)
+	{
+		info->id = 0;
+		return cpFalse;
+	}
+
+	struct ClosestPoints points = { cpvzero, cpvzero, (owner == 0 ? planes[axis.face].n : cpvneg(shape->planes[axis.face].n)), axis.d, 0 };
+	cpVect n = cpvneg(points.n);
+	int support = (owner == 0 ? axis.support : axis.face);
+	ContactPoints(SupportEdgeForSegment(seg, n), SupportEdgeForSATShape(shape, support, n), points, info);
+
+	return cpTrue;
+}
+
+// Separation of 'box2' from the face of 'box1' on its x (k = 0) or y (k = 1) axis facing it.
+// Face and corner indexes match cpBoxShapePlanes().
+static inline struct SATAxis
+BoxFaceAxis(const cpBoxShape* box1, const cpBoxShape* box2, const int k)
+{
+	cpVect n = (k ? cpvperp(box1->tx) : box1->tx);
+	cpFloat s = cpvdot(cpvsub(box2->tc, box1->tc), n);
+	int face = (k ? (s < 0.0f ? 0 : 2) : (s < 0.0f ? 3 : 1));
+	if (s < 0.0f) n = cpvneg(n);
+
+	cpFloat x = cpvdot(n, box2->tx), y = cpvcross(box2->tx, n);
+	cpFloat d = cpfabs(s) - (k ? box1->th.y : box1->th.x) - box2->th.x * cpfabs(x) - box2->th.y * cpfabs(y);
+
+	struct SATAxis axis = { d, face, BoxCornerIndex(-x, -y) };
+	return axis;
+}
+
+// SAT() specialized for boxes, each only has two axes to test.
+static int
+BoxSAT(const cpBoxShape* box1, const cpBoxShape* box2, cpCollisionID* id, struct SATAxis* out)
+{
+	if (*id & SAT_ID_FLAG)
+	{
+		int owner = (*id >> 8) & 1, k = (~*id & 1);
+		if ((owner ? BoxFaceAxis(box2, box1, k) : BoxFaceAxis(box1, box2, k)).d > 0.0f) return -1;
+	}
+
+	struct SATAxis axis1 = BoxFaceAxis(box1, box2, 0), axis1y = BoxFaceAxis(box1, box2, 1);
+	if (axis1y.d > axis1.d) axis1 = axis1y;
+	if (axis1.d > 0.0f)
+	{
+		*id = SAT_ID_FLAG | axis1.face;
+		return -1;
+	}
+
+	struct SATAxis axis2 = BoxFaceAxis(box2, box1, 0), axis2y = BoxFaceAxis(box2, box1, 1);
+	if (axis2y.d > axis2.d) axis2 = axis2y;
+	if (axis2.d > 0.0f)
+	{
+		*id = SAT_ID_FLAG | (1 << 8) | axis2.face;
+		return -1;
+	}
+
+	return SATReferenceFace(axis1, axis2, id, out);
+}
+
 //MARK: Collision Functions
 
 typedef void (*CollisionFunc)(const cpShape* a, const cpShape* b, struct cpCollisionInfo* info);
@@ -667,6 +1023,12 @@ SegmentToSegment(const cpSegmentShape* seg1, const cpSegmentShape* seg2, struct
 static void
 PolyToPoly(const cpPolyShape* poly1, const cpPolyShape* poly2, struct cpCollisionInfo* info)
 {
+	if (poly1->count <= SAT_MAX_VERTS && poly2->count <= SAT_MAX_VERTS)
+	{
+		struct SATShape shape1 = SATShapeForPoly(poly1), shape2 = SATShapeForPoly(poly2);
+		if (ShapeToShapeSAT(&shape1, &shape2, info)) return;
+	}
+
 	struct SupportContext context = { (cpShape*)poly1, (cpShape*)poly2, (SupportPointFunc)PolySupportPoint, (SupportPointFunc)PolySupportPoint };
 	struct ClosestPoints points = GJK(&context, &info->id);
 
@@ -691,6 +1053,12 @@ PolyToPoly(const cpPolyShape* poly1, const cpPolyShape* poly2, struct cpCollisio
 static void
 SegmentToPoly(const cpSegmentShape* seg, const cpPolyShape* poly, struct cpCollisionInfo* info)
 {
+	if (poly->count <= SAT_MAX_VERTS)
+	{
+		struct SATShape shape = SATShapeForPoly(poly);
+		if (SegmentToShapeSAT(seg, &shape, info)) return;
+	}
+
 	struct SupportContext context = { (cpShape*)seg, (cpShape*)poly, (SupportPointFunc)SegmentSupportPoint, (SupportPointFunc)PolySupportPoint };
 	struct ClosestPoints points = GJK(&context, &info->id);
 
@@ -742,6 +1110,161 @@ CircleToPoly(const cpCircleShape* circle, const cpPolyShape* poly, struct cpColl
 	}
 }
 
+// Boxes are collided in their own frame instead of with GJK.
+static void
+CircleToBox(const cpCircleShape* circle, const cpBoxShape* box, struct cpCollisionInfo* info)
+{
+	cpVect center = circle->tc, tx = box->tx, ty = cpvperp(tx);
+	cpVect delta = cpvsub(center, box->tc);
+	cpFloat x = cpvdot(delta, tx), y = cpvdot(delta, ty);
+	cpFloat dx = box->th.x - cpfabs(x), dy = box->th.y - cpfabs(y);
+
+	if (dx >= 0.0f && dy >= 0.0f)
+	{
+		// The center is inside, push it out through the nearest face.
+		cpFloat depth = cpfmin(dx, dy);
+		cpVect n = info->n = (dx < dy ? cpvmult(tx, x < 0.0f ? 1.0f : -1.0f) : cpvmult(ty, y < 0.0f ? 1.0f : -1.0f));
+		cpCollisionInfoPushContact(info, cpvadd(center, cpvmult(n, circle->r)), cpvsub(center, cpvmult(n, depth)), 0);
+	}
+	else
+	{
+		cpVect closest = cpvadd(box->tc, cpvadd(cpvmult(tx, cpfclamp(x, -box->th.x, box->th.x)), cpvmult(ty, cpfclamp(y, -box->th.y, box->th.y))));
+		cpVect d = cpvsub(closest, center);
+		cpFloat distsq = cpvlengthsq(d);
+		if (distsq <= circle->r * circle->r)
+		{
+			cpVect n = info->n = cpvmult(d, 1.0f / cpfsqrt(distsq));
+			cpCollisionInfoPushContact(info, cpvadd(center, cpvmult(n, circle->r)), closest, 0);
+		}
+	}
+}
+
+static struct Edge
+SupportEdgeForBox(const cpBoxShape* box, const struct SATShape* shape, const cpVect n)
+{
+	return SupportEdgeForSATShape(shape, BoxSupportPoint(box, n, -1).index, n);
+}
+
+static void
+SegmentToBox(const cpSegmentShape* seg, const cpBoxShape* box, struct cpCollisionInfo* info)
+{
+	struct cpSplittingPlane planes[4];
+	struct SATShape shape = SATShapeForBox(box, planes);
+	if (SegmentToShapeSAT(seg, &shape, info)) return;
+
+	struct SupportContext context = { (cpShape*)seg, (cpShape*)box, (SupportPointFunc)SegmentSupportPoint, (SupportPointFunc)BoxSupportPoint };
+	struct ClosestPoints points = GJK(&context, &info->id);
+
+	cpVect n = cpvneg(points.n);
+	if (points.d - seg->r <= 0.0)
+	{
+		ContactPoints(SupportEdgeForSegment(seg, n), SupportEdgeForBox(box, &shape, n), points, info);
+	}
+}
+
+static void
+PolyToBox(const cpPolyShape* poly, const cpBoxShape* box, struct cpCollisionInfo* info)
+{
+	struct cpSplittingPlane planes[4];
+	struct SATShape shape2 = SATShapeForBox(box, planes);
+	if (poly->count <= SAT_MAX_VERTS)
+	{
+		struct SATShape shape1 = SATShapeForPoly(poly);
+		if (ShapeToShapeSAT(&shape1, &shape2, info)) return;
+	}
+
+	struct SupportContext context = { (cpShape*)poly, (cpShape*)box, (SupportPointFunc)PolySupportPoint, (SupportPointFunc)BoxSupportPoint };
+	struct ClosestPoints points = GJK(&context, &info->id);
+
+	if (points.d - poly->r <= 0.0)
+	{
+		ContactPoints(SupportEdgeForPoly(poly, points.n), SupportEdgeForBox(box, &shape2, cpvneg(points.n)), points, info);
+	}
+}
+
+static void
+BoxToBox(const cpBoxShape* box1, const cpBoxShape* box2, struct cpCollisionInfo* info)
+{
+	struct SATAxis axis;
+	int owner = BoxSAT(box1, box2, &info->id, &axis);
+	if (owner < 0) return;
+
+	struct cpSplittingPlane planes1[4], planes2[4];
+	struct SATShape shape1 = SATShapeForBox(box1, planes1), shape2 = SATShapeForBox(box2, planes2);
+	SATContacts(&shape1, &shape2, owner, axis, info);
+}
+
+struct cpCollisionInfo
+cpCollideTilemapFace(const cpShape* tilemap, const cpShape* face, const cpShape* shape, struct cpContact* contacts)
+{
+	struct cpCollisionInfo info = cpCollide(face, shape, 0, contacts);
+
+	// Only circles sort before the face, flip the rest so the collision goes from the shape to the tilemap.
+	if (info.a == face)
+	{
+		info.n = cpvneg(info.n);
+		for (int i = 0; i < info.count; i++)
+		{
+			cpVect r1 = contacts[i].r1;
+			contacts[i].r1 = contacts[i].r2;
+			contacts[i].r2 = r1;
+		}
+	}
+
+	info.a = shape;
+	info.b = tilemap;
+
+	// Faces are one sided, don't push shapes into the solid cells.
+	if (cpvdot(info.n, ((cpSegmentShape*)face)->tn) > 0.0f) info.count = 0;
+	return info;
+}
+
+struct TilemapCollisionContext
+{
+	const cpShape* shape;
+	const cpShape* tilemap;
+	struct cpCollisionInfo* info;
+	cpFloat depth;
+};
+
+static void
+TilemapDeepestFace(cpShape* face, struct TilemapCollisionContext* context)
+{
+	struct cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
+	struct cpCollisionInfo faceInfo = cpCollideTilemapFace(context->tilemap, face, context->shape, contacts);
+
+	for (int i = 0; i < faceInfo.count; i++)
+	{
+		cpFloat depth = cpvdot(cpvsub(contacts[i].r1, contacts[i].r2), faceInfo.n);
+		if (depth > context->depth)
+		{
+			struct cpCollisionInfo* info = context->info;
+			context->depth = depth;
+
+			info->n = faceInfo.n;
+			info->count = faceInfo.count;
+			for (int j = 0; j < faceInfo.count; j++) info->arr[j] = contacts[j];
+		}
+	}
+}
+
+// A collision only has one normal, so keep the deepest face. cpSpace gives each face its own arbiter instead.
+static void
+ShapeToTilemap(const cpShape* shape, const cpTilemapShape* tilemap, struct cpCollisionInfo* info)
+{
+	struct TilemapCollisionContext context = { shape, (cpShape*)tilemap, info, -INFINITY };
+	cpTilemapShapeEachFace(tilemap, shape->bb, cpTrue, (cpTilemapFaceFunc)TilemapDeepestFace, &context);
+}
+
+// Tilemaps are scenery and don't collide with each other.
+static void
+TilemapToTilemap(const cpTilemapShape* tilemap1, const cpTilemapShape* tilemap2, struct cpCollisionInfo* info)
+{
+	(void)tilemap1;
+	(void)tilemap2;
+	(void)info;
+}
+
 static void
 CollisionError(const cpShape* circle, const cpShape* poly, struct cpCollisionInfo* info)
 {
@@ -749,16 +1272,32 @@ CollisionError(const cpShape* circle, const cpShape* poly, struct cpCollisionInf
 }
 
 
-static const CollisionFunc BuiltinCollisionFuncs[9] = {
+static const CollisionFunc BuiltinCollisionFuncs[25] = {
 	(CollisionFunc)CircleToCircle,
 	CollisionError,
 	CollisionError,
+	CollisionError,
+	CollisionError,
 	(CollisionFunc)CircleToSegment,
 	(CollisionFunc)SegmentToSegment,
 	CollisionError,
+	CollisionError,
+	CollisionError,
 	(CollisionFunc)CircleToPoly,
 	(CollisionFunc)SegmentToPoly,
 	(CollisionFunc)PolyToPoly,
+	CollisionError,
+	CollisionError,
+	(CollisionFunc)CircleToBox,
+	(CollisionFunc)SegmentToBox,
+	(CollisionFunc)PolyToBox,
+	(CollisionFunc)BoxToBox,
+	CollisionError,
+	(CollisionFunc)ShapeToTilemap,
+	(CollisionFunc)ShapeToTilemap,
+	(CollisionFunc)ShapeToTilemap,
+	(CollisionFunc)ShapeToTilemap,
+	(CollisionFunc)TilemapToTilemap,
 };
 static const CollisionFunc* CollisionFuncs = BuiltinCollisionFuncs;
 
@@ -789,3 +1328,749 @@ struct cpCollisionInfo
 
 	return info;
 }
+
+//MARK: Batched Circle Collisions
+
+#if CP_USE_SSE2
+// Splat the circle/segment contacts from four lanes into their collision infos.
+static inline void
+PushContacts4(struct cpCollisionInfo* infos, int hits, __m128 nx, __m128 ny, __m128 p1x, __m128 p1y, __m128 p2x, __m128 p2y)
+{
+	float n_x[4], n_y[4], p1_x[4], p1_y[4], p2_x[4], p2_y[4];
+	_mm_storeu_ps(n_x, nx);
+	_mm_storeu_ps(n_y, ny);
+	_mm_storeu_ps(p1_x, p1x);
+	_mm_storeu_ps(p1_y, p1y);
+	_mm_storeu_ps(p2_x, p2x);
+	_mm_storeu_ps(p2_y, p2y);
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (!(hits & (1 << i))) continue;
+		infos[i].n = cpv(n_x[i], n_y[i]);
+		cpCollisionInfoPushContact(infos + i, cpv(p1_x[i], p1_y[i]), cpv(p2_x[i], p2_y[i]), 0);
+	}
+}
+
+// CircleToCircle() for four pairs at once.
+static void
+CircleToCircle4(const cpShape** pairs, struct cpCollisionInfo* infos)
+{
+	float x1[4], y1[4], r1[4], x2[4], y2[4], r2[4];
+	for (int i = 0; i < 4; i++)
+	{
+		const cpCircleShape* c1 = (cpCircleShape*)pairs[2 * i];
+		const cpCircleShape* c2 = (cpCircleShape*)pairs[2 * i + 1];
+		x1[i] = c1->tc.x; y1[i] = c1->tc.y; r1[i] = c1->r;
+		x2[i] = c2->tc.x; y2[i] = c2->tc.y; r2[i] = c2->r;
+	}
+
+	__m128 c1x = _mm_loadu_ps(x1), c1y = _mm_loadu_ps(y1), c1r = _mm_loadu_ps(r1);
+	__m128 c2x = _mm_loadu_ps(x2), c2y = _mm_loadu_ps(y2), c2r = _mm_loadu_ps(r2);
+
+	__m128 mindist = _mm_add_ps(c1r, c2r);
+	__m128 dx = _mm_sub_ps(c2x, c1x), dy = _mm_sub_ps(c2y, c1y);
+	__m128 distsq = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+	int hits = _mm_movemask_ps(_mm_cmplt_ps(distsq, _mm_mul_ps(mindist, mindist)));
+	if (!hits) return;
+
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	__m128 dist = _mm_sqrt_ps(distsq);
+	__m128 inv = _mm_div_ps(one, dist);
+
+	// Coincident circles use (1, 0) for the normal.
+	__m128 coincident = _mm_cmpeq_ps(dist, zero);
+	__m128 nx = _mm_or_ps(_mm_and_ps(coincident, one), _mm_andnot_ps(coincident, _mm_mul_ps(dx, inv)));
+	__m128 ny = _mm_andnot_ps(coincident, _mm_mul_ps(dy, inv));
+
+	PushContacts4(infos, hits, nx, ny,
+		_mm_add_ps(c1x, _mm_mul_ps(nx, c1r)), _mm_add_ps(c1y, _mm_mul_ps(ny, c1r)),
+		_mm_sub_ps(c2x, _mm_mul_ps(nx, c2r)), _mm_sub_ps(c2y, _mm_mul_ps(ny, c2r))
+	);
+}
+
+// CircleToSegment() for four pairs at once.
+static void
+CircleToSegment4(const cpShape** pairs, struct cpCollisionInfo* infos)
+{
+	float cx[4], cy[4], cr[4], ax[4], ay[4], bx[4], by[4], tnx[4], tny[4], sr[4];
+	for (int i = 0; i < 4; i++)
+	{
+		const cpCircleShape* circle = (cpCircleShape*)pairs[2 * i];
+		const cpSegmentShape* seg = (cpSegmentShape*)pairs[2 * i + 1];
+		cx[i] = circle->tc.x; cy[i] = circle->tc.y; cr[i] = circle->r;
+		ax[i] = seg->ta.x; ay[i] = seg->ta.y; bx[i] = seg->tb.x; by[i] = seg->tb.y;
+		tnx[i] = seg->tn.x; tny[i] = seg->tn.y; sr[i] = seg->r;
+	}
+
+	__m128 centerx = _mm_loadu_ps(cx), centery = _mm_loadu_ps(cy), circler = _mm_loadu_ps(cr);
+	__m128 seg_ax = _mm_loadu_ps(ax), seg_ay = _mm_loadu_ps(ay), segr = _mm_loadu_ps(sr);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+	// Find the closest point on the segment to the circle.
+	__m128 sdx = _mm_sub_ps(_mm_loadu_ps(bx), seg_ax), sdy = _mm_sub_ps(_mm_loadu_ps(by), seg_ay);
+	__m128 dot = _mm_add_ps(_mm_mul_ps(sdx, _mm_sub_ps(centerx, seg_ax)), _mm_mul_ps(sdy, _mm_sub_ps(centery, seg_ay)));
+	__m128 t = _mm_div_ps(dot, _mm_add_ps(_mm_mul_ps(sdx, sdx), _mm_mul_ps(sdy, sdy)));
+	t = _mm_max_ps(zero, _mm_min_ps(t, one));
+	__m128 closestx = _mm_add_ps(seg_ax, _mm_mul_ps(sdx, t)), closesty = _mm_add_ps(seg_ay, _mm_mul_ps(sdy, t));
+
+	__m128 mindist = _mm_add_ps(circler, segr);
+	__m128 dx = _mm_sub_ps(closestx, centerx), dy = _mm_sub_ps(closesty, centery);
+	__m128 distsq = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+	int hits = _mm_movemask_ps(_mm_cmplt_ps(distsq, _mm_mul_ps(mindist, mindist)));
+	if (!hits) return;
+
+	__m128 dist = _mm_sqrt_ps(distsq);
+	__m128 inv = _mm_div_ps(one, dist);
+
+	// Centers on the segment use the segment's normal.
+	__m128 coincident = _mm_cmpeq_ps(dist, zero);
+	__m128 nx = _mm_or_ps(_mm_and_ps(coincident, _mm_loadu_ps(tnx)), _mm_andnot_ps(coincident, _mm_mul_ps(dx, inv)));
+	__m128 ny = _mm_or_ps(_mm_and_ps(coincident, _mm_loadu_ps(tny)), _mm_andnot_ps(coincident, _mm_mul_ps(dy, inv)));
+
+	PushContacts4(infos, hits, nx, ny,
+		_mm_add_ps(centerx, _mm_mul_ps(nx, circler)), _mm_add_ps(centery, _mm_mul_ps(ny, circler)),
+		_mm_sub_ps(closestx, _mm_mul_ps(nx, segr)), _mm_sub_ps(closesty, _mm_mul_ps(ny, segr))
+	);
+}
+#endif
+
+void
+cpCollideCircles(cpShapeType type, int count, const cpShape** pairs, struct cpCollisionInfo* infos, struct cpContact* contacts)
+{
+	cpAssertSoft(type == CP_CIRCLE_SHAPE || type == CP_SEGMENT_SHAPE, "Internal Error: Only circles and segments can be batched with circles.");
+
+	for (int i = 0; i < count; i++)
+	{
+		struct cpCollisionInfo info = { pairs[2 * i], pairs[2 * i + 1], 0, cpvzero, 0, contacts + i };
+		infos[i] = info;
+	}
+
+	int i = 0;
+#if CP_USE_SSE2
+	for (; i + 4 <= count; i += 4)
+	{
+		if (type == CP_CIRCLE_SHAPE)
+		{
+			CircleToCircle4(pairs + 2 * i, infos + i);
+		}
+		else
+		{
+			CircleToSegment4(pairs + 2 * i, infos + i);
+		}
+	}
+#endif
+
+	CollisionFunc func = CollisionFuncs[CP_CIRCLE_SHAPE + type * CP_NUM_SHAPES];
+	for (; i < count; i++) func(infos[i].a, infos[i].b, infos + i);
+}
+
+//MARK: Overlap Functions
+
+// Boolean versions of the collision functions above for when only a hit/no-hit answer is needed.
+// They skip EPA and contact generation entirely.
+
+typedef cpBool (*OverlapFunc)(const cpShape* a, const cpShape* b);
+
+// GJK distance test against the sum of the shapes' radii 'r'.
+// Exits as soon as the current simplex is within 'r' of the origin or a separating axis is found.
+static cpBool
+GJKOverlap(const struct SupportContext* ctx, const cpFloat r)
+{
+	cpVect axis = cpvperp(cpvsub(cpBBCenter(ctx->shape1->bb), cpBBCenter(ctx->shape2->bb)));
+	struct MinkowskiPoint v0 = Support(ctx, axis);
+	struct MinkowskiPoint v1 = Support(ctx, cpvneg(axis));
+	cpFloat rsq = r * r;
+
+	for (int iteration = 1; iteration <= MAX_GJK_ITERATIONS; iteration++)
+	{
+		if (cpCheckPointGreater(v1.ab, v0.ab, cpvzero))
+		{
+			// Origin is behind axis. Flip and try again.
+			struct MinkowskiPoint temp = v0;
+			v0 = v1;
+			v1 = temp;
+		}
+
+		// The edge lies inside the minkowski difference, so the shapes are at least this close.
+		cpFloat t = ClosestT(v0.ab, v1.ab);
+		cpVect closest = LerpT(v0.ab, v1.ab, t);
+		if (cpvlengthsq(closest) <= rsq) return cpTrue;
+
+		cpVect delta = cpvsub(v1.ab, v0.ab);
+		cpVect n = (-1.0f < t && t < 1.0f && !cpveql(delta, cpvzero) ? cpvperp(delta) : cpvneg(closest));
+		struct MinkowskiPoint p = SupportNear(ctx, n, v0);
+
+		// Nothing on the minkowski difference reaches past the origin along n by more than 'r'.
+		cpFloat pn = cpvdot(p.ab, n);
+		if (pn < 0.0f && pn * pn > rsq * cpvlengthsq(n)) return cpFalse;
+
+		if (cpCheckPointGreater(p.ab, v0.ab, cpvzero) && cpCheckPointGreater(v1.ab, p.ab, cpvzero))
+		{
+			// The triangle v0, p, v1 contains the origin.
+			return cpTrue;
+		}
+		else if (cpCheckAxis(v0.ab, v1.ab, p.ab, n))
+		{
+			// The edge v0, v1 is the closest to (0, 0) and it was already rejected above.
+			return cpFalse;
+		}
+		else if (ClosestDist(v0.ab, p.ab) < ClosestDist(p.ab, v1.ab))
+		{
+			v1 = p;
+		}
+		else
+		{
+			v0 = p;
+		}
+	}
+
+	cpAssertWarn(cpFalse, "High GJK overlap iterations: %d", MAX_GJK_ITERATIONS);
+	return cpFalse;
+}
+
+static cpBool
+CircleOverlapCircle(const cpCircleShape* c1, const cpCircleShape* c2)
+{
+	cpFloat mindist = c1->r + c2->r;
+	return (cpvdistsq(c1->tc, c2->tc) < mindist * mindist);
+}
+
+static cpBool
+CircleOverlapSegment(const cpCircleShape* circle, const cpSegmentShape* segment)
+{
+	cpVect seg_a = segment->ta;
+	cpVect seg_delta = cpvsub(segment->tb, seg_a);
+	cpVect center = circle->tc;
+
+	cpFloat closest_t = cpfclamp01(cpvdot(seg_delta, cpvsub(center, seg_a)) / cpvlengthsq(seg_delta));
+	cpVect closest = cpvadd(seg_a, cpvmult(seg_delta, closest_t));
+
+	cpFloat mindist = circle->r + segment->r;
+	return (cpvdistsq(closest, center) < mindist * mindist);
+}
+
+static cpBool
+SegmentOverlapSegment(const cpSegmentShape* seg1, const cpSegmentShape* seg2)
+{
+	struct SupportContext context = { (cpShape*)seg1, (cpShape*)seg2, (SupportPointFunc)SegmentSupportPoint, (SupportPointFunc)SegmentSupportPoint };
+	return GJKOverlap(&context, seg1->r + seg2->r);
+}
+
+static cpBool
+CircleOverlapPoly(const cpCircleShape* circle, const cpPolyShape* poly)
+{
+	struct SupportContext context = { (cpShape*)circle, (cpShape*)poly, (SupportPointFunc)CircleSupportPoint, (SupportPointFunc)PolySupportPoint };
+	return GJKOverlap(&context, circle->r + poly->r);
+}
+
+static cpBool
+SegmentOverlapPoly(const cpSegmentShape* seg, const cpPolyShape* poly)
+{
+	struct SupportContext context = { (cpShape*)seg, (cpShape*)poly, (SupportPointFunc)SegmentSupportPoint, (SupportPointFunc)PolySupportPoint };
+	return GJKOverlap(&context, seg->r + poly->r);
+}
+
+static cpBool
+PolyOverlapPoly(const cpPolyShape* poly1, const cpPolyShape* poly2)
+{
+	struct SupportContext context = { (cpShape*)poly1, (cpShape*)poly2, (SupportPointFunc)PolySupportPoint, (SupportPointFunc)PolySupportPoint };
+	return GJKOverlap(&context, poly1->r + poly2->r);
+}
+
+static cpBool
+CircleOverlapBox(const cpCircleShape* circle, const cpBoxShape* box)
+{
+	cpVect delta = cpvsub(circle->tc, box->tc);
+	cpFloat x = cpfmax(cpfabs(cpvdot(delta, box->tx)) - box->th.x, 0.0f);
+	cpFloat y = cpfmax(cpfabs(cpvcross(box->tx, delta)) - box->th.y, 0.0f);
+	return (x * x + y * y <= circle->r * circle->r);
+}
+
+static cpBool
+SegmentOverlapBox(const cpSegmentShape* seg, const cpBoxShape* box)
+{
+	struct SupportContext context = { (cpShape*)seg, (cpShape*)box, (SupportPointFunc)SegmentSupportPoint, (SupportPointFunc)BoxSupportPoint };
+	return GJKOverlap(&context, seg->r);
+}
+
+static cpBool
+PolyOverlapBox(const cpPolyShape* poly, const cpBoxShape* box)
+{
+	struct SupportContext context = { (cpShape*)poly, (cpShape*)box, (SupportPointFunc)PolySupportPoint, (SupportPointFunc)BoxSupportPoint };
+	return GJKOverlap(&context, poly->r);
+}
+
+static cpBool
+BoxOverlapBox(const cpBoxShape* box1, const cpBoxShape* box2)
+{
+	return (
+		BoxFaceAxis(box1, box2, 0).d <= 0.0f && BoxFaceAxis(box1, box2, 1).d <= 0.0f &&
+		BoxFaceAxis(box2, box1, 0).d <= 0.0f && BoxFaceAxis(box2, box1, 1).d <= 0.0f
+	);
+}
+
+struct TilemapOverlapContext
+{
+	const cpShape* shape;
+	cpBool overlap;
+};
+
+static void
+TilemapFaceOverlap(cpShape* face, struct TilemapOverlapContext* context)
+{
+	if (!context->overlap) context->overlap = cpOverlap(face, context->shape);
+}
+
+static cpBool
+ShapeOverlapTilemap(const cpShape* shape, const cpTilemapShape* tilemap)
+{
+	// Shapes completely inside of the solid cells don't touch any faces.
+	int x, y;
+	if (cpTilemapShapeGetCellAtPoint((cpShape*)tilemap, ShapePoint(shape, 0).p, &x, &y) && cpTilemapShapeGetCellBlock((cpShape*)tilemap, x, y)) return cpTrue;
+
+	struct TilemapOverlapContext context = { shape, cpFalse };
+	cpTilemapShapeEachFace(tilemap, shape->bb, cpFalse, (cpTilemapFaceFunc)TilemapFaceOverlap, &context);
+	return context.overlap;
+}
+
+static cpBool
+TilemapOverlapTilemap(const cpTilemapShape* tilemap1, const cpTilemapShape* tilemap2)
+{
+	(void)tilemap1;
+	(void)tilemap2;
+	return cpFalse;
+}
+
+static cpBool
+OverlapError(const cpShape* a, const cpShape* b)
+{
+	(void)a;
+	(void)b;
+	cpAssertHard(cpFalse, "Internal Error: Shape types are not sorted.");
+	return cpFalse;
+}
+
+static const OverlapFunc BuiltinOverlapFuncs[25] = {
+	(OverlapFunc)CircleOverlapCircle,
+	OverlapError,
+	OverlapError,
+	OverlapError,
+	OverlapError,
+	(OverlapFunc)CircleOverlapSegment,
+	(OverlapFunc)SegmentOverlapSegment,
+	OverlapError,
+	OverlapError,
+	OverlapError,
+	(OverlapFunc)CircleOverlapPoly,
+	(OverlapFunc)SegmentOverlapPoly,
+	(OverlapFunc)PolyOverlapPoly,
+	OverlapError,
+	OverlapError,
+	(OverlapFunc)CircleOverlapBox,
+	(OverlapFunc)SegmentOverlapBox,
+	(OverlapFunc)PolyOverlapBox,
+	(OverlapFunc)BoxOverlapBox,
+	OverlapError,
+	(OverlapFunc)ShapeOverlapTilemap,
+	(OverlapFunc)ShapeOverlapTilemap,
+	(OverlapFunc)ShapeOverlapTilemap,
+	(OverlapFunc)ShapeOverlapTilemap,
+	(OverlapFunc)TilemapOverlapTilemap,
+};
+static const OverlapFunc* OverlapFuncs = BuiltinOverlapFuncs;
+
+cpBool
+cpOverlap(const cpShape* a, const cpShape* b)
+{
+	// Make sure the shape types are in order.
+	if (a->klass->type > b->klass->type)
+	{
+		const cpShape* temp = a;
+		a = b;
+		b = temp;
+	}
+
+	return OverlapFuncs[a->klass->type + b->klass->type * CP_NUM_SHAPES](a, b);
+}
+
+//MARK: Shape Casting
+
+#define MAX_CAST_ITERATIONS 32
+#define MAX_CAST_ROOT_ITERATIONS 50
+// Casts stop within this fraction of the sweep of the first contact.
+#define CAST_TOLERANCE 1e-5f
+
+// The swept shape's core geometry (circle center, segment ends or poly vertexes) at some point along the sweep.
+struct CastProxy
+{
+	int count;
+	cpVect* verts;
+};
+
+static inline struct SupportPoint
+CastProxySupportPoint(const struct CastProxy* proxy, const cpVect n, const int hint)
+{
+	(void)hint;
+	const cpVect* verts = proxy->verts;
+	cpFloat max = -INFINITY;
+	int index = 0;
+
+	for (int i = 0; i < proxy->count; i++)
+	{
+		cpFloat d = cpvdot(verts[i], n);
+		if (d > max)
+		{
+			max = d;
+			index = i;
+		}
+	}
+
+	return SupportPointNew(verts[index], index);
+}
+
+static SupportPointFunc
+ShapeSupportPointFunc(const cpShape* shape)
+{
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE: return (SupportPointFunc)CircleSupportPoint;
+	case CP_SEGMENT_SHAPE: return (SupportPointFunc)SegmentSupportPoint;
+	case CP_BOX_SHAPE: return (SupportPointFunc)BoxSupportPoint;
+	default: return (SupportPointFunc)PolySupportPoint;
+	}
+}
+
+static cpFloat
+ShapeCoreRadius(const cpShape* shape)
+{
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE: return ((cpCircleShape*)shape)->r;
+	case CP_SEGMENT_SHAPE: return ((cpSegmentShape*)shape)->r;
+	case CP_BOX_SHAPE: return 0.0f;
+	default: return ((cpPolyShape*)shape)->r;
+	}
+}
+
+// Copy the body relative core geometry of a shape.
+static int
+ShapeLocalVerts(const cpShape* shape, cpVect* verts)
+{
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE:
+	{
+		verts[0] = ((cpCircleShape*)shape)->c;
+		return 1;
+	} case CP_SEGMENT_SHAPE:
+	{
+		verts[0] = ((cpSegmentShape*)shape)->a;
+		verts[1] = ((cpSegmentShape*)shape)->b;
+		return 2;
+	} case CP_BOX_SHAPE:
+	{
+		cpBoxShape* box = (cpBoxShape*)shape;
+		for (int i = 0; i < 4; i++) verts[i] = cpBoxCorner(box->c, cpv(box->h.x, 0.0f), cpv(0.0f, box->h.y), i);
+		return 4;
+	} default:
+	{
+		cpPolyShape* poly = (cpPolyShape*)shape;
+		for (int i = 0; i < poly->count; i++) verts[i] = poly->planes[i + poly->count].v0;
+		return poly->count;
+	}
+	}
+}
+
+int
+cpShapeCastVertexCount(const cpShape* shape)
+{
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE: return 1;
+	case CP_SEGMENT_SHAPE: return 2;
+	case CP_BOX_SHAPE: return 4;
+	case CP_TILEMAP_SHAPE: cpAssertHard(cpFalse, "Tilemap shapes can't be cast."); return 0;
+	default: return ((cpPolyShape*)shape)->count;
+	}
+}
+
+void
+cpShapeCastInit(struct cpShapeCast* cast, const cpShape* shape, cpTransform start, cpTransform end, cpVect* verts)
+{
+	cast->shape = shape;
+	cast->r = ShapeCoreRadius(shape);
+	cast->count = ShapeLocalVerts(shape, verts);
+	cast->verts = verts;
+
+	cast->p0 = cpv(start.tx, start.ty);
+	cast->delta = cpvsub(cpv(end.tx, end.ty), cast->p0);
+	cast->a0 = cpfatan2(start.b, start.a);
+
+	// Rotate the short way around.
+	cpFloat da = cpfatan2(end.b, end.a) - cast->a0;
+	if (da > CP_PI) da -= 2.0f * CP_PI;
+	if (da < -CP_PI) da += 2.0f * CP_PI;
+	cast->da = da;
+
+	cpFloat rmax = 0.0f;
+	for (int i = 0; i < cast->count; i++) rmax = cpfmax(rmax, cpvlength(verts[i]));
+	cast->rmax = rmax;
+
+	// Bound the swept area with circles around both ends if it rotates.
+	cpBB bb0, bb1;
+	if (da != 0.0f)
+	{
+		bb0 = cpBBNewForCircle(cast->p0, rmax + cast->r);
+		bb1 = cpBBNewForCircle(cpvadd(cast->p0, cast->delta), rmax + cast->r);
+	}
+	else
+	{
+		bb0 = bb1 = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+		for (int i = 0; i < cast->count; i++)
+		{
+			bb0 = cpBBExpand(bb0, cpTransformPoint(start, verts[i]));
+			bb1 = cpBBExpand(bb1, cpTransformPoint(end, verts[i]));
+		}
+
+		bb0 = cpBBNew(bb0.l - cast->r, bb0.b - cast->r, bb0.r + cast->r, bb0.t + cast->r);
+		bb1 = cpBBNew(bb1.l - cast->r, bb1.b - cast->r, bb1.r + cast->r, bb1.t + cast->r);
+	}
+
+	cast->bb = cpBBMerge(bb0, bb1);
+}
+
+static inline cpTransform
+CastTransform(const struct cpShapeCast* cast, cpFloat t)
+{
+	return cpTransformRigid(cpvadd(cast->p0, cpvmult(cast->delta, t)), cast->a0 + cast->da * t);
+}
+
+static void
+CastProxyUpdate(const struct cpShapeCast* cast, cpFloat t, struct CastProxy* proxy)
+{
+	cpTransform transform = CastTransform(cast, t);
+	for (int i = 0; i < cast->count; i++) proxy->verts[i] = cpTransformPoint(transform, cast->verts[i]);
+}
+
+// Separation of the shapes along the closest points' axis, used to root find once conservative advancement slows down.
+// If the closest feature is a face of the cast shape, the axis turns with it. Otherwise it's fixed in world space.
+struct CastSeparation
+{
+	const struct cpShapeCast* cast;
+	struct CastProxy* proxy;
+	const cpShape* target;
+	SupportPointFunc targetSupport;
+	cpFloat rsum;
+
+	cpBool face;
+	// The axis, and a point on the face if it's relative to the cast shape's body.
+	cpVect n, p;
+};
+
+static struct CastSeparation
+CastSeparationNew(const struct cpShapeCast* cast, struct CastProxy* proxy, const struct SupportContext* context, cpFloat rsum, cpFloat t, const struct ClosestPoints points)
+{
+	struct CastSeparation sep = { cast, proxy, context->shape2, context->func2, rsum, cpFalse, points.n, cpvzero };
+
+	// Cast shape indexes of the GJK edge's minkowski points.
+	int i0 = (points.id >> 24) & 0xFF, i1 = (points.id >> 8) & 0xFF;
+	if (i0 != i1 && i0 < cast->count && i1 < cast->count)
+	{
+		cpVect n = cpvnormalize(cpvperp(cpvsub(cast->verts[i1], cast->verts[i0])));
+		cpFloat dot = cpvdot(cpTransformVect(CastTransform(cast, t), n), points.n);
+
+		// The axis is only the face's normal if it isn't from a vertex/vertex pair.
+		if (cpfabs(dot) > 0.999f)
+		{
+			sep.face = cpTrue;
+			sep.n = (dot > 0.0f ? n : cpvneg(n));
+			sep.p = cast->verts[i0];
+		}
+	}
+
+	return sep;
+}
+
+// Separation of the cast's vertex 'i' (or face) from the target's point 'q' at 't'.
+static cpFloat
+CastSeparationEval(const struct CastSeparation* sep, cpFloat t, int i, cpVect q)
+{
+	cpTransform transform = CastTransform(sep->cast, t);
+	if (sep->face)
+	{
+		return cpvdot(cpvsub(q, cpTransformPoint(transform, sep->p)), cpTransformVect(transform, sep->n)) - sep->rsum;
+	}
+	else
+	{
+		return cpvdot(cpvsub(q, cpTransformPoint(transform, sep->cast->verts[i])), sep->n) - sep->rsum;
+	}
+}
+
+// Find the deepest pair of points along the axis at 't' and return their separation.
+static cpFloat
+CastSeparationFindMin(const struct CastSeparation* sep, cpFloat t, int* i, cpVect* q)
+{
+	if (sep->face)
+	{
+		*i = 0;
+		*q = sep->targetSupport(sep->target, cpvneg(cpTransformVect(CastTransform(sep->cast, t), sep->n)), -1).p;
+	}
+	else
+	{
+		CastProxyUpdate(sep->cast, t, sep->proxy);
+		*i = CastProxySupportPoint(sep->proxy, sep->n, -1).index;
+		*q = sep->targetSupport(sep->target, cpvneg(sep->n), -1).p;
+	}
+
+	return CastSeparationEval(sep, t, *i, *q);
+}
+
+// Time at which the separation comes within 'goal', searching forward from 't1' where the axis separates the shapes.
+// Returns INFINITY if the axis still separates them at 'maxAlpha'.
+// Root finding doesn't need a bound on the rotation, so it keeps converging for long, quickly spinning shapes.
+static cpFloat
+CastPushBack(const struct CastSeparation* sep, cpFloat t1, cpFloat maxAlpha, cpFloat goal, cpFloat tolerance)
+{
+	cpFloat t2 = maxAlpha;
+
+	// Each pass either reaches the goal or finds a new deepest pair of points closer to 't1'.
+	for (int pass = 0; pass < MAX_CAST_ITERATIONS; pass++)
+	{
+		int i;
+		cpVect q;
+		cpFloat s2 = CastSeparationFindMin(sep, t2, &i, &q);
+
+		if (s2 > goal + tolerance && t2 == maxAlpha) return INFINITY;
+		if (s2 > goal - tolerance) return t2;
+
+		cpFloat s1 = CastSeparationEval(sep, t1, i, q);
+		if (s1 <= goal + tolerance) return t1;
+
+		// Alternate bisection and the secant method to find where the pair's separation reaches the goal.
+		cpFloat a1 = t1, a2 = t2;
+		t2 = a1;
+		for (int iteration = 0; iteration < MAX_CAST_ROOT_ITERATIONS; iteration++)
+		{
+			cpFloat t = (iteration & 1 ? a1 + (goal - s1) * (a2 - a1) / (s2 - s1) : 0.5f * (a1 + a2));
+			cpFloat s = CastSeparationEval(sep, t, i, q);
+
+			if (cpfabs(s - goal) < tolerance)
+			{
+				t2 = t;
+				break;
+			}
+			else if (s > goal)
+			{
+				a1 = t;
+				s1 = s;
+				t2 = t;
+			}
+			else
+			{
+				a2 = t;
+				s2 = s;
+			}
+		}
+	}
+
+	return t1;
+}
+
+struct TilemapCastContext
+{
+	const struct cpShapeCast* cast;
+	const cpShape* tilemap;
+	cpFloat maxAlpha;
+	cpSegmentQueryInfo* info;
+	cpBool hit;
+};
+
+static void
+TilemapFaceCast(cpShape* face, struct TilemapCastContext* context)
+{
+	cpSegmentQueryInfo info;
+	if (cpShapeCastShape(context->cast, face, context->maxAlpha, &info) && cpvdot(info.normal, ((cpSegmentShape*)face)->tn) >= 0.0f)
+	{
+		info.shape = context->tilemap;
+		*context->info = info;
+		context->maxAlpha = info.alpha;
+		context->hit = cpTrue;
+	}
+}
+
+// Conservative advancement. Step the sweep forward by the largest amount that can't skip past the first contact.
+// The step is bounded by the fastest point of the rotating shape, which is far too cautious for long shapes spinning near the target.
+// If that runs out of steps, finish by root finding on the separation along the closest points' axis instead.
+cpBool
+cpShapeCastShape(const struct cpShapeCast* cast, const cpShape* target, cpFloat maxAlpha, cpSegmentQueryInfo* info)
+{
+	if (target->klass->type == CP_TILEMAP_SHAPE)
+	{
+		struct TilemapCastContext context = { cast, target, maxAlpha, info, cpFalse };
+		cpTilemapShapeEachFace((cpTilemapShape*)target, cast->bb, cpFalse, (cpTilemapFaceFunc)TilemapFaceCast, &context);
+		return context.hit;
+	}
+
+	struct CastProxy proxy = { cast->count, (cpVect*)alloca(cast->count * sizeof(cpVect)) };
+	struct SupportContext context = { (cpShape*)&proxy, target, (SupportPointFunc)CastProxySupportPoint, ShapeSupportPointFunc(target) };
+
+	cpFloat rsum = cast->r + ShapeCoreRadius(target);
+	cpFloat speed = cpvlength(cast->delta) + cpfabs(cast->da) * cast->rmax;
+	cpFloat tolerance = CAST_TOLERANCE * speed;
+
+	cpFloat t = 0.0f;
+	for (int iteration = 1;; iteration++)
+	{
+		CastProxyUpdate(cast, t, &proxy);
+
+		cpVect axis = cpvperp(cpvsub(proxy.verts[0], cpBBCenter(target->bb)));
+		struct ClosestPoints points = GJKRecurse(&context, Support(&context, axis), Support(&context, cpvneg(axis)), 1);
+
+		// GJK reports a zero distance for a degenerate simplex (ex: two points), so measure separated cores directly.
+		// Otherwise keep its axis, the direction between two nearly touching points is too noisy to root find along.
+		if (points.d >= 0.0f)
+		{
+			cpVect delta = cpvsub(points.b, points.a);
+			cpFloat length = cpvlength(delta);
+			if (length - points.d > tolerance)
+			{
+				points.d = length;
+				points.n = cpvmult(delta, 1.0f / length);
+			}
+		}
+
+		cpFloat d = points.d - rsum;
+
+		if (d <= tolerance)
+		{
+			info->shape = target;
+			info->normal = cpvneg(points.n);
+			info->point = cpvadd(points.b, cpvmult(info->normal, ShapeCoreRadius(target)));
+			info->alpha = t;
+			return cpTrue;
+		}
+
+		if (iteration <= MAX_CAST_ITERATIONS)
+		{
+			// Largest rate the gap along the separating axis can close at.
+			cpFloat closing = cpvdot(cast->delta, points.n) + cpfabs(cast->da) * cast->rmax;
+			if (closing <= 0.0f) return cpFalse;
+
+			t += d / closing;
+		}
+		else if (iteration <= 2 * MAX_CAST_ITERATIONS)
+		{
+			struct CastSeparation sep = CastSeparationNew(cast, &proxy, &context, rsum, t, points);
+			t = CastPushBack(&sep, t, maxAlpha, 0.5f * tolerance, 0.25f * tolerance);
+		}
+		else
+		{
+			// Never report a contact that wasn't reached, treat it as a miss.
+			cpAssertWarn(cpFalse, "Shape cast gave up after %d iterations.", iteration);
+			return cpFalse;
+		}
+
+		if (t > maxAlpha) return cpFalse;
+	}
+}
@@ -0,0 +1,664 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "chipmunk/chipmunk_private.h"
+
+// Median split trees are balanced, this is deep enough for any shape count that fits in memory.
+#define STACK_SIZE 64
+
+typedef void (*ChildFunc)(cpShape* child, void* data);
+
+static inline cpFloat
+BBDistSq(cpBB bb, cpVect p)
+{
+	cpFloat dx = cpfmax(cpfmax(bb.l - p.x, p.x - bb.r), 0.0f);
+	cpFloat dy = cpfmax(cpfmax(bb.b - p.y, p.y - bb.t), 0.0f);
+	return dx * dx + dy * dy;
+}
+
+static inline cpFloat
+BBArea(cpBB bb)
+{
+	return (bb.r - bb.l) * (bb.t - bb.b);
+}
+
+static inline cpBool
+TreeReady(const cpCompoundShape* compound)
+{
+	return (!compound->dirty && compound->count > 0);
+}
+
+// Get child 'i', moving it first if the compound moved since it was last needed.
+// Children are only stale while the space is locked, so queries between steps never write here.
+static inline cpShape*
+FreshChild(const cpCompoundShape* compound, int i)
+{
+	cpShape* child = compound->shapes[i];
+	if (compound->stamps[i] != compound->stamp)
+	{
+		cpShapeUpdate(child, compound->childTransform);
+		compound->stamps[i] = compound->stamp;
+	}
+
+	return child;
+}
+
+static inline cpBool
+TransformEql(cpTransform a, cpTransform b)
+{
+	return (a.a == b.a && a.b == b.b && a.c == b.c && a.d == b.d && a.tx == b.tx && a.ty == b.ty);
+}
+
+//MARK: Tree Building
+
+static inline cpFloat
+Center(const cpBB* bbs, int i, cpBool axisX)
+{
+	cpBB bb = bbs[i];
+	return (axisX ? bb.l + bb.r : bb.b + bb.t);
+}
+
+// Partially sorts 'order' so the element at 'k' is where it would be if fully sorted by center.
+static void
+Select(const cpBB* bbs, int* order, int count, int k, cpBool axisX)
+{
+	int lo = 0, hi = count - 1;
+	while (lo < hi)
+	{
+		cpFloat pivot = Center(bbs, order[(lo + hi) / 2], axisX);
+		int i = lo, j = hi;
+		while (i <= j)
+		{
+			while (Center(bbs, order[i], axisX) < pivot) i++;
+			while (Center(bbs, order[j], axisX) > pivot) j--;
+			if (i <= j)
+			{
+				int temp = order[i];
+				order[i] = order[j];
+				order[j] = temp;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j)
+		{
+			hi = j;
+		}
+		else if (k >= i)
+		{
+			lo = i;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+// Median split on the longest axis into node 'index'. Children are allocated in pairs from 'next'.
+static void
+BuildNode(cpCompoundShape* compound, int index, const cpBB* bbs, int* order, int count, int* next)
+{
+	struct cpCompoundNode* node = compound->nodes + index;
+
+	if (count == 1)
+	{
+		node->bb = bbs[order[0]];
+		node->index = order[0];
+		node->leaf = cpTrue;
+		return;
+	}
+
+	cpBB bb = bbs[order[0]];
+	for (int i = 1; i < count; i++) bb = cpBBMerge(bb, bbs[order[i]]);
+
+	int half = count / 2;
+	Select(bbs, order, count, half, bb.r - bb.l > bb.t - bb.b);
+
+	int children = *next;
+	*next += 2;
+
+	node->bb = bb;
+	node->index = children;
+	node->leaf = cpFalse;
+
+	BuildNode(compound, children + 0, bbs, order, half, next);
+	BuildNode(compound, children + 1, bbs, order + half, count - half, next);
+}
+
+static void
+Rebuild(cpCompoundShape* compound)
+{
+	cpBody* body = compound->shape.body;
+	cpVect s = body->s;
+	int count = compound->count;
+
+	compound->dirty = cpFalse;
+	compound->scale = s;
+	if (count == 0) return;
+
+	cpBB* bbs = compound->bbs;
+	int* order = compound->order;
+
+	// The tree lives in the body's unscaled frame so it only needs rebuilding when the shapes or the scale change.
+	cpTransform scale = cpTransformScale(s.x, s.y);
+	for (int i = 0; i < count; i++)
+	{
+		cpShape* child = compound->shapes[i];
+		bbs[i] = child->klass->cacheData(child, scale);
+		order[i] = i;
+	}
+
+	int next = 1;
+	BuildNode(compound, 0, bbs, order, count, &next);
+}
+
+//MARK: Traversal
+
+// Visit the children whose bounding boxes touch 'bb'.
+static void
+EachChildInBB(const cpCompoundShape* compound, cpBB bb, ChildFunc func, void* data)
+{
+	if (!TreeReady(compound))
+	{
+		for (int i = 0; i < compound->count; i++)
+		{
+			cpShape* child = FreshChild(compound, i);
+			if (cpBBIntersects(child->bb, bb)) func(child, data);
+		}
+
+		return;
+	}
+
+	// Nodes are tested in world space. Moving 'bb' into the tree's frame instead would be tighter,
+	// but would miss children whose bounding box touches 'bb' while their geometry doesn't.
+	const struct cpCompoundNode* nodes = compound->nodes;
+	cpTransform transform = compound->transform;
+
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const struct cpCompoundNode* node = nodes + stack[--top];
+		if (!cpBBIntersects(cpTransformbBB(transform, node->bb), bb)) continue;
+
+		if (node->leaf)
+		{
+			cpShape* child = FreshChild(compound, node->index);
+			if (cpBBIntersects(child->bb, bb)) func(child, data);
+		}
+		else
+		{
+			stack[top++] = node->index + 1;
+			stack[top++] = node->index + 0;
+		}
+	}
+}
+
+// Pairs of children from two compounds with overlapping bounding boxes.
+// The nodes are compared in the frame of 'a', which can skip pairs whose bounding boxes touch but whose geometry can't.
+static void
+EachTreePair(const cpCompoundShape* a, const cpCompoundShape* b, cpSpatialIndexQueryFunc func, void* data)
+{
+	const struct cpCompoundNode* nodes_a = a->nodes, * nodes_b = b->nodes;
+	cpTransform b_to_a = cpTransformMult(a->inverse, b->transform);
+
+	int stack[2 * STACK_SIZE][2];
+	int top = 0;
+	stack[top][0] = 0;
+	stack[top][1] = 0;
+	top++;
+
+	while (top > 0)
+	{
+		top--;
+		const struct cpCompoundNode* node_a = nodes_a + stack[top][0];
+		const struct cpCompoundNode* node_b = nodes_b + stack[top][1];
+
+		cpBB bb_b = cpTransformbBB(b_to_a, node_b->bb);
+		if (!cpBBIntersects(node_a->bb, bb_b)) continue;
+
+		if (node_a->leaf && node_b->leaf)
+		{
+			cpShape* child_a = FreshChild(a, node_a->index), * child_b = FreshChild(b, node_b->index);
+			if (cpBBIntersects(child_a->bb, child_b->bb)) func(child_a, child_b, 0, data);
+		}
+		else if (node_b->leaf || (!node_a->leaf && BBArea(node_a->bb) > BBArea(bb_b)))
+		{
+			int ib = (int)(node_b - nodes_b);
+			stack[top][0] = node_a->index + 1; stack[top][1] = ib; top++;
+			stack[top][0] = node_a->index + 0; stack[top][1] = ib; top++;
+		}
+		else
+		{
+			int ia = (int)(node_a - nodes_a);
+			stack[top][0] = ia; stack[top][1] = node_b->index + 1; top++;
+			stack[top][0] = ia; stack[top][1] = node_b->index + 0; top++;
+		}
+	}
+}
+
+//MARK: Queries
+
+struct QueryContext
+{
+	void* obj;
+	cpSpatialIndexQueryFunc func;
+	cpSpatialIndexBBQueryFunc bbfunc;
+	void* data;
+	cpBool stop;
+};
+
+static void
+QueryChild(cpShape* child, struct QueryContext* context)
+{
+	context->func(context->obj, child, 0, context->data);
+}
+
+void
+cpCompoundShapeQuery(const cpCompoundShape* compound, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, void* data)
+{
+	struct QueryContext context = { obj, func, NULL, data, cpFalse };
+	EachChildInBB(compound, bb, (ChildFunc)QueryChild, &context);
+}
+
+static void
+BBQueryChild(cpShape* child, struct QueryContext* context)
+{
+	if (!context->stop && !context->bbfunc(context->obj, child, context->data)) context->stop = cpTrue;
+}
+
+cpBool
+cpCompoundShapeBBQuery(const cpCompoundShape* compound, void* obj, cpBB bb, cpSpatialIndexBBQueryFunc func, void* data)
+{
+	struct QueryContext context = { obj, NULL, func, data, cpFalse };
+	EachChildInBB(compound, bb, (ChildFunc)BBQueryChild, &context);
+	return !context.stop;
+}
+
+cpFloat
+cpCompoundShapeSegmentQuery(const cpCompoundShape* compound, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void* data)
+{
+	if (!TreeReady(compound))
+	{
+		for (int i = 0; i < compound->count; i++)
+		{
+			cpShape* child = FreshChild(compound, i);
+			if (cpBBSegmentQuery(child->bb, a, b, r) < t_exit) t_exit = cpfmin(t_exit, func(obj, child, data));
+		}
+
+		return t_exit;
+	}
+
+	// Rigid transforms don't change the segment's parametrization, so times carry over to the local frame.
+	const struct cpCompoundNode* nodes = compound->nodes;
+	cpVect la = cpTransformPoint(compound->inverse, a), lb = cpTransformPoint(compound->inverse, b);
+
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const struct cpCompoundNode* node = nodes + stack[--top];
+		if (cpBBSegmentQuery(node->bb, la, lb, r) >= t_exit) continue;
+
+		if (node->leaf)
+		{
+			t_exit = cpfmin(t_exit, func(obj, FreshChild(compound, node->index), data));
+		}
+		else
+		{
+			// Visit the child the segment enters first last so it is popped first.
+			const struct cpCompoundNode* children = nodes + node->index;
+			cpBool swap = (cpBBSegmentQuery(children[1].bb, la, lb, r) < cpBBSegmentQuery(children[0].bb, la, lb, r));
+			stack[top++] = node->index + (swap ? 0 : 1);
+			stack[top++] = node->index + (swap ? 1 : 0);
+		}
+	}
+
+	return t_exit;
+}
+
+cpFloat
+cpCompoundShapeNearestQuery(const cpCompoundShape* compound, void* obj, cpVect point, cpFloat maxDistance, cpBBTreeNearestFunc func, void* data)
+{
+	cpFloat maxsq = (maxDistance > 0.0f ? maxDistance * maxDistance : 0.0f);
+
+	if (!TreeReady(compound))
+	{
+		for (int i = 0; i < compound->count; i++)
+		{
+			cpShape* child = FreshChild(compound, i);
+			if (BBDistSq(child->bb, point) > maxsq) continue;
+
+			cpFloat bound = func(obj, child, data);
+			if (bound < maxDistance)
+			{
+				maxDistance = bound;
+				maxsq = (bound > 0.0f ? bound * bound : 0.0f);
+			}
+		}
+
+		return maxDistance;
+	}
+
+	const struct cpCompoundNode* nodes = compound->nodes;
+	cpVect local = cpTransformPoint(compound->inverse, point);
+
+	int stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const struct cpCompoundNode* node = nodes + stack[--top];
+		if (BBDistSq(node->bb, local) > maxsq) continue;
+
+		if (node->leaf)
+		{
+			cpShape* child = FreshChild(compound, node->index);
+			if (BBDistSq(child->bb, point) > maxsq) continue;
+
+			cpFloat bound = func(obj, child, data);
+			if (bound < maxDistance)
+			{
+				maxDistance = bound;
+				maxsq = (bound > 0.0f ? bound * bound : 0.0f);
+			}
+		}
+		else
+		{
+			// Visit the nearer child first so it can shrink the bound for the other one.
+			const struct cpCompoundNode* children = nodes + node->index;
+			cpBool swap = (BBDistSq(children[1].bb, local) < BBDistSq(children[0].bb, local));
+			stack[top++] = node->index + (swap ? 0 : 1);
+			stack[top++] = node->index + (swap ? 1 : 0);
+		}
+	}
+
+	return maxDistance;
+}
+
+struct PairContext
+{
+	cpShape* other;
+	cpBool swapped;
+	cpSpatialIndexQueryFunc func;
+	void* data;
+};
+
+static void
+PairChild(cpShape* child, struct PairContext* context)
+{
+	if (context->swapped)
+	{
+		cpCompoundShapeEachPair(context->other, child, context->func, context->data);
+	}
+	else
+	{
+		cpCompoundShapeEachPair(child, context->other, context->func, context->data);
+	}
+}
+
+void
+cpCompoundShapeEachPair(cpShape* a, cpShape* b, cpSpatialIndexQueryFunc func, void* data)
+{
+	cpBool compound_a = cpShapeIsCompound(a), compound_b = cpShapeIsCompound(b);
+
+	if (compound_a && compound_b && TreeReady((cpCompoundShape*)a) && TreeReady((cpCompoundShape*)b))
+	{
+		EachTreePair((cpCompoundShape*)a, (cpCompoundShape*)b, func, data);
+	}
+	else if (compound_a)
+	{
+		struct PairContext context = { b, cpFalse, func, data };
+		EachChildInBB((cpCompoundShape*)a, b->bb, (ChildFunc)PairChild, &context);
+	}
+	else if (compound_b)
+	{
+		struct PairContext context = { a, cpTrue, func, data };
+		EachChildInBB((cpCompoundShape*)b, a->bb, (ChildFunc)PairChild, &context);
+	}
+	else
+	{
+		func(a, b, 0, data);
+	}
+}
+
+//MARK: Shape Class
+
+static cpBB
+cpCompoundShapeCacheData(cpCompoundShape* compound, cpTransform transform)
+{
+	cpBody* body = compound->shape.body;
+	cpBool rebuild = (compound->dirty || !cpveql(compound->scale, body->s));
+	if (rebuild) Rebuild(compound);
+
+	compound->transform = body->transform_unscaled;
+	compound->inverse = cpTransformRigidInverse(body->transform_unscaled);
+
+	if (compound->count == 0) return cpBBNewForCircle(cpv(transform.tx, transform.ty), 0.0f);
+
+	// Rebuilding the tree also clobbers the children's world data.
+	if (rebuild || !TransformEql(transform, compound->childTransform))
+	{
+		compound->childTransform = transform;
+		compound->stamp++;
+
+		cpSpace* space = compound->shape.space;
+		if (space && space->locked)
+		{
+			// The narrowphase moves the children it touches, the space moves the rest when it unlocks.
+			if (!compound->stale)
+			{
+				compound->stale = cpTrue;
+				cpArrayPush(space->staleCompounds, compound);
+			}
+		}
+		else
+		{
+			cpCompoundShapeFlush(compound);
+		}
+	}
+
+	// The root bounds the children without having to move them.
+	return cpTransformbBB(compound->transform, compound->nodes[0].bb);
+}
+
+static void
+cpCompoundShapeDestroy(cpCompoundShape* compound)
+{
+	cpfree(compound->shapes);
+	cpfree(compound->nodes);
+	cpfree(compound->bbs);
+	cpfree(compound->order);
+	cpfree(compound->stamps);
+}
+
+struct PointQueryContext
+{
+	cpVect p;
+	cpPointQueryInfo info;
+};
+
+static cpFloat
+PointQueryChild(struct PointQueryContext* context, cpShape* child, void* unused)
+{
+	(void)unused;
+	cpPointQueryInfo info;
+	if (cpShapePointQuery(child, context->p, &info) < context->info.distance) context->info = info;
+	return context->info.distance;
+}
+
+static void
+cpCompoundShapePointQuery(cpCompoundShape* compound, cpVect p, cpPointQueryInfo* info)
+{
+	struct PointQueryContext context = { p, { NULL, cpvzero, INFINITY, cpvzero } };
+	cpCompoundShapeNearestQuery(compound, &context, p, INFINITY, (cpBBTreeNearestFunc)PointQueryChild, NULL);
+	if (context.info.shape) *info = context.info;
+}
+
+struct SegmentQueryContext
+{
+	cpVect a, b;
+	cpFloat radius;
+	cpSegmentQueryInfo info;
+};
+
+static cpFloat
+SegmentQueryChild(struct SegmentQueryContext* context, cpShape* child, void* unused)
+{
+	(void)unused;
+	cpSegmentQueryInfo info;
+	if (cpShapeSegmentQuery(child, context->a, context->b, context->radius, &info) && info.alpha < context->info.alpha) context->info = info;
+	return context->info.alpha;
+}
+
+static void
+cpCompoundShapeSegmentQueryImpl(cpCompoundShape* compound, cpVect a, cpVect b, cpFloat radius, cpSegmentQueryInfo* info)
+{
+	struct SegmentQueryContext context = { a, b, radius, { NULL, b, cpvzero, 1.0f } };
+	cpCompoundShapeSegmentQuery(compound, &context, a, b, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQueryChild, NULL);
+	if (context.info.shape) *info = context.info;
+}
+
+static const cpShapeClass compoundClass = {
+	CP_COMPOUND_SHAPE,
+	(cpShapeCacheDataImpl)cpCompoundShapeCacheData,
+	(cpShapeDestroyImpl)cpCompoundShapeDestroy,
+	(cpShapePointQueryImpl)cpCompoundShapePointQuery,
+	(cpShapeSegmentQueryImpl)cpCompoundShapeSegmentQueryImpl,
+};
+
+//MARK: Compound Shapes
+
+cpCompoundShape*
+cpCompoundShapeNew(cpBody* body)
+{
+	cpCompoundShape* compound = (cpCompoundShape*)cpcalloc(1, sizeof(cpCompoundShape));
+
+	// The proxy has no mass, the children carry the body's mass.
+	struct cpShapeMassInfo info = { 0.0f, 0.0f, cpvzero, 0.0f };
+	cpShapeInit((cpShape*)compound, &compoundClass, body, info);
+
+	compound->count = compound->capacity = 0;
+	compound->shapes = NULL;
+	compound->nodes = NULL;
+	compound->dirty = cpFalse;
+	compound->scale = body->s;
+	compound->bbs = NULL;
+	compound->order = NULL;
+	compound->transform = compound->inverse = cpTransformIdentity;
+
+	compound->childTransform = cpTransformIdentity;
+	compound->stamp = 1;
+	compound->stamps = NULL;
+	compound->stale = cpFalse;
+
+	return compound;
+}
+
+// The proxy passes the union of its children's layer and mask bits. The children are filtered individually.
+static void
+UpdateFilter(cpCompoundShape* compound)
+{
+	cpShapeFilter filter = { CP_NO_GROUP, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < compound->count; i++)
+	{
+		filter.layer |= compound->shapes[i]->filter.layer;
+		filter.mask |= compound->shapes[i]->filter.mask;
+	}
+
+	compound->shape.filter = filter;
+}
+
+void
+cpCompoundShapeAdd(cpCompoundShape* compound, cpShape* shape)
+{
+	cpAssertHard(shape->body == compound->shape.body, "Internal error: Adding a shape to another body's compound.");
+	cpAssertHard(shape->klass->type != CP_COMPOUND_SHAPE, "Internal error: Compounds cannot be nested.");
+
+	if (compound->count == compound->capacity)
+	{
+		compound->capacity = (compound->capacity ? 2 * compound->capacity : 4);
+		compound->shapes = (cpShape**)cprealloc(compound->shapes, compound->capacity * sizeof(cpShape*));
+		compound->nodes = (struct cpCompoundNode*)cprealloc(compound->nodes, 2 * compound->capacity * sizeof(struct cpCompoundNode));
+		compound->bbs = (cpBB*)cprealloc(compound->bbs, compound->capacity * sizeof(cpBB));
+		compound->order = (int*)cprealloc(compound->order, compound->capacity * sizeof(int));
+		compound->stamps = (cpTimestamp*)cprealloc(compound->stamps, compound->capacity * sizeof(cpTimestamp));
+	}
+
+	// The shape was just moved to the body's transform.
+	compound->shape.bb = (compound->count ? cpBBMerge(compound->shape.bb, shape->bb) : shape->bb);
+	compound->stamps[compound->count] = compound->stamp;
+	compound->shapes[compound->count++] = shape;
+	compound->dirty = cpTrue;
+	UpdateFilter(compound);
+}
+
+void
+cpCompoundShapeRemove(cpCompoundShape* compound, cpShape* shape)
+{
+	for (int i = 0; i < compound->count; i++)
+	{
+		if (compound->shapes[i] == shape)
+		{
+			compound->count--;
+			compound->shapes[i] = compound->shapes[compound->count];
+			compound->stamps[i] = compound->stamps[compound->count];
+			compound->dirty = cpTrue;
+			UpdateFilter(compound);
+			return;
+		}
+	}
+
+	cpAssertWarn(cpFalse, "Internal error: Shape was not in the compound.");
+}
+
+void
+cpCompoundShapeChanged(cpCompoundShape* compound)
+{
+	compound->dirty = cpTrue;
+	UpdateFilter(compound);
+}
+
+void
+cpCompoundShapeFilterChanged(cpCompoundShape* compound)
+{
+	UpdateFilter(compound);
+}
+
+void
+cpCompoundShapeFlush(cpCompoundShape* compound)
+{
+	for (int i = 0; i < compound->count; i++) FreshChild(compound, i);
+	compound->stale = cpFalse;
+}
+
+void
+cpCompoundShapeEach(const cpCompoundShape* compound, cpSpatialIndexIteratorFunc func, void* data)
+{
+	for (int i = 0; i < compound->count; i++) func(FreshChild(compound, i), data);
+}
@@ -423,6 +423,10 @@ struct cpHastySpace
 	// Work function to invoke.
 	cpHastySpaceWorkFunction work;
 
+	// Spatial index work function to invoke. (see RunIndexWorkers())
+	cpSpatialIndexWorkerFunc index_work;
+	void* index_work_data;
+
 	struct ThreadContext workers[MAX_THREADS - 1];
 };
 
@@ -491,6 +495,26 @@ RunWorkers(cpHastySpace* hasty, cpHastySpaceWorkFunction func)
 	hasty->work = NULL;
 }
 
+static void
+IndexWorker(cpSpace* space, unsigned long worker, unsigned long worker_count)
+{
+	cpHastySpace* hasty = (cpHastySpace*)space;
+	hasty->index_work(hasty->index_work_data, worker, worker_count);
+}
+
+// Lets the spatial indexes borrow the worker threads for things like tree rebuilds.
+static void
+RunIndexWorkers(cpSpatialIndexWorkerFunc func, void* data, cpHastySpace* hasty)
+{
+	hasty->index_work = func;
+	hasty->index_work_data = data;
+
+	RunWorkers(hasty, IndexWorker);
+
+	hasty->index_work = NULL;
+	hasty->index_work_data = NULL;
+}
+
 static void
 Solver(cpSpace* space, unsigned long worker, unsigned long worker_count)
 {
@@ -601,6 +625,9 @@ cpHastySpaceNew(void)
 	// TODO magic number, should test this more thoroughly.
 	hasty->constraint_count_threshold = 50;
 
+	cpSpatialIndexSetWorkers(hasty->space.staticShapes, (cpSpatialIndexRunWorkersFunc)RunIndexWorkers, hasty);
+	cpSpatialIndexSetWorkers(hasty->space.dynamicShapes, (cpSpatialIndexRunWorkersFunc)RunIndexWorkers, hasty);
+
 	// Default to 1 thread for determinism.
 	hasty->num_threads = 1;
 	cpHastySpaceSetThreads((cpSpace*)hasty, 1);
@@ -662,10 +689,15 @@ cpHastySpaceStep(cpSpace* space, cpFloat dt)
 
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
+		cpSpaceSensorsBeginStep(space);
+		cpSpaceIndexTunerBegin(space);
 		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
 		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		cpSpaceCollideCircles(space);
 	} cpSpaceUnlock(space, cpFalse);
 
+	cpSpaceIndexTunerEnd(space);
+
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
 	cpSpaceProcessComponents(space, dt);
 
@@ -673,6 +705,7 @@ cpHastySpaceStep(cpSpace* space, cpFloat dt)
 	{
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		cpSpaceSensorsEndStep(space);
 
 		// Prestep the arbiters and constraints.
 		cpFloat slop = space->collisionSlop;
@@ -745,4 +778,7 @@ cpHastySpaceStep(cpSpace* space, cpFloat dt)
 			handler->postSolveFunc(arb, space, handler->userData);
 		}
 	} cpSpaceUnlock(space, cpTrue);
+
+	// Post-step callbacks may have changed the space, so publish the snapshot after them.
+	cpSpaceSnapshotsPublish(space);
 }
@@ -22,6 +22,10 @@
 #include "chipmunk/chipmunk_private.h"
 #include "chipmunk/chipmunk_unsafe.h"
 
+#if CP_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 cpPolyShape*
 cpPolyShapeAlloc(void)
 {
@@ -52,6 +56,43 @@ cpPolyShapeCacheData(cpPolyShape* poly, cpTransform transform)
 	cpBool reverse = (transform.a * transform.d) < 0.00f;
 	int offset = reverse ? 1 : 0;
 
+#if CP_USE_SSE2
+	if (!reverse)
+	{
+		// A plane is four floats, transform its vertex and normal together.
+		__m128 mx = _mm_setr_ps(transform.a, transform.b, mat_normal.a, mat_normal.b);
+		__m128 my = _mm_setr_ps(transform.c, transform.d, mat_normal.c, mat_normal.d);
+		__m128 mt = _mm_setr_ps(transform.tx, transform.ty, 0.0f, 0.0f);
+		__m128 one = _mm_set1_ps(1.0f), epsilon = _mm_set1_ps(CPFLOAT_MIN);
+		__m128 min = _mm_set1_ps(INFINITY), max = _mm_set1_ps(-INFINITY);
+
+		for (int i = 0; i < count; i++)
+		{
+			__m128 p = _mm_loadu_ps(&src[i].v0.x);
+			__m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0));
+			__m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1));
+			p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(mx, x), _mm_mul_ps(my, y)), mt);
+
+			// Normalize the normal the same way as cpvnormalize().
+			__m128 sq = _mm_mul_ps(p, p);
+			__m128 length = _mm_sqrt_ps(_mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 3, 0, 1))));
+			__m128 scale = _mm_div_ps(one, _mm_add_ps(length, epsilon));
+			p = _mm_mul_ps(p, _mm_shuffle_ps(one, scale, _MM_SHUFFLE(3, 2, 1, 0)));
+
+			_mm_storeu_ps(&dst[i].v0.x, p);
+			min = _mm_min_ps(min, p);
+			max = _mm_max_ps(max, p);
+		}
+
+		float lb[4], rt[4];
+		_mm_storeu_ps(lb, min);
+		_mm_storeu_ps(rt, max);
+
+		cpFloat radius = poly->r;
+		return (poly->shape.bb = cpBBNew(lb[0] - radius, lb[1] - radius, rt[0] + radius, rt[1] + radius));
+	}
+#endif
+
 	for (int i = 0; i < count; i++)
 	{
 		cpVect v = cpTransformPoint(transform, src[i].v0);
@@ -72,13 +113,10 @@ cpPolyShapeCacheData(cpPolyShape* poly, cpTransform transform)
 	return (poly->shape.bb = cpBBNew(l - radius, b - radius, r + radius, t + radius));
 }
 
+// Point query against a convex polygon given by its world planes. Shared by polys and boxes.
 static void
-cpPolyShapePointQuery(cpPolyShape* poly, cpVect p, cpPointQueryInfo* info)
+PlanesPointQuery(cpShape* shape, int count, const struct cpSplittingPlane* planes, cpFloat r, cpVect p, cpPointQueryInfo* info)
 {
-	int count = poly->count;
-	struct cpSplittingPlane* planes = poly->planes;
-	cpFloat r = poly->r;
-
 	cpVect v0 = planes[count - 1].v0;
 	cpFloat minDist = INFINITY;
 	cpVect closestPoint = cpvzero;
@@ -106,7 +144,7 @@ cpPolyShapePointQuery(cpPolyShape* poly, cpVect p, cpPointQueryInfo* info)
 	cpFloat dist = (outside ? minDist : -minDist);
 	cpVect g = cpvmult(cpvsub(p, closestPoint), 1.0f / (dist + CPFLOAT_MIN));
 
-	info->shape = (cpShape*)poly;
+	info->shape = shape;
 	info->point = cpvadd(closestPoint, cpvmult(g, r));
 	info->distance = dist - r;
 
@@ -115,11 +153,8 @@ cpPolyShapePointQuery(cpPolyShape* poly, cpVect p, cpPointQueryInfo* info)
 }
 
 static void
-cpPolyShapeSegmentQuery(cpPolyShape* poly, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo* info)
+PlanesSegmentQuery(cpShape* shape, int count, const struct cpSplittingPlane* planes, cpFloat r, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo* info)
 {
-	struct cpSplittingPlane* planes = poly->planes;
-	int count = poly->count;
-	cpFloat r = poly->r;
 	cpFloat rsum = r + r2;
 
 	for (int i = 0; i < count; i++)
@@ -141,7 +176,7 @@ cpPolyShapeSegmentQuery(cpPolyShape* poly, cpVect a, cpVect b, cpFloat r2, cpSeg
 
 		if (dtMin <= dt && dt <= dtMax)
 		{
-			info->shape = (cpShape*)poly;
+			info->shape = shape;
 			info->point = cpvsub(cpvlerp(a, b, t), cpvmult(n, r2));
 			info->normal = n;
 			info->alpha = t;
@@ -154,12 +189,24 @@ cpPolyShapeSegmentQuery(cpPolyShape* poly, cpVect a, cpVect b, cpFloat r2, cpSeg
 		for (int i = 0; i < count; i++)
 		{
 			cpSegmentQueryInfo circle_info = { NULL, b, cpvzero, 1.0f };
-			CircleSegmentQuery(&poly->shape, planes[i].v0, r, a, b, r2, &circle_info);
+			CircleSegmentQuery(shape, planes[i].v0, r, a, b, r2, &circle_info);
 			if (circle_info.alpha < info->alpha) (*info) = circle_info;
 		}
 	}
 }
 
+static void
+cpPolyShapePointQuery(cpPolyShape* poly, cpVect p, cpPointQueryInfo* info)
+{
+	PlanesPointQuery((cpShape*)poly, poly->count, poly->planes, poly->r, p, info);
+}
+
+static void
+cpPolyShapeSegmentQuery(cpPolyShape* poly, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo* info)
+{
+	PlanesSegmentQuery((cpShape*)poly, poly->count, poly->planes, poly->r, a, b, r2, info);
+}
+
 static void
 SetVerts(cpPolyShape* poly, int count, const cpVect* verts, cpBool invert)
 {
@@ -244,6 +291,64 @@ cpPolyShapeNewRaw(cpBody* body, int count, const cpVect* verts, cpFloat radius)
 	return (cpShape*)cpPolyShapeInitRaw(cpPolyShapeAlloc(), body, count, verts, radius);
 }
 
+//MARK: Box Shapes
+
+static cpBB
+cpBoxShapeCacheData(cpBoxShape* box, cpTransform transform)
+{
+	cpVect tx = cpTransformVect(transform, cpv(1.0f, 0.0f));
+	cpVect ty = cpTransformVect(transform, cpv(0.0f, 1.0f));
+	cpFloat sx = cpvlength(tx);
+
+	box->tc = cpTransformPoint(transform, box->c);
+	box->tx = cpvmult(tx, 1.0f / sx);
+	box->th = cpv(box->h.x * sx, box->h.y * cpvlength(ty));
+
+	// Project the half extents onto the world axes.
+	cpFloat ex = cpfabs(box->tx.x) * box->th.x + cpfabs(box->tx.y) * box->th.y;
+	cpFloat ey = cpfabs(box->tx.y) * box->th.x + cpfabs(box->tx.x) * box->th.y;
+	return cpBBNewForExtents(box->tc, ex, ey);
+}
+
+static void
+cpBoxShapePointQuery(cpBoxShape* box, cpVect p, cpPointQueryInfo* info)
+{
+	struct cpSplittingPlane planes[4];
+	cpBoxShapePlanes(box, planes);
+	PlanesPointQuery((cpShape*)box, 4, planes, 0.0f, p, info);
+}
+
+static void
+cpBoxShapeSegmentQuery(cpBoxShape* box, cpVect a, cpVect b, cpFloat r2, cpSegmentQueryInfo* info)
+{
+	struct cpSplittingPlane planes[4];
+	cpBoxShapePlanes(box, planes);
+	PlanesSegmentQuery((cpShape*)box, 4, planes, 0.0f, a, b, r2, info);
+}
+
+static const cpShapeClass boxClass = {
+	CP_BOX_SHAPE,
+	(cpShapeCacheDataImpl)cpBoxShapeCacheData,
+	NULL,
+	(cpShapePointQueryImpl)cpBoxShapePointQuery,
+	(cpShapeSegmentQueryImpl)cpBoxShapeSegmentQuery,
+};
+
+static cpBoxShape*
+BoxShapeInit(cpBoxShape* box, cpBody* body, cpBB bb)
+{
+	cpVect c = cpBBCenter(bb);
+	cpVect h = cpv((bb.r - bb.l) * 0.5f, (bb.t - bb.b) * 0.5f);
+
+	struct cpShapeMassInfo info = { 0.0f, cpMomentForBox(1.0f, 2.0f * h.x, 2.0f * h.y), c, 4.0f * h.x * h.y };
+	cpShapeInit((cpShape*)box, &boxClass, body, info);
+
+	box->c = c;
+	box->h = h;
+
+	return box;
+}
+
 cpPolyShape*
 cpBoxShapeInit(cpPolyShape* poly, cpBody* body, cpFloat width, cpFloat height, cpFloat radius)
 {
@@ -269,7 +374,10 @@ cpBoxShapeInit2(cpPolyShape* poly, cpBody* body, cpBB box, cpFloat radius)
 cpShape*
 cpBoxShapeNew(cpBody* body, cpFloat width, cpFloat height, cpFloat radius)
 {
-	return (cpShape*)cpBoxShapeInit(cpPolyShapeAlloc(), body, width, height, radius);
+	cpFloat hw = width / 2.0f;
+	cpFloat hh = height / 2.0f;
+
+	return cpBoxShapeNew2(body, cpBBNew(-hw, -hh, hw, hh), radius);
 }
 
 cpShape*
@@ -278,9 +386,26 @@ cpBoxShapeNew2(cpBody* body, cpBB box, cpFloat radius)
 	return (cpShape*)cpBoxShapeInit2(cpPolyShapeAlloc(), body, box, radius);
 }
 
+cpShape*
+cpBoxShapeNewFast(cpBody* body, cpFloat width, cpFloat height)
+{
+	cpFloat hw = width / 2.0f;
+	cpFloat hh = height / 2.0f;
+
+	return cpBoxShapeNewFast2(body, cpBBNew(-hw, -hh, hw, hh));
+}
+
+cpShape*
+cpBoxShapeNewFast2(cpBody* body, cpBB box)
+{
+	return (cpShape*)BoxShapeInit((cpBoxShape*)cpcalloc(1, sizeof(cpBoxShape)), body, box);
+}
+
 int
 cpPolyShapeGetCount(const cpShape* shape)
 {
+	if (shape->klass == &boxClass) return 4;
+
 	cpAssertHard(shape->klass == &polyClass, "Shape is not a poly shape.");
 	return ((cpPolyShape*)shape)->count;
 }
@@ -288,17 +413,23 @@ cpPolyShapeGetCount(const cpShape* shape)
 cpVect
 cpPolyShapeGetVert(const cpShape* shape, int i)
 {
-	cpAssertHard(shape->klass == &polyClass, "Shape is not a poly shape.");
-
 	int count = cpPolyShapeGetCount(shape);
 	cpAssertHard(0 <= i && i < count, "Index out of range.");
 
+	if (shape->klass == &boxClass)
+	{
+		const cpBoxShape* box = (cpBoxShape*)shape;
+		return cpBoxCorner(box->c, cpv(box->h.x, 0.0f), cpv(0.0f, box->h.y), i);
+	}
+
 	return ((cpPolyShape*)shape)->planes[i + count].v0;
 }
 
 cpFloat
 cpPolyShapeGetRadius(const cpShape* shape)
 {
+	if (shape->klass == &boxClass) return 0.0f;
+
 	cpAssertHard(shape->klass == &polyClass, "Shape is not a poly shape.");
 	return ((cpPolyShape*)shape)->r;
 }
@@ -28,8 +28,6 @@ CP_DeclareShapeGetter(struct, type, name){ \
 	return ((struct *)shape)->member; \
 }
 
-typedef struct cpBoxShape cpBoxShape;
-
 cpShape*
 cpShapeInit(cpShape* shape, const cpShapeClass* klass, cpBody* body, struct cpShapeMassInfo massInfo)
 {
@@ -227,11 +225,42 @@ cpShapeGetFilter(const cpShape* shape)
 	return shape->filter;
 }
 
+static void
+ShapeReindexFilter(cpSpace* space, void* key, cpShape* shape)
+{
+	(void)key;
+
+	// A compound's tree is still valid, only its proxy's filter bits need to be refreshed and reindexed.
+	cpBody* body = shape->body;
+	if (body->compound && shape->space && !cpShapeIsCompound(shape))
+	{
+		cpCompoundShapeFilterChanged(body->compound);
+		shape = (cpShape*)body->compound;
+	}
+
+	cpSpaceReindexShape(space, shape);
+}
+
 void
 cpShapeSetFilter(cpShape* shape, cpShapeFilter filter)
 {
 	cpBodyActivate(shape->body);
 	shape->filter = filter;
+
+	// The spatial index caches the filter bits to prune queries.
+	cpSpace* space = shape->space;
+	if (space)
+	{
+		if (space->locked)
+		{
+			// Key the callback by the filter so it can't collide with the user's own callbacks keyed by the shape.
+			cpSpaceAddPostStepCallback(space, (cpPostStepFunc)ShapeReindexFilter, &shape->filter, shape);
+		}
+		else
+		{
+			ShapeReindexFilter(space, &shape->filter, shape);
+		}
+	}
 }
 
 cpBB
@@ -246,6 +275,39 @@ cpShapeUpdate(cpShape* shape, cpTransform transform)
 	return (shape->bb = shape->klass->cacheData(shape, transform));
 }
 
+size_t
+cpShapeScratchPlanesSize(const cpShape* shape)
+{
+	int count = (shape->klass->type == CP_POLY_SHAPE ? ((cpPolyShape*)shape)->count : 0);
+	return (count > CP_POLY_SHAPE_INLINE_ALLOC ? 2 * count * sizeof(struct cpSplittingPlane) : 0);
+}
+
+cpShape*
+cpShapeScratchInit(cpShapeScratch* scratch, const cpShape* shape, cpTransform transform, struct cpSplittingPlane* planes)
+{
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE: scratch->circle = *(cpCircleShape*)shape; break;
+	case CP_SEGMENT_SHAPE: scratch->segment = *(cpSegmentShape*)shape; break;
+	case CP_BOX_SHAPE: scratch->box = *(cpBoxShape*)shape; break;
+	case CP_TILEMAP_SHAPE: scratch->tilemap = *(cpTilemapShape*)shape; break;
+	default:
+	{
+		const cpPolyShape* poly = (cpPolyShape*)shape;
+		int count = poly->count;
+
+		scratch->poly = *poly;
+		scratch->poly.planes = (count > CP_POLY_SHAPE_INLINE_ALLOC ? planes : scratch->poly._planes);
+
+		// Only the untransformed planes need to be copied.
+		for (int i = count; i < 2 * count; i++) scratch->poly.planes[i] = poly->planes[i];
+	}
+	}
+
+	cpShapeUpdate(&scratch->shape, transform);
+	return &scratch->shape;
+}
+
 cpFloat
 cpShapePointQuery(const cpShape* shape, cpVect p, cpPointQueryInfo* info)
 {
@@ -321,6 +383,23 @@ cpShapesCollide(const cpShape* a, const cpShape* b)
 	return set;
 }
 
+cpBool
+cpShapesOverlap(const cpShape* a, const cpShape* b)
+{
+	return cpOverlap(a, b);
+}
+
+cpBool
+cpShapeCast(const cpShape* shape, cpTransform start, cpTransform end, const cpShape* target, cpSegmentQueryInfo* info)
+{
+	cpSegmentQueryInfo blank = { NULL, cpvzero, cpvzero, 1.0f };
+	(*info) = blank;
+
+	struct cpShapeCast cast;
+	cpShapeCastInit(&cast, shape, start, end, (cpVect*)alloca(cpShapeCastVertexCount(shape) * sizeof(cpVect)));
+	return (cpBBIntersects(cast.bb, target->bb) && cpShapeCastShape(&cast, target, 1.0f, info));
+}
+
 cpCircleShape*
 cpCircleShapeAlloc(void)
 {
@@ -657,53 +736,3 @@ cpSegmentShapeSetRadius(cpShape* shape, cpFloat radius)
 	shape->massInfo = cpSegmentShapeMassInfo(shape->massInfo.m, seg->a, seg->b, seg->r);
 	if (mass > 0.0f) cpBodyAccumulateMassFromShapes(shape->body);
 }
-
-static cpBB
-cpBoxShapeCacheData(cpBoxShape* box, cpTransform transform)
-{
-	cpVect ta = cpTransformPoint(transform, box->a);
-	cpVect tb = cpTransformPoint(transform, box->b);
-
-	cpFloat l, r, b, t;
-
-	if (ta.x < tb.x)
-	{
-		l = ta.x;
-		r = tb.x;
-	}
-	else
-	{
-		l = tb.x;
-		r = ta.x;
-	}
-
-	if (ta.y < tb.y)
-	{
-		b = ta.y;
-		t = tb.y;
-	}
-	else
-	{
-		b = tb.y;
-		t = ta.y;
-	}
-	return cpBBNew(l, b, r, t);
-}
-
-static void
-cpBoxShapePointQuery(cpBoxShape* box, cpVect p, cpPointQueryInfo* info)
-{
-	info->shape = (cpShape*)box;
-	info->point = p;
-	info->distance = 0.00f;
-	info->gradient = cpvzero;
-}
-
-//static const cpShapeClass cpBoxShapeClass = 
-//{
-//	CP_BOX_SHAPE,
-//	(cpShapeCacheDataImpl)cpBoxShapeCacheData,
-//	NULL,
-//	(cpShapePointQueryImpl)cpBoxShapePointQuery,
-//	(cpShapeSegmentQueryImpl)cpSegmentShapeSegmentQuery,
-//};
\ No newline at end of file
@@ -22,18 +22,32 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
 #include "chipmunk/chipmunk_private.h"
 
  //MARK: Contact Set Helpers
 
  // Equal function for arbiterSet.
 static cpBool
-arbiterSetEql(cpShape** shapes, cpArbiter* arb)
+arbiterSetEql(struct cpArbiterKey* key, cpArbiter* arb)
 {
-	cpShape* a = shapes[0];
-	cpShape* b = shapes[1];
+	const cpShape* a = key->a;
+	const cpShape* b = key->b;
 
-	return ((a == arb->a && b == arb->b) || (b == arb->a && a == arb->b));
+	return ((a == arb->a && b == arb->b) || (b == arb->a && a == arb->b)) && key->part == arb->part;
 }
 
 //MARK: Collision Handler Set HelperFunctions
@@ -117,6 +131,13 @@ static cpVect ShapeVelocityFunc(cpShape* shape)
 	return shape->body->v;
 }
 
+// function to get the filter bits of a shape for the cpBBTree.
+static void ShapeFilterFunc(cpShape* shape, cpBitmask* layer, cpBitmask* mask)
+{
+	*layer = shape->filter.layer;
+	*mask = shape->filter.mask;
+}
+
 // Used for disposing of collision handlers.
 static void FreeWrap(void* ptr, void* unused)
 {
@@ -157,6 +178,7 @@ cpSpaceInit(cpSpace* space)
 	space->collisionSlop = 0.1f;
 	space->collisionBias = cpfpow(1.0f - 0.1f, 60.0f);
 	space->collisionPersistence = 3;
+	space->contactReuseTolerance = 0.0f;
 
 	space->locked = 0;
 	space->stamp = 0;
@@ -165,6 +187,9 @@ cpSpaceInit(cpSpace* space)
 	space->staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
 	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, space->staticShapes);
 	cpBBTreeSetVelocityFunc(space->dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+	cpBBTreeSetFilterFunc(space->staticShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+	cpBBTreeSetFilterFunc(space->dynamicShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+	space->indexTuner = NULL;
 
 	space->allocatedBuffers = cpArrayNew(0);
 
@@ -172,15 +197,21 @@ cpSpaceInit(cpSpace* space)
 	space->staticBodies = cpArrayNew(0);
 	space->sleepingComponents = cpArrayNew(0);
 	space->rousedBodies = cpArrayNew(0);
+	space->staleCompounds = cpArrayNew(0);
 
 	space->sleepTimeThreshold = INFINITY;
 	space->idleSpeedThreshold = 0.0f;
 
 	space->arbiters = cpArrayNew(0);
+	space->circlePairs[CP_CIRCLE_SHAPE] = cpArrayNew(0);
+	space->circlePairs[CP_SEGMENT_SHAPE] = cpArrayNew(0);
 	space->pooledArbiters = cpArrayNew(0);
 
 	space->contactBuffersHead = NULL;
 	space->cachedArbiters = cpHashSetNew(0, (cpHashSetEqlFunc)arbiterSetEql);
+	space->sensorSet = NULL;
+	space->snapshotSet = NULL;
+	space->queryQueue = NULL;
 
 	space->constraints = cpArrayNew(0);
 
@@ -216,17 +247,24 @@ cpSpaceDestroy(cpSpace* space)
 
 	cpSpatialIndexFree(space->staticShapes);
 	cpSpatialIndexFree(space->dynamicShapes);
+	cpfree(space->indexTuner);
 
 	cpArrayFree(space->dynamicBodies);
 	cpArrayFree(space->staticBodies);
 	cpArrayFree(space->sleepingComponents);
 	cpArrayFree(space->rousedBodies);
+	cpArrayFree(space->staleCompounds);
 
 	cpArrayFree(space->constraints);
 
 	cpHashSetFree(space->cachedArbiters);
+	cpSpaceSetSensorEvents(space, cpFalse);
+	cpSpaceSetSnapshots(space, cpFalse);
+	cpSpaceQueryQueueFree(space);
 
 	cpArrayFree(space->arbiters);
+	cpArrayFree(space->circlePairs[CP_CIRCLE_SHAPE]);
+	cpArrayFree(space->circlePairs[CP_SEGMENT_SHAPE]);
 	cpArrayFree(space->pooledArbiters);
 
 	if (space->allocatedBuffers)
@@ -363,6 +401,18 @@ cpSpaceSetCollisionPersistence(cpSpace* space, cpTimestamp collisionPersistence)
 	space->collisionPersistence = collisionPersistence;
 }
 
+cpFloat
+cpSpaceGetContactReuseTolerance(const cpSpace* space)
+{
+	return space->contactReuseTolerance;
+}
+
+void
+cpSpaceSetContactReuseTolerance(cpSpace* space, cpFloat contactReuseTolerance)
+{
+	space->contactReuseTolerance = contactReuseTolerance;
+}
+
 cpDataPointer
 cpSpaceGetUserData(const cpSpace* space)
 {
@@ -461,12 +511,64 @@ cpSpaceAddShape(cpSpace* space, cpShape* shape)
 
 	shape->hashid = space->shapeIDCounter++;
 	cpShapeUpdate(shape, body->transform);
-	cpSpatialIndexInsert(isStatic ? space->staticShapes : space->dynamicShapes, shape, shape->hashid);
 	shape->space = space;
 
+	cpSpatialIndex* index = (isStatic ? space->staticShapes : space->dynamicShapes);
+	if (body->compound)
+	{
+		// Only the body's proxy goes into the index.
+		cpShape* proxy = (cpShape*)body->compound;
+		cpCompoundShapeAdd(body->compound, shape);
+
+		if (proxy->space)
+		{
+			cpSpatialIndexReindexObject(index, proxy, proxy->hashid);
+		}
+		else
+		{
+			proxy->hashid = space->shapeIDCounter++;
+			cpSpatialIndexInsert(index, proxy, proxy->hashid);
+			proxy->space = space;
+		}
+	}
+	else
+	{
+		cpSpatialIndexInsert(index, shape, shape->hashid);
+	}
+
 	return shape;
 }
 
+void
+cpSpaceAddStaticShapes(cpSpace* space, cpShape** shapes, int count, cpBool restructure)
+{
+	cpAssertSpaceUnlocked(space);
+
+	cpHashValue* hashids = (cpHashValue*)cpcalloc(count, sizeof(cpHashValue));
+	for (int i = 0; i < count; i++)
+	{
+		cpShape* shape = shapes[i];
+		cpAssertHard(!shape->space, "You have already added this shape to a space. You cannot add it a second time.");
+		cpAssertHard(shape->body && cpBodyGetType(shape->body) == CP_BODY_TYPE_STATIC, "Shapes added with cpSpaceAddStaticShapes() must be attached to a static body.");
+		cpAssertHard(!shape->body->compound, "Shapes added with cpSpaceAddStaticShapes() cannot be attached to a compound body.");
+
+		shape->hashid = hashids[i] = space->shapeIDCounter++;
+		cpShapeUpdate(shape, shape->body->transform);
+		shape->space = space;
+	}
+
+	if (cpSpatialIndexIsBBTree(space->staticShapes))
+	{
+		cpBBTreeInsertBulk(space->staticShapes, (void**)shapes, hashids, count, restructure);
+	}
+	else
+	{
+		for (int i = 0; i < count; i++) cpSpatialIndexInsert(space->staticShapes, shapes[i], hashids[i]);
+	}
+
+	cpfree(hashids);
+}
+
 cpBody*
 cpSpaceAddBody(cpSpace* space, cpBody* body)
 {
@@ -619,7 +721,27 @@ cpSpaceRemoveShape(cpSpace* space, cpShape* shape)
 
 	//cpBodyRemoveShape(body, shape);
 	cpSpaceFilterArbiters(space, body, shape);
-	cpSpatialIndexRemove(isStatic ? space->staticShapes : space->dynamicShapes, shape, shape->hashid);
+	cpSpaceSensorsRemoveShape(space, shape);
+
+	cpSpatialIndex* index = (isStatic ? space->staticShapes : space->dynamicShapes);
+	if (body->compound)
+	{
+		// The proxy keeps its old bounds until the next update, they still cover the remaining shapes.
+		cpShape* proxy = (cpShape*)body->compound;
+		cpCompoundShapeRemove(body->compound, shape);
+
+		if (body->compound->count == 0)
+		{
+			cpSpatialIndexRemove(index, proxy, proxy->hashid);
+			proxy->space = NULL;
+			proxy->hashid = 0;
+		}
+	}
+	else
+	{
+		cpSpatialIndexRemove(index, shape, shape->hashid);
+	}
+
 	shape->space = NULL;
 	shape->hashid = 0;
 }
@@ -748,7 +870,14 @@ typedef struct spaceShapeContext
 static void
 spaceEachShapeIterator(cpShape* shape, spaceShapeContext* context)
 {
-	context->func(shape, context->data);
+	if (cpShapeIsCompound(shape))
+	{
+		cpCompoundShapeEach((cpCompoundShape*)shape, (cpSpatialIndexIteratorFunc)spaceEachShapeIterator, context);
+	}
+	else
+	{
+		context->func(shape, context->data);
+	}
 }
 
 void
@@ -785,6 +914,9 @@ cpSpaceReindexStatic(cpSpace* space)
 
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)&cpShapeUpdateFunc, NULL);
 	cpSpatialIndexReindex(space->staticShapes);
+
+	// Static geometry is usually reindexed wholesale, so rebuild the tree from scratch while we are at it.
+	if (cpSpatialIndexIsBBTree(space->staticShapes)) cpBBTreeOptimize(space->staticShapes);
 }
 
 void
@@ -794,6 +926,14 @@ cpSpaceReindexShape(cpSpace* space, cpShape* shape)
 	{
 		cpAssertHard(!space->locked, "You cannot manually reindex objects while the space is locked. Wait until the current query or step is complete.");
 
+		// Compound shapes are reindexed through their body's proxy, the shape may have changed under the tree.
+		cpBody* body = shape->body;
+		if (body->compound && !cpShapeIsCompound(shape))
+		{
+			cpCompoundShapeChanged(body->compound);
+			shape = (cpShape*)body->compound;
+		}
+
 		cpShapeCacheBB(shape);
 
 		// attempt to rehash the shape in both hashes
@@ -805,7 +945,35 @@ cpSpaceReindexShape(cpSpace* space, cpShape* shape)
 void
 cpSpaceReindexShapesForBody(cpSpace* space, cpBody* body)
 {
-	CP_BODY_FOREACH_SHAPE(body, shape) cpSpaceReindexShape(space, shape);
+	cpShape* proxy = cpBodyCompoundProxy(body);
+	if (proxy)
+	{
+		cpSpaceReindexShape(space, proxy);
+	}
+	else
+	{
+		CP_BODY_FOREACH_SHAPE(body, shape) cpSpaceReindexShape(space, shape);
+	}
+}
+
+void
+cpSpaceMoveBodyShapes(cpSpace* space, cpBody* body, cpSpatialIndex* fromIndex, cpSpatialIndex* toIndex)
+{
+	(void)space;
+	cpShape* proxy = cpBodyCompoundProxy(body);
+	if (proxy)
+	{
+		cpSpatialIndexRemove(fromIndex, proxy, proxy->hashid);
+		cpSpatialIndexInsert(toIndex, proxy, proxy->hashid);
+	}
+	else
+	{
+		CP_BODY_FOREACH_SHAPE(body, shape)
+		{
+			cpSpatialIndexRemove(fromIndex, shape, shape->hashid);
+			cpSpatialIndexInsert(toIndex, shape, shape->hashid);
+		}
+	}
 }
 
 
@@ -821,6 +989,9 @@ cpSpaceUseSpatialHash(cpSpace* space, cpFloat dim, int count)
 	cpSpatialIndex* staticShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
 	cpSpatialIndex* dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
 
+	cpSpatialIndexSetWorkers(staticShapes, space->staticShapes->runWorkers, space->staticShapes->runWorkersData);
+	cpSpatialIndexSetWorkers(dynamicShapes, space->dynamicShapes->runWorkers, space->dynamicShapes->runWorkersData);
+
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
 	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
 
@@ -829,4 +1000,266 @@ cpSpaceUseSpatialHash(cpSpace* space, cpFloat dim, int count)
 
 	space->staticShapes = staticShapes;
 	space->dynamicShapes = dynamicShapes;
+
+	cpfree(space->indexTuner);
+	space->indexTuner = NULL;
+}
+
+//MARK: Spatial Index Auto Selection
+
+// Steps a candidate index gets to warm up after switching, and the steps it is then timed for.
+#define CP_SPACE_INDEX_WARMUP_STEPS 2
+#define CP_SPACE_INDEX_TRIAL_STEPS 20
+// How often the shape statistics are resampled once an index was chosen.
+#define CP_SPACE_INDEX_RESAMPLE_STEPS 240
+// Below this many dynamic shapes the timings are mostly noise, the tree is used.
+#define CP_SPACE_INDEX_MIN_SHAPES 64
+#define CP_SPACE_INDEX_HASH_CELLS_PER_SHAPE 10
+
+enum
+{
+	CP_SPACE_INDEX_BBTREE,
+	CP_SPACE_INDEX_HASH,
+	CP_SPACE_INDEX_SWEEP,
+	CP_SPACE_INDEX_KIND_COUNT,
+};
+
+typedef struct cpSpaceIndexStats
+{
+	int count;
+	// Average size of the shapes, distance they move per step and pairs per shape.
+	cpFloat extent, movement, pairs;
+} cpSpaceIndexStats;
+
+struct cpSpaceIndexTuner
+{
+	// Kind of the current dynamic index, -1 if it wasn't created by the tuner.
+	int current;
+	// Candidate being timed, -1 once one was chosen.
+	int trial;
+
+	int steps;
+	double start, elapsed;
+	double cost[CP_SPACE_INDEX_KIND_COUNT];
+
+	cpSpaceIndexStats stats;
+};
+
+// Monotonic time in seconds so clock adjustments don't skew the trials.
+static double
+TimeNow(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#endif
+}
+
+static void
+SampleShape(cpShape* shape, cpSpaceIndexStats* stats)
+{
+	cpBB bb = shape->bb;
+	stats->extent += cpfmax(bb.r - bb.l, bb.t - bb.b);
+	stats->movement += cpvlength(shape->body->v);
+	stats->count++;
+}
+
+static cpSpaceIndexStats
+SampleStats(cpSpace* space)
+{
+	cpSpaceIndexStats stats = { 0, 0.0f, 0.0f, 0.0f };
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)SampleShape, &stats);
+
+	if (stats.count > 0)
+	{
+		stats.extent /= stats.count;
+		stats.movement *= space->curr_dt / stats.count;
+		stats.pairs = (cpFloat)space->arbiters->num / stats.count;
+	}
+
+	return stats;
+}
+
+static cpBool
+ValueChanged(cpFloat a, cpFloat b, cpFloat epsilon)
+{
+	a += epsilon;
+	b += epsilon;
+	return (a > 2.0f * b || b > 2.0f * a);
+}
+
+static cpBool
+StatsChanged(cpSpaceIndexStats a, cpSpaceIndexStats b)
+{
+	// Movement and pair counts are compared relative to the shape size and a small baseline so idle worlds don't flicker.
+	cpFloat extent = cpfmax(b.extent, 1e-3f);
+	return (
+		ValueChanged((cpFloat)a.count, (cpFloat)b.count, 0.0f) ||
+		ValueChanged(a.extent, b.extent, 1e-3f) ||
+		ValueChanged(a.movement / extent, b.movement / extent, 0.05f) ||
+		ValueChanged(a.pairs, b.pairs, 0.25f)
+	);
+}
+
+static void
+UseIndex(cpSpace* space, cpSpaceIndexTuner* tuner, int kind)
+{
+	if (kind == tuner->current && kind != CP_SPACE_INDEX_HASH) return;
+
+	cpSpatialIndex* oldStatic = space->staticShapes;
+	cpSpatialIndex* oldDynamic = space->dynamicShapes;
+	cpSpatialIndexBBFunc bbfunc = (cpSpatialIndexBBFunc)cpShapeGetBB;
+
+	// A static tree hands out its leaf indexes through the dynamic tree, so it's rebuilt along with it.
+	cpBool rebuildStatic = cpSpatialIndexIsBBTree(oldStatic);
+	cpSpatialIndex* staticShapes = oldStatic;
+	if (rebuildStatic)
+	{
+		staticShapes = cpBBTreeNew(bbfunc, NULL);
+		cpBBTreeSetFilterFunc(staticShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+		cpSpatialIndexSetWorkers(staticShapes, oldStatic->runWorkers, oldStatic->runWorkersData);
+	}
+	else
+	{
+		oldStatic->dynamicIndex = NULL;
+	}
+
+	cpSpatialIndex* dynamicShapes;
+	switch (kind)
+	{
+	case CP_SPACE_INDEX_HASH:
+	{
+		cpSpaceIndexStats stats = tuner->stats;
+		cpFloat dim = (stats.extent > 0.0f ? stats.extent : 1.0f);
+		int cells = cpimax(stats.count * CP_SPACE_INDEX_HASH_CELLS_PER_SHAPE, 1000);
+		dynamicShapes = cpSpaceHashNew(dim, cells, bbfunc, staticShapes);
+		break;
+	}
+	case CP_SPACE_INDEX_SWEEP:
+		dynamicShapes = cpSweep1DNew(bbfunc, staticShapes);
+		break;
+	default:
+		dynamicShapes = cpBBTreeNew(bbfunc, staticShapes);
+		cpBBTreeSetVelocityFunc(dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+		cpBBTreeSetFilterFunc(dynamicShapes, (cpBBTreeFilterFunc)ShapeFilterFunc);
+		break;
+	}
+	cpSpatialIndexSetWorkers(dynamicShapes, oldDynamic->runWorkers, oldDynamic->runWorkersData);
+
+	if (rebuildStatic)
+	{
+		cpSpatialIndexEach(oldStatic, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+		cpBBTreeOptimize(staticShapes);
+		cpSpatialIndexFree(oldStatic);
+	}
+
+	cpSpatialIndexEach(oldDynamic, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	cpSpatialIndexFree(oldDynamic);
+
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+	tuner->current = kind;
+}
+
+static void
+NextTrial(cpSpace* space, cpSpaceIndexTuner* tuner)
+{
+	tuner->trial++;
+	tuner->steps = 0;
+	tuner->elapsed = 0.0;
+
+	if (tuner->trial < CP_SPACE_INDEX_KIND_COUNT)
+	{
+		UseIndex(space, tuner, tuner->trial);
+	}
+	else
+	{
+		int best = 0;
+		for (int i = 1; i < CP_SPACE_INDEX_KIND_COUNT; i++)
+		{
+			if (tuner->cost[i] < tuner->cost[best]) best = i;
+		}
+
+		tuner->trial = -1;
+		UseIndex(space, tuner, best);
+	}
+}
+
+static void
+BeginTrials(cpSpace* space, cpSpaceIndexTuner* tuner, cpSpaceIndexStats stats)
+{
+	tuner->stats = stats;
+
+	if (stats.count < CP_SPACE_INDEX_MIN_SHAPES)
+	{
+		tuner->trial = -1;
+		tuner->steps = 0;
+		UseIndex(space, tuner, CP_SPACE_INDEX_BBTREE);
+	}
+	else
+	{
+		tuner->trial = -1;
+		NextTrial(space, tuner);
+	}
+}
+
+void
+cpSpaceSetAutoSpatialIndex(cpSpace* space, cpBool enabled)
+{
+	cpAssertSpaceUnlocked(space);
+
+	if (!enabled)
+	{
+		cpfree(space->indexTuner);
+		space->indexTuner = NULL;
+	}
+	else if (!space->indexTuner)
+	{
+		cpSpaceIndexTuner* tuner = space->indexTuner = (cpSpaceIndexTuner*)cpcalloc(1, sizeof(cpSpaceIndexTuner));
+		tuner->current = (cpSpatialIndexIsBBTree(space->dynamicShapes) && cpSpatialIndexIsBBTree(space->staticShapes) ? CP_SPACE_INDEX_BBTREE : -1);
+		BeginTrials(space, tuner, SampleStats(space));
+	}
+}
+
+cpBool
+cpSpaceGetAutoSpatialIndex(const cpSpace* space)
+{
+	return (space->indexTuner != NULL);
+}
+
+void
+cpSpaceIndexTunerBegin(cpSpace* space)
+{
+	cpSpaceIndexTuner* tuner = space->indexTuner;
+	if (tuner && tuner->trial >= 0) tuner->start = TimeNow();
+}
+
+void
+cpSpaceIndexTunerEnd(cpSpace* space)
+{
+	cpSpaceIndexTuner* tuner = space->indexTuner;
+	if (!tuner) return;
+
+	tuner->steps++;
+	if (tuner->trial >= 0)
+	{
+		if (tuner->steps > CP_SPACE_INDEX_WARMUP_STEPS) tuner->elapsed += TimeNow() - tuner->start;
+
+		if (tuner->steps == CP_SPACE_INDEX_WARMUP_STEPS + CP_SPACE_INDEX_TRIAL_STEPS)
+		{
+			tuner->cost[tuner->trial] = tuner->elapsed;
+			NextTrial(space, tuner);
+		}
+	}
+	else if (tuner->steps % CP_SPACE_INDEX_RESAMPLE_STEPS == 0)
+	{
+		cpSpaceIndexStats stats = SampleStats(space);
+		if (StatsChanged(stats, tuner->stats)) BeginTrials(space, tuner, stats);
+	}
 }
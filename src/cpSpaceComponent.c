@@ -40,11 +40,7 @@ cpSpaceActivateBody(cpSpace* space, cpBody* body)
 		cpAssertSoft(body->sleeping.root == NULL && body->sleeping.next == NULL, "Internal error: Activating body non-NULL node pointers.");
 		cpArrayPush(space->dynamicBodies, body);
 
-		CP_BODY_FOREACH_SHAPE(body, shape)
-		{
-			cpSpatialIndexRemove(space->staticShapes, shape, shape->hashid);
-			cpSpatialIndexInsert(space->dynamicShapes, shape, shape->hashid);
-		}
+		cpSpaceMoveBodyShapes(space, body, space->staticShapes, space->dynamicShapes);
 
 		CP_BODY_FOREACH_ARBITER(body, arb)
 		{
@@ -65,10 +61,8 @@ cpSpaceActivateBody(cpSpace* space, cpBody* body)
 				cpSpacePushContacts(space, numContacts);
 
 				// Reinsert the arbiter into the arbiter cache
-				const cpShape* a = arb->a, * b = arb->b;
-				const cpShape* shape_pair[] = { a, b };
-				cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
-				cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, NULL, arb);
+				struct cpArbiterKey key = { arb->a, arb->b, arb->part };
+				cpHashSetInsert(space->cachedArbiters, cpArbiterKeyHash(&key), &key, NULL, arb);
 
 				// Update the arbiter's state
 				arb->stamp = space->stamp;
@@ -96,11 +90,7 @@ cpSpaceDeactivateBody(cpSpace* space, cpBody* body)
 
 	cpArrayDeleteObj(space->dynamicBodies, body);
 
-	CP_BODY_FOREACH_SHAPE(body, shape)
-	{
-		cpSpatialIndexRemove(space->dynamicShapes, shape, shape->hashid);
-		cpSpatialIndexInsert(space->staticShapes, shape, shape->hashid);
-	}
+	cpSpaceMoveBodyShapes(space, body, space->dynamicShapes, space->staticShapes);
 
 	CP_BODY_FOREACH_ARBITER(body, arb)
 	{
@@ -373,6 +363,8 @@ cpBodySleepWithGroup(cpBody* body, cpBody* group)
 		return;
 	}
 
+	cpShape* proxy = cpBodyCompoundProxy(body);
+	if (proxy) cpShapeCacheBB(proxy);
 	CP_BODY_FOREACH_SHAPE(body, shape) cpShapeCacheBB(shape);
 	cpSpaceDeactivateBody(space, body);
 
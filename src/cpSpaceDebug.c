@@ -23,6 +23,19 @@
 
 #ifndef CP_SPACE_DISABLE_DEBUG_API
 
+struct TilemapDrawContext
+{
+	cpSpaceDebugDrawOptions* options;
+	cpSpaceDebugColor color;
+};
+
+static void
+cpSpaceDebugDrawTilemapFace(cpShape* face, struct TilemapDrawContext* context)
+{
+	cpSegmentShape* seg = (cpSegmentShape*)face;
+	context->options->drawSegment(seg->ta, seg->tb, context->color, context->options->data);
+}
+
 static void
 cpSpaceDebugDrawShape(cpShape* shape, cpSpaceDebugDrawOptions* options)
 {
@@ -81,6 +94,24 @@ cpSpaceDebugDrawShape(cpShape* shape, cpSpaceDebugDrawOptions* options)
 
 		break;
 	}
+	case CP_BOX_SHAPE:
+	{
+		cpBoxShape* box = (cpBoxShape*)shape;
+
+		cpVect verts[4];
+		cpVect x = cpvmult(box->tx, box->th.x), y = cpvmult(cpvperp(box->tx), box->th.y);
+		for (int i = 0; i < 4; i++) verts[i] = cpBoxCorner(box->tc, x, y, i);
+		options->drawPolygon(4, verts, 0.0f, outline_color, fill_color, data);
+
+		break;
+	}
+	case CP_TILEMAP_SHAPE:
+	{
+		// Draw the merged faces the other shapes collide with.
+		struct TilemapDrawContext context = { options, outline_color };
+		cpTilemapShapeEachFace((cpTilemapShape*)shape, shape->bb, cpFalse, (cpTilemapFaceFunc)cpSpaceDebugDrawTilemapFace, &context);
+		break;
+	}
 	default: break;
 	}
 }
@@ -19,11 +19,14 @@
  * SOFTWARE.
  */
 
+#include <limits.h>
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 #include "prime.h"
 
-typedef struct cpSpaceHashBin cpSpaceHashBin;
 typedef struct cpHandle cpHandle;
+typedef struct CellRect CellRect;
 
 struct cpSpaceHash
 {
@@ -32,48 +35,45 @@ struct cpSpaceHash
 	int numcells;
 	cpFloat celldim;
 
-	cpSpaceHashBin** table;
+	// Objects are stored densely, 'handleSet' maps them to their index.
 	cpHashSet* handleSet;
-
-	cpSpaceHashBin* pooledBins;
 	cpArray* pooledHandles;
 	cpArray* allocatedBuffers;
 
-	cpTimestamp stamp;
+	int count, capacity;
+	cpHandle** handles;
+	cpBB* bbs;
+	CellRect* rects;
+
+	// The grid is rebuilt with a counting sort.
+	// The objects hashed to cell 'i' are cellObjects[cellStart[i]] to cellObjects[cellStart[i + 1] - 1].
+	int* cellStart;
+	int* cellMark;
+	int* cellObjects;
+	int cellObjectsCapacity;
+
+	// Objects added or moved since the grid was built aren't in it, queries check them directly until the next rebuild.
+	// Removed objects leave a NULL hole so the indexes in the grid stay valid.
+	int* pending;
+	int pendingCount;
+
+	// Objects were added, removed or moved since the grid was built.
+	cpBool dirty;
 };
 
+struct CellRect
+{
+	int l, b, r, t;
+};
 
 //MARK: Handle Functions
 
 struct cpHandle
 {
 	void* obj;
-	int retain;
-	cpTimestamp stamp;
+	int index;
 };
 
-static cpHandle*
-cpHandleInit(cpHandle* hand, void* obj)
-{
-	hand->obj = obj;
-	hand->retain = 0;
-	hand->stamp = 0;
-
-	return hand;
-}
-
-static inline void cpHandleRetain(cpHandle* hand)
-{
-	hand->retain++;
-}
-
-static inline void
-cpHandleRelease(cpHandle* hand, cpArray* pooledHandles)
-{
-	hand->retain--;
-	if (hand->retain == 0) cpArrayPush(pooledHandles, hand);
-}
-
 static int handleSetEql(void* obj, cpHandle* hand)
 {
 	return (obj == hand->obj);
@@ -94,76 +94,13 @@ handleSetTrans(void* obj, cpSpaceHash* hash)
 		for (int i = 0; i < count; i++) cpArrayPush(hash->pooledHandles, buffer + i);
 	}
 
-	cpHandle* hand = cpHandleInit((cpHandle*)cpArrayPop(hash->pooledHandles), obj);
-	cpHandleRetain(hand);
+	cpHandle* hand = (cpHandle*)cpArrayPop(hash->pooledHandles);
+	hand->obj = obj;
+	hand->index = -1;
 
 	return hand;
 }
 
-//MARK: Bin Functions
-
-struct cpSpaceHashBin
-{
-	cpHandle* handle;
-	cpSpaceHashBin* next;
-};
-
-static inline void
-recycleBin(cpSpaceHash* hash, cpSpaceHashBin* bin)
-{
-	bin->next = hash->pooledBins;
-	hash->pooledBins = bin;
-}
-
-static inline void
-clearTableCell(cpSpaceHash* hash, int idx)
-{
-	cpSpaceHashBin* bin = hash->table[idx];
-	while (bin)
-	{
-		cpSpaceHashBin* next = bin->next;
-
-		cpHandleRelease(bin->handle, hash->pooledHandles);
-		recycleBin(hash, bin);
-
-		bin = next;
-	}
-
-	hash->table[idx] = NULL;
-}
-
-static void
-clearTable(cpSpaceHash* hash)
-{
-	for (int i = 0; i < hash->numcells; i++) clearTableCell(hash, i);
-}
-
-// Get a recycled or new bin.
-static inline cpSpaceHashBin*
-getEmptyBin(cpSpaceHash* hash)
-{
-	cpSpaceHashBin* bin = hash->pooledBins;
-
-	if (bin)
-	{
-		hash->pooledBins = bin->next;
-		return bin;
-	}
-	else
-	{
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES / sizeof(cpSpaceHashBin);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-
-		cpSpaceHashBin* buffer = (cpSpaceHashBin*)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(hash->allocatedBuffers, buffer);
-
-		// push all but the first one, return the first instead
-		for (int i = 1; i < count; i++) recycleBin(hash, buffer + i);
-		return buffer;
-	}
-}
-
 //MARK: Memory Management Functions
 
 cpSpaceHash*
@@ -172,14 +109,26 @@ cpSpaceHashAlloc(void)
 	return (cpSpaceHash*)cpcalloc(1, sizeof(cpSpaceHash));
 }
 
-// Frees the old table, and allocate a new one.
+// Frees the old cell arrays, and allocate new ones.
 static void
 cpSpaceHashAllocTable(cpSpaceHash* hash, int numcells)
 {
-	cpfree(hash->table);
+	cpfree(hash->cellStart);
+	cpfree(hash->cellMark);
 
 	hash->numcells = numcells;
-	hash->table = (cpSpaceHashBin**)cpcalloc(numcells, sizeof(cpSpaceHashBin*));
+	hash->cellStart = (int*)cpcalloc(numcells + 1, sizeof(int));
+	hash->cellMark = (int*)cpcalloc(numcells, sizeof(int));
+}
+
+static void
+ResizeObjects(cpSpaceHash* hash, int capacity)
+{
+	hash->capacity = capacity;
+	hash->handles = (cpHandle**)cprealloc(hash->handles, capacity * sizeof(cpHandle*));
+	hash->bbs = (cpBB*)cprealloc(hash->bbs, capacity * sizeof(cpBB));
+	hash->rects = (CellRect*)cprealloc(hash->rects, capacity * sizeof(CellRect));
+	hash->pending = (int*)cprealloc(hash->pending, capacity * sizeof(int));
 }
 
 static inline cpSpatialIndexClass* Klass(void);
@@ -189,17 +138,26 @@ cpSpaceHashInit(cpSpaceHash* hash, cpFloat celldim, int numcells, cpSpatialIndex
 {
 	cpSpatialIndexInit((cpSpatialIndex*)hash, Klass(), bbfunc, staticIndex);
 
+	hash->cellStart = hash->cellMark = NULL;
 	cpSpaceHashAllocTable(hash, next_prime(numcells));
 	hash->celldim = celldim;
 
 	hash->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql);
 
 	hash->pooledHandles = cpArrayNew(0);
-
-	hash->pooledBins = NULL;
 	hash->allocatedBuffers = cpArrayNew(0);
 
-	hash->stamp = 1;
+	hash->count = hash->capacity = 0;
+	hash->handles = NULL;
+	hash->bbs = NULL;
+	hash->rects = NULL;
+	hash->pending = NULL;
+	hash->pendingCount = 0;
+	hash->dirty = cpFalse;
+	ResizeObjects(hash, 32);
+
+	hash->cellObjects = NULL;
+	hash->cellObjectsCapacity = 0;
 
 	return (cpSpatialIndex*)hash;
 }
@@ -213,8 +171,14 @@ cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatia
 static void
 cpSpaceHashDestroy(cpSpaceHash* hash)
 {
-	if (hash->table) clearTable(hash);
-	cpfree(hash->table);
+	cpfree(hash->cellStart);
+	cpfree(hash->cellMark);
+	cpfree(hash->cellObjects);
+
+	cpfree(hash->handles);
+	cpfree(hash->bbs);
+	cpfree(hash->rects);
+	cpfree(hash->pending);
 
 	cpHashSetFree(hash->handleSet);
 
@@ -225,18 +189,6 @@ cpSpaceHashDestroy(cpSpaceHash* hash)
 
 //MARK: Helper Functions
 
-static inline cpBool
-containsHandle(cpSpaceHashBin* bin, cpHandle* hand)
-{
-	while (bin)
-	{
-		if (bin->handle == hand) return cpTrue;
-		bin = bin->next;
-	}
-
-	return cpFalse;
-}
-
 // The hash function itself.
 static inline cpHashValue
 hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
@@ -253,35 +205,138 @@ floor_int(cpFloat f)
 	return (f < 0.0f && f != i ? i - 1 : i);
 }
 
-static inline void
-hashHandle(cpSpaceHash* hash, cpHandle* hand, cpBB bb)
+static inline CellRect
+CellRectForBB(cpSpaceHash* hash, cpBB bb)
 {
 	// Find the dimensions in cell coordinates.
 	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l / dim); // Fix by ShiftZ
-	int r = floor_int(bb.r / dim);
-	int b = floor_int(bb.b / dim);
-	int t = floor_int(bb.t / dim);
+	CellRect rect = {
+		floor_int(bb.l / dim), // Fix by ShiftZ
+		floor_int(bb.b / dim),
+		floor_int(bb.r / dim),
+		floor_int(bb.t / dim),
+	};
+
+	return rect;
+}
+
+static inline cpBool
+CellRectContains(CellRect rect, int x, int y)
+{
+	return (rect.l <= x && x <= rect.r && rect.b <= y && y <= rect.t);
+}
+
+// Objects out of the grid get an empty rect so its cells skip them.
+static const CellRect EmptyRect = { 0, 0, -1, -1 };
+
+// Take an object out of the grid until the next rebuild.
+static inline void
+MarkPending(cpSpaceHash* hash, int i)
+{
+	if (hash->rects[i].l <= hash->rects[i].r)
+	{
+		hash->rects[i] = EmptyRect;
+		hash->pending[hash->pendingCount++] = i;
+	}
+
+	hash->dirty = cpTrue;
+}
+
+// Rebuild the grid from scratch. Two passes over the objects, no per cell allocations.
+static void
+cpSpaceHashRebuild(cpSpaceHash* hash)
+{
+	// Compact the holes left by removed objects.
+	int count = 0;
+	for (int i = 0; i < hash->count; i++)
+	{
+		cpHandle* hand = hash->handles[i];
+		if (hand)
+		{
+			hand->index = count;
+			hash->handles[count++] = hand;
+		}
+	}
+
+	hash->count = count;
+	hash->pendingCount = 0;
 
 	int n = hash->numcells;
-	for (int i = l; i <= r; i++)
+
+	int* cellStart = hash->cellStart;
+	int* cellMark = hash->cellMark;
+	memset(cellStart, 0, (n + 1) * sizeof(int));
+
+	// Count the objects in each cell.
+	// Several cells of an object can hash to the same index, 'cellMark' makes sure it's only counted once.
+	int total = 0;
+	for (int i = 0; i < count; i++)
 	{
-		for (int j = b; j <= t; j++)
+		cpBB bb = hash->bbs[i] = hash->spatialIndex.bbfunc(hash->handles[i]->obj);
+		CellRect rect = hash->rects[i] = CellRectForBB(hash, bb);
+
+		for (int x = rect.l; x <= rect.r; x++)
 		{
-			cpHashValue idx = hash_func(i, j, n);
-			cpSpaceHashBin* bin = hash->table[idx];
-
-			// Don't add an object twice to the same cell.
-			if (containsHandle(bin, hand)) continue;
-
-			cpHandleRetain(hand);
-			// Insert a new bin for the handle in this cell.
-			cpSpaceHashBin* newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			hash->table[idx] = newBin;
+			for (int y = rect.b; y <= rect.t; y++)
+			{
+				cpHashValue idx = hash_func(x, y, n);
+				if (cellMark[idx] != i + 1)
+				{
+					cellMark[idx] = i + 1;
+					cellStart[idx]++;
+					total++;
+				}
+			}
 		}
 	}
+
+	if (total > hash->cellObjectsCapacity)
+	{
+		hash->cellObjectsCapacity = cpimax(total, 2 * hash->cellObjectsCapacity);
+		cpfree(hash->cellObjects);
+		hash->cellObjects = (int*)cpcalloc(hash->cellObjectsCapacity, sizeof(int));
+	}
+
+	// Inclusive prefix sum, filling in the objects walks them back to the start of each cell.
+	for (int i = 0, sum = 0; i < n; i++)
+	{
+		sum += cellStart[i];
+		cellStart[i] = sum;
+	}
+	cellStart[n] = total;
+
+	// Fill in reverse so each cell ends up sorted by object index.
+	int* cellObjects = hash->cellObjects;
+	for (int i = count - 1; i >= 0; i--)
+	{
+		CellRect rect = hash->rects[i];
+		for (int x = rect.l; x <= rect.r; x++)
+		{
+			for (int y = rect.b; y <= rect.t; y++)
+			{
+				cpHashValue idx = hash_func(x, y, n);
+				if (cellMark[idx] != -(i + 1))
+				{
+					cellMark[idx] = -(i + 1);
+					cellObjects[--cellStart[idx]] = i;
+				}
+			}
+		}
+	}
+
+	hash->dirty = cpFalse;
+}
+
+static inline void
+cpSpaceHashUpdate(cpSpaceHash* hash)
+{
+	if (hash->dirty) cpSpaceHashRebuild(hash);
+}
+
+void
+cpSpaceHashFlush(cpSpatialIndex* index)
+{
+	if (index && index->klass == Klass()) cpSpaceHashUpdate((cpSpaceHash*)index);
 }
 
 //MARK: Basic Operations
@@ -290,34 +345,32 @@ static void
 cpSpaceHashInsert(cpSpaceHash* hash, void* obj, cpHashValue hashid)
 {
 	cpHandle* hand = (cpHandle*)cpHashSetInsert(hash->handleSet, hashid, obj, (cpHashSetTransFunc)handleSetTrans, hash);
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(obj));
-}
+	if (hand->index >= 0) return;
 
-static void
-cpSpaceHashRehashObject(cpSpaceHash* hash, void* obj, cpHashValue hashid)
-{
-	cpHandle* hand = (cpHandle*)cpHashSetRemove(hash->handleSet, hashid, obj);
+	// Reclaim the holes of removed objects before growing.
+	if (hash->count == hash->capacity && hash->dirty) cpSpaceHashRebuild(hash);
+	if (hash->count == hash->capacity) ResizeObjects(hash, 2 * hash->capacity);
 
-	if (hand)
-	{
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
+	int index = hand->index = hash->count++;
+	hash->handles[index] = hand;
 
-		cpSpaceHashInsert(hash, obj, hashid);
-	}
+	hash->rects[index] = EmptyRect;
+	hash->pending[hash->pendingCount++] = index;
+
+	hash->dirty = cpTrue;
 }
 
 static void
-rehash_helper(cpHandle* hand, cpSpaceHash* hash)
+cpSpaceHashRehashObject(cpSpaceHash* hash, void* obj, cpHashValue hashid)
 {
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(hand->obj));
+	cpHandle* hand = (cpHandle*)cpHashSetFind(hash->handleSet, hashid, obj);
+	if (hand) MarkPending(hash, hand->index);
 }
 
 static void
 cpSpaceHashRehash(cpSpaceHash* hash)
 {
-	clearTable(hash);
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)rehash_helper, hash);
+	cpSpaceHashRebuild(hash);
 }
 
 static void
@@ -327,201 +380,124 @@ cpSpaceHashRemove(cpSpaceHash* hash, void* obj, cpHashValue hashid)
 
 	if (hand)
 	{
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
-	}
-}
+		// Leave a hole until the next rebuild, moving another object into it would invalidate the grid.
+		int index = hand->index;
+		hash->handles[index] = NULL;
+		hash->rects[index] = EmptyRect;
 
-typedef struct eachContext
-{
-	cpSpatialIndexIteratorFunc func;
-	void* data;
-} eachContext;
+		hand->obj = NULL;
+		cpArrayPush(hash->pooledHandles, hand);
 
-static void eachHelper(cpHandle* hand, eachContext* context)
-{
-	context->func(hand->obj, context->data);
+		hash->dirty = cpTrue;
+	}
 }
 
 static void
 cpSpaceHashEach(cpSpaceHash* hash, cpSpatialIndexIteratorFunc func, void* data)
 {
-	eachContext context = { func, data };
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)eachHelper, &context);
-}
-
-static void
-remove_orphaned_handles(cpSpaceHash* hash, cpSpaceHashBin** bin_ptr)
-{
-	cpSpaceHashBin* bin = *bin_ptr;
-	while (bin)
+	cpHandle** handles = hash->handles;
+	for (int i = 0, count = hash->count; i < count; i++)
 	{
-		cpHandle* hand = bin->handle;
-		cpSpaceHashBin* next = bin->next;
-
-		if (!hand->obj)
-		{
-			// orphaned handle, unlink and recycle the bin
-			(*bin_ptr) = bin->next;
-			recycleBin(hash, bin);
-
-			cpHandleRelease(hand, hash->pooledHandles);
-		}
-		else
-		{
-			bin_ptr = &bin->next;
-		}
-
-		bin = next;
+		if (handles[i]) func(handles[i]->obj, data);
 	}
 }
 
 //MARK: Query Functions
 
-static inline void
-query_helper(cpSpaceHash* hash, cpSpaceHashBin** bin_ptr, void* obj, cpSpatialIndexQueryFunc func, void* data)
+static void
+cpSpaceHashQuery(cpSpaceHash* hash, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, void* data)
 {
-restart:
-	for (cpSpaceHashBin* bin = *bin_ptr; bin; bin = bin->next)
+	// Queries never rebuild the grid so they stay read only. Check the objects that aren't in it directly.
+	for (int k = 0; k < hash->pendingCount; k++)
 	{
-		cpHandle* hand = bin->handle;
-		void* other = hand->obj;
-
-		if (hand->stamp == hash->stamp || obj == other)
-		{
-			continue;
-		}
-		else if (other)
-		{
-			func(obj, other, 0, data);
-			hand->stamp = hash->stamp;
-		}
-		else
-		{
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
+		cpHandle* hand = hash->handles[hash->pending[k]];
+		if (hand && obj != hand->obj && cpBBIntersects(bb, hash->spatialIndex.bbfunc(hand->obj))) func(obj, hand->obj, 0, data);
 	}
-}
 
-static void
-cpSpaceHashQuery(cpSpaceHash* hash, void* obj, cpBB bb, cpSpatialIndexQueryFunc func, void* data)
-{
-	// Get the dimensions in cell coordinates.
-	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l / dim);  // Fix by ShiftZ
-	int r = floor_int(bb.r / dim);
-	int b = floor_int(bb.b / dim);
-	int t = floor_int(bb.t / dim);
+	CellRect rect = CellRectForBB(hash, bb);
 
 	int n = hash->numcells;
-	cpSpaceHashBin** table = hash->table;
+	int* cellStart = hash->cellStart;
+	int* cellObjects = hash->cellObjects;
+	CellRect* rects = hash->rects;
 
 	// Iterate over the cells and query them.
-	for (int i = l; i <= r; i++)
+	for (int x = rect.l; x <= rect.r; x++)
 	{
-		for (int j = b; j <= t; j++)
+		for (int y = rect.b; y <= rect.t; y++)
 		{
-			query_helper(hash, &table[hash_func(i, j, n)], obj, func, data);
+			cpHashValue idx = hash_func(x, y, n);
+			for (int k = cellStart[idx], end = cellStart[idx + 1]; k < end; k++)
+			{
+				int i = cellObjects[k];
+
+				// Like the pairs in cpSpaceHashReindexQuery(), objects are only reported by the lower left cell of the overlap.
+				// Queries don't need to write any stamps this way, and can run on several threads at once.
+				CellRect r = rects[i];
+				if (x != cpimax(rect.l, r.l) || y != cpimax(rect.b, r.b) || !CellRectContains(r, x, y)) continue;
+
+				void* other = hash->handles[i]->obj;
+				if (obj != other && cpBBIntersects(bb, hash->bbs[i])) func(obj, other, 0, data);
+			}
 		}
 	}
-
-	hash->stamp++;
 }
 
-// Similar to struct eachPair above.
-typedef struct queryRehashContext
-{
-	cpSpaceHash* hash;
-	cpSpatialIndexQueryFunc func;
-	void* data;
-} queryRehashContext;
-
-// Hashset iterator func used with cpSpaceHashQueryRehash().
 static void
-queryRehash_helper(cpHandle* hand, queryRehashContext* context)
+cpSpaceHashReindexQuery(cpSpaceHash* hash, cpSpatialIndexQueryFunc func, void* data)
 {
-	cpSpaceHash* hash = context->hash;
-	cpSpatialIndexQueryFunc func = context->func;
-	void* data = context->data;
+	cpSpaceHashRebuild(hash);
 
-	cpFloat dim = hash->celldim;
 	int n = hash->numcells;
+	int* cellStart = hash->cellStart;
+	int* cellObjects = hash->cellObjects;
+	cpHandle** handles = hash->handles;
+	CellRect* rects = hash->rects;
+	cpBB* bbs = hash->bbs;
 
-	void* obj = hand->obj;
-	cpBB bb = hash->spatialIndex.bbfunc(obj);
-
-	int l = floor_int(bb.l / dim);
-	int r = floor_int(bb.r / dim);
-	int b = floor_int(bb.b / dim);
-	int t = floor_int(bb.t / dim);
-
-	cpSpaceHashBin** table = hash->table;
-
-	for (int i = l; i <= r; i++)
+	for (int idx = 0; idx < n; idx++)
 	{
-		for (int j = b; j <= t; j++)
+		int start = cellStart[idx], end = cellStart[idx + 1];
+		for (int ka = start; ka < end; ka++)
 		{
-			cpHashValue idx = hash_func(i, j, n);
-			cpSpaceHashBin* bin = table[idx];
+			int a = cellObjects[ka];
+			CellRect ra = rects[a];
 
-			if (containsHandle(bin, hand)) continue;
+			for (int kb = ka + 1; kb < end; kb++)
+			{
+				int b = cellObjects[kb];
+				CellRect rb = rects[b];
 
-			cpHandleRetain(hand); // this MUST be done first in case the object is removed in func()
-			query_helper(hash, &bin, obj, func, data);
+				// A pair is only reported by the cell holding the lower left corner of the overlap of their cells.
+				int x = cpimax(ra.l, rb.l), y = cpimax(ra.b, rb.b);
+				if (x > cpimin(ra.r, rb.r) || y > cpimin(ra.t, rb.t)) continue;
+				if (hash_func(x, y, n) != (cpHashValue)idx) continue;
 
-			cpSpaceHashBin* newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			table[idx] = newBin;
+				if (cpBBIntersects(bbs[a], bbs[b])) func(handles[a]->obj, handles[b]->obj, 0, data);
+			}
 		}
 	}
 
-	// Increment the stamp for each object hashed.
-	hash->stamp++;
-}
-
-static void
-cpSpaceHashReindexQuery(cpSpaceHash* hash, cpSpatialIndexQueryFunc func, void* data)
-{
-	clearTable(hash);
-
-	queryRehashContext context = { hash, func, data };
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)queryRehash_helper, &context);
-
 	cpSpatialIndexCollideStatic((cpSpatialIndex*)hash, hash->spatialIndex.staticIndex, func, data);
 }
 
 static inline cpFloat
-segmentQuery_helper(cpSpaceHash* hash, cpSpaceHashBin** bin_ptr, void* obj, cpSpatialIndexSegmentQueryFunc func, void* data)
+segmentQuery_helper(cpSpaceHash* hash, int x, int y, int prev_x, int prev_y, void* obj, cpSpatialIndexSegmentQueryFunc func, void* data)
 {
 	cpFloat t = 1.0f;
 
-restart:
-	for (cpSpaceHashBin* bin = *bin_ptr; bin; bin = bin->next)
+	cpHashValue idx = hash_func(x, y, hash->numcells);
+	int* cellObjects = hash->cellObjects;
+	for (int k = hash->cellStart[idx], end = hash->cellStart[idx + 1]; k < end; k++)
 	{
-		cpHandle* hand = bin->handle;
-		void* other = hand->obj;
+		int i = cellObjects[k];
 
-		// Skip over certain conditions
-		if (hand->stamp == hash->stamp)
-		{
-			continue;
-		}
-		else if (other)
-		{
-			t = cpfmin(t, func(obj, other, data));
-			hand->stamp = hash->stamp;
-		}
-		else
-		{
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
+		// The walk never re-enters an object's cells once it leaves them.
+		// Only report it from the first cell of the walk inside them, which is when the previous cell was outside.
+		CellRect r = hash->rects[i];
+		if (!CellRectContains(r, x, y) || CellRectContains(r, prev_x, prev_y)) continue;
+
+		t = cpfmin(t, func(obj, hash->handles[i]->obj, data));
 	}
 
 	return t;
@@ -531,6 +507,13 @@ restart:
 static void
 cpSpaceHashSegmentQuery(cpSpaceHash* hash, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void* data)
 {
+	// Queries never rebuild the grid so they stay read only. Check the objects that aren't in it directly.
+	for (int k = 0; k < hash->pendingCount; k++)
+	{
+		cpHandle* hand = hash->handles[hash->pending[k]];
+		if (hand && cpBBSegmentQuery(hash->spatialIndex.bbfunc(hand->obj), a, b, r) < t_exit) t_exit = cpfmin(t_exit, func(obj, hand->obj, data));
+	}
+
 	a = cpvmult(a, 1.0f / hash->celldim);
 	b = cpvmult(b, 1.0f / hash->celldim);
 
@@ -571,13 +554,14 @@ cpSpaceHashSegmentQuery(cpSpaceHash* hash, void* obj, cpVect a, cpVect b, cpFloa
 	cpFloat next_h = (temp_h ? temp_h * dt_dx : dt_dx);
 	cpFloat next_v = (temp_v ? temp_v * dt_dy : dt_dy);
 
-	int n = hash->numcells;
-	cpSpaceHashBin** table = hash->table;
+	// No object's cells contain the cell before the first one.
+	int prev_x = INT_MIN, prev_y = INT_MIN;
 
 	while (t < t_exit)
 	{
-		cpHashValue idx = hash_func(cell_x, cell_y, n);
-		t_exit = cpfmin(t_exit, segmentQuery_helper(hash, &table[idx], obj, func, data));
+		t_exit = cpfmin(t_exit, segmentQuery_helper(hash, cell_x, cell_y, prev_x, prev_y, obj, func, data));
+		prev_x = cell_x;
+		prev_y = cell_y;
 
 		if (next_v < next_h)
 		{
@@ -592,8 +576,6 @@ cpSpaceHashSegmentQuery(cpSpaceHash* hash, void* obj, cpVect a, cpVect b, cpFloa
 			next_h += dt_dx;
 		}
 	}
-
-	hash->stamp++;
 }
 
 //MARK: Misc
@@ -607,10 +589,9 @@ cpSpaceHashResize(cpSpaceHash* hash, cpFloat celldim, int numcells)
 		return;
 	}
 
-	clearTable(hash);
-
 	hash->celldim = celldim;
 	cpSpaceHashAllocTable(hash, next_prime(numcells));
+	cpSpaceHashRebuild(hash);
 }
 
 static int
@@ -667,6 +648,8 @@ cpSpaceHashRenderDebug(cpSpatialIndex* index)
 	}
 
 	cpSpaceHash* hash = (cpSpaceHash*)index;
+	cpSpaceHashUpdate(hash);
+
 	cpBB bb = cpBBNew(-320, -240, 320, 240);
 
 	cpFloat dim = hash->celldim;
@@ -681,11 +664,8 @@ cpSpaceHashRenderDebug(cpSpatialIndex* index)
 	{
 		for (int j = b; j <= t; j++)
 		{
-			int cell_count = 0;
-
 			int index = hash_func(i, j, n);
-			for (cpSpaceHashBin* bin = hash->table[index]; bin; bin = bin->next)
-				cell_count++;
+			int cell_count = hash->cellStart[index + 1] - hash->cellStart[index];
 
 			GLfloat v = 1.0f - (GLfloat)cell_count / 10.0f;
 			glColor3f(v, v, v);
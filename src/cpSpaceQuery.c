@@ -21,6 +21,167 @@
 
 #include "chipmunk/chipmunk_private.h"
 
+//MARK: Index Queries
+
+// Compound bodies only have a proxy in the spatial indexes. These query the indexes and look through the proxies to their shapes.
+
+struct IndexQueryContext
+{
+	void* obj;
+	cpBB bb;
+	cpSpatialIndexQueryFunc func;
+	cpSpatialIndexBBQueryFunc bbfunc;
+	void* data;
+};
+
+static cpCollisionID
+IndexQueryFunc(struct IndexQueryContext* context, cpShape* shape, cpCollisionID id, void* unused)
+{
+	(void)unused;
+	if (!cpShapeIsCompound(shape)) return context->func(context->obj, shape, id, context->data);
+
+	cpCompoundShapeQuery((cpCompoundShape*)shape, context->obj, context->bb, context->func, context->data);
+	return id;
+}
+
+static void
+IndexQuery(cpSpatialIndex* index, void* obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexQueryFunc func, void* data)
+{
+	struct IndexQueryContext context = { obj, bb, func, NULL, data };
+	cpBBTreeQueryFiltered(index, &context, bb, layer, mask, (cpSpatialIndexQueryFunc)IndexQueryFunc, NULL);
+}
+
+static cpBool
+IndexBBQueryFunc(struct IndexQueryContext* context, cpShape* shape, void* unused)
+{
+	(void)unused;
+	if (!cpShapeIsCompound(shape)) return context->bbfunc(context->obj, shape, context->data);
+	return cpCompoundShapeBBQuery((cpCompoundShape*)shape, context->obj, context->bb, context->bbfunc, context->data);
+}
+
+static void
+IndexBBQuery(cpSpatialIndex* index, void* obj, cpBB bb, cpBitmask layer, cpBitmask mask, cpSpatialIndexBBQueryFunc func, void* data)
+{
+	struct IndexQueryContext context = { obj, bb, NULL, func, data };
+	cpBBTreeBBQueryFiltered(index, &context, bb, layer, mask, (cpSpatialIndexBBQueryFunc)IndexBBQueryFunc, NULL);
+}
+
+struct IndexSegmentQueryContext
+{
+	void* obj;
+	cpVect a, b;
+	cpFloat r;
+	// Tracks the index's exit time so the compounds can prune with it.
+	cpFloat t_exit;
+	cpSpatialIndexSegmentQueryFunc func;
+	void* data;
+};
+
+static cpFloat
+IndexSegmentQueryFunc(struct IndexSegmentQueryContext* context, cpShape* shape, void* unused)
+{
+	(void)unused;
+	cpFloat t = (
+		cpShapeIsCompound(shape) ?
+		cpCompoundShapeSegmentQuery((cpCompoundShape*)shape, context->obj, context->a, context->b, context->r, context->t_exit, context->func, context->data) :
+		context->func(context->obj, shape, context->data)
+		);
+
+	context->t_exit = cpfmin(context->t_exit, t);
+	return t;
+}
+
+static void
+IndexSegmentQuery(cpSpatialIndex* index, void* obj, cpVect a, cpVect b, cpFloat r, cpFloat t_exit, cpBitmask layer, cpBitmask mask, cpSpatialIndexSegmentQueryFunc func, void* data)
+{
+	struct IndexSegmentQueryContext context = { obj, a, b, r, t_exit, func, data };
+	cpBBTreeSegmentQueryFiltered(index, &context, a, b, r, t_exit, layer, mask, (cpSpatialIndexSegmentQueryFunc)IndexSegmentQueryFunc, NULL);
+}
+
+struct IndexNearestQueryContext
+{
+	void* obj;
+	cpVect point;
+	// Tracks the index's search radius so the compounds can prune with it.
+	cpFloat maxDistance;
+	cpBBTreeNearestFunc func;
+	void* data;
+};
+
+static cpFloat
+IndexNearestQueryFunc(struct IndexNearestQueryContext* context, cpShape* shape, void* unused)
+{
+	(void)unused;
+	cpFloat bound = (
+		cpShapeIsCompound(shape) ?
+		cpCompoundShapeNearestQuery((cpCompoundShape*)shape, context->obj, context->point, context->maxDistance, context->func, context->data) :
+		context->func(context->obj, shape, context->data)
+		);
+
+	if (bound < context->maxDistance) context->maxDistance = bound;
+	return bound;
+}
+
+static void
+IndexNearestQuery(cpSpatialIndex* index, void* obj, cpVect point, cpFloat maxDistance, cpBitmask layer, cpBitmask mask, cpBBTreeNearestFunc func, void* data)
+{
+	struct IndexNearestQueryContext context = { obj, point, maxDistance, func, data };
+	cpBBTreeNearestQuery(index, &context, point, maxDistance, layer, mask, (cpBBTreeNearestFunc)IndexNearestQueryFunc, NULL);
+}
+
+struct IndexSegmentPacketContext
+{
+	void* obj;
+	const cpVect* a, * b;
+	const cpFloat* r;
+	cpFloat t_exit[CP_BBTREE_PACKET_SIZE];
+	cpBBTreeSegmentPacketFunc func;
+	void* data;
+};
+
+// A single lane of a packet, traced through a compound on its own.
+struct IndexSegmentLane
+{
+	struct IndexSegmentPacketContext* context;
+	int lane;
+};
+
+static cpFloat
+IndexSegmentLaneFunc(struct IndexSegmentLane* lane, cpShape* shape, void* unused)
+{
+	(void)unused;
+	struct IndexSegmentPacketContext* context = lane->context;
+	return context->func(context->obj, shape, lane->lane, context->data);
+}
+
+static cpFloat
+IndexSegmentPacketFunc(struct IndexSegmentPacketContext* context, cpShape* shape, int lane, void* unused)
+{
+	(void)unused;
+	cpFloat t;
+	if (cpShapeIsCompound(shape))
+	{
+		struct IndexSegmentLane adapter = { context, lane };
+		t = cpCompoundShapeSegmentQuery((cpCompoundShape*)shape, &adapter, context->a[lane], context->b[lane], context->r[lane], context->t_exit[lane], (cpSpatialIndexSegmentQueryFunc)IndexSegmentLaneFunc, NULL);
+	}
+	else
+	{
+		t = context->func(context->obj, shape, lane, context->data);
+	}
+
+	context->t_exit[lane] = cpfmin(context->t_exit[lane], t);
+	return t;
+}
+
+static void
+IndexSegmentQueryPacket(cpSpatialIndex* index, void* obj, int count, const cpVect* a, const cpVect* b, const cpFloat* r, cpFloat* t_exit, const cpBitmask* layers, const cpBitmask* masks, cpBBTreeSegmentPacketFunc func, void* data)
+{
+	struct IndexSegmentPacketContext context = { obj, a, b, r, { 0.0f }, func, data };
+	for (int i = 0; i < count; i++) context.t_exit[i] = t_exit[i];
+
+	cpBBTreeSegmentQueryPacket(index, &context, count, a, b, r, t_exit, layers, masks, (cpBBTreeSegmentPacketFunc)IndexSegmentPacketFunc, NULL);
+}
+
  //MARK: Nearest Point Query Functions
 
 typedef struct PointQueryMeta PointQueryMeta;
@@ -55,11 +216,12 @@ void cpSpacePointQuery(cpSpace* space, cpVect point, cpFloat maxDistance, cpShap
 	struct PointQueryContext context = { point, maxDistance, filter, func };
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
 
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+	IndexQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+	IndexQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
 }
 
-static cpCollisionID NearestPointQueryNearest(struct PointQueryContext* context, cpShape* shape, cpCollisionID id, cpPointQueryInfo* out)
+static cpFloat
+NearestPointQueryNearest(struct PointQueryContext* context, cpShape* shape, cpPointQueryInfo* out)
 {
 	if (!cpShapeFilterReject(shape->filter, context->filter) && !shape->sensor)
 	{
@@ -69,7 +231,7 @@ static cpCollisionID NearestPointQueryNearest(struct PointQueryContext* context,
 		if (info.distance < out->distance) (*out) = info;
 	}
 
-	return id;
+	return out->distance;
 }
 
 cpShape*
@@ -91,9 +253,8 @@ cpSpacePointQueryNearest(cpSpace* space, cpVect point, cpFloat maxDistance, cpSh
 		NULL
 	};
 
-	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	IndexNearestQuery(space->dynamicShapes, &context, point, maxDistance, filter.layer, filter.mask, (cpBBTreeNearestFunc)NearestPointQueryNearest, out);
+	IndexNearestQuery(space->staticShapes, &context, point, out->distance, filter.layer, filter.mask, (cpBBTreeNearestFunc)NearestPointQueryNearest, out);
 
 	return (cpShape*)out->shape;
 }
@@ -135,8 +296,8 @@ cpSpaceSegmentQuery(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cp
 
 	//cpSpaceLock(space);
 	//{
-	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
-	cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+	IndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+	IndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
 	//} 
 	//cpSpaceUnlock(space, cpTrue);
 }
@@ -176,12 +337,151 @@ cpSpaceSegmentQueryFirst(cpSpace* space, cpVect start, cpVect end, cpFloat radiu
 		NULL
 	};
 
-	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
-	cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, out->alpha, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	IndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	IndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, out->alpha, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
 
 	return (cpShape*)out->shape;
 }
 
+// Batches at least this large are split across the worker threads.
+#define CP_SPACE_SEGMENT_BATCH_PARALLEL_THRESHOLD 256
+
+typedef struct SegmentBatchKey
+{
+	uint32_t key;
+	int index;
+} SegmentBatchKey;
+
+typedef struct SegmentBatchContext
+{
+	cpSpace* space;
+	const cpSegmentQueryRay* rays;
+	cpSegmentQueryInfo* out;
+	const SegmentBatchKey* order;
+	int count;
+} SegmentBatchContext;
+
+// The rays and results of one packet, indexed by lane.
+struct SegmentBatchPacket
+{
+	const cpSegmentQueryRay* rays[CP_BBTREE_PACKET_SIZE];
+	cpSegmentQueryInfo* out[CP_BBTREE_PACKET_SIZE];
+};
+
+static cpFloat
+SegmentQueryBatchFirst(struct SegmentBatchPacket* packet, cpShape* shape, int lane, void* unused)
+{
+	(void)unused;
+	const cpSegmentQueryRay* ray = packet->rays[lane];
+	cpSegmentQueryInfo* out = packet->out[lane];
+	cpSegmentQueryInfo info;
+
+	if (!cpShapeFilterReject(shape->filter, ray->filter) && !shape->sensor && cpShapeSegmentQuery(shape, ray->start, ray->end, ray->radius, &info) && info.alpha < out->alpha)
+	{
+		(*out) = info;
+	}
+
+	return out->alpha;
+}
+
+static inline uint32_t
+SegmentBatchSpread(uint32_t x)
+{
+	x &= 0x3FFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+static int
+SegmentBatchKeySort(const SegmentBatchKey* a, const SegmentBatchKey* b)
+{
+	return (a->key < b->key ? -1 : (a->key > b->key ? 1 : 0));
+}
+
+static void
+SegmentBatchWorker(SegmentBatchContext* context, unsigned long worker, unsigned long worker_count)
+{
+	cpSpace* space = context->space;
+	int count = context->count;
+
+	for (int start = (int)worker * CP_BBTREE_PACKET_SIZE; start < count; start += (int)worker_count * CP_BBTREE_PACKET_SIZE)
+	{
+		int lanes = (count - start < CP_BBTREE_PACKET_SIZE ? count - start : CP_BBTREE_PACKET_SIZE);
+
+		struct SegmentBatchPacket packet;
+		cpVect a[CP_BBTREE_PACKET_SIZE], b[CP_BBTREE_PACKET_SIZE];
+		cpFloat r[CP_BBTREE_PACKET_SIZE], t_exit[CP_BBTREE_PACKET_SIZE];
+		cpBitmask layers[CP_BBTREE_PACKET_SIZE], masks[CP_BBTREE_PACKET_SIZE];
+
+		for (int i = 0; i < lanes; i++)
+		{
+			int index = context->order[start + i].index;
+			const cpSegmentQueryRay* ray = packet.rays[i] = context->rays + index;
+			cpSegmentQueryInfo* out = packet.out[i] = context->out + index;
+
+			cpSegmentQueryInfo info = { NULL, ray->end, cpvzero, 1.0f };
+			(*out) = info;
+
+			a[i] = ray->start;
+			b[i] = ray->end;
+			r[i] = ray->radius;
+			t_exit[i] = 1.0f;
+			layers[i] = ray->filter.layer;
+			masks[i] = ray->filter.mask;
+		}
+
+		IndexSegmentQueryPacket(space->staticShapes, &packet, lanes, a, b, r, t_exit, layers, masks, (cpBBTreeSegmentPacketFunc)SegmentQueryBatchFirst, NULL);
+		IndexSegmentQueryPacket(space->dynamicShapes, &packet, lanes, a, b, r, t_exit, layers, masks, (cpBBTreeSegmentPacketFunc)SegmentQueryBatchFirst, NULL);
+	}
+}
+
+int
+cpSpaceSegmentQueryBatch(cpSpace* space, const cpSegmentQueryRay* rays, int count, cpSegmentQueryInfo* out)
+{
+	if (count <= 0) return 0;
+
+	// Sort the rays by direction quadrant, then along a Z-order curve by their start points.
+	cpBB bounds = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+	for (int i = 0; i < count; i++) bounds = cpBBExpand(bounds, rays[i].start);
+
+	cpFloat w = bounds.r - bounds.l, h = bounds.t - bounds.b;
+	cpFloat sx = (w > 0.0f ? 16383.0f / w : 0.0f), sy = (h > 0.0f ? 16383.0f / h : 0.0f);
+
+	SegmentBatchKey* order = (SegmentBatchKey*)cpcalloc(count, sizeof(SegmentBatchKey));
+	for (int i = 0; i < count; i++)
+	{
+		const cpSegmentQueryRay* ray = rays + i;
+		uint32_t quadrant = (ray->end.x < ray->start.x ? 1 : 0) | (ray->end.y < ray->start.y ? 2 : 0);
+		uint32_t x = (uint32_t)((ray->start.x - bounds.l) * sx);
+		uint32_t y = (uint32_t)((ray->start.y - bounds.b) * sy);
+
+		order[i].key = (quadrant << 28) | SegmentBatchSpread(x) | (SegmentBatchSpread(y) << 1);
+		order[i].index = i;
+	}
+
+	qsort(order, count, sizeof(SegmentBatchKey), (int (*)(const void*, const void*))SegmentBatchKeySort);
+
+	SegmentBatchContext context = { space, rays, out, order, count };
+	if (count >= CP_SPACE_SEGMENT_BATCH_PARALLEL_THRESHOLD)
+	{
+		cpSpaceFlushIndexes(space);
+		cpSpatialIndexRunWorkers(space->dynamicShapes, (cpSpatialIndexWorkerFunc)SegmentBatchWorker, &context);
+	}
+	else
+	{
+		SegmentBatchWorker(&context, 0, 1);
+	}
+
+	cpfree(order);
+
+	int hits = 0;
+	for (int i = 0; i < count; i++) hits += (out[i].shape != NULL);
+	return hits;
+}
+
 //MARK: BB Query Functions
 
 struct BBQueryContext
@@ -209,8 +509,8 @@ cpSpaceBBQuery(cpSpace* space, cpBB bb, cpShapeFilter filter, cpSpaceBBQueryFunc
 
 	//cpSpaceLock(space);
 	//{
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
+	IndexQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)BBQuery, data);
+	IndexQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)BBQuery, data);
 	//} 
 	//cpSpaceUnlock(space, cpTrue);
 }
@@ -219,6 +519,7 @@ cpSpaceBBQuery(cpSpace* space, cpBB bb, cpShapeFilter filter, cpSpaceBBQueryFunc
 
 struct ShapeQueryContext
 {
+	cpShape* shape;
 	cpSpaceShapeQueryFunc func;
 	void* data;
 	cpBool anyCollision;
@@ -226,7 +527,9 @@ struct ShapeQueryContext
 
 struct ShapeQueryContext2
 {
+	// The shape being queried and its moved copy.
 	cpShape* shape;
+	cpShape* moved;
 	cpShapeFilter filter;
 };
 
@@ -234,12 +537,20 @@ struct ShapeQueryContext2
 static cpCollisionID
 ShapeQuery(cpShape* a, cpShape* b, cpCollisionID id, struct ShapeQueryContext* context)
 {
-	if (cpShapeFilterReject(a->filter, b->filter) || a == b) return id;
+	if (cpShapeFilterReject(a->filter, b->filter) || b == context->shape) return id;
 
-	cpContactPointSet set = cpShapesCollide(a, b);
-	if (set.count)
+	if (context->func)
+	{
+		cpContactPointSet set = cpShapesCollide(a, b);
+		if (set.count)
+		{
+			context->func(b, &set, context->data);
+			context->anyCollision = !(a->sensor || b->sensor);
+		}
+	}
+	else if (cpOverlap(a, b))
 	{
-		if (context->func) context->func(b, &set, context->data);
+		// No callback to pass contacts to, skip generating them.
 		context->anyCollision = !(a->sensor || b->sensor);
 	}
 
@@ -249,14 +560,18 @@ ShapeQuery(cpShape* a, cpShape* b, cpCollisionID id, struct ShapeQueryContext* c
 cpBool
 cpSpaceShapeQuery(cpSpace* space, cpShape* shape, cpSpaceShapeQueryFunc func, void* data)
 {
+	struct ShapeQueryContext context = { shape, func, data, cpFalse };
+
+	// Query with a moved copy so the shape itself isn't written to.
+	cpShapeScratch scratch;
 	cpBody* body = shape->body;
-	cpBB bb = (body ? cpShapeUpdate(shape, body->transform) : shape->bb);
-	struct ShapeQueryContext context = { func, data, cpFalse };
+	cpShape* moved = (body ? cpShapeScratchInit(&scratch, shape, body->transform, (struct cpSplittingPlane*)alloca(cpShapeScratchPlanesSize(shape))) : shape);
+	cpBB bb = moved->bb;
 
 	//cpSpaceLock(space);
 	//{
-	cpSpatialIndexQuery(space->dynamicShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
-	cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+	IndexQuery(space->dynamicShapes, moved, bb, shape->filter.layer, shape->filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+	IndexQuery(space->staticShapes, moved, bb, shape->filter.layer, shape->filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
 	//} 
 	//cpSpaceUnlock(space, cpTrue);
 
@@ -308,8 +623,61 @@ cpSpacePointQuery2(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFil
 
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
 
-	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)PointQuery2, &meta);
-	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)PointQuery2, &meta);
+	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) IndexQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)PointQuery2, &meta);
+	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) IndexQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)PointQuery2, &meta);
+
+	return meta.count;
+}
+
+// Keeps the k nearest shapes sorted by distance.
+static cpFloat
+PointQueryKNearest(struct PointQueryContext* context, cpShape* shape, PointQueryMeta* meta)
+{
+	if (!cpShapeFilterReject(shape->filter, context->filter) && !shape->sensor)
+	{
+		cpPointQueryInfo info;
+		cpShapePointQuery(shape, context->point, &info);
+
+		cpPointQueryInfo* results = meta->results;
+		int count = meta->count;
+
+		if (info.distance < context->maxDistance && (count < meta->max_count || info.distance < results[count - 1].distance))
+		{
+			int i = (count < meta->max_count ? count++ : count - 1);
+			for (; i > 0 && info.distance < results[i - 1].distance; i--) results[i] = results[i - 1];
+			results[i] = info;
+			meta->count = count;
+		}
+	}
+
+	// Shrink the search radius to the current kth shape.
+	return (meta->count == meta->max_count ? meta->results[meta->count - 1].distance : context->maxDistance);
+}
+
+size_t
+cpSpacePointQueryKNearest(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int k)
+{
+	if (k <= 0) return 0;
+
+	struct PointQueryContext context =
+	{
+		point,
+		maxDistance,
+		filter,
+		NULL
+	};
+
+	struct PointQueryMeta meta =
+	{
+		results,
+		0,
+		k
+	};
+
+	if (flags & QUERY_DYNAMIC) IndexNearestQuery(space->dynamicShapes, &context, point, maxDistance, filter.layer, filter.mask, (cpBBTreeNearestFunc)PointQueryKNearest, &meta);
+
+	cpFloat radius = (meta.count == k ? results[k - 1].distance : maxDistance);
+	if (flags & QUERY_STATIC) IndexNearestQuery(space->staticShapes, &context, point, radius, filter.layer, filter.mask, (cpBBTreeNearestFunc)PointQueryKNearest, &meta);
 
 	return meta.count;
 }
@@ -354,8 +722,61 @@ cpSpaceSegmentQuery2(cpSpace* space, cpVect start, cpVect end, cpFloat radius, c
 		max_count
 	};
 
-	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery2, &meta);
-	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery2, &meta);
+	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) IndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery2, &meta);
+	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) IndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQuery2, &meta);
+
+	return meta.count;
+}
+
+// Keeps the k nearest hits sorted by alpha.
+static cpFloat
+SegmentQueryNearestK(struct SegmentQueryContext* context, cpShape* shape, SegmentQueryMeta* meta)
+{
+	cpSegmentQueryInfo info;
+
+	if (!cpShapeFilterReject(shape->filter, context->filter) && !shape->sensor && cpShapeSegmentQuery(shape, context->start, context->end, context->radius, &info))
+	{
+		cpSegmentQueryInfo* results = meta->results;
+		int count = meta->count;
+
+		if (count < meta->max_count || info.alpha < results[count - 1].alpha)
+		{
+			int i = (count < meta->max_count ? count++ : count - 1);
+			for (; i > 0 && info.alpha < results[i - 1].alpha; i--) results[i] = results[i - 1];
+			results[i] = info;
+			meta->count = count;
+		}
+	}
+
+	// Prune anything further than the current kth hit.
+	return (meta->count == meta->max_count ? meta->results[meta->count - 1].alpha : 1.0f);
+}
+
+size_t
+cpSpaceSegmentQueryNearestK(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int k)
+{
+	if (k <= 0) return 0;
+
+	struct SegmentQueryContext context =
+	{
+		start,
+		end,
+		radius,
+		filter,
+		NULL,
+	};
+
+	struct SegmentQueryMeta meta =
+	{
+		results,
+		0,
+		k
+	};
+
+	if (flags & QUERY_STATIC) IndexSegmentQuery(space->staticShapes, &context, start, end, radius, 1.0f, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryNearestK, &meta);
+
+	cpFloat t_exit = (meta.count == k ? results[k - 1].alpha : 1.0f);
+	if (flags & QUERY_DYNAMIC) IndexSegmentQuery(space->dynamicShapes, &context, start, end, radius, t_exit, filter.layer, filter.mask, (cpSpatialIndexSegmentQueryFunc)SegmentQueryNearestK, &meta);
 
 	return meta.count;
 }
@@ -373,8 +794,7 @@ ShapeQuery2(struct ShapeQueryContext2* context, cpShape* shape, cpCollisionID id
 {
 	if (meta->count < meta->max_count && shape != context->shape && !cpShapeFilterReject(shape->filter, context->filter))
 	{
-		cpContactPointSet set = cpShapesCollide(shape, context->shape);
-		if (set.count)
+		if (cpOverlap(shape, context->moved))
 		{
 			meta->results[meta->count] = cpShapeQueryInfo
 			{
@@ -398,15 +818,15 @@ ShapeQuery2(struct ShapeQueryContext2* context, cpShape* shape, cpCollisionID id
 	//return id;
 }
 
-size_t
-cpSpaceShapeQuery2(cpSpace* space, cpShape* shape, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count)
+static size_t
+ShapeQuery2Moved(cpSpace* space, cpShape* shape, cpShape* moved, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count)
 {
-	cpBody* body = shape->body;
-	cpBB bb = (body ? cpShapeUpdate(shape, body->transform) : shape->bb);
+	cpBB bb = moved->bb;
 
 	struct ShapeQueryContext2 context = 
 	{ 
 		shape,
+		moved,
 		filter
 	};
 
@@ -417,12 +837,80 @@ cpSpaceShapeQuery2(cpSpace* space, cpShape* shape, cpShapeFilter filter, cpShape
 		max_count
 	};
 
-	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)ShapeQuery2, &meta);
-	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)ShapeQuery2, &meta);
+	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) IndexQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery2, &meta);
+	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) IndexQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)ShapeQuery2, &meta);
 
 	return meta.count;
 }
 
+size_t
+cpSpaceShapeQuery2(cpSpace* space, cpShape* shape, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	cpBody* body = shape->body;
+	if (!body) return ShapeQuery2Moved(space, shape, shape, filter, results, flags, max_count);
+
+	return cpSpaceShapeQueryTransformed(space, shape, body->transform, filter, results, flags, max_count);
+}
+
+size_t
+cpSpaceShapeQueryTransformed(cpSpace* space, cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	cpShapeScratch scratch;
+	cpShape* moved = cpShapeScratchInit(&scratch, shape, transform, (struct cpSplittingPlane*)alloca(cpShapeScratchPlanesSize(shape)));
+	return ShapeQuery2Moved(space, shape, moved, filter, results, flags, max_count);
+}
+
+
+//MARK: Shape Cast Functions
+
+struct ShapeCastContext
+{
+	struct cpShapeCast cast;
+	cpShapeFilter filter;
+};
+
+static cpCollisionID
+ShapeCastQuery(struct ShapeCastContext* context, cpShape* shape, cpCollisionID id, cpSegmentQueryInfo* out)
+{
+	const cpShape* caster = context->cast.shape;
+	cpSegmentQueryInfo info;
+
+	if (
+		shape != caster && (!caster->body || shape->body != caster->body) && !shape->sensor &&
+		!cpShapeFilterReject(shape->filter, context->filter) && cpBBIntersects(context->cast.bb, shape->bb) &&
+		cpShapeCastShape(&context->cast, shape, out->alpha, &info) && info.alpha < out->alpha
+		)
+	{
+		(*out) = info;
+	}
+
+	return id;
+}
+
+cpShape*
+cpSpaceShapeCast(cpSpace* space, cpShape* shape, cpTransform start, cpTransform end, cpShapeFilter filter, cpSegmentQueryInfo* out)
+{
+	cpSegmentQueryInfo info = { NULL, cpvzero, cpvzero, 1.0f };
+	if (out)
+	{
+		(*out) = info;
+	}
+	else
+	{
+		out = &info;
+	}
+
+	struct ShapeCastContext context;
+	cpShapeCastInit(&context.cast, shape, start, end, (cpVect*)alloca(cpShapeCastVertexCount(shape) * sizeof(cpVect)));
+	context.filter = filter;
+
+	cpBB bb = context.cast.bb;
+	IndexQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)ShapeCastQuery, out);
+	IndexQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexQueryFunc)ShapeCastQuery, out);
+
+	return (cpShape*)out->shape;
+}
+
 
 struct BBQueryMeta
 {
@@ -463,8 +951,8 @@ cpSpaceBBQuery2(cpSpace* space, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* re
 		max_count
 	};
 
-	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) cpSpatialIndexBBQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexBBQueryFunc)BBQuery2, &meta);
-	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) cpSpatialIndexBBQuery(space->staticShapes, &context, bb, (cpSpatialIndexBBQueryFunc)BBQuery2, &meta);
+	if ((flags & QUERY_DYNAMIC) && meta.count < meta.max_count) IndexBBQuery(space->dynamicShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexBBQueryFunc)BBQuery2, &meta);
+	if ((flags & QUERY_STATIC) && meta.count < meta.max_count) IndexBBQuery(space->staticShapes, &context, bb, filter.layer, filter.mask, (cpSpatialIndexBBQueryFunc)BBQuery2, &meta);
 
 	return meta.count;
 }
@@ -0,0 +1,283 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+// Queues at least this large are split across the worker threads.
+#define CP_SPACE_QUERY_QUEUE_PARALLEL_THRESHOLD 32
+// Number of consecutive sorted queries a worker runs before moving on to its next block.
+#define QUERY_QUEUE_BLOCK_SIZE 16
+
+typedef enum QueuedQueryType
+{
+	QUEUED_POINT_QUERY,
+	QUEUED_SEGMENT_QUERY,
+	QUEUED_SEGMENT_QUERY_FIRST,
+	QUEUED_BB_QUERY,
+	QUEUED_SHAPE_QUERY,
+} QueuedQueryType;
+
+typedef struct QueuedQuery
+{
+	QueuedQueryType type;
+	cpShapeFilter filter;
+	enum cpQueryFlags flags;
+	int max_count;
+	cpDataPointer tag;
+
+	// Point queries use 'a' and 'r', segment queries 'a', 'b' and 'r'.
+	cpVect a, b;
+	cpFloat r;
+	cpBB bb;
+	cpShape* shape;
+	cpTransform transform;
+
+	void* results;
+	size_t count;
+} QueuedQuery;
+
+typedef struct QueuedQueryKey
+{
+	uint32_t key;
+	int index;
+} QueuedQueryKey;
+
+struct cpQueryQueue
+{
+	QueuedQuery* queries;
+	int count, capacity;
+};
+
+typedef struct QueryQueueContext
+{
+	cpSpace* space;
+	QueuedQuery* queries;
+	const QueuedQueryKey* order;
+	int count;
+} QueryQueueContext;
+
+//MARK: Queue Functions
+
+static QueuedQuery*
+QueuePush(cpSpace* space, QueuedQueryType type, cpShapeFilter filter, void* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag)
+{
+	cpQueryQueue* queue = space->queryQueue;
+	if (!queue) queue = space->queryQueue = (cpQueryQueue*)cpcalloc(1, sizeof(cpQueryQueue));
+
+	if (queue->count == queue->capacity)
+	{
+		queue->capacity = (queue->capacity ? 2 * queue->capacity : 64);
+		queue->queries = (QueuedQuery*)cprealloc(queue->queries, queue->capacity * sizeof(QueuedQuery));
+	}
+
+	QueuedQuery* query = queue->queries + queue->count++;
+	memset(query, 0, sizeof(QueuedQuery));
+	query->type = type;
+	query->filter = filter;
+	query->flags = flags;
+	query->max_count = max_count;
+	query->tag = tag;
+	query->results = results;
+
+	return query;
+}
+
+void
+cpSpaceQueuePointQuery(cpSpace* space, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag)
+{
+	QueuedQuery* query = QueuePush(space, QUEUED_POINT_QUERY, filter, results, flags, max_count, tag);
+	query->a = point;
+	query->r = maxDistance;
+	query->bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
+}
+
+void
+cpSpaceQueueSegmentQuery(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag)
+{
+	QueuedQuery* query = QueuePush(space, QUEUED_SEGMENT_QUERY, filter, results, flags, max_count, tag);
+	query->a = start;
+	query->b = end;
+	query->r = radius;
+	query->bb = cpBBNewForExtents(cpvlerp(start, end, 0.5f), cpfabs(end.x - start.x) * 0.5f + radius, cpfabs(end.y - start.y) * 0.5f + radius);
+}
+
+void
+cpSpaceQueueSegmentQueryFirst(cpSpace* space, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* out, cpDataPointer tag)
+{
+	cpSpaceQueueSegmentQuery(space, start, end, radius, filter, out, (enum cpQueryFlags)(QUERY_DYNAMIC | QUERY_STATIC), 1, tag);
+	space->queryQueue->queries[space->queryQueue->count - 1].type = QUEUED_SEGMENT_QUERY_FIRST;
+}
+
+void
+cpSpaceQueueBBQuery(cpSpace* space, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag)
+{
+	QueuedQuery* query = QueuePush(space, QUEUED_BB_QUERY, filter, results, flags, max_count, tag);
+	query->bb = bb;
+}
+
+void
+cpSpaceQueueShapeQuery(cpSpace* space, cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count, cpDataPointer tag)
+{
+	QueuedQuery* query = QueuePush(space, QUEUED_SHAPE_QUERY, filter, results, flags, max_count, tag);
+	query->shape = shape;
+	query->transform = transform;
+	query->bb = cpBBNewForCircle(cpTransformPoint(transform, cpvzero), 0.0f);
+}
+
+int
+cpSpaceGetQueuedQueryCount(const cpSpace* space)
+{
+	return (space->queryQueue ? space->queryQueue->count : 0);
+}
+
+void
+cpSpaceQueryQueueFree(cpSpace* space)
+{
+	cpQueryQueue* queue = space->queryQueue;
+	if (queue)
+	{
+		cpfree(queue->queries);
+		cpfree(queue);
+		space->queryQueue = NULL;
+	}
+}
+
+//MARK: Flushing
+
+static void
+QueuedQueryRun(cpSpace* space, QueuedQuery* query)
+{
+	switch (query->type)
+	{
+	case QUEUED_POINT_QUERY:
+		query->count = cpSpacePointQuery2(space, query->a, query->r, query->filter, (cpPointQueryInfo*)query->results, query->flags, query->max_count);
+		break;
+	case QUEUED_SEGMENT_QUERY:
+		query->count = cpSpaceSegmentQuery2(space, query->a, query->b, query->r, query->filter, (cpSegmentQueryInfo*)query->results, query->flags, query->max_count);
+		break;
+	case QUEUED_SEGMENT_QUERY_FIRST:
+		query->count = (cpSpaceSegmentQueryFirst(space, query->a, query->b, query->r, query->filter, (cpSegmentQueryInfo*)query->results) != NULL);
+		break;
+	case QUEUED_BB_QUERY:
+		query->count = cpSpaceBBQuery2(space, query->bb, query->filter, (cpBBQueryInfo*)query->results, query->flags, query->max_count);
+		break;
+	case QUEUED_SHAPE_QUERY:
+		query->count = cpSpaceShapeQueryTransformed(space, query->shape, query->transform, query->filter, (cpShapeQueryInfo*)query->results, query->flags, query->max_count);
+		break;
+	}
+}
+
+static void
+QueryQueueWorker(QueryQueueContext* context, unsigned long worker, unsigned long worker_count)
+{
+	int count = context->count;
+	for (int start = (int)worker * QUERY_QUEUE_BLOCK_SIZE; start < count; start += (int)worker_count * QUERY_QUEUE_BLOCK_SIZE)
+	{
+		int end = (count - start < QUERY_QUEUE_BLOCK_SIZE ? count : start + QUERY_QUEUE_BLOCK_SIZE);
+		for (int i = start; i < end; i++) QueuedQueryRun(context->space, context->queries + context->order[i].index);
+	}
+}
+
+static inline uint32_t
+QueryQueueSpread(uint32_t x)
+{
+	x &= 0xFFFF;
+	x = (x | (x << 8)) & 0x00FF00FF;
+	x = (x | (x << 4)) & 0x0F0F0F0F;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+static int
+QueuedQueryKeySort(const QueuedQueryKey* a, const QueuedQueryKey* b)
+{
+	return (a->key < b->key ? -1 : (a->key > b->key ? 1 : 0));
+}
+
+int
+cpSpaceFlushQueries(cpSpace* space, cpSpaceQueryResultFunc func, void* data)
+{
+	cpAssertSpaceUnlocked(space);
+
+	cpQueryQueue* queue = space->queryQueue;
+	if (!queue || queue->count == 0) return 0;
+
+	// Detach the queries so the callbacks can queue more for the next flush.
+	QueuedQuery* queries = queue->queries;
+	int count = queue->count, capacity = queue->capacity;
+	queue->queries = NULL;
+	queue->count = queue->capacity = 0;
+
+	// Sort the queries along a Z-order curve so nearby queries run together and share cached tree nodes.
+	cpBB bounds = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+	for (int i = 0; i < count; i++) bounds = cpBBExpand(bounds, cpBBCenter(queries[i].bb));
+
+	cpFloat w = bounds.r - bounds.l, h = bounds.t - bounds.b;
+	cpFloat sx = (w > 0.0f ? 65535.0f / w : 0.0f), sy = (h > 0.0f ? 65535.0f / h : 0.0f);
+
+	QueuedQueryKey* order = (QueuedQueryKey*)cpcalloc(count, sizeof(QueuedQueryKey));
+	for (int i = 0; i < count; i++)
+	{
+		cpVect center = cpBBCenter(queries[i].bb);
+		uint32_t x = (uint32_t)cpfclamp((center.x - bounds.l) * sx, 0.0f, 65535.0f);
+		uint32_t y = (uint32_t)cpfclamp((center.y - bounds.b) * sy, 0.0f, 65535.0f);
+
+		order[i].key = QueryQueueSpread(x) | (QueryQueueSpread(y) << 1);
+		order[i].index = i;
+	}
+
+	qsort(order, count, sizeof(QueuedQueryKey), (int (*)(const void*, const void*))QueuedQueryKeySort);
+
+	QueryQueueContext context = { space, queries, order, count };
+	if (count >= CP_SPACE_QUERY_QUEUE_PARALLEL_THRESHOLD)
+	{
+		cpSpaceFlushIndexes(space);
+		cpSpatialIndexRunWorkers(space->dynamicShapes, (cpSpatialIndexWorkerFunc)QueryQueueWorker, &context);
+	}
+	else
+	{
+		QueryQueueWorker(&context, 0, 1);
+	}
+
+	cpfree(order);
+
+	// Report the results in the order the queries were queued.
+	if (func)
+	{
+		for (int i = 0; i < count; i++) func(queries[i].tag, queries[i].results, queries[i].count, data);
+	}
+
+	// Keep the buffer unless the callbacks already queued into a new one.
+	if (queue->queries)
+	{
+		cpfree(queries);
+	}
+	else
+	{
+		queue->queries = queries;
+		queue->capacity = capacity;
+	}
+
+	return count;
+}
@@ -0,0 +1,270 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "chipmunk/chipmunk_private.h"
+
+typedef struct SensorPair
+{
+	cpShape* a, * b;
+	cpTimestamp stamp;
+} SensorPair;
+
+typedef struct SensorEvents
+{
+	cpSensorEvent* events;
+	int count, capacity;
+} SensorEvents;
+
+struct cpSensorSet
+{
+	// Dense array of the overlapping pairs.
+	SensorPair* pairs;
+	int count, capacity;
+
+	// Open addressed table of indexes into 'pairs', -1 for empty slots.
+	int* slots;
+	int slotMask;
+
+	SensorEvents begin, end;
+};
+
+//MARK: Pair Functions
+
+static inline int
+SlotFor(cpSensorSet* set, cpShape* a, cpShape* b)
+{
+	cpHashValue hash = CP_HASH_PAIR(a, b);
+	return (int)(hash ^ (hash >> 16)) & set->slotMask;
+}
+
+// Returns the slot holding the pair, or the empty slot where it would go.
+static int
+SlotFind(cpSensorSet* set, cpShape* a, cpShape* b)
+{
+	int* slots = set->slots;
+	SensorPair* pairs = set->pairs;
+	int mask = set->slotMask;
+
+	int i = SlotFor(set, a, b);
+	while (slots[i] >= 0 && (pairs[slots[i]].a != a || pairs[slots[i]].b != b)) i = (i + 1) & mask;
+	return i;
+}
+
+static void
+SlotsResize(cpSensorSet* set, int capacity)
+{
+	cpfree(set->slots);
+	set->slots = (int*)cpcalloc(capacity, sizeof(int));
+	set->slotMask = capacity - 1;
+
+	for (int i = 0; i < capacity; i++) set->slots[i] = -1;
+	for (int i = 0; i < set->count; i++) set->slots[SlotFind(set, set->pairs[i].a, set->pairs[i].b)] = i;
+}
+
+// Linear probing removal, shifts the following entries back instead of leaving tombstones.
+static void
+SlotRemove(cpSensorSet* set, int i)
+{
+	int* slots = set->slots;
+	int mask = set->slotMask;
+
+	for (int j = (i + 1) & mask; slots[j] >= 0; j = (j + 1) & mask)
+	{
+		SensorPair* pair = set->pairs + slots[j];
+		int home = SlotFor(set, pair->a, pair->b);
+
+		// Move the entry back if 'i' lies cyclically between its home slot and 'j'.
+		if (((j - home) & mask) >= ((j - i) & mask))
+		{
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+
+	slots[i] = -1;
+}
+
+// Swap removes the pair, the last pair takes its place.
+static void
+PairRemove(cpSensorSet* set, int i)
+{
+	SensorPair* pairs = set->pairs;
+	SlotRemove(set, SlotFind(set, pairs[i].a, pairs[i].b));
+
+	int last = --set->count;
+	if (i != last)
+	{
+		pairs[i] = pairs[last];
+		set->slots[SlotFind(set, pairs[i].a, pairs[i].b)] = i;
+	}
+}
+
+static void
+EventPush(SensorEvents* events, cpShape* a, cpShape* b)
+{
+	if (events->count == events->capacity)
+	{
+		events->capacity = (events->capacity ? 2 * events->capacity : 32);
+		events->events = (cpSensorEvent*)cprealloc(events->events, events->capacity * sizeof(cpSensorEvent));
+	}
+
+	// Report the sensor first.
+	cpSensorEvent event = { a->sensor ? a : b, a->sensor ? b : a };
+	events->events[events->count++] = event;
+}
+
+static inline cpBool
+BodyIsInactive(cpBody* body)
+{
+	return (cpBodyGetType(body) == CP_BODY_TYPE_STATIC || cpBodyIsSleeping(body));
+}
+
+//MARK: Space Functions
+
+void
+cpSpaceSetSensorEvents(cpSpace* space, cpBool enabled)
+{
+	cpAssertSpaceUnlocked(space);
+
+	cpSensorSet* set = space->sensorSet;
+	if (!enabled && set)
+	{
+		cpfree(set->pairs);
+		cpfree(set->slots);
+		cpfree(set->begin.events);
+		cpfree(set->end.events);
+		cpfree(set);
+
+		space->sensorSet = NULL;
+	}
+	else if (enabled && !set)
+	{
+		set = space->sensorSet = (cpSensorSet*)cpcalloc(1, sizeof(cpSensorSet));
+		SlotsResize(set, 64);
+	}
+}
+
+cpBool
+cpSpaceGetSensorEvents(const cpSpace* space)
+{
+	return (space->sensorSet != NULL);
+}
+
+const cpSensorEvent*
+cpSpaceGetSensorBeginEvents(const cpSpace* space, int* count)
+{
+	cpSensorSet* set = space->sensorSet;
+	(*count) = (set ? set->begin.count : 0);
+	return (set ? set->begin.events : NULL);
+}
+
+const cpSensorEvent*
+cpSpaceGetSensorEndEvents(const cpSpace* space, int* count)
+{
+	cpSensorSet* set = space->sensorSet;
+	(*count) = (set ? set->end.count : 0);
+	return (set ? set->end.events : NULL);
+}
+
+void
+cpSpaceSensorOverlap(cpSpace* space, cpShape* a, cpShape* b)
+{
+	if (!cpOverlap(a, b)) return;
+
+	cpSensorSet* set = space->sensorSet;
+	if (a > b)
+	{
+		cpShape* temp = a;
+		a = b;
+		b = temp;
+	}
+
+	// Keep the load factor under 1/2.
+	if (2 * (set->count + 1) > set->slotMask + 1) SlotsResize(set, 2 * (set->slotMask + 1));
+
+	int slot = SlotFind(set, a, b);
+	if (set->slots[slot] < 0)
+	{
+		if (set->count == set->capacity)
+		{
+			set->capacity = (set->capacity ? 2 * set->capacity : 64);
+			set->pairs = (SensorPair*)cprealloc(set->pairs, set->capacity * sizeof(SensorPair));
+		}
+
+		SensorPair pair = { a, b, 0 };
+		set->pairs[set->count] = pair;
+		set->slots[slot] = set->count++;
+
+		EventPush(&set->begin, a, b);
+	}
+
+	set->pairs[set->slots[slot]].stamp = space->stamp;
+}
+
+void
+cpSpaceSensorsBeginStep(cpSpace* space)
+{
+	cpSensorSet* set = space->sensorSet;
+	if (set) set->begin.count = set->end.count = 0;
+}
+
+void
+cpSpaceSensorsEndStep(cpSpace* space)
+{
+	cpSensorSet* set = space->sensorSet;
+	if (!set) return;
+
+	for (int i = 0; i < set->count;)
+	{
+		SensorPair* pair = set->pairs + i;
+
+		// Like arbiters, pairs between sleeping or static bodies are kept since they aren't checked.
+		if (pair->stamp == space->stamp || (BodyIsInactive(pair->a->body) && BodyIsInactive(pair->b->body)))
+		{
+			i++;
+		}
+		else
+		{
+			EventPush(&set->end, pair->a, pair->b);
+			PairRemove(set, i);
+		}
+	}
+}
+
+void
+cpSpaceSensorsRemoveShape(cpSpace* space, cpShape* shape)
+{
+	cpSensorSet* set = space->sensorSet;
+	if (!set) return;
+
+	for (int i = 0; i < set->count;)
+	{
+		SensorPair* pair = set->pairs + i;
+		if (pair->a == shape || pair->b == shape)
+		{
+			PairRemove(set, i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
@@ -0,0 +1,632 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define SNAPSHOT_LEAF_SIZE 4
+#define SNAPSHOT_STACK_SIZE 64
+
+typedef struct SnapshotEntry
+{
+	// The live shape, only used to identify results. Queries never read it.
+	cpShape* shape;
+	// Copy of the shape with its world geometry as of the end of the step.
+	cpShapeScratch copy;
+	cpBool isStatic;
+	// Offset of the poly's world planes in the snapshot's plane array.
+	int planes;
+	// Offset of the tilemap's cells in the snapshot's cell array.
+	int cells;
+} SnapshotEntry;
+
+// Flattened BVH node. The first child of an internal node follows it, 'index' is the second child.
+// Leaves have a 'count' of entries starting at 'index' in the snapshot's 'order' array.
+typedef struct SnapshotNode
+{
+	cpBB bb;
+	cpBitmask layer, mask;
+	int index, count;
+} SnapshotNode;
+
+struct cpSpaceSnapshot
+{
+	cpTimestamp stamp;
+
+	int count, capacity;
+	SnapshotEntry* entries;
+	int* order;
+
+	int nodeCount;
+	SnapshotNode* nodes;
+
+	int planeCount, planeCapacity;
+	struct cpSplittingPlane* planes;
+
+	int cellCount, cellCapacity;
+	struct cpTilemapCell* cells;
+
+	// Number of readers holding the snapshot. It's only rebuilt once none are left.
+	volatile long readers;
+};
+
+struct cpSnapshotSet
+{
+	// The latest published snapshot, NULL until the first step.
+	cpSpaceSnapshot* volatile current;
+	cpArray* snapshots;
+};
+
+//MARK: Atomics
+
+#if defined(_MSC_VER)
+static inline long AtomicAdd(volatile long* value, long delta){ return _InterlockedExchangeAdd(value, delta) + delta; }
+static inline cpSpaceSnapshot* AtomicLoad(cpSpaceSnapshot* volatile* ptr){ return (cpSpaceSnapshot*)_InterlockedCompareExchangePointer((void* volatile*)ptr, NULL, NULL); }
+static inline void AtomicStore(cpSpaceSnapshot* volatile* ptr, cpSpaceSnapshot* value){ _InterlockedExchangePointer((void* volatile*)ptr, value); }
+#else
+static inline long AtomicAdd(volatile long* value, long delta){ return __atomic_add_fetch(value, delta, __ATOMIC_SEQ_CST); }
+static inline cpSpaceSnapshot* AtomicLoad(cpSpaceSnapshot* volatile* ptr){ return __atomic_load_n(ptr, __ATOMIC_SEQ_CST); }
+static inline void AtomicStore(cpSpaceSnapshot* volatile* ptr, cpSpaceSnapshot* value){ __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST); }
+#endif
+
+//MARK: Building
+
+static void
+SnapshotFree(cpSpaceSnapshot* snapshot)
+{
+	cpfree(snapshot->entries);
+	cpfree(snapshot->order);
+	cpfree(snapshot->nodes);
+	cpfree(snapshot->planes);
+	cpfree(snapshot->cells);
+	cpfree(snapshot);
+}
+
+static void
+SnapshotReserve(cpSpaceSnapshot* snapshot, int count)
+{
+	if (count <= snapshot->capacity) return;
+
+	snapshot->capacity = cpimax(count, 2 * snapshot->capacity);
+	snapshot->entries = (SnapshotEntry*)cprealloc(snapshot->entries, snapshot->capacity * sizeof(SnapshotEntry));
+	snapshot->order = (int*)cprealloc(snapshot->order, snapshot->capacity * sizeof(int));
+	snapshot->nodes = (SnapshotNode*)cprealloc(snapshot->nodes, 2 * snapshot->capacity * sizeof(SnapshotNode));
+}
+
+typedef struct SnapshotBuildContext
+{
+	cpSpaceSnapshot* snapshot;
+	cpBool isStatic;
+} SnapshotBuildContext;
+
+static void
+SnapshotAddShape(cpShape* shape, SnapshotBuildContext* context)
+{
+	cpSpaceSnapshot* snapshot = context->snapshot;
+
+	// Compound proxies are replaced by their shapes, which weren't counted when reserving.
+	if (cpShapeIsCompound(shape))
+	{
+		cpCompoundShape* compound = (cpCompoundShape*)shape;
+		SnapshotReserve(snapshot, snapshot->count + compound->count);
+		cpCompoundShapeEach(compound, (cpSpatialIndexIteratorFunc)SnapshotAddShape, context);
+		return;
+	}
+
+	SnapshotEntry* entry = snapshot->entries + snapshot->count++;
+	entry->shape = shape;
+	entry->isStatic = context->isStatic;
+	entry->planes = -1;
+	entry->cells = -1;
+
+	switch (shape->klass->type)
+	{
+	case CP_CIRCLE_SHAPE: entry->copy.circle = *(cpCircleShape*)shape; break;
+	case CP_SEGMENT_SHAPE: entry->copy.segment = *(cpSegmentShape*)shape; break;
+	case CP_BOX_SHAPE: entry->copy.box = *(cpBoxShape*)shape; break;
+	case CP_TILEMAP_SHAPE:
+	{
+		cpTilemapShape* tilemap = (cpTilemapShape*)shape;
+		entry->copy.tilemap = *tilemap;
+
+		// The cells can be changed while the snapshot is read.
+		int count = (tilemap->width + 2) * (tilemap->height + 2);
+		if (snapshot->cellCount + count > snapshot->cellCapacity)
+		{
+			snapshot->cellCapacity = cpimax(snapshot->cellCount + count, 2 * snapshot->cellCapacity);
+			snapshot->cells = (struct cpTilemapCell*)cprealloc(snapshot->cells, snapshot->cellCapacity * sizeof(struct cpTilemapCell));
+		}
+
+		entry->cells = snapshot->cellCount;
+		memcpy(snapshot->cells + snapshot->cellCount, tilemap->cells, count * sizeof(struct cpTilemapCell));
+		snapshot->cellCount += count;
+		break;
+	}
+	default:
+	{
+		cpPolyShape* poly = (cpPolyShape*)shape;
+		entry->copy.poly = *poly;
+
+		// Queries only need the world planes.
+		int count = poly->count;
+		if (snapshot->planeCount + count > snapshot->planeCapacity)
+		{
+			snapshot->planeCapacity = cpimax(snapshot->planeCount + count, 2 * snapshot->planeCapacity);
+			snapshot->planes = (struct cpSplittingPlane*)cprealloc(snapshot->planes, snapshot->planeCapacity * sizeof(struct cpSplittingPlane));
+		}
+
+		entry->planes = snapshot->planeCount;
+		for (int i = 0; i < count; i++) snapshot->planes[snapshot->planeCount++] = poly->planes[i];
+	}
+	}
+
+	// Nothing in the copy may lead back to live objects.
+	entry->copy.shape.space = NULL;
+	entry->copy.shape.body = NULL;
+	entry->copy.shape.next = entry->copy.shape.prev = NULL;
+}
+
+static inline cpFloat
+EntryCenter(const SnapshotEntry* entry, cpBool axisX)
+{
+	cpBB bb = entry->copy.shape.bb;
+	return (axisX ? bb.l + bb.r : bb.b + bb.t);
+}
+
+// Partially sorts 'order' so the element at 'k' is where it would be if fully sorted by center.
+static void
+SnapshotSelect(const SnapshotEntry* entries, int* order, int count, int k, cpBool axisX)
+{
+	int lo = 0, hi = count - 1;
+	while (lo < hi)
+	{
+		cpFloat pivot = EntryCenter(entries + order[(lo + hi) / 2], axisX);
+		int i = lo, j = hi;
+		while (i <= j)
+		{
+			while (EntryCenter(entries + order[i], axisX) < pivot) i++;
+			while (EntryCenter(entries + order[j], axisX) > pivot) j--;
+			if (i <= j)
+			{
+				int temp = order[i];
+				order[i] = order[j];
+				order[j] = temp;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j)
+		{
+			hi = j;
+		}
+		else if (k >= i)
+		{
+			lo = i;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+// Median split on the longest axis. Returns the index of the new node.
+static int
+SnapshotBuildNode(cpSpaceSnapshot* snapshot, int start, int count)
+{
+	int index = snapshot->nodeCount++;
+	int* order = snapshot->order + start;
+
+	cpBB bb = snapshot->entries[order[0]].copy.shape.bb;
+	cpBitmask layer = 0, mask = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const cpShape* shape = &snapshot->entries[order[i]].copy.shape;
+		bb = cpBBMerge(bb, shape->bb);
+		layer |= shape->filter.layer;
+		mask |= shape->filter.mask;
+	}
+
+	SnapshotNode node = { bb, layer, mask, start, count };
+	if (count > SNAPSHOT_LEAF_SIZE)
+	{
+		int half = count / 2;
+		SnapshotSelect(snapshot->entries, order, count, half, bb.r - bb.l > bb.t - bb.b);
+
+		SnapshotBuildNode(snapshot, start, half);
+		node.index = SnapshotBuildNode(snapshot, start + half, count - half);
+		node.count = 0;
+	}
+
+	snapshot->nodes[index] = node;
+	return index;
+}
+
+static void
+SnapshotBuild(cpSpaceSnapshot* snapshot, cpSpace* space)
+{
+	snapshot->stamp = space->stamp;
+	snapshot->count = snapshot->nodeCount = snapshot->planeCount = snapshot->cellCount = 0;
+	SnapshotReserve(snapshot, cpSpatialIndexCount(space->staticShapes) + cpSpatialIndexCount(space->dynamicShapes));
+
+	SnapshotBuildContext staticContext = { snapshot, cpTrue };
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)SnapshotAddShape, &staticContext);
+	SnapshotBuildContext dynamicContext = { snapshot, cpFalse };
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)SnapshotAddShape, &dynamicContext);
+
+	// The entries, planes and cells don't move anymore, point the copies at them.
+	for (int i = 0; i < snapshot->count; i++)
+	{
+		SnapshotEntry* entry = snapshot->entries + i;
+		if (entry->planes >= 0) entry->copy.poly.planes = snapshot->planes + entry->planes;
+		if (entry->cells >= 0) entry->copy.tilemap.cells = snapshot->cells + entry->cells;
+		snapshot->order[i] = i;
+	}
+
+	if (snapshot->count > 0) SnapshotBuildNode(snapshot, 0, snapshot->count);
+}
+
+//MARK: Space Functions
+
+void
+cpSpaceSetSnapshots(cpSpace* space, cpBool enabled)
+{
+	cpAssertSpaceUnlocked(space);
+
+	cpSnapshotSet* set = space->snapshotSet;
+	if (!enabled && set)
+	{
+		for (int i = 0; i < set->snapshots->num; i++)
+		{
+			cpSpaceSnapshot* snapshot = (cpSpaceSnapshot*)set->snapshots->arr[i];
+			cpAssertHard(snapshot->readers == 0, "Snapshots cannot be disabled while a snapshot is still acquired.");
+			SnapshotFree(snapshot);
+		}
+
+		cpArrayFree(set->snapshots);
+		cpfree(set);
+
+		space->snapshotSet = NULL;
+	}
+	else if (enabled && !set)
+	{
+		set = space->snapshotSet = (cpSnapshotSet*)cpcalloc(1, sizeof(cpSnapshotSet));
+		set->snapshots = cpArrayNew(2);
+	}
+}
+
+cpBool
+cpSpaceGetSnapshots(const cpSpace* space)
+{
+	return (space->snapshotSet != NULL);
+}
+
+void
+cpSpaceSnapshotsPublish(cpSpace* space)
+{
+	cpSnapshotSet* set = space->snapshotSet;
+	if (!set) return;
+
+	// Reuse a snapshot that isn't published and that no reader holds.
+	// Readers check that what they acquired is still current, so one that isn't can't be picked up again.
+	cpSpaceSnapshot* current = set->current;
+	cpSpaceSnapshot* snapshot = NULL;
+	for (int i = 0; i < set->snapshots->num; i++)
+	{
+		cpSpaceSnapshot* candidate = (cpSpaceSnapshot*)set->snapshots->arr[i];
+		if (candidate != current && AtomicAdd(&candidate->readers, 0) == 0)
+		{
+			snapshot = candidate;
+			break;
+		}
+	}
+
+	// Slow readers hold all of them, add another buffer.
+	if (!snapshot)
+	{
+		snapshot = (cpSpaceSnapshot*)cpcalloc(1, sizeof(cpSpaceSnapshot));
+		cpArrayPush(set->snapshots, snapshot);
+	}
+
+	SnapshotBuild(snapshot, space);
+	AtomicStore(&set->current, snapshot);
+}
+
+const cpSpaceSnapshot*
+cpSpaceAcquireSnapshot(cpSpace* space)
+{
+	cpSnapshotSet* set = space->snapshotSet;
+	cpAssertHard(set, "Snapshots are not enabled for this space. Call cpSpaceSetSnapshots() first.");
+
+	for (;;)
+	{
+		cpSpaceSnapshot* snapshot = AtomicLoad(&set->current);
+		if (!snapshot) return NULL;
+
+		// If it was replaced before the reader count went up, the step may already be rebuilding it.
+		AtomicAdd(&snapshot->readers, 1);
+		if (snapshot == AtomicLoad(&set->current)) return snapshot;
+		AtomicAdd(&snapshot->readers, -1);
+	}
+}
+
+void
+cpSpaceReleaseSnapshot(cpSpace* space, const cpSpaceSnapshot* snapshot)
+{
+	(void)space;
+	if (snapshot) AtomicAdd(&((cpSpaceSnapshot*)snapshot)->readers, -1);
+}
+
+cpTimestamp
+cpSpaceSnapshotGetStamp(const cpSpaceSnapshot* snapshot)
+{
+	return snapshot->stamp;
+}
+
+//MARK: Queries
+
+static inline cpBool
+NodeAccepts(const SnapshotNode* node, cpShapeFilter filter)
+{
+	return ((node->layer & filter.mask) | (filter.layer & node->mask)) != 0;
+}
+
+static inline cpBool
+EntryAccepts(const SnapshotEntry* entry, cpShapeFilter filter, enum cpQueryFlags flags)
+{
+	return (flags & (entry->isStatic ? QUERY_STATIC : QUERY_DYNAMIC)) && !cpShapeFilterReject(entry->copy.shape.filter, filter);
+}
+
+// Returns false to stop the query.
+typedef cpBool (*SnapshotQueryFunc)(const SnapshotEntry* entry, void* data);
+
+static void
+SnapshotQuery(const cpSpaceSnapshot* snapshot, cpBB bb, cpShapeFilter filter, enum cpQueryFlags flags, SnapshotQueryFunc func, void* data)
+{
+	if (snapshot->nodeCount == 0) return;
+
+	int stack[SNAPSHOT_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int index = stack[--top];
+		const SnapshotNode* node = snapshot->nodes + index;
+		if (!cpBBIntersects(node->bb, bb) || !NodeAccepts(node, filter)) continue;
+
+		if (node->count)
+		{
+			for (int i = 0; i < node->count; i++)
+			{
+				const SnapshotEntry* entry = snapshot->entries + snapshot->order[node->index + i];
+				if (EntryAccepts(entry, filter, flags) && cpBBIntersects(entry->copy.shape.bb, bb) && !func(entry, data)) return;
+			}
+		}
+		else
+		{
+			stack[top++] = node->index;
+			stack[top++] = index + 1;
+		}
+	}
+}
+
+// Returns the new t_exit, entries and nodes past it are skipped.
+typedef cpFloat (*SnapshotSegmentQueryFunc)(const SnapshotEntry* entry, void* data);
+
+static void
+SnapshotSegmentQuery(const cpSpaceSnapshot* snapshot, cpVect a, cpVect b, cpFloat r, cpShapeFilter filter, enum cpQueryFlags flags, SnapshotSegmentQueryFunc func, void* data)
+{
+	if (snapshot->nodeCount == 0) return;
+
+	int stack[SNAPSHOT_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	cpFloat t_exit = 1.0f;
+	while (top > 0)
+	{
+		int index = stack[--top];
+		const SnapshotNode* node = snapshot->nodes + index;
+		if (!NodeAccepts(node, filter) || !(cpBBSegmentQuery(node->bb, a, b, r) < t_exit)) continue;
+
+		if (node->count)
+		{
+			for (int i = 0; i < node->count; i++)
+			{
+				const SnapshotEntry* entry = snapshot->entries + snapshot->order[node->index + i];
+				if (EntryAccepts(entry, filter, flags)) t_exit = cpfmin(t_exit, func(entry, data));
+			}
+		}
+		else
+		{
+			// Visit the nearer child first so it can shorten the segment for the other.
+			int first = index + 1, second = node->index;
+			if (cpBBSegmentQuery(snapshot->nodes[second].bb, a, b, r) < cpBBSegmentQuery(snapshot->nodes[first].bb, a, b, r))
+			{
+				first = node->index;
+				second = index + 1;
+			}
+
+			stack[top++] = second;
+			stack[top++] = first;
+		}
+	}
+}
+
+struct SnapshotPointQueryContext
+{
+	cpVect point;
+	cpFloat maxDistance;
+	cpPointQueryInfo* results;
+	int count, max_count;
+};
+
+static cpBool
+PointQueryEntry(const SnapshotEntry* entry, struct SnapshotPointQueryContext* context)
+{
+	cpPointQueryInfo info;
+	cpShapePointQuery(&entry->copy.shape, context->point, &info);
+
+	if (info.distance < context->maxDistance)
+	{
+		info.shape = entry->shape;
+		context->results[context->count++] = info;
+	}
+
+	return context->count < context->max_count;
+}
+
+size_t
+cpSpaceSnapshotPointQuery(const cpSpaceSnapshot* snapshot, cpVect point, cpFloat maxDistance, cpShapeFilter filter, cpPointQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	struct SnapshotPointQueryContext context = { point, maxDistance, results, 0, max_count };
+	if (max_count > 0) SnapshotQuery(snapshot, cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f)), filter, flags, (SnapshotQueryFunc)PointQueryEntry, &context);
+
+	return context.count;
+}
+
+struct SnapshotSegmentQueryContext
+{
+	cpVect start, end;
+	cpFloat radius;
+	cpSegmentQueryInfo* results;
+	int count, max_count;
+};
+
+static cpFloat
+SegmentQueryEntry(const SnapshotEntry* entry, struct SnapshotSegmentQueryContext* context)
+{
+	cpSegmentQueryInfo info;
+	if (context->count < context->max_count && cpShapeSegmentQuery(&entry->copy.shape, context->start, context->end, context->radius, &info))
+	{
+		info.shape = entry->shape;
+		context->results[context->count++] = info;
+	}
+
+	// Stop once the results are full.
+	return (context->count < context->max_count ? 1.0f : 0.0f);
+}
+
+size_t
+cpSpaceSnapshotSegmentQuery(const cpSpaceSnapshot* snapshot, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	struct SnapshotSegmentQueryContext context = { start, end, radius, results, 0, max_count };
+	if (max_count > 0) SnapshotSegmentQuery(snapshot, start, end, radius, filter, flags, (SnapshotSegmentQueryFunc)SegmentQueryEntry, &context);
+
+	return context.count;
+}
+
+static cpFloat
+SegmentQueryFirstEntry(const SnapshotEntry* entry, struct SnapshotSegmentQueryContext* context)
+{
+	cpSegmentQueryInfo info;
+	cpSegmentQueryInfo* out = context->results;
+
+	if (!entry->copy.shape.sensor && cpShapeSegmentQuery(&entry->copy.shape, context->start, context->end, context->radius, &info) && info.alpha < out->alpha)
+	{
+		info.shape = entry->shape;
+		(*out) = info;
+	}
+
+	return out->alpha;
+}
+
+cpShape*
+cpSpaceSnapshotSegmentQueryFirst(const cpSpaceSnapshot* snapshot, cpVect start, cpVect end, cpFloat radius, cpShapeFilter filter, cpSegmentQueryInfo* out)
+{
+	cpSegmentQueryInfo info = { NULL, end, cpvzero, 1.0f };
+	if (out)
+	{
+		(*out) = info;
+	}
+	else
+	{
+		out = &info;
+	}
+
+	struct SnapshotSegmentQueryContext context = { start, end, radius, out, 0, 1 };
+	SnapshotSegmentQuery(snapshot, start, end, radius, filter, (enum cpQueryFlags)(QUERY_DYNAMIC | QUERY_STATIC), (SnapshotSegmentQueryFunc)SegmentQueryFirstEntry, &context);
+
+	return (cpShape*)out->shape;
+}
+
+struct SnapshotBBQueryContext
+{
+	cpBBQueryInfo* results;
+	int count, max_count;
+};
+
+static cpBool
+BBQueryEntry(const SnapshotEntry* entry, struct SnapshotBBQueryContext* context)
+{
+	cpBBQueryInfo info = { entry->shape };
+	context->results[context->count++] = info;
+
+	return context->count < context->max_count;
+}
+
+size_t
+cpSpaceSnapshotBBQuery(const cpSpaceSnapshot* snapshot, cpBB bb, cpShapeFilter filter, cpBBQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	struct SnapshotBBQueryContext context = { results, 0, max_count };
+	if (max_count > 0) SnapshotQuery(snapshot, bb, filter, flags, (SnapshotQueryFunc)BBQueryEntry, &context);
+
+	return context.count;
+}
+
+struct SnapshotShapeQueryContext
+{
+	const cpShape* shape;
+	const cpShape* moved;
+	cpShapeQueryInfo* results;
+	int count, max_count;
+};
+
+static cpBool
+ShapeQueryEntry(const SnapshotEntry* entry, struct SnapshotShapeQueryContext* context)
+{
+	if (entry->shape != context->shape && cpOverlap(&entry->copy.shape, context->moved))
+	{
+		cpShapeQueryInfo info = { entry->shape };
+		context->results[context->count++] = info;
+	}
+
+	return context->count < context->max_count;
+}
+
+size_t
+cpSpaceSnapshotShapeQuery(const cpSpaceSnapshot* snapshot, const cpShape* shape, cpTransform transform, cpShapeFilter filter, cpShapeQueryInfo* results, enum cpQueryFlags flags, int max_count)
+{
+	cpShapeScratch scratch;
+	cpShape* moved = cpShapeScratchInit(&scratch, shape, transform, (struct cpSplittingPlane*)alloca(cpShapeScratchPlanesSize(shape)));
+
+	struct SnapshotShapeQueryContext context = { shape, moved, results, 0, max_count };
+	if (max_count > 0) SnapshotQuery(snapshot, moved->bb, filter, flags, (SnapshotQueryFunc)ShapeQueryEntry, &context);
+
+	return context.count;
+}
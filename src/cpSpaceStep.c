@@ -79,6 +79,12 @@ cpSpaceUnlock(cpSpace* space, cpBool runPostStep)
 
 	if (space->locked == 0)
 	{
+		// Queries between steps only read the children, so move the ones the narrowphase skipped.
+		// This has to happen before the post-step callbacks can remove or free the compounds.
+		cpArray* stale = space->staleCompounds;
+		for (int i = 0; i < stale->num; i++) cpCompoundShapeFlush((cpCompoundShape*)stale->arr[i]);
+		stale->num = 0;
+
 		cpArray* waking = space->rousedBodies;
 
 		for (int i = 0, count = waking->num; i < count; i++)
@@ -111,6 +117,9 @@ cpSpaceUnlock(cpSpace* space, cpBool runPostStep)
 			arr->num = 0;
 			space->skipPostStep = cpFalse;
 		}
+
+		// Woken bodies and post-step callbacks often add and remove shapes, rebuild now so later queries use the grids.
+		if (space->locked == 0) cpSpaceFlushIndexes(space);
 	}
 }
 
@@ -204,7 +213,7 @@ cpSpacePopContacts(cpSpace* space, int count)
 //MARK: Collision Detection Functions
 
 static void*
-cpSpaceArbiterSetTrans(cpShape** shapes, cpSpace* space)
+cpSpaceArbiterSetTrans(struct cpArbiterKey* key, cpSpace* space)
 {
 	if (space->pooledArbiters->num == 0)
 	{
@@ -218,7 +227,9 @@ cpSpaceArbiterSetTrans(cpShape** shapes, cpSpace* space)
 		for (int i = 0; i < count; i++) cpArrayPush(space->pooledArbiters, buffer + i);
 	}
 
-	return cpArbiterInit((cpArbiter*)cpArrayPop(space->pooledArbiters), shapes[0], shapes[1]);
+	cpArbiter* arb = cpArbiterInit((cpArbiter*)cpArrayPop(space->pooledArbiters), (cpShape*)key->a, (cpShape*)key->b);
+	arb->part = key->part;
+	return arb;
 }
 
 static inline cpBool
@@ -253,25 +264,69 @@ QueryReject(cpShape* a, cpShape* b)
 		);
 }
 
-// Callback from the spatial hash.
-cpCollisionID
-cpSpaceCollideShapes(cpShape* a, cpShape* b, cpCollisionID id, cpSpace* space)
+static inline cpTransform
+ArbiterPose(const cpBody* a, const cpBody* b)
 {
-	// Reject any of the simple cases
-	if (QueryReject(a, b)) return id;
+	return cpTransformMult(cpTransformInverse(a->transform), b->transform);
+}
 
-	// Narrow-phase collision detection.
-	struct cpCollisionInfo info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+// Move the contacts from the last step along with the bodies if they haven't moved much relative to each other since the narrowphase.
+static cpBool
+ReuseContacts(cpSpace* space, cpShape* a, cpShape* b, struct cpCollisionInfo* info)
+{
+	struct cpArbiterKey key = { a, b, 0 };
+	cpArbiter* arb = (cpArbiter*)cpHashSetFind(space->cachedArbiters, cpArbiterKeyHash(&key), &key);
+
+	// The contacts need to be from the last step, older contact buffers may have been reused.
+	if (!arb || arb->stamp + 1 != space->stamp || arb->state != CP_ARBITER_STATE_NORMAL || arb->count == 0) return cpFalse;
+
+	cpBody* body_a = arb->body_a, * body_b = arb->body_b;
+	cpTransform pose = ArbiterPose(body_a, body_b), last = arb->pose;
+
+	cpFloat reach = 0.0f;
+	for (int i = 0; i < arb->count; i++) reach = cpfmax(reach, cpvlengthsq(arb->contacts[i].r2));
+
+	// Bound how far the contacts moved on body b's surface relative to body a. (rotation, scale and translation)
+	cpFloat linear = cpfmax(cpfmax(cpfabs(pose.a - last.a), cpfabs(pose.b - last.b)), cpfmax(cpfabs(pose.c - last.c), cpfabs(pose.d - last.d)));
+	cpFloat moved = cpvdist(cpTransformPoint(pose, body_b->cog), cpTransformPoint(last, body_b->cog)) + 2.0f * linear * cpfsqrt(reach);
+	if (moved > space->contactReuseTolerance) return cpFalse;
+
+	cpVect rot_a = cpBodyGetRotation(body_a), rot_b = cpBodyGetRotation(body_b);
+	cpVect delta_a = cpvunrotate(rot_a, arb->rot_a), delta_b = cpvunrotate(rot_b, arb->rot_b);
+
+	// cpArbiterUpdate() expects absolute contact positions like the narrowphase returns.
+	struct cpContact* contacts = cpContactBufferGetArray(space);
+	for (int i = 0; i < arb->count; i++)
+	{
+		struct cpContact con = arb->contacts[i];
+		con.r1 = cpvadd(body_a->p, cpvrotate(con.r1, delta_a));
+		con.r2 = cpvadd(body_b->p, cpvrotate(con.r2, delta_b));
+		contacts[i] = con;
+	}
+
+	info->a = arb->a;
+	info->b = arb->b;
+	info->n = cpvrotate(arb->n, delta_a);
+	info->count = arb->count;
+	info->arr = contacts;
+	return cpTrue;
+}
 
-	if (info.count == 0) return info.id; // Shapes are not colliding.
-	cpSpacePushContacts(space, info.count);
+// Find the arbiter for a colliding pair and run its callbacks.
+static void
+CollideArbiter(cpSpace* space, cpShape* a, cpShape* b, cpHashValue part, struct cpCollisionInfo* info, cpBool reused)
+{
+	cpSpacePushContacts(space, info->count);
 
 	// Get an arbiter from space->arbiterSet for the two shapes.
 	// This is where the persistant contact magic comes from.
-	const cpShape* shape_pair[] = { info.a, info.b };
-	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)info.a, (cpHashValue)info.b);
-	cpArbiter* arb = (cpArbiter*)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
-	cpArbiterUpdate(arb, &info, space);
+	struct cpArbiterKey key = { info->a, info->b, part };
+	cpArbiter* arb = (cpArbiter*)cpHashSetInsert(space->cachedArbiters, cpArbiterKeyHash(&key), &key, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
+	cpArbiterUpdate(arb, info, space);
+
+	if (!reused) arb->pose = ArbiterPose(arb->body_a, arb->body_b);
+	arb->rot_a = cpBodyGetRotation(arb->body_a);
+	arb->rot_b = cpBodyGetRotation(arb->body_b);
 
 	cpCollisionHandler* handler = arb->handler;
 
@@ -299,7 +354,7 @@ cpSpaceCollideShapes(cpShape* a, cpShape* b, cpCollisionID id, cpSpace* space)
 	}
 	else
 	{
-		cpSpacePopContacts(space, info.count);
+		cpSpacePopContacts(space, info->count);
 
 		arb->contacts = NULL;
 		arb->count = 0;
@@ -311,9 +366,120 @@ cpSpaceCollideShapes(cpShape* a, cpShape* b, cpCollisionID id, cpSpace* space)
 
 	// Time stamp the arbiter so we know it was used recently.
 	arb->stamp = space->stamp;
+}
+
+struct TilemapCollisionContext
+{
+	cpSpace* space;
+	cpShape* shape;
+	cpShape* tilemap;
+};
+
+static void
+CollideTilemapFace(cpShape* face, struct TilemapCollisionContext* context)
+{
+	cpSpace* space = context->space;
+	struct cpCollisionInfo info = cpCollideTilemapFace(context->tilemap, face, context->shape, cpContactBufferGetArray(space));
+	if (info.count > 0) CollideArbiter(space, context->shape, context->tilemap, face->hashid, &info, cpFalse);
+}
+
+static cpCollisionID
+CollideShapes(cpShape* a, cpShape* b, cpCollisionID id, cpSpace* space)
+{
+	// Reject any of the simple cases
+	if (QueryReject(a, b)) return id;
+
+	// Sensor overlaps are tracked separately if sensor events are enabled.
+	if (space->sensorSet && (a->sensor || b->sensor))
+	{
+		cpSpaceSensorOverlap(space, a, b);
+		return id;
+	}
+
+	// Each face of a tilemap that a shape touches gets its own arbiter.
+	cpShapeType type_a = a->klass->type, type_b = b->klass->type;
+	if (type_a == CP_TILEMAP_SHAPE || type_b == CP_TILEMAP_SHAPE)
+	{
+		struct TilemapCollisionContext context = { space, (type_a == CP_TILEMAP_SHAPE ? b : a), (type_a == CP_TILEMAP_SHAPE ? a : b) };
+		if (type_a != type_b) cpTilemapShapeEachFace((cpTilemapShape*)context.tilemap, context.shape->bb, cpTrue, (cpTilemapFaceFunc)CollideTilemapFace, &context);
+		return id;
+	}
+
+	// Circles against circles or segments are batched by cpSpaceCollideCircles(). They don't use the collision id.
+	if (type_a == CP_CIRCLE_SHAPE && type_b <= CP_SEGMENT_SHAPE)
+	{
+		cpArrayPush(space->circlePairs[type_b], a);
+		cpArrayPush(space->circlePairs[type_b], b);
+		return id;
+	}
+	else if (type_b == CP_CIRCLE_SHAPE && type_a == CP_SEGMENT_SHAPE)
+	{
+		cpArrayPush(space->circlePairs[type_a], b);
+		cpArrayPush(space->circlePairs[type_a], a);
+		return id;
+	}
+
+	// Narrow-phase collision detection.
+	struct cpCollisionInfo info = { a, b, id, cpvzero, 0, NULL };
+	cpBool reused = (space->contactReuseTolerance > 0.0f && space->collisionPersistence > 0 && ReuseContacts(space, a, b, &info));
+	if (!reused) info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+
+	if (info.count > 0) CollideArbiter(space, a, b, 0, &info, reused);
 	return info.id;
 }
 
+// Callback from the spatial hash.
+cpCollisionID
+cpSpaceCollideShapes(cpShape* a, cpShape* b, cpCollisionID id, cpSpace* space)
+{
+	if (!cpShapeIsCompound(a) && !cpShapeIsCompound(b)) return CollideShapes(a, b, id, space);
+
+	// Compound proxies only carry the union of their shapes' filters, so they are filtered shape by shape.
+	if (
+		!cpBBIntersects(a->bb, b->bb) || a->body == b->body ||
+		(a->body->parent_entity != 0 && a->body->parent_entity == b->body->parent_entity) ||
+		QueryRejectConstraint(a->body, b->body)
+		) return id;
+
+	// Shapes in compounds don't keep collision ids between steps, there is nowhere to store one per pair.
+	cpCompoundShapeEachPair(a, b, (cpSpatialIndexQueryFunc)CollideShapes, space);
+	return id;
+}
+
+// Number of circle pairs collided at a time.
+#define CIRCLE_BATCH_SIZE 64
+
+void
+cpSpaceCollideCircles(cpSpace* space)
+{
+	struct cpCollisionInfo infos[CIRCLE_BATCH_SIZE];
+	struct cpContact contacts[CIRCLE_BATCH_SIZE];
+
+	for (int type = CP_CIRCLE_SHAPE; type <= CP_SEGMENT_SHAPE; type++)
+	{
+		cpArray* pairs = space->circlePairs[type];
+		int count = pairs->num / 2;
+
+		for (int i = 0; i < count; i += CIRCLE_BATCH_SIZE)
+		{
+			int batch = (count - i < CIRCLE_BATCH_SIZE ? count - i : CIRCLE_BATCH_SIZE);
+			cpCollideCircles((cpShapeType)type, batch, (const cpShape**)pairs->arr + 2 * i, infos, contacts);
+
+			for (int j = 0; j < batch; j++)
+			{
+				struct cpCollisionInfo* info = infos + j;
+				if (info->count == 0) continue;
+
+				info->arr = cpContactBufferGetArray(space);
+				info->arr[0] = contacts[j];
+				CollideArbiter(space, (cpShape*)info->a, (cpShape*)info->b, 0, info, cpFalse);
+			}
+		}
+
+		pairs->num = 0;
+	}
+}
+
 // Hashset filter func to throw away old arbiters.
 cpBool
 cpSpaceArbiterSetFilter(cpArbiter* arb, cpSpace* space)
@@ -361,6 +527,14 @@ cpShapeUpdateFunc(cpShape* shape, void* unused)
 	cpShapeCacheBB(shape);
 }
 
+// Tilemaps use the material of the cell under the contacts.
+static inline uint8_t
+ArbiterMaterial(const cpArbiter* arb, const cpShape* shape, cpVect pos)
+{
+	if (shape->klass->type != CP_TILEMAP_SHAPE) return shape->material_type;
+	return cpTilemapShapeMaterialAt(shape, pos, shape == arb->a ? arb->n : cpvneg(arb->n));
+}
+
 void
 cpSpaceStep(cpSpace* space, cpFloat dt)
 {
@@ -391,6 +565,10 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 	}
 	arbiters->num = 0;
 
+	// Static shapes added or removed since the last step would otherwise be checked one by one against every dynamic shape.
+	// The dynamic hash is rebuilt by the reindex query anyway.
+	cpSpaceHashFlush(space->staticShapes);
+
 	cpSpaceLock(space);
 	{
 		// Integrate positions
@@ -402,11 +580,17 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
+		cpSpaceSensorsBeginStep(space);
+		cpSpaceIndexTunerBegin(space);
 		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
 		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		cpSpaceCollideCircles(space);
 	}
 	cpSpaceUnlock(space, cpFalse);
 
+	// May switch to a different spatial index, so it has to run while the space is unlocked.
+	cpSpaceIndexTunerEnd(space);
+
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
 	cpSpaceProcessComponents(space, dt);
 
@@ -414,6 +598,7 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 	{
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		cpSpaceSensorsEndStep(space);
 
 		// Prestep the arbiters and constraints.
 		cpFloat slop = space->collisionSlop;
@@ -557,8 +742,8 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 						}
 						else
 						{
-							imp->material_type_a = arb->a->material_type;
-							imp->material_type_b = arb->b->material_type;
+							imp->material_type_a = ArbiterMaterial(arb, arb->a, pos);
+							imp->material_type_b = ArbiterMaterial(arb, arb->b, pos);
 
 							imp->body_type_a = arb->body_a->type;
 							imp->body_type_b = arb->body_b->type;
@@ -586,8 +771,8 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 						}
 						else
 						{
-							imp->material_type_a = arb->b->material_type;
-							imp->material_type_b = arb->a->material_type;
+							imp->material_type_a = ArbiterMaterial(arb, arb->b, pos);
+							imp->material_type_b = ArbiterMaterial(arb, arb->a, pos);
 
 							imp->body_type_a = arb->body_b->type;
 							imp->body_type_b = arb->body_a->type;
@@ -603,4 +788,7 @@ cpSpaceStep(cpSpace* space, cpFloat dt)
 		}
 	}
 	cpSpaceUnlock(space, cpTrue);
+
+	// Post-step callbacks may have changed the space, so publish the snapshot after them.
+	cpSpaceSnapshotsPublish(space);
 }
@@ -37,6 +37,8 @@ cpSpatialIndexInit(cpSpatialIndex* index, cpSpatialIndexClass* klass, cpSpatialI
 	index->klass = klass;
 	index->bbfunc = bbfunc;
 	index->staticIndex = staticIndex;
+	index->runWorkers = NULL;
+	index->runWorkersData = NULL;
 
 	if (staticIndex)
 	{
@@ -47,6 +49,27 @@ cpSpatialIndexInit(cpSpatialIndex* index, cpSpatialIndexClass* klass, cpSpatialI
 	return index;
 }
 
+void
+cpSpatialIndexSetWorkers(cpSpatialIndex* index, cpSpatialIndexRunWorkersFunc func, void* data)
+{
+	index->runWorkers = func;
+	index->runWorkersData = data;
+}
+
+void
+cpSpatialIndexRunWorkers(cpSpatialIndex* index, cpSpatialIndexWorkerFunc func, void* data)
+{
+	cpSpatialIndexRunWorkersFunc runWorkers = index->runWorkers;
+	if (runWorkers)
+	{
+		runWorkers(func, data, index->runWorkersData);
+	}
+	else
+	{
+		func(data, 0, 1);
+	}
+}
+
 typedef struct dynamicToStaticContext
 {
 	cpSpatialIndexBBFunc bbfunc;
@@ -19,6 +19,8 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass* Klass(void);
@@ -33,7 +35,8 @@ typedef struct Bounds
 typedef struct TableCell
 {
 	void* obj;
-	Bounds bounds;
+	// Bounds on the sweep axis, and on the other axis.
+	Bounds bounds, other;
 } TableCell;
 
 struct cpSweep1D
@@ -43,6 +46,15 @@ struct cpSweep1D
 	int num;
 	int max;
 	TableCell* table;
+
+	// Sweep along y instead of x.
+	cpBool sweepY;
+	// Number of cells at the start of the table that were sorted by the last reindex.
+	int sorted;
+
+	// Other axis bounds copied out in table order so the overlap test can be vectorized.
+	cpFloat* otherMin, * otherMax;
+	unsigned char* hits;
 };
 
 static inline cpBool
@@ -54,14 +66,22 @@ BoundsOverlap(Bounds a, Bounds b)
 static inline Bounds
 BBToBounds(cpSweep1D* sweep, cpBB bb)
 {
-	Bounds bounds = { bb.l, bb.r };
+	Bounds bounds = { sweep->sweepY ? bb.b : bb.l, sweep->sweepY ? bb.t : bb.r };
+	return bounds;
+}
+
+static inline Bounds
+BBToOtherBounds(cpSweep1D* sweep, cpBB bb)
+{
+	Bounds bounds = { sweep->sweepY ? bb.l : bb.b, sweep->sweepY ? bb.r : bb.t };
 	return bounds;
 }
 
 static inline TableCell
 MakeTableCell(cpSweep1D* sweep, void* obj)
 {
-	TableCell cell = { obj, BBToBounds(sweep, sweep->spatialIndex.bbfunc(obj)) };
+	cpBB bb = sweep->spatialIndex.bbfunc(obj);
+	TableCell cell = { obj, BBToBounds(sweep, bb), BBToOtherBounds(sweep, bb) };
 	return cell;
 }
 
@@ -78,6 +98,10 @@ ResizeTable(cpSweep1D* sweep, int size)
 {
 	sweep->max = size;
 	sweep->table = (TableCell*)cprealloc(sweep->table, size * sizeof(TableCell));
+
+	sweep->otherMin = (cpFloat*)cprealloc(sweep->otherMin, size * sizeof(cpFloat));
+	sweep->otherMax = (cpFloat*)cprealloc(sweep->otherMax, size * sizeof(cpFloat));
+	sweep->hits = (unsigned char*)cprealloc(sweep->hits, size * sizeof(unsigned char));
 }
 
 cpSpatialIndex*
@@ -86,6 +110,11 @@ cpSweep1DInit(cpSweep1D* sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex* sta
 	cpSpatialIndexInit((cpSpatialIndex*)sweep, Klass(), bbfunc, staticIndex);
 
 	sweep->num = 0;
+	sweep->sweepY = cpFalse;
+	sweep->sorted = 0;
+
+	sweep->otherMin = sweep->otherMax = NULL;
+	sweep->hits = NULL;
 	ResizeTable(sweep, 32);
 
 	return (cpSpatialIndex*)sweep;
@@ -102,6 +131,10 @@ cpSweep1DDestroy(cpSweep1D* sweep)
 {
 	cpfree(sweep->table);
 	sweep->table = NULL;
+
+	cpfree(sweep->otherMin);
+	cpfree(sweep->otherMax);
+	cpfree(sweep->hits);
 }
 
 //MARK: Misc
@@ -150,11 +183,12 @@ cpSweep1DRemove(cpSweep1D* sweep, void* obj, cpHashValue hashid)
 	{
 		if (table[i].obj == obj)
 		{
+			// Shift the rest down to keep the table sorted for the next reindex.
 			int num = --sweep->num;
-
-			table[i] = table[num];
+			memmove(table + i, table + i + 1, (num - i) * sizeof(TableCell));
 			table[num].obj = NULL;
 
+			if (i < sweep->sorted) sweep->sorted--;
 			return;
 		}
 	}
@@ -184,12 +218,13 @@ cpSweep1DQuery(cpSweep1D* sweep, void* obj, cpBB bb, cpSpatialIndexQueryFunc fun
 	// but not a lower limit. Probably not worth the hassle.
 
 	Bounds bounds = BBToBounds(sweep, bb);
+	Bounds other = BBToOtherBounds(sweep, bb);
 
 	TableCell* table = sweep->table;
 	for (int i = 0, count = sweep->num; i < count; i++)
 	{
 		TableCell cell = table[i];
-		if (BoundsOverlap(bounds, cell.bounds) && obj != cell.obj) func(obj, cell.obj, 0, data);
+		if (BoundsOverlap(bounds, cell.bounds) && BoundsOverlap(other, cell.other) && obj != cell.obj) func(obj, cell.obj, 0, data);
 	}
 }
 
@@ -198,12 +233,13 @@ cpSweep1DSegmentQuery(cpSweep1D* sweep, void* obj, cpVect a, cpVect b, cpFloat r
 {
 	cpBB bb = cpBBExpand(cpBBNew(a.x, a.y, a.x, a.y), b);
 	Bounds bounds = BBToBounds(sweep, bb);
+	Bounds other = BBToOtherBounds(sweep, bb);
 
 	TableCell* table = sweep->table;
 	for (int i = 0, count = sweep->num; i < count; i++)
 	{
 		TableCell cell = table[i];
-		if (BoundsOverlap(bounds, cell.bounds)) func(obj, cell.obj, data);
+		if (BoundsOverlap(bounds, cell.bounds) && BoundsOverlap(other, cell.other)) func(obj, cell.obj, data);
 	}
 }
 
@@ -215,24 +251,109 @@ TableSort(TableCell* a, TableCell* b)
 	return (a->bounds.min < b->bounds.min ? -1 : (a->bounds.min > b->bounds.min ? 1 : 0));
 }
 
+// Insertion sort, nearly linear since the order rarely changes much between steps.
+static void
+TableInsertionSort(TableCell* table, int count)
+{
+	for (int i = 1; i < count; i++)
+	{
+		TableCell cell = table[i];
+		cpFloat min = cell.bounds.min;
+
+		int j = i;
+		for (; j > 0 && table[j - 1].bounds.min > min; j--) table[j] = table[j - 1];
+		table[j] = cell;
+	}
+}
+
+// Refreshes the bounds and returns true if the other axis has a much larger spread than the sweep axis.
+static cpBool
+UpdateBounds(cpSweep1D* sweep)
+{
+	TableCell* table = sweep->table;
+	int count = sweep->num;
+
+	double sum = 0.0, sumSq = 0.0, otherSum = 0.0, otherSumSq = 0.0;
+	for (int i = 0; i < count; i++)
+	{
+		TableCell* cell = table + i;
+		cpBB bb = sweep->spatialIndex.bbfunc(cell->obj);
+		cell->bounds = BBToBounds(sweep, bb);
+		cell->other = BBToOtherBounds(sweep, bb);
+
+		double c = cell->bounds.min + cell->bounds.max;
+		double o = cell->other.min + cell->other.max;
+		sum += c; sumSq += c * c;
+		otherSum += o; otherSumSq += o * o;
+	}
+
+	if (count < 2) return cpFalse;
+
+	double variance = sumSq - sum * sum / count;
+	double otherVariance = otherSumSq - otherSum * otherSum / count;
+
+	// Some hysteresis so the axis doesn't flip back and forth, switching requires a full sort.
+	return (otherVariance > 1.5 * variance);
+}
+
 static void
 cpSweep1DReindexQuery(cpSweep1D* sweep, cpSpatialIndexQueryFunc func, void* data)
 {
 	TableCell* table = sweep->table;
 	int count = sweep->num;
 
-	// Update bounds and sort
-	for (int i = 0; i < count; i++) table[i] = MakeTableCell(sweep, table[i].obj);
-	qsort(table, count, sizeof(TableCell), (int (*)(const void*, const void*))TableSort); // TODO: use insertion sort instead
+	// Update bounds and pick the axis with the largest spread.
+	if (UpdateBounds(sweep))
+	{
+		sweep->sweepY = !sweep->sweepY;
+		sweep->sorted = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			Bounds bounds = table[i].bounds;
+			table[i].bounds = table[i].other;
+			table[i].other = bounds;
+		}
+	}
+
+	// Sort, falling back to qsort if too much of the table is new.
+	if (4 * sweep->sorted < 3 * count)
+	{
+		qsort(table, count, sizeof(TableCell), (int (*)(const void*, const void*))TableSort);
+	}
+	else
+	{
+		TableInsertionSort(table, count);
+	}
+	sweep->sorted = count;
+
+	cpFloat* otherMin = sweep->otherMin;
+	cpFloat* otherMax = sweep->otherMax;
+	unsigned char* hits = sweep->hits;
 
 	for (int i = 0; i < count; i++)
 	{
-		TableCell cell = table[i];
-		cpFloat max = cell.bounds.max;
+		otherMin[i] = table[i].other.min;
+		otherMax[i] = table[i].other.max;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		cpFloat max = table[i].bounds.max;
+
+		// Find the run of cells that overlap on the sweep axis.
+		int end = i + 1;
+		while (end < count && table[end].bounds.min <= max) end++;
+
+		// Branch free test of the other axis so the compiler can vectorize it.
+		cpFloat min = otherMin[i];
+		cpFloat top = otherMax[i];
+		for (int j = i + 1; j < end; j++) hits[j] = (unsigned char)((otherMin[j] <= top) & (min <= otherMax[j]));
 
-		for (int j = i + 1; table[j].bounds.min < max && j < count; j++)
+		void* obj = table[i].obj;
+		for (int j = i + 1; j < end; j++)
 		{
-			func(cell.obj, table[j].obj, 0, data);
+			if (hits[j]) func(obj, table[j].obj, 0, data);
 		}
 	}
 
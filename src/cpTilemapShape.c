@@ -0,0 +1,489 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "chipmunk/chipmunk_private.h"
+
+// Outward normals of the faces of a cell, in the same order as a box's planes.
+static const int FaceDX[] = { 0, 1, 0, -1 };
+static const int FaceDY[] = { -1, 0, 1, 0 };
+
+// Cells past the apron are empty.
+static inline cpBool
+Solid(const cpTilemapShape* tilemap, int x, int y)
+{
+	if (x < -1 || x > tilemap->width || y < -1 || y > tilemap->height) return cpFalse;
+	return (tilemap->cells[(x + 1) + (y + 1) * (tilemap->width + 2)].block_id != 0);
+}
+
+// Only the cells inside the grid collide, the apron belongs to the neighboring tilemaps.
+static inline cpBool
+Collides(const cpTilemapShape* tilemap, int x, int y)
+{
+	return (0 <= x && x < tilemap->width && 0 <= y && y < tilemap->height && Solid(tilemap, x, y));
+}
+
+// Convert a world point to cell units.
+static inline cpVect
+LocalPoint(const cpTilemapShape* tilemap, cpTransform inverse, cpVect p)
+{
+	return cpvmult(cpvsub(cpTransformPoint(inverse, p), tilemap->offset), 1.0f / tilemap->cellSize);
+}
+
+static inline cpVect
+BodyPoint(const cpTilemapShape* tilemap, cpVect p)
+{
+	return cpvadd(tilemap->offset, cpvmult(p, tilemap->cellSize));
+}
+
+static inline cpVect
+WorldPoint(const cpTilemapShape* tilemap, cpVect p)
+{
+	return cpTransformPoint(tilemap->transform, BodyPoint(tilemap, p));
+}
+
+static inline cpVect
+WorldNormal(const cpTilemapShape* tilemap, cpVect n)
+{
+	cpTransform t = tilemap->transform;
+	return cpvnormalize(cpMat2x2TransformVect(cpMat2x2InverseTransposedRaw(t.a, t.b, t.c, t.d), n));
+}
+
+// Range of cells overlapping a world bounding box. Returns false if it misses the grid.
+static cpBool
+CellRange(const cpTilemapShape* tilemap, cpBB bb, int* x0, int* y0, int* x1, int* y1)
+{
+	cpTransform inverse = cpTransformInverse(tilemap->transform);
+	cpBB local = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+	local = cpBBExpand(local, LocalPoint(tilemap, inverse, cpv(bb.l, bb.b)));
+	local = cpBBExpand(local, LocalPoint(tilemap, inverse, cpv(bb.r, bb.b)));
+	local = cpBBExpand(local, LocalPoint(tilemap, inverse, cpv(bb.r, bb.t)));
+	local = cpBBExpand(local, LocalPoint(tilemap, inverse, cpv(bb.l, bb.t)));
+
+	// Clamp before converting to avoid overflowing for far away boxes.
+	*x0 = (int)cpffloor(cpfmax(local.l, 0.0f));
+	*y0 = (int)cpffloor(cpfmax(local.b, 0.0f));
+	*x1 = (int)cpffloor(cpfmin(local.r, tilemap->width - 1));
+	*y1 = (int)cpffloor(cpfmin(local.t, tilemap->height - 1));
+	return (*x0 <= *x1 && *y0 <= *y1);
+}
+
+static cpBB
+cpTilemapShapeCacheData(cpTilemapShape* tilemap, cpTransform transform)
+{
+	tilemap->transform = transform;
+
+	cpFloat w = tilemap->width, h = tilemap->height;
+	cpBB bb = cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY);
+	bb = cpBBExpand(bb, WorldPoint(tilemap, cpv(0.0f, 0.0f)));
+	bb = cpBBExpand(bb, WorldPoint(tilemap, cpv(w, 0.0f)));
+	bb = cpBBExpand(bb, WorldPoint(tilemap, cpv(w, h)));
+	bb = cpBBExpand(bb, WorldPoint(tilemap, cpv(0.0f, h)));
+	return bb;
+}
+
+static void
+cpTilemapShapeDestroy(cpTilemapShape* tilemap)
+{
+	cpfree(tilemap->cells);
+}
+
+//MARK: Faces
+
+// Whether cell 'k' along a row (bottom and top faces) or column (side faces) has a face in direction 'dir'.
+static inline cpBool
+RunFace(const cpTilemapShape* tilemap, int dir, int line, int k)
+{
+	int x = (dir & 1 ? line : k), y = (dir & 1 ? k : line);
+	return Solid(tilemap, x, y) && !Solid(tilemap, x + FaceDX[dir], y + FaceDY[dir]);
+}
+
+void
+cpTilemapShapeEachFace(const cpTilemapShape* tilemap, cpBB bb, cpBool extend, cpTilemapFaceFunc func, void* data)
+{
+	int x0, y0, x1, y1;
+	if (!CellRange(tilemap, bb, &x0, &y0, &x1, &y1)) return;
+
+	cpSegmentShape face;
+	cpSegmentShapeInit(&face, tilemap->shape.body, cpvzero, cpv(1.0f, 0.0f), 0.0f);
+
+	for (int dir = 0; dir < 4; dir++)
+	{
+		// Bottom and top faces run along rows, side faces along columns.
+		cpBool rows = !(dir & 1);
+		int lineMin = (rows ? y0 : x0), lineMax = (rows ? y1 : x1);
+		int kMin = (rows ? x0 : y0), kMax = (rows ? x1 : y1);
+		int count = (rows ? tilemap->width : tilemap->height);
+		int lo = (extend ? -1 : 0), hi = (extend ? count : count - 1);
+
+		for (int line = lineMin; line <= lineMax; line++)
+		{
+			for (int k = kMin; k <= kMax; k++)
+			{
+				// Runs that started before this cell were already visited.
+				if (!RunFace(tilemap, dir, line, k) || (k > kMin && RunFace(tilemap, dir, line, k - 1))) continue;
+
+				int start = k, end = k;
+				while (start > lo && RunFace(tilemap, dir, line, start - 1)) start--;
+				while (end < hi && RunFace(tilemap, dir, line, end + 1)) end++;
+
+				// Wind the face so its normal points out of the cells.
+				cpFloat side = (dir == 1 || dir == 2 ? line + 1 : line);
+				cpVect p0 = (rows ? cpv(start, side) : cpv(side, start));
+				cpVect p1 = (rows ? cpv(end + 1, side) : cpv(side, end + 1));
+				face.a = BodyPoint(tilemap, dir < 2 ? p0 : p1);
+				face.b = BodyPoint(tilemap, dir < 2 ? p1 : p0);
+				face.n = cpv(FaceDX[dir], FaceDY[dir]);
+
+				// The size limit keeps the lines and run starts within 15 bits.
+				face.shape.hashid = (cpHashValue)dir | (cpHashValue)line << 2 | (cpHashValue)(start + 1) << 17;
+				cpShapeUpdate((cpShape*)&face, tilemap->transform);
+				func((cpShape*)&face, data);
+
+				k = end;
+			}
+		}
+	}
+}
+
+uint8_t
+cpTilemapShapeMaterialAt(const cpShape* shape, cpVect p, cpVect n)
+{
+	const cpTilemapShape* tilemap = (cpTilemapShape*)shape;
+	cpTransform inverse = cpTransformInverse(tilemap->transform);
+
+	// Step half a cell back into the tilemap from the contact.
+	cpVect q = cpvsub(LocalPoint(tilemap, inverse, p), cpvmult(cpvnormalize(cpTransformVect(inverse, n)), 0.5f));
+	int x = (int)cpffloor(cpfclamp(q.x, -1.0f, tilemap->width));
+	int y = (int)cpffloor(cpfclamp(q.y, -1.0f, tilemap->height));
+	return (Collides(tilemap, x, y) ? tilemap->cells[(x + 1) + (y + 1) * (tilemap->width + 2)].material_type : shape->material_type);
+}
+
+//MARK: Queries
+
+static void
+cpTilemapShapePointQuery(cpTilemapShape* tilemap, cpVect p, cpPointQueryInfo* info)
+{
+	info->shape = (cpShape*)tilemap;
+	if (tilemap->solidCount == 0) return;
+
+	int w = tilemap->width, h = tilemap->height;
+	cpVect lp = LocalPoint(tilemap, cpTransformInverse(tilemap->transform), p);
+
+	// Search outward from the cell of the point clamped to the apron, the rings are still a lower bound on the distance.
+	int ox = (int)cpffloor(cpfclamp(lp.x, -1.0f, w)), oy = (int)cpffloor(cpfclamp(lp.y, -1.0f, h));
+	cpBool inside = Collides(tilemap, ox, oy);
+
+	// Find the closest face on the other side of the surface.
+	// Faces follow the same rule as cpTilemapShapeEachFace(), solid apron cells hide the seams between tilemaps.
+	int maxRing = 1 + (int)cpfmax(cpfmax(ox + 1, w - ox), cpfmax(oy + 1, h - oy));
+	cpFloat best = INFINITY;
+	cpVect closest = lp;
+	cpVect normal = cpvzero;
+
+	for (int ring = 0; ring <= maxRing && !(ring > 1 && (cpFloat)(ring - 1) * (ring - 1) >= best); ring++)
+	{
+		for (int i = -ring; i <= ring; i++)
+		{
+			// Cells along the top and bottom of the ring, then the sides.
+			for (int j = 0; j < 4; j++)
+			{
+				int x, y;
+				if (j < 2)
+				{
+					x = ox + i; y = oy + (j ? ring : -ring);
+				}
+				else
+				{
+					if (i == -ring || i == ring) continue;
+					x = ox + (j == 3 ? ring : -ring); y = oy + i;
+				}
+
+				if (ring == 0 && j > 0) continue;
+
+				// Outside the faces are on solid cells facing empty ones, inside on empty cells facing solid ones.
+				if (inside ? Solid(tilemap, x, y) : !Collides(tilemap, x, y)) continue;
+
+				for (int dir = 0; dir < 4; dir++)
+				{
+					int nx = x + FaceDX[dir], ny = y + FaceDY[dir];
+					if (inside ? !Collides(tilemap, nx, ny) : Solid(tilemap, nx, ny)) continue;
+
+					// Closest point on the side of the cell facing the neighbor.
+					cpVect c = cpv(
+						FaceDX[dir] ? x + (FaceDX[dir] > 0) : cpfclamp(lp.x, x, x + 1),
+						FaceDY[dir] ? y + (FaceDY[dir] > 0) : cpfclamp(lp.y, y, y + 1)
+					);
+
+					cpFloat d = cpvdistsq(lp, c);
+					if (d < best)
+					{
+						best = d;
+						closest = c;
+						normal = (inside ? cpv(-FaceDX[dir], -FaceDY[dir]) : cpv(FaceDX[dir], FaceDY[dir]));
+					}
+				}
+			}
+		}
+	}
+
+	if (best == INFINITY) return;
+
+	cpVect point = WorldPoint(tilemap, closest);
+	cpVect delta = (inside ? cpvsub(point, p) : cpvsub(p, point));
+	cpFloat d = cpvlength(delta);
+
+	info->point = point;
+	info->distance = (inside ? -d : d);
+
+	// On the surface, use the normal of the face.
+	info->gradient = (d > MAGIC_EPSILON ? cpvmult(delta, 1.0f / d) : WorldNormal(tilemap, normal));
+}
+
+struct FaceQueryContext
+{
+	const cpShape* tilemap;
+	cpVect a, b;
+	cpFloat radius;
+	cpSegmentQueryInfo* info;
+};
+
+static void
+FaceSegmentQuery(cpShape* face, struct FaceQueryContext* context)
+{
+	cpSegmentQueryInfo hit = { NULL, context->b, cpvzero, 1.0f };
+	face->klass->segmentQuery(face, context->a, context->b, context->radius, &hit);
+
+	// Faces are one sided.
+	cpSegmentQueryInfo* info = context->info;
+	if (hit.shape && (!info->shape || hit.alpha < info->alpha) && cpvdot(hit.normal, ((cpSegmentShape*)face)->tn) >= 0.0f)
+	{
+		(*info) = hit;
+		info->shape = context->tilemap;
+	}
+}
+
+// Clip a segment against one axis of the grid. 'enter' is set to 'axis' if the segment enters through that side.
+static inline cpBool
+ClipSlab(cpFloat p, cpFloat d, cpFloat max, int axis, cpFloat* t0, cpFloat* t1, int* enter)
+{
+	if (d == 0.0f) return (0.0f <= p && p <= max);
+
+	cpFloat ta = -p / d, tb = (max - p) / d;
+	if (ta > tb)
+	{
+		cpFloat t = ta; ta = tb; tb = t;
+	}
+
+	if (ta > *t0)
+	{
+		*t0 = ta;
+		*enter = axis;
+	}
+
+	*t1 = cpfmin(*t1, tb);
+	return (*t0 <= *t1);
+}
+
+static void
+cpTilemapShapeSegmentQuery(cpTilemapShape* tilemap, cpVect a, cpVect b, cpFloat radius, cpSegmentQueryInfo* info)
+{
+	if (tilemap->solidCount == 0) return;
+
+	// Thick segments are tested against the faces near them.
+	if (radius > 0.0f)
+	{
+		struct FaceQueryContext context = { (cpShape*)tilemap, a, b, radius, info };
+		cpBB bb = cpBBMerge(cpBBNewForCircle(a, radius), cpBBNewForCircle(b, radius));
+		cpTilemapShapeEachFace(tilemap, bb, cpFalse, (cpTilemapFaceFunc)FaceSegmentQuery, &context);
+		return;
+	}
+
+	int w = tilemap->width, h = tilemap->height;
+	cpTransform inverse = cpTransformInverse(tilemap->transform);
+	cpVect la = LocalPoint(tilemap, inverse, a);
+	cpVect d = cpvsub(LocalPoint(tilemap, inverse, b), la);
+
+	cpFloat t0 = 0.0f, t1 = 1.0f;
+	int axis = -1;
+	if (!ClipSlab(la.x, d.x, w, 0, &t0, &t1, &axis) || !ClipSlab(la.y, d.y, h, 1, &t0, &t1, &axis)) return;
+
+	// Walk the cells along the segment. (Amanatides and Woo)
+	cpVect start = cpvadd(la, cpvmult(d, t0));
+	int x = (int)cpffloor(cpfclamp(start.x, 0.0f, w - 1)), y = (int)cpffloor(cpfclamp(start.y, 0.0f, h - 1));
+	int stepX = (d.x > 0.0f ? 1 : -1), stepY = (d.y > 0.0f ? 1 : -1);
+	cpFloat deltaX = (d.x != 0.0f ? 1.0f / cpfabs(d.x) : INFINITY), deltaY = (d.y != 0.0f ? 1.0f / cpfabs(d.y) : INFINITY);
+	cpFloat nextX = (d.x != 0.0f ? ((d.x > 0.0f ? x + 1 : x) - la.x) / d.x : INFINITY);
+	cpFloat nextY = (d.y != 0.0f ? ((d.y > 0.0f ? y + 1 : y) - la.y) / d.y : INFINITY);
+
+	// Only crossing from an empty cell into a solid one hits a face, the apron counts when entering from outside.
+	cpBool solid = (axis == 0 ? Solid(tilemap, x - stepX, y) : axis == 1 ? Solid(tilemap, x, y - stepY) : Solid(tilemap, x, y));
+	cpFloat t = t0;
+
+	for (;;)
+	{
+		if (!solid && Solid(tilemap, x, y))
+		{
+			info->shape = (cpShape*)tilemap;
+			info->point = cpvlerp(a, b, t);
+			info->normal = WorldNormal(tilemap, axis == 0 ? cpv(-stepX, 0.0f) : cpv(0.0f, -stepY));
+			info->alpha = t;
+			return;
+		}
+
+		solid = Solid(tilemap, x, y);
+
+		if (nextX < nextY)
+		{
+			t = nextX;
+			nextX += deltaX;
+			x += stepX;
+			axis = 0;
+		}
+		else
+		{
+			t = nextY;
+			nextY += deltaY;
+			y += stepY;
+			axis = 1;
+		}
+
+		if (t > t1 || x < 0 || x >= w || y < 0 || y >= h) return;
+	}
+}
+
+static const cpShapeClass tilemapClass = {
+	CP_TILEMAP_SHAPE,
+	(cpShapeCacheDataImpl)cpTilemapShapeCacheData,
+	(cpShapeDestroyImpl)cpTilemapShapeDestroy,
+	(cpShapePointQueryImpl)cpTilemapShapePointQuery,
+	(cpShapeSegmentQueryImpl)cpTilemapShapeSegmentQuery,
+};
+
+//MARK: Tilemap Shapes
+
+cpTilemapShape*
+cpTilemapShapeAlloc(void)
+{
+	return (cpTilemapShape*)cpcalloc(1, sizeof(cpTilemapShape));
+}
+
+cpTilemapShape*
+cpTilemapShapeInit(cpTilemapShape* tilemap, cpBody* body, int width, int height, cpFloat cellSize, cpVect offset)
+{
+	cpAssertHard(0 < width && width < 0x4000 && 0 < height && height < 0x4000, "Tilemap size is out of range.");
+	cpAssertHard(cellSize > 0.0f, "Tilemap cell size must be positive.");
+
+	// Tilemaps have no mass.
+	struct cpShapeMassInfo info = { 0.0f, 0.0f, cpvzero, 0.0f };
+	cpShapeInit((cpShape*)tilemap, &tilemapClass, body, info);
+
+	tilemap->width = width;
+	tilemap->height = height;
+	tilemap->cellSize = cellSize;
+	tilemap->offset = offset;
+
+	tilemap->cells = (struct cpTilemapCell*)cpcalloc((width + 2) * (height + 2), sizeof(struct cpTilemapCell));
+	tilemap->solidCount = 0;
+	tilemap->transform = cpTransformIdentity;
+
+	return tilemap;
+}
+
+cpShape*
+cpTilemapShapeNew(cpBody* body, int width, int height, cpFloat cellSize, cpVect offset)
+{
+	return (cpShape*)cpTilemapShapeInit(cpTilemapShapeAlloc(), body, width, height, cellSize, offset);
+}
+
+int
+cpTilemapShapeGetWidth(const cpShape* shape)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	return ((cpTilemapShape*)shape)->width;
+}
+
+int
+cpTilemapShapeGetHeight(const cpShape* shape)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	return ((cpTilemapShape*)shape)->height;
+}
+
+cpFloat
+cpTilemapShapeGetCellSize(const cpShape* shape)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	return ((cpTilemapShape*)shape)->cellSize;
+}
+
+cpVect
+cpTilemapShapeGetOffset(const cpShape* shape)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	return ((cpTilemapShape*)shape)->offset;
+}
+
+static struct cpTilemapCell*
+GetCell(const cpShape* shape, int x, int y)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	const cpTilemapShape* tilemap = (cpTilemapShape*)shape;
+
+	cpAssertHard(-1 <= x && x <= tilemap->width && -1 <= y && y <= tilemap->height, "Cell is out of range.");
+	return tilemap->cells + (x + 1) + (y + 1) * (tilemap->width + 2);
+}
+
+void
+cpTilemapShapeSetCell(cpShape* shape, int x, int y, uint8_t block_id, uint8_t material_type)
+{
+	cpTilemapShape* tilemap = (cpTilemapShape*)shape;
+	struct cpTilemapCell* cell = GetCell(shape, x, y);
+
+	if (0 <= x && x < tilemap->width && 0 <= y && y < tilemap->height) tilemap->solidCount += (block_id != 0) - (cell->block_id != 0);
+	cell->block_id = block_id;
+	cell->material_type = material_type;
+}
+
+uint8_t
+cpTilemapShapeGetCellBlock(const cpShape* shape, int x, int y)
+{
+	return GetCell(shape, x, y)->block_id;
+}
+
+uint8_t
+cpTilemapShapeGetCellMaterial(const cpShape* shape, int x, int y)
+{
+	return GetCell(shape, x, y)->material_type;
+}
+
+cpBool
+cpTilemapShapeGetCellAtPoint(const cpShape* shape, cpVect p, int* x, int* y)
+{
+	cpAssertHard(shape->klass == &tilemapClass, "Shape is not a tilemap shape.");
+	const cpTilemapShape* tilemap = (cpTilemapShape*)shape;
+
+	cpVect lp = LocalPoint(tilemap, cpTransformInverse(tilemap->transform), p);
+	if (!(0.0f <= lp.x && lp.x < tilemap->width && 0.0f <= lp.y && lp.y < tilemap->height)) return cpFalse;
+
+	*x = (int)cpffloor(lp.x);
+	*y = (int)cpffloor(lp.y);
+	return cpTrue;
+}